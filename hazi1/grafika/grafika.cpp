@@ -102,15 +102,15 @@ bool vecEq(const vec3 lhs, const vec3& rhs) {
 // Osztlyok
 class Object {
 protected:
-	unsigned int vao, vbo;
+	unsigned int vao;
+	StreamingBuffer<vec3> stream;
 	std::vector<vec3> vtx;
 public:
-	Object() : vao(0), vbo(0) {
+	Object() : vao(0) {
 		glGenVertexArrays(1, &vao);
 		glBindVertexArray(vao);
 
-		glGenBuffers(1, &vbo);
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, stream.Buffer());
 
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
 		glEnableVertexAttribArray(0);
@@ -120,10 +120,10 @@ public:
 		vtx = verticles;
 	}
 
+	// csak a vltozott (pl. most hozzadott) pontok mennek fel
 	void update() {
 		glBindVertexArray(vao);
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		glBufferData(GL_ARRAY_BUFFER, vtx.size() * sizeof(vec3), &vtx[0], GL_DYNAMIC_DRAW);
+		if (stream.Update(vtx)) stream.AttribPointer(0, 3);
 	}
 
 	void Draw(GLenum type, vec3 col) {
@@ -144,7 +144,6 @@ public:
 	}
 
 	~Object() {
-		glDeleteBuffers(1, &vbo);
 		glDeleteVertexArrays(1, &vao);
 	}
 
@@ -382,6 +381,7 @@ public:
 
 	// Inicializacio
 	void onInitialization() {
+		setLoopPolicy(LOOP_WAIT_EVENTS); // csak bemenetre rajzol jra
 		glViewport(0, 0, winWidth, winHeight);
 
 		points = new PointCollection();
@@ -33,12 +33,74 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #ifdef LODEPNG_COMPILE_DISK
 #include <limits.h> /* LONG_MAX */
 #include <stdio.h> /* file handling */
+#if defined(__unix__) || defined(__APPLE__)
+#define LODEPNG_MAP_POSIX
+#include <sys/mman.h> /* mmap */
+#include <sys/stat.h> /* fstat */
+#include <fcntl.h> /* open */
+#include <unistd.h> /* close */
+#elif defined(_WIN32)
+#define LODEPNG_MAP_WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h> /* CreateFileMapping, MapViewOfFile */
+#endif
 #endif /* LODEPNG_COMPILE_DISK */
 
 #ifdef LODEPNG_COMPILE_ALLOCATORS
 #include <stdlib.h> /* allocations */
 #endif /* LODEPNG_COMPILE_ALLOCATORS */
 
+#ifdef LODEPNG_COMPILE_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LODEPNG_SIMD
+#define LODEPNG_SIMD_X86
+#include <emmintrin.h> /* SSE2, part of the x86-64 baseline */
+#include <tmmintrin.h> /* SSSE3, only called after the runtime check */
+#include <immintrin.h> /* AVX2, only called after the runtime check */
+#if defined(_MSC_VER)
+#include <intrin.h> /* __cpuid, _xgetbv */
+#define LODEPNG_TARGET(features) /* MSVC compiles any intrinsic without flags */
+#else
+#include <cpuid.h>
+#define LODEPNG_TARGET(features) __attribute__((target(features)))
+#endif
+/* the detected instruction sets are shared by all threads, so they are read and written atomically */
+#if defined(__cplusplus) && (__cplusplus >= 201103L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201103L))
+#include <atomic>
+#define LODEPNG_CPU_ATOMIC_CPP
+#elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L) && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#define LODEPNG_CPU_ATOMIC_C11
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define LODEPNG_SIMD
+#define LODEPNG_SIMD_NEON
+#include <arm_neon.h>
+#endif
+#endif /* LODEPNG_COMPILE_SIMD */
+
+#ifdef LODEPNG_COMPILE_FAST_INFLATE
+#if defined(_MSC_VER) || (defined(__cplusplus) && __cplusplus >= 201103L) || \
+    (defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L)
+#define LODEPNG_FAST_INFLATE
+typedef unsigned long long lodepng_uint64;
+#endif
+#endif /* LODEPNG_COMPILE_FAST_INFLATE */
+
+#if defined(LODEPNG_COMPILE_THREADS) && defined(LODEPNG_COMPILE_ENCODER) && defined(__cplusplus)
+#if __cplusplus >= 201103L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201103L)
+#define LODEPNG_THREADS
+#include <atomic>
+#include <thread>
+#include <vector>
+#endif
+#endif /* LODEPNG_COMPILE_THREADS */
+
 #if defined(_MSC_VER) && (_MSC_VER >= 1310) /*Visual Studio: A few warning types are not desired here.*/
 #pragma warning( disable : 4244 ) /*implicit conversions: not warned by gcc -Wall -Wextra and requires too much casts*/
 #pragma warning( disable : 4996 ) /*VS does not like fopen, but fopen_s is not standard C so unusable here*/
@@ -129,6 +191,183 @@ static void lodepng_memset(void* LODEPNG_RESTRICT dst,
   for(i = 0; i < num; i++) ((char*)dst)[i] = (char)value;
 }
 
+/* Thread local storage, which the arena of a LodePNGContext call needs. Without it there is no arena. */
+#if defined(_MSC_VER)
+#define LODEPNG_THREAD_LOCAL __declspec(thread)
+#elif defined(__cplusplus) && (__cplusplus >= 201103L)
+#define LODEPNG_THREAD_LOCAL thread_local
+#elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+#define LODEPNG_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define LODEPNG_THREAD_LOCAL __thread
+#endif
+
+#ifdef LODEPNG_THREAD_LOCAL
+/*
+The arena of a LodePNGContext, for the scratch memory of its calls: blocks in size classes
+of four per power of two, carved from slabs of lodepng_malloc. A freed block goes to the
+list of its class and is given out again, so the same work on the same sizes doesn't
+allocate anymore after the first time. The slabs are only freed with the arena.
+*/
+#define ARENA_HEADER 16 /*the size class in front of each block, 16 bytes to keep the blocks aligned for SIMD*/
+#define ARENA_SLAB 262144 /*size of the slabs that smaller blocks share, larger blocks get a slab of their own*/
+#define ARENA_CLASSES (sizeof(size_t) * 32)
+
+typedef struct ArenaSlab {
+  struct ArenaSlab* next;
+  unsigned char* end;
+} ArenaSlab;
+
+typedef struct LodePNGArena {
+  void* free[ARENA_CLASSES]; /*the free blocks of each class, linked through their first bytes*/
+  ArenaSlab* slabs;
+  unsigned char* pos; /*unused part of the newest shared slab*/
+  unsigned char* end;
+} LodePNGArena;
+
+/*the arena of the LodePNGContext call running in this thread, if any*/
+static LODEPNG_THREAD_LOCAL LodePNGArena* lodepng_arena = 0;
+
+#if defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)
+static void arena_init(LodePNGArena* arena) {
+  size_t i;
+  for(i = 0; i != ARENA_CLASSES; ++i) arena->free[i] = 0;
+  arena->slabs = 0;
+  arena->pos = arena->end = 0;
+}
+
+static void arena_cleanup(LodePNGArena* arena) {
+  while(arena->slabs) {
+    ArenaSlab* next = arena->slabs->next;
+    lodepng_free(arena->slabs);
+    arena->slabs = next;
+  }
+  arena_init(arena);
+}
+#endif /*defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)*/
+
+/*bytes of a block of size class c, including the header*/
+static size_t arena_class_size(size_t c) {
+  return (size_t)(5 + (c & 3u)) << ((c >> 2u) - 2u);
+}
+
+static unsigned char* arena_add_slab(LodePNGArena* arena, size_t size) {
+  ArenaSlab* slab = (ArenaSlab*)lodepng_malloc(ARENA_HEADER + size);
+  if(!slab) return 0;
+  slab->next = arena->slabs;
+  slab->end = (unsigned char*)slab + ARENA_HEADER + size;
+  arena->slabs = slab;
+  return (unsigned char*)slab + ARENA_HEADER;
+}
+
+static void* arena_malloc(LodePNGArena* arena, size_t size) {
+  size_t bytes, m, k = 4, c;
+  unsigned char* block;
+  if(size > ((size_t)(-1) >> 2u)) return 0; /*too large for a size class*/
+  bytes = (size + ARENA_HEADER + 15u) & ~(size_t)15u;
+  if(bytes < 32) bytes = 32;
+  m = bytes - 1;
+  while(m >> (k + 1u)) ++k;
+  c = (k << 2u) + ((m >> (k - 2u)) & 3u);
+  if(arena->free[c]) {
+    void* result = arena->free[c];
+    arena->free[c] = *(void**)result;
+    return result;
+  }
+  bytes = arena_class_size(c);
+  if(bytes >= ARENA_SLAB) {
+    block = arena_add_slab(arena, bytes);
+  } else {
+    if((size_t)(arena->end - arena->pos) < bytes) {
+      arena->pos = arena_add_slab(arena, ARENA_SLAB);
+      arena->end = arena->pos ? arena->pos + ARENA_SLAB : 0;
+    }
+    block = arena->pos;
+    if(block) arena->pos += bytes;
+  }
+  if(!block) return 0; /*alloc fail*/
+  *(size_t*)block = c;
+  return block + ARENA_HEADER;
+}
+
+static void arena_free(LodePNGArena* arena, void* ptr) {
+  size_t c = *(size_t*)((unsigned char*)ptr - ARENA_HEADER);
+  *(void**)ptr = arena->free[c];
+  arena->free[c] = ptr;
+}
+
+static void* arena_realloc(LodePNGArena* arena, void* ptr, size_t new_size) {
+  size_t capacity = arena_class_size(*(size_t*)((unsigned char*)ptr - ARENA_HEADER)) - ARENA_HEADER;
+  void* result;
+  if(new_size <= capacity) return ptr;
+  result = arena_malloc(arena, new_size);
+  if(!result) return 0; /*alloc fail, ptr is left untouched like realloc does*/
+  lodepng_memcpy(result, ptr, capacity);
+  arena_free(arena, ptr);
+  return result;
+}
+
+/*whether ptr is a block of the arena, rather than of lodepng_malloc*/
+static int arena_owns(const LodePNGArena* arena, const void* ptr) {
+  const ArenaSlab* slab;
+  for(slab = arena->slabs; slab; slab = slab->next) {
+    if((const unsigned char*)ptr > (const unsigned char*)slab && (const unsigned char*)ptr < slab->end) return 1;
+  }
+  return 0;
+}
+
+/*
+Allocators for the scratch memory of the codecs: from the arena while a LodePNGContext
+call runs in this thread, from lodepng_malloc otherwise. lodepng_scratch_free and
+realloc take blocks of either kind. Memory that outlives the call, such as the output
+or the fields of LodePNGInfo, uses lodepng_malloc directly.
+*/
+static void* lodepng_scratch_malloc(size_t size) {
+  return lodepng_arena ? arena_malloc(lodepng_arena, size) : lodepng_malloc(size);
+}
+
+static void* lodepng_scratch_realloc(void* ptr, size_t new_size) {
+  if(!lodepng_arena) return lodepng_realloc(ptr, new_size);
+  if(!ptr) return arena_malloc(lodepng_arena, new_size);
+  if(arena_owns(lodepng_arena, ptr)) return arena_realloc(lodepng_arena, ptr, new_size);
+  return lodepng_realloc(ptr, new_size);
+}
+
+static void lodepng_scratch_free(void* ptr) {
+  if(lodepng_arena && ptr && arena_owns(lodepng_arena, ptr)) arena_free(lodepng_arena, ptr);
+  else lodepng_free(ptr);
+}
+
+#if defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)
+/*sets the arena of this thread, returns the previous one. Custom zlib functions run without
+arena, since they allocate and free the buffers lodepng gives them with their own allocator.*/
+static LodePNGArena* lodepng_arena_set(LodePNGArena* arena) {
+  LodePNGArena* previous = lodepng_arena;
+  lodepng_arena = arena;
+  return previous;
+}
+#endif /*defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)*/
+#else /*LODEPNG_THREAD_LOCAL*/
+typedef struct LodePNGArena LodePNGArena;
+#define lodepng_scratch_malloc lodepng_malloc
+#define lodepng_scratch_realloc lodepng_realloc
+#define lodepng_scratch_free lodepng_free
+#if defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)
+static LodePNGArena* lodepng_arena_set(LodePNGArena* arena) {
+  (void)arena;
+  return 0;
+}
+#endif /*defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)*/
+#endif /*LODEPNG_THREAD_LOCAL*/
+
+#if defined(LODEPNG_COMPILE_STREAMING) && defined(LODEPNG_COMPILE_ZLIB)
+/*copies size bytes to a lower address in the same buffer, to drop the bytes the streaming codecs are done with*/
+static void lodepng_memmove_down(unsigned char* dst, const unsigned char* src, size_t size) {
+  size_t i;
+  for(i = 0; i < size; i++) dst[i] = src[i];
+}
+#endif /*defined(LODEPNG_COMPILE_STREAMING) && defined(LODEPNG_COMPILE_ZLIB)*/
+
 /* does not check memory out of bounds, do not use on untrusted data */
 static size_t lodepng_strlen(const char* a) {
   const char* orig = a;
@@ -168,6 +407,116 @@ static int lodepng_gtofl(size_t a, size_t b, size_t c) {
 #endif /*LODEPNG_COMPILE_ZLIB*/
 #endif /*LODEPNG_COMPILE_DECODER*/
 
+#if defined(LODEPNG_SIMD_X86) && (defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ZLIB) || \
+    (defined(LODEPNG_COMPILE_PNG) && defined(LODEPNG_COMPILE_CRC)))
+#define LODEPNG_CPU_SSSE3 1u
+#define LODEPNG_CPU_AVX2 2u
+#define LODEPNG_CPU_PCLMUL 4u
+
+#define LODEPNG_CPU_DETECTED 0x80000000u
+
+/* The features with LODEPNG_CPU_DETECTED set, 0 before the first detection. Threads detecting at the same
+time store the same value. Without any atomics (old C compilers other than GCC or MSVC) lodepng starts no
+threads, so the plain variable is only shared if the caller decodes on several threads at once. */
+#if defined(LODEPNG_CPU_ATOMIC_CPP)
+static std::atomic<unsigned> lodepng_cpu_state(0u);
+#define LODEPNG_CPU_LOAD() lodepng_cpu_state.load(std::memory_order_relaxed)
+#define LODEPNG_CPU_STORE(value) lodepng_cpu_state.store(value, std::memory_order_relaxed)
+#elif defined(LODEPNG_CPU_ATOMIC_C11)
+static _Atomic unsigned lodepng_cpu_state = 0u;
+#define LODEPNG_CPU_LOAD() atomic_load_explicit(&lodepng_cpu_state, memory_order_relaxed)
+#define LODEPNG_CPU_STORE(value) atomic_store_explicit(&lodepng_cpu_state, value, memory_order_relaxed)
+#elif defined(__GNUC__)
+static unsigned lodepng_cpu_state = 0u;
+#define LODEPNG_CPU_LOAD() __atomic_load_n(&lodepng_cpu_state, __ATOMIC_RELAXED)
+#define LODEPNG_CPU_STORE(value) __atomic_store_n(&lodepng_cpu_state, value, __ATOMIC_RELAXED)
+#elif defined(_MSC_VER)
+static volatile long lodepng_cpu_state = 0;
+#define LODEPNG_CPU_LOAD() ((unsigned)_InterlockedOr(&lodepng_cpu_state, 0))
+#define LODEPNG_CPU_STORE(value) _InterlockedExchange(&lodepng_cpu_state, (long)(value))
+#else
+static unsigned lodepng_cpu_state = 0u;
+#define LODEPNG_CPU_LOAD() lodepng_cpu_state
+#define LODEPNG_CPU_STORE(value) (lodepng_cpu_state = (value))
+#endif
+
+/* Instruction sets beyond SSE2, detected once. */
+static unsigned lodepng_cpu_features(void) {
+  unsigned state = LODEPNG_CPU_LOAD();
+  if(!(state & LODEPNG_CPU_DETECTED)) {
+    unsigned result = LODEPNG_CPU_DETECTED;
+    unsigned ecx1, ebx7 = 0, xcr0 = 0, maxleaf;
+#if defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 0);
+    maxleaf = (unsigned)regs[0];
+    __cpuid(regs, 1);
+    ecx1 = (unsigned)regs[2];
+    if(maxleaf >= 7) { __cpuidex(regs, 7, 0); ebx7 = (unsigned)regs[1]; }
+    if(ecx1 & (1u << 27)) xcr0 = (unsigned)_xgetbv(0);
+#else
+    unsigned eax, ebx, ecx7, edx;
+    maxleaf = __get_cpuid_max(0, 0);
+    __cpuid(1, eax, ebx, ecx1, edx);
+    if(maxleaf >= 7) { __cpuid_count(7, 0, eax, ebx7, ecx7, edx); (void)ecx7; }
+    if(ecx1 & (1u << 27)) __asm__("xgetbv" : "=a"(xcr0), "=d"(edx) : "c"(0));
+#endif
+    if(ecx1 & (1u << 9)) result |= LODEPNG_CPU_SSSE3;
+    if(ecx1 & (1u << 1)) result |= LODEPNG_CPU_PCLMUL;
+    /*AVX2 also needs the OS to save the ymm registers (OSXSAVE and XCR0 bits 1 and 2)*/
+    if((ebx7 & (1u << 5)) && (ecx1 & (1u << 27)) && (xcr0 & 6u) == 6u) result |= LODEPNG_CPU_AVX2;
+    LODEPNG_CPU_STORE(result);
+    state = result;
+  }
+  return state & ~LODEPNG_CPU_DETECTED;
+}
+#endif /*LODEPNG_SIMD_X86 and a user of lodepng_cpu_features*/
+
+#ifdef LODEPNG_COMPILE_ENCODER
+/*the amount of threads to use for the num_threads setting, 0 means all hardware threads*/
+static unsigned lodepng_thread_count(unsigned num_threads) {
+#ifdef LODEPNG_THREADS
+  if(num_threads == 0) num_threads = std::thread::hardware_concurrency();
+  return num_threads ? num_threads : 1;
+#else /*LODEPNG_THREADS*/
+  (void)num_threads;
+  return 1;
+#endif /*LODEPNG_THREADS*/
+}
+
+#ifdef LODEPNG_THREADS
+static void lodepng_parallel_worker(std::atomic<size_t>* next, size_t count,
+                                    void (*task)(void*, size_t), void* context) {
+  size_t i;
+  while((i = (*next)++) < count) task(context, i);
+}
+#endif /*LODEPNG_THREADS*/
+
+/*Calls task(context, i) for each i in 0..count-1, on up to num_threads threads including the calling one. The
+tasks are handed out in order, and each task must write only its own results. If a thread can't be started, the
+remaining ones do the work.*/
+static void lodepng_parallel_for(size_t count, unsigned num_threads, void (*task)(void*, size_t), void* context) {
+#ifdef LODEPNG_THREADS
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> threads;
+  size_t i;
+  for(i = 1; i < num_threads && i < count; ++i) {
+    try {
+      threads.push_back(std::thread(lodepng_parallel_worker, &next, count, task, context));
+    } catch(...) {
+      break;
+    }
+  }
+  lodepng_parallel_worker(&next, count, task, context);
+  for(i = 0; i != threads.size(); ++i) threads[i].join();
+#else /*LODEPNG_THREADS*/
+  size_t i;
+  (void)num_threads;
+  for(i = 0; i != count; ++i) task(context, i);
+#endif /*LODEPNG_THREADS*/
+}
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
 
 /*
 Often in case of an error a value is assigned to a variable and then it breaks
@@ -222,22 +571,28 @@ typedef struct uivector {
 
 static void uivector_cleanup(void* p) {
   ((uivector*)p)->size = ((uivector*)p)->allocsize = 0;
-  lodepng_free(((uivector*)p)->data);
+  lodepng_scratch_free(((uivector*)p)->data);
   ((uivector*)p)->data = NULL;
 }
 
 /*returns 1 if success, 0 if failure ==> nothing done*/
-static unsigned uivector_resize(uivector* p, size_t size) {
+static unsigned uivector_reserve(uivector* p, size_t size) {
   size_t allocsize = size * sizeof(unsigned);
   if(allocsize > p->allocsize) {
     size_t newsize = allocsize + (p->allocsize >> 1u);
-    void* data = lodepng_realloc(p->data, newsize);
+    void* data = lodepng_scratch_realloc(p->data, newsize);
     if(data) {
       p->allocsize = newsize;
       p->data = (unsigned*)data;
     }
     else return 0; /*error: not enough memory*/
   }
+  return 1; /*success*/
+}
+
+/*returns 1 if success, 0 if failure ==> nothing done*/
+static unsigned uivector_resize(uivector* p, size_t size) {
+  if(!uivector_reserve(p, size)) return 0;
   p->size = size;
   return 1; /*success*/
 }
@@ -269,7 +624,7 @@ typedef struct ucvector {
 static unsigned ucvector_reserve(ucvector* p, size_t size) {
   if(size > p->allocsize) {
     size_t newsize = size + (p->allocsize >> 1u);
-    void* data = lodepng_realloc(p->data, newsize);
+    void* data = lodepng_scratch_realloc(p->data, newsize);
     if(data) {
       p->allocsize = newsize;
       p->data = (unsigned char*)data;
@@ -299,7 +654,7 @@ static ucvector ucvector_init(unsigned char* buffer, size_t size) {
 
 /*free string pointer and set it to NULL*/
 static void string_cleanup(char** out) {
-  lodepng_free(*out);
+  lodepng_scratch_free(*out);
   *out = NULL;
 }
 
@@ -390,6 +745,79 @@ unsigned lodepng_load_file(unsigned char** out, size_t* outsize, const char* fil
   return lodepng_buffer_file(*out, (size_t)size, filename);
 }
 
+unsigned lodepng_map_file(const unsigned char** out, size_t* outsize, const char* filename) {
+#if defined(LODEPNG_MAP_POSIX)
+  struct stat status;
+  void* data;
+  int file = open(filename, O_RDONLY);
+  *out = 0;
+  *outsize = 0;
+  if(file < 0) return 78;
+  /*only regular files can be mapped, and only if they fit in the address space*/
+  if(fstat(file, &status) != 0 || !S_ISREG(status.st_mode) || (off_t)(size_t)status.st_size != status.st_size) {
+    close(file);
+    return 78;
+  }
+  if(status.st_size == 0) {
+    close(file); /*mmap can't map 0 bytes, an empty file is just an empty buffer*/
+    return 0;
+  }
+  data = mmap(0, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file); /*the mapping keeps its own reference to the file*/
+  if(data == MAP_FAILED) return 78;
+  /*the decoder reads the file once from start to end*/
+#if defined(MADV_SEQUENTIAL)
+  madvise(data, (size_t)status.st_size, MADV_SEQUENTIAL);
+#elif defined(POSIX_MADV_SEQUENTIAL)
+  posix_madvise(data, (size_t)status.st_size, POSIX_MADV_SEQUENTIAL);
+#endif
+  *out = (const unsigned char*)data;
+  *outsize = (size_t)status.st_size;
+  return 0;
+#elif defined(LODEPNG_MAP_WIN32)
+  LARGE_INTEGER size;
+  HANDLE mapping;
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  *out = 0;
+  *outsize = 0;
+  if(file == INVALID_HANDLE_VALUE) return 78;
+  if(!GetFileSizeEx(file, &size) || (LONGLONG)(size_t)size.QuadPart != size.QuadPart) {
+    CloseHandle(file);
+    return 78;
+  }
+  if(size.QuadPart == 0) {
+    CloseHandle(file); /*a mapping of 0 bytes can't be created, an empty file is just an empty buffer*/
+    return 0;
+  }
+  mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(file); /*the mapping and its view keep their own references to the file*/
+  if(!mapping) return 78;
+  *out = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if(!*out) return 78;
+  *outsize = (size_t)size.QuadPart;
+  return 0;
+#else /*no file mapping on this platform: read the file instead*/
+  unsigned char* buffer = 0;
+  unsigned error = lodepng_load_file(&buffer, outsize, filename);
+  *out = buffer;
+  return error;
+#endif
+}
+
+void lodepng_unmap_file(const unsigned char* buffer, size_t buffersize) {
+#if defined(LODEPNG_MAP_POSIX)
+  if(buffer) munmap((void*)buffer, buffersize);
+#elif defined(LODEPNG_MAP_WIN32)
+  (void)buffersize;
+  if(buffer) UnmapViewOfFile(buffer);
+#else
+  (void)buffersize;
+  lodepng_scratch_free((void*)buffer);
+#endif
+}
+
 /*write given buffer to the file, overwriting the file, it doesn't append to it.*/
 unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const char* filename) {
   FILE* file;
@@ -646,10 +1074,10 @@ static void HuffmanTree_init(HuffmanTree* tree) {
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree) {
-  lodepng_free(tree->codes);
-  lodepng_free(tree->lengths);
-  lodepng_free(tree->table_len);
-  lodepng_free(tree->table_value);
+  lodepng_scratch_free(tree->codes);
+  lodepng_scratch_free(tree->lengths);
+  lodepng_scratch_free(tree->table_len);
+  lodepng_scratch_free(tree->table_value);
 }
 
 /* amount of bits for first huffman table lookup (aka root bits), see HuffmanTree_makeTable and huffmanDecodeSymbol.*/
@@ -665,7 +1093,7 @@ static unsigned HuffmanTree_makeTable(HuffmanTree* tree) {
   static const unsigned headsize = 1u << FIRSTBITS; /*size of the first table*/
   static const unsigned mask = (1u << FIRSTBITS) /*headsize*/ - 1u;
   size_t i, numpresent, pointer, size; /*total table size*/
-  unsigned* maxlens = (unsigned*)lodepng_malloc(headsize * sizeof(unsigned));
+  unsigned* maxlens = (unsigned*)lodepng_scratch_malloc(headsize * sizeof(unsigned));
   if(!maxlens) return 83; /*alloc fail*/
 
   /* compute maxlens: max total bit length of symbols sharing prefix in the first table*/
@@ -685,10 +1113,10 @@ static unsigned HuffmanTree_makeTable(HuffmanTree* tree) {
     unsigned l = maxlens[i];
     if(l > FIRSTBITS) size += (((size_t)1) << (l - FIRSTBITS));
   }
-  tree->table_len = (unsigned char*)lodepng_malloc(size * sizeof(*tree->table_len));
-  tree->table_value = (unsigned short*)lodepng_malloc(size * sizeof(*tree->table_value));
+  tree->table_len = (unsigned char*)lodepng_scratch_malloc(size * sizeof(*tree->table_len));
+  tree->table_value = (unsigned short*)lodepng_scratch_malloc(size * sizeof(*tree->table_value));
   if(!tree->table_len || !tree->table_value) {
-    lodepng_free(maxlens);
+    lodepng_scratch_free(maxlens);
     /* freeing tree->table values is done at a higher scope */
     return 83; /*alloc fail*/
   }
@@ -704,7 +1132,7 @@ static unsigned HuffmanTree_makeTable(HuffmanTree* tree) {
     tree->table_value[i] = (unsigned short)pointer;
     pointer += (((size_t)1) << (l - FIRSTBITS));
   }
-  lodepng_free(maxlens);
+  lodepng_scratch_free(maxlens);
 
   /*fill in the first table for short symbols, or secondary table for long symbols*/
   numpresent = 0;
@@ -788,9 +1216,9 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree) {
   unsigned error = 0;
   unsigned bits, n;
 
-  tree->codes = (unsigned*)lodepng_malloc(tree->numcodes * sizeof(unsigned));
-  blcount = (unsigned*)lodepng_malloc((tree->maxbitlen + 1) * sizeof(unsigned));
-  nextcode = (unsigned*)lodepng_malloc((tree->maxbitlen + 1) * sizeof(unsigned));
+  tree->codes = (unsigned*)lodepng_scratch_malloc(tree->numcodes * sizeof(unsigned));
+  blcount = (unsigned*)lodepng_scratch_malloc((tree->maxbitlen + 1) * sizeof(unsigned));
+  nextcode = (unsigned*)lodepng_scratch_malloc((tree->maxbitlen + 1) * sizeof(unsigned));
   if(!tree->codes || !blcount || !nextcode) error = 83; /*alloc fail*/
 
   if(!error) {
@@ -811,8 +1239,8 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree) {
     }
   }
 
-  lodepng_free(blcount);
-  lodepng_free(nextcode);
+  lodepng_scratch_free(blcount);
+  lodepng_scratch_free(nextcode);
 
   if(!error) error = HuffmanTree_makeTable(tree);
   return error;
@@ -826,7 +1254,7 @@ return value is error.
 static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* bitlen,
                                             size_t numcodes, unsigned maxbitlen) {
   unsigned i;
-  tree->lengths = (unsigned*)lodepng_malloc(numcodes * sizeof(unsigned));
+  tree->lengths = (unsigned*)lodepng_scratch_malloc(numcodes * sizeof(unsigned));
   if(!tree->lengths) return 83; /*alloc fail*/
   for(i = 0; i != numcodes; ++i) tree->lengths[i] = bitlen[i];
   tree->numcodes = (unsigned)numcodes; /*number of symbols*/
@@ -892,7 +1320,7 @@ static BPMNode* bpmnode_create(BPMLists* lists, int weight, unsigned index, BPMN
 
 /*sort the leaves with stable mergesort*/
 static void bpmnode_sort(BPMNode* leaves, size_t num) {
-  BPMNode* mem = (BPMNode*)lodepng_malloc(sizeof(*leaves) * num);
+  BPMNode* mem = (BPMNode*)lodepng_scratch_malloc(sizeof(*leaves) * num);
   size_t width, counter = 0;
   for(width = 1; width < num; width *= 2) {
     BPMNode* a = (counter & 1) ? mem : leaves;
@@ -910,7 +1338,7 @@ static void bpmnode_sort(BPMNode* leaves, size_t num) {
     counter++;
   }
   if(counter & 1) lodepng_memcpy(leaves, mem, sizeof(*leaves) * num);
-  lodepng_free(mem);
+  lodepng_scratch_free(mem);
 }
 
 /*Boundary Package Merge step, numpresent is the amount of leaves, and c is the current chain.*/
@@ -949,7 +1377,7 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
   if(numcodes == 0) return 80; /*error: a tree of 0 symbols is not supposed to be made*/
   if((1u << maxbitlen) < (unsigned)numcodes) return 80; /*error: represent all symbols*/
 
-  leaves = (BPMNode*)lodepng_malloc(numcodes * sizeof(*leaves));
+  leaves = (BPMNode*)lodepng_scratch_malloc(numcodes * sizeof(*leaves));
   if(!leaves) return 83; /*alloc fail*/
 
   for(i = 0; i != numcodes; ++i) {
@@ -982,10 +1410,10 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
     lists.memsize = 2 * maxbitlen * (maxbitlen + 1);
     lists.nextfree = 0;
     lists.numfree = lists.memsize;
-    lists.memory = (BPMNode*)lodepng_malloc(lists.memsize * sizeof(*lists.memory));
-    lists.freelist = (BPMNode**)lodepng_malloc(lists.memsize * sizeof(BPMNode*));
-    lists.chains0 = (BPMNode**)lodepng_malloc(lists.listsize * sizeof(BPMNode*));
-    lists.chains1 = (BPMNode**)lodepng_malloc(lists.listsize * sizeof(BPMNode*));
+    lists.memory = (BPMNode*)lodepng_scratch_malloc(lists.memsize * sizeof(*lists.memory));
+    lists.freelist = (BPMNode**)lodepng_scratch_malloc(lists.memsize * sizeof(BPMNode*));
+    lists.chains0 = (BPMNode**)lodepng_scratch_malloc(lists.listsize * sizeof(BPMNode*));
+    lists.chains1 = (BPMNode**)lodepng_scratch_malloc(lists.listsize * sizeof(BPMNode*));
     if(!lists.memory || !lists.freelist || !lists.chains0 || !lists.chains1) error = 83; /*alloc fail*/
 
     if(!error) {
@@ -1007,13 +1435,13 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
       }
     }
 
-    lodepng_free(lists.memory);
-    lodepng_free(lists.freelist);
-    lodepng_free(lists.chains0);
-    lodepng_free(lists.chains1);
+    lodepng_scratch_free(lists.memory);
+    lodepng_scratch_free(lists.freelist);
+    lodepng_scratch_free(lists.chains0);
+    lodepng_scratch_free(lists.chains1);
   }
 
-  lodepng_free(leaves);
+  lodepng_scratch_free(leaves);
   return error;
 }
 
@@ -1022,7 +1450,7 @@ static unsigned HuffmanTree_makeFromFrequencies(HuffmanTree* tree, const unsigne
                                                 size_t mincodes, size_t numcodes, unsigned maxbitlen) {
   unsigned error = 0;
   while(!frequencies[numcodes - 1] && numcodes > mincodes) --numcodes; /*trim zeroes*/
-  tree->lengths = (unsigned*)lodepng_malloc(numcodes * sizeof(unsigned));
+  tree->lengths = (unsigned*)lodepng_scratch_malloc(numcodes * sizeof(unsigned));
   if(!tree->lengths) return 83; /*alloc fail*/
   tree->maxbitlen = maxbitlen;
   tree->numcodes = (unsigned)numcodes; /*number of symbols*/
@@ -1036,7 +1464,7 @@ static unsigned HuffmanTree_makeFromFrequencies(HuffmanTree* tree, const unsigne
 /*get the literal and length code tree of a deflated block with fixed tree, as per the deflate specification*/
 static unsigned generateFixedLitLenTree(HuffmanTree* tree) {
   unsigned i, error = 0;
-  unsigned* bitlen = (unsigned*)lodepng_malloc(NUM_DEFLATE_CODE_SYMBOLS * sizeof(unsigned));
+  unsigned* bitlen = (unsigned*)lodepng_scratch_malloc(NUM_DEFLATE_CODE_SYMBOLS * sizeof(unsigned));
   if(!bitlen) return 83; /*alloc fail*/
 
   /*288 possible codes: 0-255=literals, 256=endcode, 257-285=lengthcodes, 286-287=unused*/
@@ -1047,21 +1475,21 @@ static unsigned generateFixedLitLenTree(HuffmanTree* tree) {
 
   error = HuffmanTree_makeFromLengths(tree, bitlen, NUM_DEFLATE_CODE_SYMBOLS, 15);
 
-  lodepng_free(bitlen);
+  lodepng_scratch_free(bitlen);
   return error;
 }
 
 /*get the distance code tree of a deflated block with fixed tree, as specified in the deflate specification*/
 static unsigned generateFixedDistanceTree(HuffmanTree* tree) {
   unsigned i, error = 0;
-  unsigned* bitlen = (unsigned*)lodepng_malloc(NUM_DISTANCE_SYMBOLS * sizeof(unsigned));
+  unsigned* bitlen = (unsigned*)lodepng_scratch_malloc(NUM_DISTANCE_SYMBOLS * sizeof(unsigned));
   if(!bitlen) return 83; /*alloc fail*/
 
   /*there are 32 distance codes, but 30-31 are unused*/
   for(i = 0; i != NUM_DISTANCE_SYMBOLS; ++i) bitlen[i] = 5;
   error = HuffmanTree_makeFromLengths(tree, bitlen, NUM_DISTANCE_SYMBOLS, 15);
 
-  lodepng_free(bitlen);
+  lodepng_scratch_free(bitlen);
   return error;
 }
 
@@ -1124,7 +1552,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   /*number of code length codes. Unlike the spec, the value 4 is added to it here already*/
   HCLEN = readBits(reader, 4) + 4;
 
-  bitlen_cl = (unsigned*)lodepng_malloc(NUM_CODE_LENGTH_CODES * sizeof(unsigned));
+  bitlen_cl = (unsigned*)lodepng_scratch_malloc(NUM_CODE_LENGTH_CODES * sizeof(unsigned));
   if(!bitlen_cl) return 83 /*alloc fail*/;
 
   HuffmanTree_init(&tree_cl);
@@ -1146,8 +1574,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     if(error) break;
 
     /*now we can use this tree to read the lengths for the tree that this function will return*/
-    bitlen_ll = (unsigned*)lodepng_malloc(NUM_DEFLATE_CODE_SYMBOLS * sizeof(unsigned));
-    bitlen_d = (unsigned*)lodepng_malloc(NUM_DISTANCE_SYMBOLS * sizeof(unsigned));
+    bitlen_ll = (unsigned*)lodepng_scratch_malloc(NUM_DEFLATE_CODE_SYMBOLS * sizeof(unsigned));
+    bitlen_d = (unsigned*)lodepng_scratch_malloc(NUM_DISTANCE_SYMBOLS * sizeof(unsigned));
     if(!bitlen_ll || !bitlen_d) ERROR_BREAK(83 /*alloc fail*/);
     lodepng_memset(bitlen_ll, 0, NUM_DEFLATE_CODE_SYMBOLS * sizeof(*bitlen_ll));
     lodepng_memset(bitlen_d, 0, NUM_DISTANCE_SYMBOLS * sizeof(*bitlen_d));
@@ -1226,43 +1654,248 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     break; /*end of error-while*/
   }
 
-  lodepng_free(bitlen_cl);
-  lodepng_free(bitlen_ll);
-  lodepng_free(bitlen_d);
+  lodepng_scratch_free(bitlen_cl);
+  lodepng_scratch_free(bitlen_ll);
+  lodepng_scratch_free(bitlen_d);
   HuffmanTree_cleanup(&tree_cl);
 
   return error;
 }
 
-/*inflate a block with dynamic of fixed Huffman tree. btype must be 1 or 2.*/
-static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
-                                    unsigned btype, size_t max_output_size) {
+#ifdef LODEPNG_FAST_INFLATE
+/*
+Fast path for the bulk of a huffman block, used while enough input and output space is left. The bits are kept in
+a 64-bit buffer that is refilled without branches, and the lookup tables resolve a literal/length code together
+with the extra bits of the length, or two short literals, in one lookup. Anything unusual (end of the input, codes
+that are invalid, distances pointing before the start) returns without consuming that symbol, and the loop in
+inflateHuffmanBlock finishes the block with exactly the same output and error codes as it would have alone. For the
+latter, it only stops near the limits where that loop would start a new iteration: that loop checks for errors
+after up to two symbols (a literal and the next symbol), so the grouping of the symbols can change which error it
+reports first.
+*/
+
+#define FASTBITS_LL 11u /*index bits of the literal/length table, enough for two literals of up to 5-6 bits*/
+#define FASTBITS_D FIRSTBITS /*index bits of the distance table*/
+#define FAST_MARGIN 272u /*free output space needed for one step: max length 258 plus the copy overshoot*/
+
+/*table entry: bits 0-7 code length(s), 8-11 amount of extra bits, 12-15 kind, 16-31 value.
+0 means the code is too long for the table or invalid, and needs the regular lookup.*/
+#define FAST_LITERAL 0x1000u /*value is one literal*/
+#define FAST_PAIR 0x2000u /*value is two literals, the first one in the low byte, bits 8-11 are its code length*/
+#define FAST_MATCH 0x4000u /*value is the base length, or in the distance table the base distance*/
+#define FAST_END 0x8000u /*end code*/
+
+static lodepng_uint64 lodepng_read64bitLE(const unsigned char* buffer) {
+  /*compilers turn this into a single load on little endian CPUs*/
+  return (lodepng_uint64)buffer[0] | ((lodepng_uint64)buffer[1] << 8u) |
+         ((lodepng_uint64)buffer[2] << 16u) | ((lodepng_uint64)buffer[3] << 24u) |
+         ((lodepng_uint64)buffer[4] << 32u) | ((lodepng_uint64)buffer[5] << 40u) |
+         ((lodepng_uint64)buffer[6] << 48u) | ((lodepng_uint64)buffer[7] << 56u);
+}
+
+/*like huffmanDecodeSymbol, but from the lowest bits of buffer, and returns the code length in bits*/
+static unsigned huffmanDecodeBuffered(const HuffmanTree* codetree, lodepng_uint64 buffer, unsigned* bits) {
+  unsigned index = (unsigned)buffer & ((1u << FIRSTBITS) - 1u);
+  unsigned l = codetree->table_len[index];
+  if(l > FIRSTBITS) {
+    index = codetree->table_value[index] + ((unsigned)(buffer >> FIRSTBITS) & ((1u << (l - FIRSTBITS)) - 1u));
+    l = codetree->table_len[index];
+  }
+  *bits = l;
+  return codetree->table_value[index];
+}
+
+static unsigned inflateFastLengthEntry(unsigned symbol, unsigned bits) {
+  if(symbol <= 255) return (symbol << 16u) | FAST_LITERAL | bits;
+  if(symbol == 256) return FAST_END | bits;
+  if(symbol >= FIRST_LENGTH_CODE_INDEX && symbol <= LAST_LENGTH_CODE_INDEX) {
+    symbol -= FIRST_LENGTH_CODE_INDEX;
+    return (LENGTHBASE[symbol] << 16u) | FAST_MATCH | (LENGTHEXTRA[symbol] << 8u) | bits;
+  }
+  return 0; /*invalid symbol*/
+}
+
+static unsigned inflateFastDistanceEntry(unsigned symbol, unsigned bits) {
+  if(symbol > 29) return 0; /*invalid symbol*/
+  return (DISTANCEBASE[symbol] << 16u) | FAST_MATCH | (DISTANCEEXTRA[symbol] << 8u) | bits;
+}
+
+/*fills the 2^numbits entries of the table, codes longer than numbits are left 0*/
+static void inflateFastTable(unsigned* table, const HuffmanTree* codetree, unsigned numbits, int distance) {
+  unsigned i, size = 1u << numbits;
+  for(i = 0; i < size; ++i) {
+    unsigned bits, symbol = huffmanDecodeBuffered(codetree, i, &bits);
+    if(bits > numbits) table[i] = 0;
+    else table[i] = distance ? inflateFastDistanceEntry(symbol, bits) : inflateFastLengthEntry(symbol, bits);
+  }
+  if(distance) return;
+  /*merge two literals into one entry if both codes fit in numbits. Going downwards, the entry of the second literal
+  (index i >> bits, always smaller than i) is still a single literal when it is read.*/
+  for(i = size; i-- > 0;) {
+    unsigned first = table[i], second, bits;
+    if(!(first & FAST_LITERAL)) continue;
+    bits = first & 255u;
+    second = table[i >> bits];
+    if(!(second & FAST_LITERAL) || bits + (second & 255u) > numbits) continue;
+    table[i] = (first & 0xff0000u) | ((second & 0xff0000u) << 8u) | FAST_PAIR | (bits << 8u) | (bits + (second & 255u));
+  }
+}
+
+/*copies a match from distance bytes back, writes up to 7 bytes past the end*/
+static void inflateFastCopy(unsigned char* out, size_t distance, size_t length) {
+  const unsigned char* in = out - distance;
+  unsigned char* end = out + length;
+  if(distance >= 8) {
+    /*chunks don't overlap, and each one only reads bytes that were already written*/
+    do {
+      lodepng_memcpy(out, in, 8);
+      out += 8;
+      in += 8;
+    } while(out < end);
+  } else if(distance == 1) {
+    lodepng_memset(out, *in, length);
+  } else {
+    /*short distances such as a repeated pixel: the first bytes one by one, then the pattern also repeats at a
+    multiple of distance that is at least 8 back, so the rest can be copied in chunks from there*/
+    size_t i, period = distance;
+    while(period < 8) period += distance;
+    for(i = 0; i < period && out < end; ++i) *out++ = *in++;
+    for(in = out - period; out < end; out += 8, in += 8) lodepng_memcpy(out, in, 8);
+  }
+}
+
+static unsigned inflateHuffmanFast(ucvector* out, LodePNGBitReader* reader, const HuffmanTree* tree_ll,
+                                   const HuffmanTree* tree_d, size_t max_output_size, int* done) {
   unsigned error = 0;
-  HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
-  HuffmanTree tree_d; /*the huffman tree for distance codes*/
-  const size_t reserved_size = 260; /* must be at least 258 for max length, and a few extra for adding a few extra literals */
-  int done = 0;
+  const unsigned char* in = reader->data;
+  size_t inpos = reader->bp >> 3u; /*next byte to load into buffer*/
+  lodepng_uint64 buffer = 0;
+  unsigned numbits = 0; /*valid bits in buffer, above them are the next bits of the input or zeroes*/
+  int second = 0; /*the next symbol is the second one of an iteration of the loop in inflateHuffmanBlock*/
+  unsigned* table_ll;
+  unsigned* table_d;
+  /*kept in locals: the compiler can't keep out->size in a register across the stores to the output bytes*/
+  unsigned char* data = out->data;
+  size_t size = out->size;
+
+  if(inpos + 64 > reader->size) return 0; /*not worth building the tables for the last few bytes*/
+  table_ll = (unsigned*)lodepng_scratch_malloc(((1u << FASTBITS_LL) + (1u << FASTBITS_D)) * sizeof(unsigned));
+  if(!table_ll) return 83; /*alloc fail*/
+  table_d = table_ll + (1u << FASTBITS_LL);
+  inflateFastTable(table_ll, tree_ll, FASTBITS_LL, 0);
+  inflateFastTable(table_d, tree_d, FASTBITS_D, 1);
+
+  buffer = lodepng_read64bitLE(in + inpos);
+  inpos += 7;
+  numbits = 56 - (unsigned)(reader->bp & 7u);
+  buffer >>= reader->bp & 7u;
 
-  if(!ucvector_reserve(out, out->size + reserved_size)) return 83; /*alloc fail*/
+  for(;;) {
+    unsigned entry, bits;
+    /*near the end of the input or max_output_size: stop at the next iteration boundary, with enough room left
+    to decode one more symbol before it. The rest is decoded with bounds checks.*/
+    int near = inpos + 16 > reader->size || (max_output_size && size + 2 * FAST_MARGIN > max_output_size);
+    if(out->allocsize - size < FAST_MARGIN) {
+      out->size = size;
+      if(!ucvector_reserve(out, size + FAST_MARGIN)) ERROR_BREAK(83); /*alloc fail*/
+      data = out->data;
+    }
+    if(near && !second) break;
+
+    /*branchless refill: load 8 bytes, and advance by the whole bytes that fit, leaving 56 to 63 valid bits*/
+    buffer |= lodepng_read64bitLE(in + inpos) << numbits;
+    inpos += (63u - numbits) >> 3u;
+    numbits |= 56u;
+
+    entry = table_ll[buffer & ((1u << FASTBITS_LL) - 1u)];
+    if(!entry) {
+      unsigned symbol = huffmanDecodeBuffered(tree_ll, buffer, &bits);
+      entry = inflateFastLengthEntry(symbol, bits);
+      if(!entry) break; /*invalid symbol, the regular loop reports it*/
+    }
+    bits = entry & 255u;
+    if((entry & FAST_PAIR) && near) {
+      /*only the first literal, which ends the iteration*/
+      bits = (entry >> 8u) & 15u;
+      entry = (entry & 0xff0000u) | FAST_LITERAL;
+    }
+
+    if(entry & FAST_PAIR) {
+      data[size] = (unsigned char)(entry >> 16u);
+      data[size + 1] = (unsigned char)(entry >> 24u);
+      size += 2; /*leaves second as it was*/
+    } else if(entry & FAST_LITERAL) {
+      data[size++] = (unsigned char)(entry >> 16u);
+      second = !second;
+    } else if(entry & FAST_MATCH) {
+      /*up to 15 + 5 bits for the length and 15 + 13 for the distance, all within the 56 refilled bits*/
+      unsigned length, distance, entry_d;
+      unsigned numextra = (entry >> 8u) & 15u;
+      length = (entry >> 16u) + ((unsigned)(buffer >> bits) & ((1u << numextra) - 1u));
+      bits += numextra;
+
+      entry_d = table_d[(buffer >> bits) & ((1u << FASTBITS_D) - 1u)];
+      if(!entry_d) {
+        unsigned symbol_d, bits_d;
+        symbol_d = huffmanDecodeBuffered(tree_d, buffer >> bits, &bits_d);
+        entry_d = inflateFastDistanceEntry(symbol_d, bits_d);
+        if(!entry_d) break; /*invalid distance code, the regular loop reports it*/
+      }
+      bits += entry_d & 255u;
+      numextra = (entry_d >> 8u) & 15u;
+      distance = (entry_d >> 16u) + ((unsigned)(buffer >> bits) & ((1u << numextra) - 1u));
+      bits += numextra;
+      if(distance > size) break; /*too long backward distance, the regular loop reports it*/
 
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
+      inflateFastCopy(data + size, distance, length);
+      size += length;
+      second = 0;
+    } else /*if(entry & FAST_END)*/ {
+      *done = 1;
+    }
 
-  if(btype == 1) error = getTreeInflateFixed(&tree_ll, &tree_d);
-  else /*if(btype == 2)*/ error = getTreeInflateDynamic(&tree_ll, &tree_d, reader);
+    buffer >>= bits;
+    numbits -= bits;
+    if(*done) break;
+  }
+
+  out->size = size;
+  reader->bp = (inpos << 3u) - numbits;
+  lodepng_scratch_free(table_ll);
+  return error;
+}
+#endif /*LODEPNG_FAST_INFLATE*/
+
+/*decode the symbols of a block with the given trees, until the end code which sets *done. For the streaming
+decoder it can also stop early at a symbol boundary, to continue later with the same trees: if partial is set when
+fewer than 64 bits of input are left (more input is still to come), and if stop_size is not 0 when the output
+reached that size.*/
+static unsigned inflateHuffmanSymbols(ucvector* out, LodePNGBitReader* reader,
+                                      const HuffmanTree* tree_ll, const HuffmanTree* tree_d,
+                                      size_t max_output_size, unsigned partial, size_t stop_size, int* done) {
+  unsigned error = 0;
+  const size_t reserved_size = 260; /* must be at least 258 for max length, and a few extra for adding a few extra literals */
+
+  if(!ucvector_reserve(out, out->size + reserved_size)) return 83; /*alloc fail*/
 
+#ifdef LODEPNG_FAST_INFLATE
+  error = inflateHuffmanFast(out, reader, tree_ll, tree_d, stop_size ? stop_size : max_output_size, done);
+#endif /*LODEPNG_FAST_INFLATE*/
 
-  while(!error && !done) /*decode all symbols until end reached, breaks at end code*/ {
+  while(!error && !*done) /*decode all symbols until end reached, breaks at end code*/ {
     /*code_ll is literal, length or end code*/
     unsigned code_ll;
+    /*one iteration reads at most 15 + 15 + 5 + 15 + 13 bits*/
+    if(partial && reader->bitsize - reader->bp < 64) break;
+    if(stop_size && out->size >= stop_size) break;
     /* ensure enough bits for 2 huffman code reads (15 bits each): if the first is a literal, a second literal is read at once. This
     appears to be slightly faster, than ensuring 20 bits here for 1 huffman symbol and the potential 5 extra bits for the length symbol.*/
     ensureBits32(reader, 30);
-    code_ll = huffmanDecodeSymbol(reader, &tree_ll);
+    code_ll = huffmanDecodeSymbol(reader, tree_ll);
     if(code_ll <= 255) {
       /*slightly faster code path if multiple literals in a row*/
       out->data[out->size++] = (unsigned char)code_ll;
-      code_ll = huffmanDecodeSymbol(reader, &tree_ll);
+      code_ll = huffmanDecodeSymbol(reader, tree_ll);
     }
     if(code_ll <= 255) /*literal symbol*/ {
       out->data[out->size++] = (unsigned char)code_ll;
@@ -1284,7 +1917,7 @@ static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
 
       /*part 3: get distance code*/
       ensureBits32(reader, 28); /* up to 15 for the huffman symbol, up to 13 for the extra bits */
-      code_d = huffmanDecodeSymbol(reader, &tree_d);
+      code_d = huffmanDecodeSymbol(reader, tree_d);
       if(code_d > 29) {
         if(code_d <= 31) {
           ERROR_BREAK(18); /*error: invalid distance code (30-31 are never used)*/
@@ -1318,7 +1951,7 @@ static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
         lodepng_memcpy(out->data + start, out->data + backward, length);
       }
     } else if(code_ll == 256) {
-      done = 1; /*end code, finish the loop*/
+      *done = 1; /*end code, finish the loop*/
     } else /*if(code_ll == INVALIDSYMBOL)*/ {
       ERROR_BREAK(16); /*error: tried to read disallowed huffman symbol*/
     }
@@ -1337,6 +1970,25 @@ static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
     }
   }
 
+  return error;
+}
+
+/*inflate a block with dynamic of fixed Huffman tree. btype must be 1 or 2.*/
+static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
+                                    unsigned btype, size_t max_output_size) {
+  unsigned error = 0;
+  HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
+  HuffmanTree tree_d; /*the huffman tree for distance codes*/
+  int done = 0;
+
+  HuffmanTree_init(&tree_ll);
+  HuffmanTree_init(&tree_d);
+
+  if(btype == 1) error = getTreeInflateFixed(&tree_ll, &tree_d);
+  else /*if(btype == 2)*/ error = getTreeInflateDynamic(&tree_ll, &tree_d, reader);
+
+  if(!error) error = inflateHuffmanSymbols(out, reader, &tree_ll, &tree_d, max_output_size, 0, 0, &done);
+
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
 
@@ -1362,10 +2014,12 @@ static unsigned inflateNoCompression(ucvector* out, LodePNGBitReader* reader,
     return 21; /*error: NLEN is not one's complement of LEN*/
   }
 
+  /*checked before growing the output, so a failed call does not leave uninitialized bytes in it*/
+  if(bytepos + LEN > size) return 23; /*error: reading outside of in buffer*/
+
   if(!ucvector_resize(out, out->size + LEN)) return 83; /*alloc fail*/
 
   /*read the literal data: LEN bytes are now stored in the out buffer*/
-  if(bytepos + LEN > size) return 23; /*error: reading outside of in buffer*/
 
   /*out->data can be NULL (when LEN is zero), and arithmetics on NULL ptr is undefined*/
   if (LEN) {
@@ -1433,6 +2087,150 @@ static unsigned inflatev(ucvector* out, const unsigned char* in, size_t insize,
 
 #endif /*LODEPNG_COMPILE_DECODER*/
 
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Adler32                                                                / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+static unsigned update_adler32_scalar(unsigned adler, const unsigned char* data, unsigned len) {
+  unsigned s1 = adler & 0xffffu;
+  unsigned s2 = (adler >> 16u) & 0xffffu;
+
+  while(len != 0u) {
+    unsigned i;
+    /*at least 5552 sums can be done before the sums overflow, saving a lot of module divisions*/
+    unsigned amount = len > 5552u ? 5552u : len;
+    len -= amount;
+    for(i = 0; i != amount; ++i) {
+      s1 += (*data++);
+      s2 += s1;
+    }
+    s1 %= 65521u;
+    s2 %= 65521u;
+  }
+
+  return (s2 << 16u) | s1;
+}
+
+#ifdef LODEPNG_SIMD_X86
+/*
+The SIMD versions take blocks of 32 bytes, len must be a multiple of 32. Per block, s1 grows by the sum of the
+bytes, and s2 by 32 times s1 before the block plus the bytes weighted 32, 31, ..., 1. The weighted sums are
+kept in 32-bit lanes and reduced modulo 65521 after at most 5536 bytes, the same overflow bound as above.
+*/
+LODEPNG_TARGET("ssse3")
+static unsigned update_adler32_ssse3(unsigned adler, const unsigned char* data, unsigned len) {
+  unsigned s1 = adler & 0xffffu;
+  unsigned s2 = (adler >> 16u) & 0xffffu;
+  unsigned blocks = len / 32u;
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+
+  while(blocks != 0u) {
+    unsigned n = blocks > 173u ? 173u : blocks;
+    /*v_ps: sum of s1 before each block, v_s1: sum of the bytes, v_s2: the weighted sums*/
+    __m128i v_ps = _mm_cvtsi32_si128((int)(s1 * n));
+    __m128i v_s2 = _mm_cvtsi32_si128((int)s2);
+    __m128i v_s1 = zero;
+    blocks -= n;
+    while(n--) {
+      __m128i bytes1 = _mm_loadu_si128((const __m128i*)data);
+      __m128i bytes2 = _mm_loadu_si128((const __m128i*)(data + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+      data += 32;
+    }
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+    /*horizontal sums of the four lanes*/
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(v_s1)) % 65521u;
+    s2 = (unsigned)_mm_cvtsi128_si32(v_s2) % 65521u;
+  }
+  return (s2 << 16u) | s1;
+}
+
+LODEPNG_TARGET("avx2")
+static unsigned update_adler32_avx2(unsigned adler, const unsigned char* data, unsigned len) {
+  unsigned s1 = adler & 0xffffu;
+  unsigned s2 = (adler >> 16u) & 0xffffu;
+  unsigned blocks = len / 32u;
+  const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                       16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+
+  while(blocks != 0u) {
+    unsigned n = blocks > 173u ? 173u : blocks;
+    __m256i v_ps = _mm256_setr_epi32((int)(s1 * n), 0, 0, 0, 0, 0, 0, 0);
+    __m256i v_s2 = _mm256_setr_epi32((int)s2, 0, 0, 0, 0, 0, 0, 0);
+    __m256i v_s1 = zero;
+    __m128i h1, h2;
+    blocks -= n;
+    while(n--) {
+      __m256i bytes = _mm256_loadu_si256((const __m256i*)data);
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+      data += 32;
+    }
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+    h1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+    h2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+    h1 = _mm_add_epi32(h1, _mm_shuffle_epi32(h1, _MM_SHUFFLE(2, 3, 0, 1)));
+    h1 = _mm_add_epi32(h1, _mm_shuffle_epi32(h1, _MM_SHUFFLE(1, 0, 3, 2)));
+    h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, _MM_SHUFFLE(2, 3, 0, 1)));
+    h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(h1)) % 65521u;
+    s2 = (unsigned)_mm_cvtsi128_si32(h2) % 65521u;
+  }
+  return (s2 << 16u) | s1;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len) {
+#ifdef LODEPNG_SIMD_X86
+  if(len >= 64u) {
+    unsigned features = lodepng_cpu_features();
+    unsigned simdlen = len & ~31u;
+    if(features & (LODEPNG_CPU_AVX2 | LODEPNG_CPU_SSSE3)) {
+      if(features & LODEPNG_CPU_AVX2) adler = update_adler32_avx2(adler, data, simdlen);
+      else adler = update_adler32_ssse3(adler, data, simdlen);
+      data += simdlen;
+      len -= simdlen;
+    }
+  }
+#endif /*LODEPNG_SIMD_X86*/
+  return update_adler32_scalar(adler, data, len);
+}
+
+/*Return the adler32 of the bytes data[0..len-1]*/
+static unsigned adler32(const unsigned char* data, unsigned len) {
+  return update_adler32(1u, data, len);
+}
+
+#ifdef LODEPNG_COMPILE_ENCODER
+/*Return the adler32 of the concatenation of two parts, from the adler32 of both and the length of the second*/
+static unsigned adler32_combine(unsigned adler1, unsigned adler2, size_t len2) {
+  unsigned rem = (unsigned)(len2 % 65521u);
+  unsigned s1 = adler1 & 0xffffu;
+  unsigned s2 = (rem * s1) % 65521u;
+  s1 += (adler2 & 0xffffu) + 65521u - 1u;
+  s2 += ((adler1 >> 16u) & 0xffffu) + ((adler2 >> 16u) & 0xffffu) + 65521u - rem;
+  if(s1 >= 65521u) s1 -= 65521u;
+  if(s1 >= 65521u) s1 -= 65521u;
+  if(s2 >= 65521u * 2u) s2 -= 65521u * 2u;
+  if(s2 >= 65521u) s2 -= 65521u;
+  return (s2 << 16u) | s1;
+}
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
 #ifdef LODEPNG_COMPILE_ENCODER
 
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -1500,13 +2298,13 @@ typedef struct Hash {
 
 static unsigned hash_init(Hash* hash, unsigned windowsize) {
   unsigned i;
-  hash->head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
-  hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
-  hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
+  hash->head = (int*)lodepng_scratch_malloc(sizeof(int) * HASH_NUM_VALUES);
+  hash->val = (int*)lodepng_scratch_malloc(sizeof(int) * windowsize);
+  hash->chain = (unsigned short*)lodepng_scratch_malloc(sizeof(unsigned short) * windowsize);
 
-  hash->zeros = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
-  hash->headz = (int*)lodepng_malloc(sizeof(int) * (MAX_SUPPORTED_DEFLATE_LENGTH + 1));
-  hash->chainz = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
+  hash->zeros = (unsigned short*)lodepng_scratch_malloc(sizeof(unsigned short) * windowsize);
+  hash->headz = (int*)lodepng_scratch_malloc(sizeof(int) * (MAX_SUPPORTED_DEFLATE_LENGTH + 1));
+  hash->chainz = (unsigned short*)lodepng_scratch_malloc(sizeof(unsigned short) * windowsize);
 
   if(!hash->head || !hash->chain || !hash->val  || !hash->headz|| !hash->chainz || !hash->zeros) {
     return 83; /*alloc fail*/
@@ -1524,13 +2322,13 @@ static unsigned hash_init(Hash* hash, unsigned windowsize) {
 }
 
 static void hash_cleanup(Hash* hash) {
-  lodepng_free(hash->head);
-  lodepng_free(hash->val);
-  lodepng_free(hash->chain);
+  lodepng_scratch_free(hash->head);
+  lodepng_scratch_free(hash->val);
+  lodepng_scratch_free(hash->chain);
 
-  lodepng_free(hash->zeros);
-  lodepng_free(hash->headz);
-  lodepng_free(hash->chainz);
+  lodepng_scratch_free(hash->zeros);
+  lodepng_scratch_free(hash->headz);
+  lodepng_scratch_free(hash->chainz);
 }
 
 
@@ -1575,6 +2373,40 @@ static void updateHashChain(Hash* hash, size_t wpos, unsigned hashval, unsigned
   hash->headz[numzeros] = (int)wpos;
 }
 
+#ifdef LODEPNG_SIMD_X86
+/*index of the lowest set bit, mask must not be 0*/
+static unsigned lodepng_ctz(unsigned mask) {
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return (unsigned)index;
+#else
+  return (unsigned)__builtin_ctz(mask);
+#endif
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+/*how many bytes from fore on, up to end, are the same as those from back on*/
+static unsigned matchLength(const unsigned char* back, const unsigned char* fore, const unsigned char* end) {
+  const unsigned char* start = fore;
+#ifdef LODEPNG_SIMD_X86
+  /*16 bytes at a time, the first different byte is the lowest 0 bit of the compare mask*/
+  while(end - fore >= 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)back);
+    __m128i b = _mm_loadu_si128((const __m128i*)fore);
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 65535u;
+    if(mask) return (unsigned)(fore - start) + lodepng_ctz(mask);
+    back += 16;
+    fore += 16;
+  }
+#endif /*LODEPNG_SIMD_X86*/
+  while(fore != end && *back == *fore) {
+    ++back;
+    ++fore;
+  }
+  return (unsigned)(fore - start);
+}
+
 /*
 LZ77-encode the data. Return value is error code. The input are raw bytes, the output
 is in the form of unsigned integers with codes representing for example literal bytes, or
@@ -1585,10 +2417,14 @@ the "dictionary". A brute force search through all possible distances would be s
 this hash technique is one out of several ways to speed this up.
 */
 static unsigned encodeLZ77(uivector* out, Hash* hash,
-                           const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
-                           unsigned minmatch, unsigned nicematch, unsigned lazymatching) {
+                           const unsigned char* in, size_t inpos, size_t insize,
+                           const LodePNGCompressSettings* settings) {
   size_t pos;
   unsigned i, error = 0;
+  unsigned windowsize = settings->windowsize;
+  unsigned minmatch = settings->minmatch;
+  unsigned nicematch = settings->nicematch;
+  unsigned lazymatching = settings->lazymatching;
   /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
   unsigned maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8u;
   unsigned maxlazymatch = windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
@@ -1608,8 +2444,16 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
 
   if(windowsize == 0 || windowsize > 32768) return 60; /*error: windowsize smaller/larger than allowed*/
   if((windowsize & (windowsize - 1)) != 0) return 90; /*error: must be power of two*/
+  /*a literal is one value and a match of at least 3 bytes is four, so the output never needs more than this.
+  Reserving it up front means no reallocations while encoding, and the same memory whatever the data is.*/
+  if(!uivector_reserve(out, out->size + (insize - inpos) + (insize - inpos) / 3u + 1u)) return 83; /*alloc fail*/
 
   if(nicematch > MAX_SUPPORTED_DEFLATE_LENGTH) nicematch = MAX_SUPPORTED_DEFLATE_LENGTH;
+  if(settings->maxchain) {
+    /*a match of nicematch is good enough to take without trying the next position either*/
+    maxchainlength = settings->maxchain;
+    maxlazymatch = nicematch;
+  }
 
   for(pos = inpos; pos < insize; ++pos) {
     size_t wpos = pos & (windowsize - 1); /*position for in 'circular' hash buffers*/
@@ -1655,11 +2499,8 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
           foreptr += skip;
         }
 
-        while(foreptr != lastptr && *backptr == *foreptr) /*maximum supported length by deflate is max length*/ {
-          ++backptr;
-          ++foreptr;
-        }
-        current_length = (unsigned)(foreptr - &in[pos]);
+        /*maximum supported length by deflate is max length*/
+        current_length = (unsigned)(foreptr - &in[pos]) + matchLength(backptr, foreptr, lastptr);
 
         if(current_length > length) {
           length = current_length; /*the longest length*/
@@ -1735,7 +2576,8 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
 
 /* /////////////////////////////////////////////////////////////////////////// */
 
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize) {
+/*final: whether the last block is the last one of the deflate stream*/
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize, unsigned final) {
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
   2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
 
@@ -1746,7 +2588,7 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
     unsigned char firstbyte;
     size_t pos = out->size;
 
-    BFINAL = (i == numdeflateblocks - 1);
+    BFINAL = final && (i == numdeflateblocks - 1);
     BTYPE = 0;
 
     LEN = 65535;
@@ -1845,9 +2687,9 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
   HuffmanTree_init(&tree_d);
   HuffmanTree_init(&tree_cl);
   /* could fit on stack, but >1KB is on the larger side so allocate instead */
-  frequencies_ll = (unsigned*)lodepng_malloc(286 * sizeof(*frequencies_ll));
-  frequencies_d = (unsigned*)lodepng_malloc(30 * sizeof(*frequencies_d));
-  frequencies_cl = (unsigned*)lodepng_malloc(NUM_CODE_LENGTH_CODES * sizeof(*frequencies_cl));
+  frequencies_ll = (unsigned*)lodepng_scratch_malloc(286 * sizeof(*frequencies_ll));
+  frequencies_d = (unsigned*)lodepng_scratch_malloc(30 * sizeof(*frequencies_d));
+  frequencies_cl = (unsigned*)lodepng_scratch_malloc(NUM_CODE_LENGTH_CODES * sizeof(*frequencies_cl));
 
   if(!frequencies_ll || !frequencies_d || !frequencies_cl) error = 83; /*alloc fail*/
 
@@ -1859,8 +2701,7 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     lodepng_memset(frequencies_cl, 0, NUM_CODE_LENGTH_CODES * sizeof(*frequencies_cl));
 
     if(settings->use_lz77) {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings);
       if(error) break;
     } else {
       if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
@@ -1890,9 +2731,9 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     numcodes_d = LODEPNG_MIN(tree_d.numcodes, 30);
     /*store the code lengths of both generated trees in bitlen_lld*/
     numcodes_lld = numcodes_ll + numcodes_d;
-    bitlen_lld = (unsigned*)lodepng_malloc(numcodes_lld * sizeof(*bitlen_lld));
+    bitlen_lld = (unsigned*)lodepng_scratch_malloc(numcodes_lld * sizeof(*bitlen_lld));
     /*numcodes_lld_e never needs more size than bitlen_lld*/
-    bitlen_lld_e = (unsigned*)lodepng_malloc(numcodes_lld * sizeof(*bitlen_lld_e));
+    bitlen_lld_e = (unsigned*)lodepng_scratch_malloc(numcodes_lld * sizeof(*bitlen_lld_e));
     if(!bitlen_lld || !bitlen_lld_e) ERROR_BREAK(83); /*alloc fail*/
     numcodes_lld_e = 0;
 
@@ -2011,11 +2852,11 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
   HuffmanTree_cleanup(&tree_cl);
-  lodepng_free(frequencies_ll);
-  lodepng_free(frequencies_d);
-  lodepng_free(frequencies_cl);
-  lodepng_free(bitlen_lld);
-  lodepng_free(bitlen_lld_e);
+  lodepng_scratch_free(frequencies_ll);
+  lodepng_scratch_free(frequencies_d);
+  lodepng_scratch_free(frequencies_cl);
+  lodepng_scratch_free(bitlen_lld);
+  lodepng_scratch_free(bitlen_lld_e);
 
   return error;
 }
@@ -2045,8 +2886,7 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
     if(settings->use_lz77) /*LZ77 encoded*/ {
       uivector lz77_encoded;
       uivector_init(&lz77_encoded);
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings);
       if(!error) writeLZ77data(writer, &lz77_encoded, &tree_ll, &tree_d);
       uivector_cleanup(&lz77_encoded);
     } else /*no LZ77, but still will be Huffman compressed*/ {
@@ -2065,52 +2905,203 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings) {
+/*deflates in[datapos..dataend) as blocks of blocksize bytes, the last one final if final is set*/
+static unsigned deflateBlocks(LodePNGBitWriter* writer, Hash* hash, const unsigned char* in,
+                              size_t datapos, size_t dataend, size_t blocksize,
+                              const LodePNGCompressSettings* settings, unsigned final) {
   unsigned error = 0;
-  size_t i, blocksize, numdeflateblocks;
+  size_t i, numdeflateblocks = 1; /*also for empty input, where blocksize is 0 for the fixed tree*/
+  if(dataend - datapos > blocksize) numdeflateblocks = (dataend - datapos + blocksize - 1) / blocksize;
+
+  for(i = 0; i != numdeflateblocks && !error; ++i) {
+    unsigned blockfinal = final && (i == numdeflateblocks - 1);
+    size_t start = datapos + i * blocksize;
+    size_t end = start + blocksize;
+    if(end > dataend) end = dataend;
+
+    if(settings->btype == 1) error = deflateFixed(writer, hash, in, start, end, settings, blockfinal);
+    else if(settings->btype == 2) error = deflateDynamic(writer, hash, in, start, end, settings, blockfinal);
+  }
+  return error;
+}
+
+/*Adds the windowsize bytes before inpos to the hash, as LZ77 does while encoding them, so that the data from inpos
+on can refer back to them like to a preset dictionary. insize is the end of the data that may be read.*/
+static void hash_preset(Hash* hash, const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize) {
+  size_t pos = inpos > windowsize ? inpos - windowsize : 0;
+  unsigned numzeros = 0;
+  for(; pos < inpos; ++pos) {
+    unsigned hashval = getHash(in, insize, pos);
+    if(hashval == 0) {
+      if(numzeros == 0) numzeros = countZeros(in, insize, pos);
+      else if(pos + numzeros > insize || in[pos + numzeros - 1] != 0) --numzeros;
+    } else {
+      numzeros = 0;
+    }
+    updateHashChain(hash, pos & (windowsize - 1), hashval, (unsigned short)numzeros);
+  }
+}
+
+/*reports these like the LZ77 encoder would, for when the hash is used with them before it*/
+static unsigned checkWindowSize(const LodePNGCompressSettings* settings) {
+  if(settings->use_lz77) {
+    if(settings->windowsize == 0 || settings->windowsize > 32768) return 60;
+    if((settings->windowsize & (settings->windowsize - 1)) != 0) return 90;
+  }
+  return 0;
+}
+
+/*Deflates in[start..end) as a part of a larger deflate stream, starting at a byte boundary, that can refer back
+to the data before start. Unless final, it ends byte aligned. btype must be 1 or 2.*/
+static unsigned deflatePart(ucvector* out, const unsigned char* in, size_t start, size_t end, size_t blocksize,
+                            const LodePNGCompressSettings* settings, unsigned final) {
+  unsigned error;
   Hash hash;
   LodePNGBitWriter writer;
 
   LodePNGBitWriter_init(&writer, out);
 
-  if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
-  else if(settings->btype == 1) blocksize = insize;
-  else /*if(settings->btype == 2)*/ {
-    /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
-    blocksize = insize / 8u + 8;
-    if(blocksize < 65536) blocksize = 65536;
-    if(blocksize > 262144) blocksize = 262144;
+  error = hash_init(&hash, settings->windowsize);
+  if(!error) {
+    if(settings->use_lz77) hash_preset(&hash, in, start, end, settings->windowsize);
+    error = deflateBlocks(&writer, &hash, in, start, end, blocksize, settings, final);
+  }
+  if(!error && !final) {
+    /*sync flush: an empty non-final stored block, whose LEN and NLEN start at a byte boundary, so that
+    the next part can be appended as whole bytes*/
+    writeBits(&writer, 0, 1); /*BFINAL*/
+    writeBits(&writer, 0, 2); /*BTYPE 00*/
+    if(!ucvector_resize(out, out->size + 4)) error = 83; /*alloc fail*/
+    else lodepng_memcpy(out->data + out->size - 4, "\0\0\377\377", 4);
   }
+  hash_cleanup(&hash);
+  return error;
+}
 
-  numdeflateblocks = (insize + blocksize - 1) / blocksize;
-  if(numdeflateblocks == 0) numdeflateblocks = 1;
+/*the parts of a parallel deflate, each deflated by deflateChunk on some thread*/
+typedef struct DeflateChunks {
+  const unsigned char* in;
+  size_t insize;
+  size_t chunksize; /*input bytes per part*/
+  size_t blocksize; /*deflate block size within a part*/
+  const LodePNGCompressSettings* settings;
+  ucvector* outs; /*the deflated parts, each one ends byte aligned*/
+  unsigned* adlers; /*adler32 of the input of each part*/
+  unsigned* errors;
+} DeflateChunks;
+
+static void deflateChunk(void* context, size_t index) {
+  DeflateChunks* chunks = (DeflateChunks*)context;
+  size_t start = index * chunks->chunksize;
+  size_t end = LODEPNG_MIN(start + chunks->chunksize, chunks->insize);
+  unsigned error = deflatePart(&chunks->outs[index], chunks->in, start, end, chunks->blocksize, chunks->settings,
+                               end == chunks->insize);
+
+  chunks->adlers[index] = update_adler32(1u, chunks->in + start, (unsigned)(end - start));
+  chunks->errors[index] = error;
+}
+
+/*deflates the parts of chunksize bytes on num_threads threads, and outputs the adler32 of in if adler isn't 0*/
+static unsigned deflateParallel(ucvector* out, unsigned* adler, const unsigned char* in, size_t insize,
+                                size_t chunksize, size_t blocksize, const LodePNGCompressSettings* settings,
+                                unsigned num_threads) {
+  unsigned error = 0, checksum = 1u;
+  size_t i, numchunks = (insize + chunksize - 1) / chunksize;
+  DeflateChunks chunks;
+
+  error = checkWindowSize(settings);
+  if(error) return error;
 
-  error = hash_init(&hash, settings->windowsize);
+  chunks.in = in;
+  chunks.insize = insize;
+  chunks.chunksize = chunksize;
+  chunks.blocksize = blocksize;
+  chunks.settings = settings;
+  chunks.outs = (ucvector*)lodepng_scratch_malloc(numchunks * sizeof(ucvector));
+  chunks.adlers = (unsigned*)lodepng_scratch_malloc(numchunks * sizeof(unsigned));
+  chunks.errors = (unsigned*)lodepng_scratch_malloc(numchunks * sizeof(unsigned));
+  if(!chunks.outs || !chunks.adlers || !chunks.errors) error = 83; /*alloc fail*/
 
   if(!error) {
-    for(i = 0; i != numdeflateblocks && !error; ++i) {
-      unsigned final = (i == numdeflateblocks - 1);
-      size_t start = i * blocksize;
-      size_t end = start + blocksize;
-      if(end > insize) end = insize;
-
-      if(settings->btype == 1) error = deflateFixed(&writer, &hash, in, start, end, settings, final);
-      else if(settings->btype == 2) error = deflateDynamic(&writer, &hash, in, start, end, settings, final);
+    for(i = 0; i != numchunks; ++i) chunks.outs[i] = ucvector_init(NULL, 0);
+    lodepng_parallel_for(numchunks, num_threads, deflateChunk, &chunks);
+    for(i = 0; i != numchunks; ++i) {
+      if(!error) error = chunks.errors[i];
+      if(!error) {
+        size_t start = out->size;
+        if(!ucvector_resize(out, out->size + chunks.outs[i].size)) error = 83; /*alloc fail*/
+        else lodepng_memcpy(out->data + start, chunks.outs[i].data, chunks.outs[i].size);
+        checksum = i == 0 ? chunks.adlers[0] :
+            adler32_combine(checksum, chunks.adlers[i], LODEPNG_MIN(chunksize, insize - i * chunksize));
+      }
+      lodepng_scratch_free(chunks.outs[i].data);
     }
   }
 
-  hash_cleanup(&hash);
-
+  if(adler) *adler = checksum;
+  lodepng_scratch_free(chunks.outs);
+  lodepng_scratch_free(chunks.adlers);
+  lodepng_scratch_free(chunks.errors);
   return error;
 }
 
-unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
-                         const unsigned char* in, size_t insize,
-                         const LodePNGCompressSettings* settings) {
+/*the size of the deflate blocks when compressing insize bytes with btype 1 or 2*/
+static size_t deflateBlockSize(size_t insize, unsigned btype) {
+  size_t blocksize = insize;
+  if(btype == 2) {
+    /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
+    blocksize = insize / 8u + 8;
+    if(blocksize < 65536) blocksize = 65536;
+    if(blocksize > 262144) blocksize = 262144;
+  }
+  return blocksize;
+}
+
+/*the size of the parts for deflatePart: one dynamic block per part, the other types have no need for blocks
+so they get parts of the largest size*/
+static size_t deflatePartSize(size_t blocksize, unsigned btype) {
+  return btype == 2 ? blocksize : 262144;
+}
+
+/*adler, if not 0, receives the adler32 of in, which the parallel compression computes along the way*/
+static unsigned lodepng_deflatev(ucvector* out, unsigned* adler, const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings) {
+  unsigned error = 0;
+  size_t blocksize;
+  unsigned num_threads = lodepng_thread_count(settings->num_threads);
+  Hash hash;
+  LodePNGBitWriter writer;
+
+  LodePNGBitWriter_init(&writer, out);
+
+  if(settings->btype > 2) return 61;
+  else if(settings->btype == 0) {
+    if(adler) *adler = adler32(in, (unsigned)insize);
+    return deflateNoCompression(out, in, insize, 1);
+  }
+  blocksize = deflateBlockSize(insize, settings->btype);
+
+  if(num_threads > 1) {
+    size_t chunksize = deflatePartSize(blocksize, settings->btype);
+    if(insize > chunksize) {
+      return deflateParallel(out, adler, in, insize, chunksize, LODEPNG_MIN(blocksize, chunksize),
+                             settings, num_threads);
+    }
+  }
+
+  error = hash_init(&hash, settings->windowsize);
+  if(!error) error = deflateBlocks(&writer, &hash, in, 0, insize, blocksize, settings, 1);
+  hash_cleanup(&hash);
+  if(adler) *adler = adler32(in, (unsigned)insize);
+
+  return error;
+}
+
+unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
+                         const unsigned char* in, size_t insize,
+                         const LodePNGCompressSettings* settings) {
   ucvector v = ucvector_init(*out, *outsize);
-  unsigned error = lodepng_deflatev(&v, in, insize, settings);
+  unsigned error = lodepng_deflatev(&v, 0, in, insize, settings);
   *out = v.data;
   *outsize = v.size;
   return error;
@@ -2130,48 +3121,16 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 
 #endif /*LODEPNG_COMPILE_DECODER*/
 
-/* ////////////////////////////////////////////////////////////////////////// */
-/* / Adler32                                                                / */
-/* ////////////////////////////////////////////////////////////////////////// */
-
-static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len) {
-  unsigned s1 = adler & 0xffffu;
-  unsigned s2 = (adler >> 16u) & 0xffffu;
-
-  while(len != 0u) {
-    unsigned i;
-    /*at least 5552 sums can be done before the sums overflow, saving a lot of module divisions*/
-    unsigned amount = len > 5552u ? 5552u : len;
-    len -= amount;
-    for(i = 0; i != amount; ++i) {
-      s1 += (*data++);
-      s2 += s1;
-    }
-    s1 %= 65521u;
-    s2 %= 65521u;
-  }
-
-  return (s2 << 16u) | s1;
-}
-
-/*Return the adler32 of the bytes data[0..len-1]*/
-static unsigned adler32(const unsigned char* data, unsigned len) {
-  return update_adler32(1u, data, len);
-}
-
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Zlib                                                                   / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-static unsigned lodepng_zlib_decompressv(ucvector* out,
-                                         const unsigned char* in, size_t insize,
-                                         const LodePNGDecompressSettings* settings) {
-  unsigned error = 0;
+/*checks the 2 bytes of the zlib header, returns error code*/
+static unsigned checkZlibHeader(const unsigned char* in) {
   unsigned CM, CINFO, FDICT;
 
-  if(insize < 2) return 53; /*error, size of zlib data too small*/
   /*read information from zlib header*/
   if((in[0] * 256 + in[1]) % 31 != 0) {
     /*error: 256 * in[0] + in[1] must be a multiple of 31, the FCHECK value is supposed to be made that way*/
@@ -2194,6 +3153,18 @@ static unsigned lodepng_zlib_decompressv(ucvector* out,
     return 26;
   }
 
+  return 0;
+}
+
+static unsigned lodepng_zlib_decompressv(ucvector* out,
+                                         const unsigned char* in, size_t insize,
+                                         const LodePNGDecompressSettings* settings) {
+  unsigned error = 0;
+
+  if(insize < 2) return 53; /*error, size of zlib data too small*/
+  error = checkZlibHeader(in);
+  if(error) return error;
+
   error = inflatev(out, in + 2, insize - 2, settings);
   if(error) return error;
 
@@ -2220,6 +3191,9 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
 static unsigned zlib_decompress(unsigned char** out, size_t* outsize, size_t expected_size,
                                 const unsigned char* in, size_t insize, const LodePNGDecompressSettings* settings) {
   unsigned error;
+  unsigned custom = settings->custom_zlib || settings->custom_inflate;
+  /*custom functions reallocate the output with their own allocator, so it can't be a block of the arena*/
+  LodePNGArena* arena = custom ? lodepng_arena_set(0) : 0;
   if(settings->custom_zlib) {
     error = settings->custom_zlib(out, outsize, in, insize, settings);
     if(error) {
@@ -2239,9 +3213,220 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, size_t exp
     *out = v.data;
     *outsize = v.size;
   }
+  if(custom) lodepng_arena_set(arena);
+  return error;
+}
+
+#ifdef LODEPNG_COMPILE_STREAMING
+/*the states of a ZlibStream*/
+#define ZLIB_STREAM_HEADER 0 /*before the 2 byte zlib header*/
+#define ZLIB_STREAM_BLOCK 1 /*before the header of a deflate block*/
+#define ZLIB_STREAM_STORED 2 /*inside the data of an uncompressed block*/
+#define ZLIB_STREAM_HUFFMAN 3 /*inside the symbols of a compressed block*/
+#define ZLIB_STREAM_DONE 4 /*after the final block*/
+
+/*a dynamic block header with its trees can't be longer than this many bytes: 17 bits, 19 * 3 bits for the code length
+code and at most 320 code lengths of 7 bits plus 7 extra bits*/
+#define ZLIB_STREAM_HEADER_MAX 600
+
+/*zlib decompression that gets its input in pieces and can stop at any symbol to continue later. The input that is
+not used yet stays in 'in', the output is appended to 'out' which keeps the last 32768 bytes for the backward
+distances, and is otherwise emptied as the caller uses it.*/
+typedef struct ZlibStream {
+  ucvector in; /*input that is not fully used yet*/
+  size_t bp; /*bit position of the next unused bit in 'in'*/
+  ucvector out;
+  size_t taken; /*the bytes of out before this were used by the caller*/
+  size_t total; /*total size of the output so far*/
+  unsigned mode; /*one of the ZLIB_STREAM states*/
+  unsigned BFINAL; /*the current block is the final one*/
+  unsigned stored; /*bytes left in the current uncompressed block*/
+  HuffmanTree tree_ll; /*the trees of the current compressed block*/
+  HuffmanTree tree_d;
+  unsigned adler; /*adler32 of the output so far*/
+  size_t insize; /*total size of the input so far*/
+  unsigned char tail[4]; /*the last 4 bytes of the input: the adler32 checksum, once all input was given*/
+} ZlibStream;
+
+static void ZlibStream_init(ZlibStream* stream) {
+  stream->in = ucvector_init(NULL, 0);
+  stream->out = ucvector_init(NULL, 0);
+  stream->bp = stream->taken = stream->total = stream->insize = 0;
+  stream->mode = ZLIB_STREAM_HEADER;
+  stream->BFINAL = stream->stored = 0;
+  HuffmanTree_init(&stream->tree_ll);
+  HuffmanTree_init(&stream->tree_d);
+  stream->adler = 1u;
+  lodepng_memset(stream->tail, 0, 4);
+}
+
+static void ZlibStream_cleanup(ZlibStream* stream) {
+  lodepng_scratch_free(stream->in.data);
+  lodepng_scratch_free(stream->out.data);
+  HuffmanTree_cleanup(&stream->tree_ll);
+  HuffmanTree_cleanup(&stream->tree_d);
+}
+
+/*appends input, after dropping the bytes that were fully used*/
+static unsigned ZlibStream_push(ZlibStream* stream, const unsigned char* in, size_t insize) {
+  size_t used = stream->bp >> 3u, i;
+  size_t keep = stream->in.size - used;
+  if(used) {
+    lodepng_memmove_down(stream->in.data, stream->in.data + used, keep);
+    stream->in.size = keep;
+    stream->bp &= 7u;
+  }
+  if(!ucvector_resize(&stream->in, keep + insize)) return 83; /*alloc fail*/
+  if(insize) lodepng_memcpy(stream->in.data + keep, in, insize);
+  for(i = insize > 4 ? insize - 4 : 0; i < insize; ++i) {
+    stream->tail[0] = stream->tail[1];
+    stream->tail[1] = stream->tail[2];
+    stream->tail[2] = stream->tail[3];
+    stream->tail[3] = in[i];
+  }
+  stream->insize += insize;
+  return 0;
+}
+
+/*drops the output bytes that the caller used and that are no longer needed as window*/
+static void ZlibStream_compact(ZlibStream* stream) {
+  size_t drop = stream->out.size > 32768u ? stream->out.size - 32768u : 0;
+  if(drop > stream->taken) drop = stream->taken;
+  /*only when enough can be dropped, to not move the window for every few bytes*/
+  if(drop >= 32768u) {
+    lodepng_memmove_down(stream->out.data, stream->out.data + drop, stream->out.size - drop);
+    stream->out.size -= drop;
+    stream->taken -= drop;
+  }
+}
+
+/*Decodes as much of the input as possible, until it needs more input or the output reached stop_size. With partial
+set, more input can still come, so running out of input is not an error, and it stops before the last few bytes so
+that a symbol is never read from incomplete input.*/
+static unsigned ZlibStream_run(ZlibStream* stream, const LodePNGDecompressSettings* settings,
+                               unsigned partial, size_t stop_size) {
+  unsigned error = 0;
+  size_t start = stream->out.size;
+  LodePNGBitReader reader;
+
+  error = LodePNGBitReader_init(&reader, stream->in.data, stream->in.size);
+  if(error) return error;
+  reader.bp = stream->bp;
+
+  while(!error && stream->out.size < stop_size) {
+    if(stream->mode == ZLIB_STREAM_HEADER) {
+      if(stream->in.size < 2) {
+        if(!partial) error = 53; /*error, size of zlib data too small*/
+        break;
+      }
+      error = checkZlibHeader(stream->in.data);
+      reader.bp = 16;
+      stream->mode = ZLIB_STREAM_BLOCK;
+    } else if(stream->mode == ZLIB_STREAM_BLOCK) {
+      size_t blockstart = reader.bp;
+      unsigned BFINAL, BTYPE;
+      if(stream->BFINAL) {
+        stream->mode = ZLIB_STREAM_DONE;
+        break;
+      }
+      if(reader.bitsize - reader.bp < 3) {
+        if(!partial) error = 52; /*error, bit pointer will jump past memory*/
+        break;
+      }
+      ensureBits9(&reader, 3);
+      BFINAL = readBits(&reader, 1);
+      BTYPE = readBits(&reader, 2);
+
+      if(BTYPE == 3) {
+        error = 20; /*error: invalid BTYPE*/
+      } else if(BTYPE == 0) {
+        unsigned LEN, NLEN;
+        size_t bytepos = (reader.bp + 7u) >> 3u; /*go to first boundary of byte*/
+        const unsigned char* in = stream->in.data;
+        if(bytepos + 4 >= stream->in.size) {
+          if(!partial) error = 52; /*error, bit pointer will jump past memory*/
+          reader.bp = blockstart;
+          break;
+        }
+        LEN = (unsigned)in[bytepos] + ((unsigned)in[bytepos + 1] << 8u);
+        NLEN = (unsigned)in[bytepos + 2] + ((unsigned)in[bytepos + 3] << 8u);
+        /*check if 16-bit NLEN is really the one's complement of LEN*/
+        if(!settings->ignore_nlen && LEN + NLEN != 65535) {
+          error = 21; /*error: NLEN is not one's complement of LEN*/
+        } else {
+          reader.bp = (bytepos + 4) << 3u;
+          stream->stored = LEN;
+          stream->BFINAL = BFINAL;
+          stream->mode = ZLIB_STREAM_STORED;
+        }
+      } else {
+        HuffmanTree_cleanup(&stream->tree_ll);
+        HuffmanTree_cleanup(&stream->tree_d);
+        HuffmanTree_init(&stream->tree_ll);
+        HuffmanTree_init(&stream->tree_d);
+        if(BTYPE == 1) error = getTreeInflateFixed(&stream->tree_ll, &stream->tree_d);
+        else error = getTreeInflateDynamic(&stream->tree_ll, &stream->tree_d, &reader);
+        /*the header may be cut off by the end of the input so far, then read it again when there's more*/
+        if((error || reader.bp > reader.bitsize) && partial
+           && reader.bitsize - blockstart < ZLIB_STREAM_HEADER_MAX * 8u) {
+          error = 0;
+          reader.bp = blockstart;
+          break;
+        }
+        stream->BFINAL = BFINAL;
+        stream->mode = ZLIB_STREAM_HUFFMAN;
+      }
+    } else if(stream->mode == ZLIB_STREAM_STORED) {
+      size_t bytepos = reader.bp >> 3u;
+      size_t amount = stream->stored;
+      if(amount > stream->in.size - bytepos) amount = stream->in.size - bytepos;
+      if(amount > stop_size - stream->out.size) amount = stop_size - stream->out.size;
+      if(!ucvector_reserve(&stream->out, stream->out.size + amount)) ERROR_BREAK(83); /*alloc fail*/
+      /*out.data can be NULL when amount is zero, and arithmetics on NULL ptr is undefined*/
+      if(amount) lodepng_memcpy(stream->out.data + stream->out.size, stream->in.data + bytepos, amount);
+      stream->out.size += amount;
+      reader.bp += amount << 3u;
+      stream->stored -= (unsigned)amount;
+      if(stream->stored == 0) {
+        stream->mode = ZLIB_STREAM_BLOCK;
+      } else if(bytepos + amount == stream->in.size) {
+        if(!partial) error = 23; /*error: reading outside of in buffer*/
+        break;
+      }
+    } else if(stream->mode == ZLIB_STREAM_HUFFMAN) {
+      int done = 0;
+      error = inflateHuffmanSymbols(&stream->out, &reader, &stream->tree_ll, &stream->tree_d,
+                                    0, partial, stop_size, &done);
+      if(error) break;
+      if(done) stream->mode = ZLIB_STREAM_BLOCK;
+      else if(stream->out.size < stop_size) break; /*stopped for more input*/
+    } else /*if(stream->mode == ZLIB_STREAM_DONE)*/ {
+      break;
+    }
+  }
+
+  stream->bp = reader.bp;
+  if(!settings->ignore_adler32 && stream->out.size > start) {
+    stream->adler = update_adler32(stream->adler, stream->out.data + start, (unsigned)(stream->out.size - start));
+  }
+  stream->total += stream->out.size - start;
+  if(!error && settings->max_output_size && stream->total > settings->max_output_size) {
+    error = 109; /*error, larger than max size*/
+  }
   return error;
 }
 
+/*Checks the end of the zlib data, after ZlibStream_run without partial decoded all of it*/
+static unsigned ZlibStream_finish(const ZlibStream* stream, const LodePNGDecompressSettings* settings) {
+  if(stream->mode != ZLIB_STREAM_DONE && stream->mode != ZLIB_STREAM_BLOCK) return 52;
+  if(!settings->ignore_adler32) {
+    unsigned ADLER32 = lodepng_read32bitInt(stream->tail);
+    if(stream->adler != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
+  }
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_STREAMING*/
+
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -2252,19 +3437,28 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   unsigned error;
   unsigned char* deflatedata = 0;
   size_t deflatesize = 0;
+  unsigned ADLER32 = 0;
 
-  error = deflate(&deflatedata, &deflatesize, in, insize, settings);
+  if(settings->custom_deflate) {
+    error = deflate(&deflatedata, &deflatesize, in, insize, settings);
+    ADLER32 = adler32(in, (unsigned)insize);
+  } else {
+    /*the built in deflate computes the checksum too, in parallel when it compresses in parallel*/
+    ucvector v = ucvector_init(NULL, 0);
+    error = lodepng_deflatev(&v, &ADLER32, in, insize, settings);
+    deflatedata = v.data;
+    deflatesize = v.size;
+  }
 
   *out = NULL;
   *outsize = 0;
   if(!error) {
     *outsize = deflatesize + 6;
-    *out = (unsigned char*)lodepng_malloc(*outsize);
+    *out = (unsigned char*)lodepng_scratch_malloc(*outsize);
     if(!*out) error = 83; /*alloc fail*/
   }
 
   if(!error) {
-    unsigned ADLER32 = adler32(in, (unsigned)insize);
     /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
     unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
     unsigned FLEVEL = 0;
@@ -2279,20 +3473,26 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
     lodepng_set32bitInt(&(*out)[*outsize - 4], ADLER32);
   }
 
-  lodepng_free(deflatedata);
+  lodepng_scratch_free(deflatedata);
   return error;
 }
 
 /* compress using the default or custom zlib function */
 static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
                               size_t insize, const LodePNGCompressSettings* settings) {
+  unsigned error;
+  unsigned custom = settings->custom_zlib || settings->custom_deflate;
+  /*custom functions allocate their output with their own allocator, and may free it with it on error*/
+  LodePNGArena* arena = custom ? lodepng_arena_set(0) : 0;
   if(settings->custom_zlib) {
-    unsigned error = settings->custom_zlib(out, outsize, in, insize, settings);
+    error = settings->custom_zlib(out, outsize, in, insize, settings);
     /*the custom zlib is allowed to have its own error codes, however, we translate it to code 111*/
-    return error ? 111 : 0;
+    if(error) error = 111;
   } else {
-    return lodepng_zlib_compress(out, outsize, in, insize, settings);
+    error = lodepng_zlib_compress(out, outsize, in, insize, settings);
   }
+  if(custom) lodepng_arena_set(arena);
+  return error;
 }
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2302,16 +3502,26 @@ static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsign
 #ifdef LODEPNG_COMPILE_DECODER
 static unsigned zlib_decompress(unsigned char** out, size_t* outsize, size_t expected_size,
                                 const unsigned char* in, size_t insize, const LodePNGDecompressSettings* settings) {
+  unsigned error;
+  LodePNGArena* arena;
   if(!settings->custom_zlib) return 87; /*no custom zlib function provided */
   (void)expected_size;
-  return settings->custom_zlib(out, outsize, in, insize, settings);
+  arena = lodepng_arena_set(0); /*the custom function allocates the output with its own allocator*/
+  error = settings->custom_zlib(out, outsize, in, insize, settings);
+  lodepng_arena_set(arena);
+  return error;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
 #ifdef LODEPNG_COMPILE_ENCODER
 static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
                               size_t insize, const LodePNGCompressSettings* settings) {
+  unsigned error;
+  LodePNGArena* arena;
   if(!settings->custom_zlib) return 87; /*no custom zlib function provided */
-  return settings->custom_zlib(out, outsize, in, insize, settings);
+  arena = lodepng_arena_set(0); /*the custom function allocates the output with its own allocator*/
+  error = settings->custom_zlib(out, outsize, in, insize, settings);
+  lodepng_arena_set(arena);
+  return error;
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
@@ -2332,13 +3542,31 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings) {
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->maxchain = 0;
+  settings->num_threads = 1;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 1, 0, 0, 0};
+
+void lodepng_compress_settings_effort(LodePNGCompressSettings* settings, unsigned effort) {
+  /*hash chain positions tried per byte, the length that ends the search, and lazy matching, per level*/
+  static const unsigned short maxchain[9] = {1, 2, 4, 8, 16, 64, 256, 1024, 32768};
+  static const unsigned short nicematch[9] = {16, 32, 64, 32, 64, 128, 258, 258, 258};
+  static const unsigned char lazymatching[9] = {0, 0, 0, 1, 1, 1, 1, 1, 1};
+  if(effort < 1) effort = 1;
+  if(effort > 9) effort = 9;
+  settings->btype = 2;
+  settings->use_lz77 = 1;
+  settings->windowsize = 32768;
+  settings->minmatch = 3;
+  settings->maxchain = maxchain[effort - 1];
+  settings->nicematch = nicematch[effort - 1];
+  settings->lazymatching = lazymatching[effort - 1];
+}
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2654,10 +3882,94 @@ static const unsigned lodepng_crc32_table7[256] = {
   0x2c8e0fffu, 0xe0240f61u, 0x6eab0882u, 0xa201081cu, 0xa8c40105u, 0x646e019bu, 0xeae10678u, 0x264b06e6u
 };
 
-/* Computes the cyclic redundancy check as used by PNG chunks*/
-unsigned lodepng_crc32(const unsigned char* data, size_t length) {
+#ifdef LODEPNG_SIMD_X86
+/*
+CRC of length bytes (a multiple of 16, at least 64) by folding with carry-less multiplication, from "Fast CRC
+Computation for Generic Polynomials Using PCLMULQDQ Instruction" (Gopal et al., Intel), as in zlib's Chromium port.
+r is the CRC register, before the final inversion. Four 128-bit lanes are folded 64 bytes ahead, then into one lane,
+then one lane 16 bytes ahead, and the last 128 bits are Barrett reduced to 32.
+*/
+LODEPNG_TARGET("pclmul")
+static unsigned lodepng_crc32_pclmul(unsigned r, const unsigned char* data, size_t length) {
+  /*the 64-bit folding constants and polynomials of the paper, as pairs of 32-bit halves*/
+  const __m128i k1k2 = _mm_set_epi32(1, (int)0xc6e41596u, 1, 0x54442bd4);
+  const __m128i k3k4 = _mm_set_epi32(0, (int)0xccaa009eu, 1, 0x751997d0);
+  const __m128i k5k0 = _mm_set_epi32(0, 0, 1, 0x63cd6124);
+  const __m128i poly = _mm_set_epi32(1, (int)0xf7011641u, 1, (int)0xdb710641u);
+  const __m128i mask32 = _mm_setr_epi32(-1, 0, -1, 0);
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)data), _mm_cvtsi32_si128((int)r));
+  x2 = _mm_loadu_si128((const __m128i*)(data + 16));
+  x3 = _mm_loadu_si128((const __m128i*)(data + 32));
+  x4 = _mm_loadu_si128((const __m128i*)(data + 48));
+  data += 64;
+  length -= 64;
+
+  x0 = k1k2;
+  while(length >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)data));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 16)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 32)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 48)));
+    data += 64;
+    length -= 64;
+  }
+
+  x0 = k3k4;
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  while(length >= 16) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data)), x5);
+    data += 16;
+    length -= 16;
+  }
+
+  /*128 to 64 bits*/
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  /*Barrett reduction to 32 bits*/
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+/*Continues the CRC crc of earlier bytes with the given ones, for data that arrives in pieces. crc is 0 at the start.*/
+static unsigned lodepng_crc32_update(unsigned crc, const unsigned char* data, size_t length) {
+  unsigned r = crc ^ 0xffffffffu;
+#ifdef LODEPNG_SIMD_X86
+  if(length >= 64 && (lodepng_cpu_features() & LODEPNG_CPU_PCLMUL)) {
+    size_t simdlength = length & ~(size_t)15;
+    r = lodepng_crc32_pclmul(r, data, simdlength);
+    data += simdlength;
+    length -= simdlength;
+  }
+#endif /*LODEPNG_SIMD_X86*/
   /*Using the Slicing by Eight algorithm*/
-  unsigned r = 0xffffffffu;
   while(length >= 8) {
     r = lodepng_crc32_table7[(data[0] ^ (r & 0xffu))] ^
         lodepng_crc32_table6[(data[1] ^ ((r >> 8) & 0xffu))] ^
@@ -2675,6 +3987,11 @@ unsigned lodepng_crc32(const unsigned char* data, size_t length) {
   }
   return r ^ 0xffffffffu;
 }
+
+/* Computes the cyclic redundancy check as used by PNG chunks*/
+unsigned lodepng_crc32(const unsigned char* data, size_t length) {
+  return lodepng_crc32_update(0, data, length);
+}
 #else /* LODEPNG_COMPILE_CRC */
 /*in this case, the function is only declared here, and must be defined externally
 so that it will be linked in.
@@ -3000,7 +4317,7 @@ static int lodepng_color_mode_equal(const LodePNGColorMode* a, const LodePNGColo
 }
 
 void lodepng_palette_clear(LodePNGColorMode* info) {
-  if(info->palette) lodepng_free(info->palette);
+  if(info->palette) lodepng_scratch_free(info->palette);
   info->palette = 0;
   info->palettesize = 0;
 }
@@ -3120,7 +4437,7 @@ static void LodePNGUnknownChunks_init(LodePNGInfo* info) {
 
 static void LodePNGUnknownChunks_cleanup(LodePNGInfo* info) {
   unsigned i;
-  for(i = 0; i != 3; ++i) lodepng_free(info->unknown_chunks_data[i]);
+  for(i = 0; i != 3; ++i) lodepng_scratch_free(info->unknown_chunks_data[i]);
 }
 
 static unsigned LodePNGUnknownChunks_copy(LodePNGInfo* dest, const LodePNGInfo* src) {
@@ -3131,7 +4448,9 @@ static unsigned LodePNGUnknownChunks_copy(LodePNGInfo* dest, const LodePNGInfo*
   for(i = 0; i != 3; ++i) {
     size_t j;
     dest->unknown_chunks_size[i] = src->unknown_chunks_size[i];
-    dest->unknown_chunks_data[i] = (unsigned char*)lodepng_malloc(src->unknown_chunks_size[i]);
+    /*no allocation for the usual empty ones, an encode copies the info every time*/
+    dest->unknown_chunks_data[i] = src->unknown_chunks_size[i] ?
+        (unsigned char*)lodepng_malloc(src->unknown_chunks_size[i]) : 0;
     if(!dest->unknown_chunks_data[i] && dest->unknown_chunks_size[i]) return 83; /*alloc fail*/
     for(j = 0; j < src->unknown_chunks_size[i]; ++j) {
       dest->unknown_chunks_data[i][j] = src->unknown_chunks_data[i][j];
@@ -3155,8 +4474,8 @@ static void LodePNGText_cleanup(LodePNGInfo* info) {
     string_cleanup(&info->text_keys[i]);
     string_cleanup(&info->text_strings[i]);
   }
-  lodepng_free(info->text_keys);
-  lodepng_free(info->text_strings);
+  lodepng_scratch_free(info->text_keys);
+  lodepng_scratch_free(info->text_strings);
 }
 
 static unsigned LodePNGText_copy(LodePNGInfo* dest, const LodePNGInfo* source) {
@@ -3213,10 +4532,10 @@ static void LodePNGIText_cleanup(LodePNGInfo* info) {
     string_cleanup(&info->itext_transkeys[i]);
     string_cleanup(&info->itext_strings[i]);
   }
-  lodepng_free(info->itext_keys);
-  lodepng_free(info->itext_langtags);
-  lodepng_free(info->itext_transkeys);
-  lodepng_free(info->itext_strings);
+  lodepng_scratch_free(info->itext_keys);
+  lodepng_scratch_free(info->itext_langtags);
+  lodepng_scratch_free(info->itext_transkeys);
+  lodepng_scratch_free(info->itext_strings);
 }
 
 static unsigned LodePNGIText_copy(LodePNGInfo* dest, const LodePNGInfo* source) {
@@ -3290,7 +4609,7 @@ unsigned lodepng_set_icc(LodePNGInfo* info, const char* name, const unsigned cha
 
 void lodepng_clear_icc(LodePNGInfo* info) {
   string_cleanup(&info->iccp_name);
-  lodepng_free(info->iccp_profile);
+  lodepng_scratch_free(info->iccp_profile);
   info->iccp_profile = NULL;
   info->iccp_profile_size = 0;
   info->iccp_defined = 0;
@@ -3377,25 +4696,29 @@ One node of a color tree
 This is the data structure used to count the number of unique colors and to get a palette
 index for a color. It's like an octree, but because the alpha channel is used too, each
 node has 16 instead of 8 children.
+The nodes below the root come from one block, allocated with the first color, that is large enough for the
+most colors a tree gets (a palette, or the 257 that lodepng_compute_color_stats counts up to): one allocation
+per tree instead of one per node, and the same one whatever the colors are.
 */
+#define COLOR_TREE_MAX_NODES (257u * 8u)
+
 struct ColorTree {
   ColorTree* children[16]; /*up to 16 pointers to ColorTree of next level*/
   int index; /*the payload. Only has a meaningful value if this is in the last level*/
+  ColorTree* nodes; /*root only: the block of the nodes, and how many of them are used*/
+  unsigned numnodes;
 };
 
 static void color_tree_init(ColorTree* tree) {
   lodepng_memset(tree->children, 0, 16 * sizeof(*tree->children));
   tree->index = -1;
+  tree->nodes = 0;
+  tree->numnodes = 0;
 }
 
 static void color_tree_cleanup(ColorTree* tree) {
-  int i;
-  for(i = 0; i != 16; ++i) {
-    if(tree->children[i]) {
-      color_tree_cleanup(tree->children[i]);
-      lodepng_free(tree->children[i]);
-    }
-  }
+  lodepng_scratch_free(tree->nodes);
+  color_tree_init(tree);
 }
 
 /*returns -1 if color not present, its index otherwise*/
@@ -3421,11 +4744,16 @@ Returns error code, or 0 if ok*/
 static unsigned color_tree_add(ColorTree* tree,
                                unsigned char r, unsigned char g, unsigned char b, unsigned char a, unsigned index) {
   int bit;
+  ColorTree* root = tree;
+  if(!root->nodes) {
+    root->nodes = (ColorTree*)lodepng_scratch_malloc(COLOR_TREE_MAX_NODES * sizeof(ColorTree));
+    if(!root->nodes) return 83; /*alloc fail*/
+  }
   for(bit = 0; bit < 8; ++bit) {
     int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
     if(!tree->children[i]) {
-      tree->children[i] = (ColorTree*)lodepng_malloc(sizeof(ColorTree));
-      if(!tree->children[i]) return 83; /*alloc fail*/
+      if(root->numnodes == COLOR_TREE_MAX_NODES) return 83; /*more colors than any caller adds*/
+      tree->children[i] = &root->nodes[root->numnodes++];
       color_tree_init(tree->children[i]);
     }
     tree = tree->children[i];
@@ -4377,6 +5705,239 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
+#ifdef LODEPNG_SIMD_X86
+/*
+SIMD versions of unfilterScanline for the common 8-bit RGB and RGBA cases. Sub, Average and Paeth depend
+on the previous pixel, so they go pixel by pixel with all channels of a pixel in one register. Up has no
+such dependency and is done 16 (SSE2) or 32 (AVX2) bytes at a time. Every pixel is loaded before its
+recon bytes are stored, so recon and scanline may still be the same memory.
+*/
+/*bytewidth is 3 or 4, the branch is the same for the whole line*/
+static __m128i lodepng_load_pixel(const unsigned char* p, size_t bytewidth) {
+  unsigned v = p[0] | ((unsigned)p[1] << 8u) | ((unsigned)p[2] << 16u);
+  if(bytewidth == 4) v |= (unsigned)p[3] << 24u;
+  return _mm_cvtsi32_si128((int)v);
+}
+
+static void lodepng_store_pixel(unsigned char* p, __m128i v, size_t bytewidth) {
+  unsigned u = (unsigned)_mm_cvtsi128_si32(v);
+  p[0] = (unsigned char)u;
+  p[1] = (unsigned char)(u >> 8u);
+  p[2] = (unsigned char)(u >> 16u);
+  if(bytewidth == 4) p[3] = (unsigned char)(u >> 24u);
+}
+
+/*per lane: mask ? x : y*/
+static __m128i lodepng_select(__m128i mask, __m128i x, __m128i y) {
+  return _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, y));
+}
+
+static void unfilterSub_sse2(unsigned char* recon, const unsigned char* scanline, size_t bytewidth, size_t length) {
+  size_t i;
+  __m128i a = _mm_setzero_si128();
+  for(i = 0; i != length; i += bytewidth) {
+    a = _mm_add_epi8(a, lodepng_load_pixel(&scanline[i], bytewidth));
+    lodepng_store_pixel(&recon[i], a, bytewidth);
+  }
+}
+
+static void unfilterUp_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                            size_t length) {
+  size_t i = 0;
+  for(; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+    __m128i b = _mm_loadu_si128((const __m128i*)&precon[i]);
+    _mm_storeu_si128((__m128i*)&recon[i], _mm_add_epi8(x, b));
+  }
+  for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+}
+
+LODEPNG_TARGET("avx2")
+static void unfilterUp_avx2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                            size_t length) {
+  size_t i = 0;
+  for(; i + 32 <= length; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)&scanline[i]);
+    __m256i b = _mm256_loadu_si256((const __m256i*)&precon[i]);
+    _mm256_storeu_si256((__m256i*)&recon[i], _mm256_add_epi8(x, b));
+  }
+  for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+}
+
+static void unfilterAverage_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t bytewidth, size_t length) {
+  size_t i;
+  __m128i a = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+  for(i = 0; i != length; i += bytewidth) {
+    __m128i b = lodepng_load_pixel(&precon[i], bytewidth);
+    /*_mm_avg_epu8 rounds up, PNG rounds down: subtract the lost low bit where a + b is odd*/
+    __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    a = _mm_add_epi8(avg, lodepng_load_pixel(&scanline[i], bytewidth));
+    lodepng_store_pixel(&recon[i], a, bytewidth);
+  }
+}
+
+/*the Paeth predictor of paethPredictor, for the 16-bit lanes of a, b and c. pa = |b - c|, pb = |a - c| and
+pc = |a + b - 2c| = |(b - c) + (a - c)|; ties favor a, then b, as in the scalar version*/
+static __m128i paeth_sse2(__m128i a, __m128i b, __m128i c) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sa = _mm_sub_epi16(b, c), sb = _mm_sub_epi16(a, c);
+  __m128i sc = _mm_add_epi16(sa, sb);
+  __m128i pa = _mm_max_epi16(sa, _mm_sub_epi16(zero, sa));
+  __m128i pb = _mm_max_epi16(sb, _mm_sub_epi16(zero, sb));
+  __m128i pc = _mm_max_epi16(sc, _mm_sub_epi16(zero, sc));
+  __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+  __m128i nearest = lodepng_select(_mm_cmpeq_epi16(smallest, pb), b, c);
+  return lodepng_select(_mm_cmpeq_epi16(smallest, pa), a, nearest);
+}
+
+static void unfilterPaeth_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                               size_t bytewidth, size_t length) {
+  size_t i;
+  const __m128i zero = _mm_setzero_si128(), low = _mm_set1_epi16(255);
+  __m128i a = zero, c = zero; /*16-bit lanes, the left pixel is 0 at the start of the line*/
+  for(i = 0; i != length; i += bytewidth) {
+    /*only a depends on the previous pixel, it stays in 16-bit lanes so the chain has no pack and unpack*/
+    __m128i b = _mm_unpacklo_epi8(lodepng_load_pixel(&precon[i], bytewidth), zero);
+    __m128i x = _mm_unpacklo_epi8(lodepng_load_pixel(&scanline[i], bytewidth), zero);
+    a = _mm_and_si128(_mm_add_epi16(paeth_sse2(a, b, c), x), low);
+    lodepng_store_pixel(&recon[i], _mm_packus_epi16(a, zero), bytewidth);
+    c = b;
+  }
+}
+
+/*same with the SSSE3 absolute value, one instruction instead of two per distance*/
+LODEPNG_TARGET("ssse3")
+static void unfilterPaeth_ssse3(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                size_t bytewidth, size_t length) {
+  size_t i;
+  const __m128i zero = _mm_setzero_si128(), low = _mm_set1_epi16(255);
+  __m128i a = zero, c = zero;
+  for(i = 0; i != length; i += bytewidth) {
+    __m128i b = _mm_unpacklo_epi8(lodepng_load_pixel(&precon[i], bytewidth), zero);
+    __m128i x = _mm_unpacklo_epi8(lodepng_load_pixel(&scanline[i], bytewidth), zero);
+    __m128i sa = _mm_sub_epi16(b, c), sb = _mm_sub_epi16(a, c);
+    __m128i pa = _mm_abs_epi16(sa), pb = _mm_abs_epi16(sb), pc = _mm_abs_epi16(_mm_add_epi16(sa, sb));
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i nearest = lodepng_select(_mm_cmpeq_epi16(smallest, pa), a, lodepng_select(_mm_cmpeq_epi16(smallest, pb), b, c));
+    a = _mm_and_si128(_mm_add_epi16(nearest, x), low);
+    lodepng_store_pixel(&recon[i], _mm_packus_epi16(a, zero), bytewidth);
+    c = b;
+  }
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+/*NEON versions of the kernels above, see there*/
+static uint8x8_t lodepng_load_pixel(const unsigned char* p, size_t bytewidth) {
+  unsigned v = p[0] | ((unsigned)p[1] << 8u) | ((unsigned)p[2] << 16u);
+  if(bytewidth == 4) v |= (unsigned)p[3] << 24u;
+  return vreinterpret_u8_u32(vdup_n_u32(v));
+}
+
+static void lodepng_store_pixel(unsigned char* p, uint8x8_t v, size_t bytewidth) {
+  unsigned u = vget_lane_u32(vreinterpret_u32_u8(v), 0);
+  p[0] = (unsigned char)u;
+  p[1] = (unsigned char)(u >> 8u);
+  p[2] = (unsigned char)(u >> 16u);
+  if(bytewidth == 4) p[3] = (unsigned char)(u >> 24u);
+}
+
+static void unfilterSub_neon(unsigned char* recon, const unsigned char* scanline, size_t bytewidth, size_t length) {
+  size_t i;
+  uint8x8_t a = vdup_n_u8(0);
+  for(i = 0; i != length; i += bytewidth) {
+    a = vadd_u8(a, lodepng_load_pixel(&scanline[i], bytewidth));
+    lodepng_store_pixel(&recon[i], a, bytewidth);
+  }
+}
+
+static void unfilterUp_neon(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                            size_t length) {
+  size_t i = 0;
+  for(; i + 16 <= length; i += 16) vst1q_u8(&recon[i], vaddq_u8(vld1q_u8(&scanline[i]), vld1q_u8(&precon[i])));
+  for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+}
+
+static void unfilterAverage_neon(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t bytewidth, size_t length) {
+  size_t i;
+  uint8x8_t a = vdup_n_u8(0);
+  for(i = 0; i != length; i += bytewidth) {
+    /*vhadd rounds down, as PNG does*/
+    a = vadd_u8(vhadd_u8(a, lodepng_load_pixel(&precon[i], bytewidth)), lodepng_load_pixel(&scanline[i], bytewidth));
+    lodepng_store_pixel(&recon[i], a, bytewidth);
+  }
+}
+
+static void unfilterPaeth_neon(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                               size_t bytewidth, size_t length) {
+  size_t i;
+  uint8x8_t a = vdup_n_u8(0), c = vdup_n_u8(0);
+  for(i = 0; i != length; i += bytewidth) {
+    uint8x8_t b = lodepng_load_pixel(&precon[i], bytewidth);
+    uint16x8_t pa = vabdl_u8(b, c), pb = vabdl_u8(a, c);
+    uint16x8_t pc = vabdq_u16(vaddl_u8(a, b), vaddl_u8(c, c));
+    uint8x8_t usea = vmovn_u16(vandq_u16(vcleq_u16(pa, pb), vcleq_u16(pa, pc)));
+    uint8x8_t useb = vmovn_u16(vcleq_u16(pb, pc));
+    uint8x8_t nearest = vbsl_u8(usea, a, vbsl_u8(useb, b, c));
+    a = vadd_u8(nearest, lodepng_load_pixel(&scanline[i], bytewidth));
+    lodepng_store_pixel(&recon[i], a, bytewidth);
+    c = b;
+  }
+}
+#endif /*LODEPNG_SIMD_NEON*/
+
+#ifdef LODEPNG_SIMD
+/*Unfilters the line with a SIMD kernel if there is one for this case: Up for any pixel size,
+the others for 3 and 4 byte pixels. Returns 0 if the scalar code has to do it.*/
+static int unfilterScanlineSIMD(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                size_t bytewidth, unsigned char filterType, size_t length) {
+#ifdef LODEPNG_SIMD_X86
+  unsigned features = lodepng_cpu_features();
+#endif
+  if(filterType == 2) {
+    if(!precon) return 0;
+#ifdef LODEPNG_SIMD_X86
+    if(features & LODEPNG_CPU_AVX2) unfilterUp_avx2(recon, scanline, precon, length);
+    else unfilterUp_sse2(recon, scanline, precon, length);
+#else
+    unfilterUp_neon(recon, scanline, precon, length);
+#endif
+    return 1;
+  }
+  if(bytewidth != 3 && bytewidth != 4) return 0;
+  if(filterType == 1) {
+#ifdef LODEPNG_SIMD_X86
+    unfilterSub_sse2(recon, scanline, bytewidth, length);
+#else
+    unfilterSub_neon(recon, scanline, bytewidth, length);
+#endif
+    return 1;
+  }
+  if(!precon) return 0;
+  if(filterType == 3) {
+#ifdef LODEPNG_SIMD_X86
+    unfilterAverage_sse2(recon, scanline, precon, bytewidth, length);
+#else
+    unfilterAverage_neon(recon, scanline, precon, bytewidth, length);
+#endif
+    return 1;
+  }
+  if(filterType == 4) {
+#ifdef LODEPNG_SIMD_X86
+    if(features & LODEPNG_CPU_SSSE3) unfilterPaeth_ssse3(recon, scanline, precon, bytewidth, length);
+    else unfilterPaeth_sse2(recon, scanline, precon, bytewidth, length);
+#else
+    unfilterPaeth_neon(recon, scanline, precon, bytewidth, length);
+#endif
+    return 1;
+  }
+  return 0;
+}
+#endif /*LODEPNG_SIMD*/
+
 static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
                                  size_t bytewidth, unsigned char filterType, size_t length) {
   /*
@@ -4389,6 +5950,9 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   */
 
   size_t i;
+#ifdef LODEPNG_SIMD
+  if(unfilterScanlineSIMD(recon, scanline, precon, bytewidth, filterType, length)) return 0;
+#endif /*LODEPNG_SIMD*/
   switch(filterType) {
     case 0:
       for(i = 0; i != length; ++i) recon[i] = scanline[i];
@@ -4814,7 +6378,7 @@ static unsigned readChunk_tEXt(LodePNGInfo* info, const unsigned char* data, siz
     there's no null termination char, if the text is empty*/
     if(length < 1 || length > 79) CERROR_BREAK(error, 89); /*keyword too short or long*/
 
-    key = (char*)lodepng_malloc(length + 1);
+    key = (char*)lodepng_scratch_malloc(length + 1);
     if(!key) CERROR_BREAK(error, 83); /*alloc fail*/
 
     lodepng_memcpy(key, data, length);
@@ -4823,7 +6387,7 @@ static unsigned readChunk_tEXt(LodePNGInfo* info, const unsigned char* data, siz
     string2_begin = length + 1; /*skip keyword null terminator*/
 
     length = (unsigned)(chunkLength < string2_begin ? 0 : chunkLength - string2_begin);
-    str = (char*)lodepng_malloc(length + 1);
+    str = (char*)lodepng_scratch_malloc(length + 1);
     if(!str) CERROR_BREAK(error, 83); /*alloc fail*/
 
     lodepng_memcpy(str, data + string2_begin, length);
@@ -4834,8 +6398,8 @@ static unsigned readChunk_tEXt(LodePNGInfo* info, const unsigned char* data, siz
     break;
   }
 
-  lodepng_free(key);
-  lodepng_free(str);
+  lodepng_scratch_free(key);
+  lodepng_scratch_free(str);
 
   return error;
 }
@@ -4858,7 +6422,7 @@ static unsigned readChunk_zTXt(LodePNGInfo* info, const LodePNGDecoderSettings*
     if(length + 2 >= chunkLength) CERROR_BREAK(error, 75); /*no null termination, corrupt?*/
     if(length < 1 || length > 79) CERROR_BREAK(error, 89); /*keyword too short or long*/
 
-    key = (char*)lodepng_malloc(length + 1);
+    key = (char*)lodepng_scratch_malloc(length + 1);
     if(!key) CERROR_BREAK(error, 83); /*alloc fail*/
 
     lodepng_memcpy(key, data, length);
@@ -4881,8 +6445,8 @@ static unsigned readChunk_zTXt(LodePNGInfo* info, const LodePNGDecoderSettings*
     break;
   }
 
-  lodepng_free(key);
-  lodepng_free(str);
+  lodepng_scratch_free(key);
+  lodepng_scratch_free(str);
 
   return error;
 }
@@ -4909,7 +6473,7 @@ static unsigned readChunk_iTXt(LodePNGInfo* info, const LodePNGDecoderSettings*
     if(length + 3 >= chunkLength) CERROR_BREAK(error, 75); /*no null termination char, corrupt?*/
     if(length < 1 || length > 79) CERROR_BREAK(error, 89); /*keyword too short or long*/
 
-    key = (char*)lodepng_malloc(length + 1);
+    key = (char*)lodepng_scratch_malloc(length + 1);
     if(!key) CERROR_BREAK(error, 83); /*alloc fail*/
 
     lodepng_memcpy(key, data, length);
@@ -4927,7 +6491,7 @@ static unsigned readChunk_iTXt(LodePNGInfo* info, const LodePNGDecoderSettings*
     length = 0;
     for(i = begin; i < chunkLength && data[i] != 0; ++i) ++length;
 
-    langtag = (char*)lodepng_malloc(length + 1);
+    langtag = (char*)lodepng_scratch_malloc(length + 1);
     if(!langtag) CERROR_BREAK(error, 83); /*alloc fail*/
 
     lodepng_memcpy(langtag, data + begin, length);
@@ -4938,7 +6502,7 @@ static unsigned readChunk_iTXt(LodePNGInfo* info, const LodePNGDecoderSettings*
     length = 0;
     for(i = begin; i < chunkLength && data[i] != 0; ++i) ++length;
 
-    transkey = (char*)lodepng_malloc(length + 1);
+    transkey = (char*)lodepng_scratch_malloc(length + 1);
     if(!transkey) CERROR_BREAK(error, 83); /*alloc fail*/
 
     lodepng_memcpy(transkey, data + begin, length);
@@ -4959,7 +6523,7 @@ static unsigned readChunk_iTXt(LodePNGInfo* info, const LodePNGDecoderSettings*
       /*error: compressed text larger than  decoder->max_text_size*/
       if(error && size > zlibsettings.max_output_size) error = 112;
       if(!error) error = lodepng_add_itext_sized(info, key, langtag, transkey, (char*)str, size);
-      lodepng_free(str);
+      lodepng_scratch_free(str);
     } else {
       error = lodepng_add_itext_sized(info, key, langtag, transkey, (char*)(data + begin), length);
     }
@@ -4967,9 +6531,9 @@ static unsigned readChunk_iTXt(LodePNGInfo* info, const LodePNGDecoderSettings*
     break;
   }
 
-  lodepng_free(key);
-  lodepng_free(langtag);
-  lodepng_free(transkey);
+  lodepng_scratch_free(key);
+  lodepng_scratch_free(langtag);
+  lodepng_scratch_free(transkey);
 
   return error;
 }
@@ -5038,6 +6602,7 @@ static unsigned readChunk_iCCP(LodePNGInfo* info, const LodePNGDecoderSettings*
   unsigned error = 0;
   unsigned i;
   size_t size = 0;
+  LodePNGArena* arena;
   /*copy the object to change parameters in it*/
   LodePNGDecompressSettings zlibsettings = decoder->zlibsettings;
 
@@ -5063,9 +6628,11 @@ static unsigned readChunk_iCCP(LodePNGInfo* info, const LodePNGDecoderSettings*
 
   length = (unsigned)chunkLength - string2_begin;
   zlibsettings.max_output_size = decoder->max_icc_size;
+  arena = lodepng_arena_set(0); /*the profile stays in the info, so not in the arena*/
   error = zlib_decompress(&info->iccp_profile, &size, 0,
                           &data[string2_begin],
                           length, &zlibsettings);
+  lodepng_arena_set(arena);
   /*error: ICC profile larger than  decoder->max_icc_size*/
   if(error && size > zlibsettings.max_output_size) error = 113;
   info->iccp_profile_size = (unsigned)size;
@@ -5170,26 +6737,95 @@ unsigned lodepng_inspect_chunk(LodePNGState* state, size_t pos,
 }
 
 /*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
-static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
-                          LodePNGState* state,
-                          const unsigned char* in, size_t insize) {
+/*reads a chunk other than IHDR, IDAT and IEND into the state, for decodeGeneric and the streaming decoder.
+critical_pos is 1 after IHDR, 2 after PLTE, 3 after IDAT. Sets unknown for the chunk types that are skipped.*/
+static unsigned readChunk(LodePNGState* state, const unsigned char* chunk, unsigned* critical_pos, unsigned* unknown) {
+  unsigned error = 0;
+  unsigned chunkLength = lodepng_chunk_length(chunk);
+  const unsigned char* data = lodepng_chunk_data_const(chunk);
+
+  *unknown = 0;
+  if(lodepng_chunk_type_equals(chunk, "PLTE")) {
+    /*palette chunk (PLTE)*/
+    error = readChunk_PLTE(&state->info_png.color, data, chunkLength);
+    *critical_pos = 2;
+  } else if(lodepng_chunk_type_equals(chunk, "tRNS")) {
+    /*palette transparency chunk (tRNS). Even though this one is an ancillary chunk , it is still compiled
+    in without 'LODEPNG_COMPILE_ANCILLARY_CHUNKS' because it contains essential color information that
+    affects the alpha channel of pixels. */
+    error = readChunk_tRNS(&state->info_png.color, data, chunkLength);
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+    /*background color chunk (bKGD)*/
+  } else if(lodepng_chunk_type_equals(chunk, "bKGD")) {
+    error = readChunk_bKGD(&state->info_png, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "tEXt")) {
+    /*text chunk (tEXt)*/
+    if(state->decoder.read_text_chunks) {
+      error = readChunk_tEXt(&state->info_png, data, chunkLength);
+    }
+  } else if(lodepng_chunk_type_equals(chunk, "zTXt")) {
+    /*compressed text chunk (zTXt)*/
+    if(state->decoder.read_text_chunks) {
+      error = readChunk_zTXt(&state->info_png, &state->decoder, data, chunkLength);
+    }
+  } else if(lodepng_chunk_type_equals(chunk, "iTXt")) {
+    /*international text chunk (iTXt)*/
+    if(state->decoder.read_text_chunks) {
+      error = readChunk_iTXt(&state->info_png, &state->decoder, data, chunkLength);
+    }
+  } else if(lodepng_chunk_type_equals(chunk, "tIME")) {
+    error = readChunk_tIME(&state->info_png, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "pHYs")) {
+    error = readChunk_pHYs(&state->info_png, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "gAMA")) {
+    error = readChunk_gAMA(&state->info_png, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "cHRM")) {
+    error = readChunk_cHRM(&state->info_png, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "sRGB")) {
+    error = readChunk_sRGB(&state->info_png, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "iCCP")) {
+    error = readChunk_iCCP(&state->info_png, &state->decoder, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "sBIT")) {
+    error = readChunk_sBIT(&state->info_png, data, chunkLength);
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  } else /*it's not an implemented chunk type, so ignore it: skip over the data*/ {
+    /*error: unknown critical chunk (5th bit of first byte of chunk type is 0)*/
+    if(!state->decoder.ignore_critical && !lodepng_chunk_ancillary(chunk)) {
+      return 69;
+    }
+
+    *unknown = 1;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+    if(state->decoder.remember_unknown_chunks) {
+      error = lodepng_chunk_append(&state->info_png.unknown_chunks_data[*critical_pos - 1],
+                                   &state->info_png.unknown_chunks_size[*critical_pos - 1], chunk);
+    }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  }
+  return error;
+}
+
+/*
+Reads the chunks of the PNG and decompresses its IDAT data into scanlines, which are still filtered (and interlaced).
+The IDAT data is read straight from in while there is one IDAT chunk, more chunks are joined into a copy.
+*/
+static void decodeScanlines(unsigned char** scanlines, unsigned* w, unsigned* h,
+                            LodePNGState* state,
+                            const unsigned char* in, size_t insize) {
   unsigned char IEND = 0;
   const unsigned char* chunk; /*points to beginning of next chunk*/
-  unsigned char* idat; /*the data from idat chunks, zlib compressed*/
+  const unsigned char* idat = 0; /*the data from idat chunks, zlib compressed*/
+  unsigned char* idatcopy = 0; /*the joined data if there's more than one idat chunk*/
   size_t idatsize = 0;
-  unsigned char* scanlines = 0;
   size_t scanlines_size = 0, expected_size = 0;
-  size_t outsize = 0;
 
   /*for unknown chunk order*/
   unsigned unknown = 0;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   unsigned critical_pos = 1; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
 
   /* safe output values in case error happens */
-  *out = 0;
+  *scanlines = 0;
   *w = *h = 0;
 
   state->error = lodepng_inspect(w, h, state, in, insize); /*reads header and resets other parameters in state->info_png*/
@@ -5199,14 +6835,9 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     CERROR_RETURN(state->error, 92); /*overflow possible due to amount of pixels*/
   }
 
-  /*the input filesize is a safe upper bound for the sum of idat chunks size*/
-  idat = (unsigned char*)lodepng_malloc(insize);
-  if(!idat) CERROR_RETURN(state->error, 83); /*alloc fail*/
-
   chunk = &in[33]; /*first byte of the first chunk after the header*/
 
-  /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk.
-  IDAT data is put at the start of the in buffer*/
+  /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk*/
   while(!IEND && !state->error) {
     unsigned chunkLength;
     const unsigned char* data; /*the data in the chunk*/
@@ -5239,86 +6870,26 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
       size_t newsize;
       if(lodepng_addofl(idatsize, chunkLength, &newsize)) CERROR_BREAK(state->error, 95);
       if(newsize > insize) CERROR_BREAK(state->error, 95);
-      lodepng_memcpy(idat + idatsize, data, chunkLength);
+      if(!idat) {
+        idat = data;
+      } else {
+        if(!idatcopy) {
+          /*the input filesize is a safe upper bound for the sum of idat chunks size*/
+          idatcopy = (unsigned char*)lodepng_scratch_malloc(insize);
+          if(!idatcopy) CERROR_BREAK(state->error, 83); /*alloc fail*/
+          lodepng_memcpy(idatcopy, idat, idatsize);
+          idat = idatcopy;
+        }
+        lodepng_memcpy(idatcopy + idatsize, data, chunkLength);
+      }
       idatsize += chunkLength;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
       critical_pos = 3;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     } else if(lodepng_chunk_type_equals(chunk, "IEND")) {
       /*IEND chunk*/
       IEND = 1;
-    } else if(lodepng_chunk_type_equals(chunk, "PLTE")) {
-      /*palette chunk (PLTE)*/
-      state->error = readChunk_PLTE(&state->info_png.color, data, chunkLength);
-      if(state->error) break;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      critical_pos = 2;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    } else if(lodepng_chunk_type_equals(chunk, "tRNS")) {
-      /*palette transparency chunk (tRNS). Even though this one is an ancillary chunk , it is still compiled
-      in without 'LODEPNG_COMPILE_ANCILLARY_CHUNKS' because it contains essential color information that
-      affects the alpha channel of pixels. */
-      state->error = readChunk_tRNS(&state->info_png.color, data, chunkLength);
-      if(state->error) break;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      /*background color chunk (bKGD)*/
-    } else if(lodepng_chunk_type_equals(chunk, "bKGD")) {
-      state->error = readChunk_bKGD(&state->info_png, data, chunkLength);
+    } else {
+      state->error = readChunk(state, chunk, &critical_pos, &unknown);
       if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "tEXt")) {
-      /*text chunk (tEXt)*/
-      if(state->decoder.read_text_chunks) {
-        state->error = readChunk_tEXt(&state->info_png, data, chunkLength);
-        if(state->error) break;
-      }
-    } else if(lodepng_chunk_type_equals(chunk, "zTXt")) {
-      /*compressed text chunk (zTXt)*/
-      if(state->decoder.read_text_chunks) {
-        state->error = readChunk_zTXt(&state->info_png, &state->decoder, data, chunkLength);
-        if(state->error) break;
-      }
-    } else if(lodepng_chunk_type_equals(chunk, "iTXt")) {
-      /*international text chunk (iTXt)*/
-      if(state->decoder.read_text_chunks) {
-        state->error = readChunk_iTXt(&state->info_png, &state->decoder, data, chunkLength);
-        if(state->error) break;
-      }
-    } else if(lodepng_chunk_type_equals(chunk, "tIME")) {
-      state->error = readChunk_tIME(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "pHYs")) {
-      state->error = readChunk_pHYs(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "gAMA")) {
-      state->error = readChunk_gAMA(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "cHRM")) {
-      state->error = readChunk_cHRM(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "sRGB")) {
-      state->error = readChunk_sRGB(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "iCCP")) {
-      state->error = readChunk_iCCP(&state->info_png, &state->decoder, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "sBIT")) {
-      state->error = readChunk_sBIT(&state->info_png, data, chunkLength);
-      if(state->error) break;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    } else /*it's not an implemented chunk type, so ignore it: skip over the data*/ {
-      /*error: unknown critical chunk (5th bit of first byte of chunk type is 0)*/
-      if(!state->decoder.ignore_critical && !lodepng_chunk_ancillary(chunk)) {
-        CERROR_BREAK(state->error, 69);
-      }
-
-      unknown = 1;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      if(state->decoder.remember_unknown_chunks) {
-        state->error = lodepng_chunk_append(&state->info_png.unknown_chunks_data[critical_pos - 1],
-                                            &state->info_png.unknown_chunks_size[critical_pos - 1], chunk);
-        if(state->error) break;
-      }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     }
 
     if(!state->decoder.ignore_crc && !unknown) /*check CRC if wanted, only on known chunk types*/ {
@@ -5351,60 +6922,502 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
       expected_size += lodepng_get_raw_size_idat((*w + 0), (*h + 0) >> 1, bpp);
     }
 
-    state->error = zlib_decompress(&scanlines, &scanlines_size, expected_size, idat, idatsize, &state->decoder.zlibsettings);
+    state->error = zlib_decompress(scanlines, &scanlines_size, expected_size, idat, idatsize,
+                                   &state->decoder.zlibsettings);
   }
   if(!state->error && scanlines_size != expected_size) state->error = 91; /*decompressed size doesn't match prediction*/
-  lodepng_free(idat);
+  lodepng_scratch_free(idatcopy);
+}
 
-  if(!state->error) {
-    outsize = lodepng_get_raw_size(*w, *h, &state->info_png.color);
-    *out = (unsigned char*)lodepng_malloc(outsize);
-    if(!*out) state->error = 83; /*alloc fail*/
+/*
+Turns the scanlines into the image in out, in the color type of info_raw. When that needs a color conversion,
+images without Adam7 are unfiltered in place in the scanlines and converted from there, only Adam7 images
+need a temporary image in the color type of the PNG. NOTE: the scanlines are overwritten.
+*/
+static unsigned postProcessInto(unsigned char* out, unsigned char* scanlines, unsigned w, unsigned h,
+                                const LodePNGState* state) {
+  const LodePNGColorMode* color = &state->info_png.color;
+  unsigned bpp = lodepng_get_bpp(color);
+  unsigned error = 0;
+  if(lodepng_color_mode_equal(&state->info_raw, color)) {
+    lodepng_memset(out, 0, lodepng_get_raw_size(w, h, color));
+    return postProcessScanlines(out, scanlines, w, h, &state->info_png);
   }
-  if(!state->error) {
-    lodepng_memset(*out, 0, outsize);
-    state->error = postProcessScanlines(*out, scanlines, *w, *h, &state->info_png);
+  if(bpp == 0) return 31; /*error: invalid colortype*/
+  if(state->info_png.interlace_method == 0) {
+    error = unfilter(scanlines, scanlines, w, h, bpp);
+    if(!error && bpp < 8 && w * bpp != ((w * bpp + 7u) / 8u) * 8u) {
+      removePaddingBits(scanlines, scanlines, w * bpp, ((w * bpp + 7u) / 8u) * 8u, h);
+    }
+    if(!error) error = lodepng_convert(out, scanlines, &state->info_raw, color, w, h);
+  } else {
+    size_t size = lodepng_get_raw_size(w, h, color);
+    unsigned char* image = (unsigned char*)lodepng_scratch_malloc(size);
+    if(!image) return 83; /*alloc fail*/
+    lodepng_memset(image, 0, size);
+    error = postProcessScanlines(image, scanlines, w, h, &state->info_png);
+    if(!error) error = lodepng_convert(out, image, &state->info_raw, color, w, h);
+    lodepng_scratch_free(image);
   }
-  lodepng_free(scanlines);
+  return error;
+}
+
+/*
+Decodes the PNG into the buffer that get_out gives for the size of the image, which is asked for once the image
+data is decompressed. get_out returns an error code if it has no such buffer. user is passed on to it.
+*/
+static unsigned decodeInto(unsigned* w, unsigned* h, LodePNGState* state, const unsigned char* in, size_t insize,
+                           unsigned (*get_out)(unsigned char** out, size_t size, void* user), void* user) {
+  unsigned char* scanlines = 0;
+  unsigned char* out = 0;
+  decodeScanlines(&scanlines, w, h, state, in, insize);
+  if(!state->error && !state->decoder.color_convert) {
+    /*store the info_png color settings on the info_raw so that the info_raw still reflects what colortype
+    the raw image has to the end user*/
+    state->error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+  }
+  /*TODO: check if this works according to the statement in the documentation: "The converter can convert
+  from grayscale input color type, to 8-bit grayscale or grayscale with alpha"*/
+  if(!state->error && !lodepng_color_mode_equal(&state->info_raw, &state->info_png.color)
+     && !(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+     && !(state->info_raw.bitdepth == 8)) {
+    state->error = 56; /*unsupported color mode conversion*/
+  }
+  if(!state->error) state->error = get_out(&out, lodepng_get_raw_size(*w, *h, &state->info_raw), user);
+  if(!state->error) state->error = postProcessInto(out, scanlines, *w, *h, state);
+  lodepng_scratch_free(scanlines);
+  return state->error;
+}
+
+/*get_out of decodeInto for lodepng_decode, user is its out parameter*/
+static unsigned decodeAllocate(unsigned char** out, size_t size, void* user) {
+  *out = *(unsigned char**)user = (unsigned char*)lodepng_malloc(size);
+  return *out ? 0 : 83; /*alloc fail*/
 }
 
 unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
                         LodePNGState* state,
                         const unsigned char* in, size_t insize) {
   *out = 0;
-  decodeGeneric(out, w, h, state, in, insize);
-  if(state->error) return state->error;
-  if(!state->decoder.color_convert || lodepng_color_mode_equal(&state->info_raw, &state->info_png.color)) {
-    /*same color type, no copying or converting of data needed*/
-    /*store the info_png color settings on the info_raw so that the info_raw still reflects what colortype
-    the raw image has to the end user*/
-    if(!state->decoder.color_convert) {
-      state->error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
-      if(state->error) return state->error;
+  if(decodeInto(w, h, state, in, insize, decodeAllocate, out)) {
+    lodepng_scratch_free(*out);
+    *out = 0;
+  }
+  return state->error;
+}
+
+/*get_out of decodeInto for lodepng_decode_into, user is a ucvector of the caller's buffer*/
+static unsigned decodeUseBuffer(unsigned char** out, size_t size, void* user) {
+  const ucvector* buffer = (const ucvector*)user;
+  if(size > buffer->size) return 117; /*the caller's buffer is too small*/
+  *out = buffer->data;
+  return 0;
+}
+
+unsigned lodepng_decode_into(unsigned char* out, size_t outsize, unsigned* w, unsigned* h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize) {
+  ucvector buffer = ucvector_init(out, outsize);
+  return decodeInto(w, h, state, in, insize, decodeUseBuffer, &buffer);
+}
+
+#ifdef LODEPNG_COMPILE_STREAMING
+/*the states of a LodePNGStreamDecoder, they say what the next input bytes are*/
+#define PNG_STREAM_SIGNATURE 0 /*the signature and IHDR chunk, 33 bytes*/
+#define PNG_STREAM_CHUNK 1 /*length and type of the next chunk*/
+#define PNG_STREAM_DATA 2 /*data and CRC of a chunk other than IDAT*/
+#define PNG_STREAM_IDAT 3 /*data of an IDAT chunk*/
+#define PNG_STREAM_CRC 4 /*CRC of an IDAT chunk*/
+#define PNG_STREAM_END 5 /*after the IEND chunk*/
+
+/*IDAT data is decompressed in slices of at most this size, which is the most compressed input kept*/
+#define PNG_STREAM_SLICE 65536
+
+struct LodePNGStreamDecoder {
+  LodePNGState* state;
+  LodePNGRowCallback callback;
+  void* user;
+  unsigned w, h;
+  unsigned mode; /*one of the PNG_STREAM states*/
+  ucvector chunk; /*the bytes of the current chunk, while it arrives, for all but the data of IDAT*/
+  size_t need; /*size the chunk buffer must reach before it can be used*/
+  size_t idat_left; /*bytes of the current IDAT chunk that are still to come*/
+  unsigned char idat_header[8]; /*length and type of the current IDAT chunk*/
+  unsigned crc; /*CRC of the current IDAT chunk so far*/
+  unsigned critical_pos; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
+  unsigned started; /*the scanlines are set up, at the first IDAT chunk*/
+  unsigned custom; /*custom zlib functions, which can't stream: then all IDAT data is collected in idat*/
+#ifdef LODEPNG_COMPILE_ZLIB
+  ZlibStream zlib;
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  ucvector idat;
+  unsigned bpp;
+  unsigned passw[7], passh[7]; /*size of the Adam7 passes, or of the image in pass 0 without interlacing*/
+  unsigned pass; /*pass of the next scanline, 7 after the last one*/
+  unsigned y; /*the next scanline in the pass*/
+  size_t expected; /*size of all scanlines with their filter bytes*/
+  unsigned char* line; /*the current unfiltered scanline*/
+  unsigned char* prevline; /*the previous one, for the filters that look up*/
+  unsigned char* image; /*interlaced only: the image in the color type of the PNG*/
+  unsigned char* row; /*a row converted to the color type of info_raw, if it differs*/
+};
+
+/*puts the pixels of scanline y of Adam7 pass i at their place in the w pixels wide image out, like Adam7_deinterlace*/
+static void Adam7_deinterlaceScanline(unsigned char* out, const unsigned char* in, unsigned w,
+                                      unsigned passw, unsigned i, unsigned y, unsigned bpp) {
+  unsigned x, b;
+  if(bpp >= 8) {
+    size_t bytewidth = bpp / 8u;
+    for(x = 0; x < passw; ++x) {
+      size_t pixeloutstart = ((ADAM7_IY[i] + (size_t)y * ADAM7_DY[i]) * (size_t)w
+                           + ADAM7_IX[i] + (size_t)x * ADAM7_DX[i]) * bytewidth;
+      for(b = 0; b < bytewidth; ++b) {
+        out[pixeloutstart + b] = in[x * bytewidth + b];
+      }
     }
-  } else { /*color conversion needed*/
-    unsigned char* data = *out;
-    size_t outsize;
+  } else {
+    size_t ibp = 0;
+    for(x = 0; x < passw; ++x) {
+      size_t obp = (ADAM7_IY[i] + (size_t)y * ADAM7_DY[i]) * w * bpp + (ADAM7_IX[i] + (size_t)x * ADAM7_DX[i]) * bpp;
+      for(b = 0; b < bpp; ++b) {
+        unsigned char bit = readBitFromReversedStream(&ibp, in);
+        setBitOfReversedStream(&obp, out, bit);
+      }
+    }
+  }
+}
+
+/*gives one row, in the color type of the PNG, to the callback*/
+static unsigned streamRow(LodePNGStreamDecoder* decoder, const unsigned char* line, unsigned y) {
+  LodePNGState* state = decoder->state;
+  if(decoder->row) {
+    unsigned error = lodepng_convert(decoder->row, line, &state->info_raw, &state->info_png.color, decoder->w, 1);
+    if(error) return error;
+    line = decoder->row;
+  }
+  return decoder->callback(decoder->user, line, y, decoder->w, decoder->h);
+}
+
+/*sets up the scanlines and color conversion once the chunks before the image data are known*/
+static unsigned streamStart(LodePNGStreamDecoder* decoder) {
+  LodePNGState* state = decoder->state;
+  const LodePNGInfo* info = &state->info_png;
+  unsigned w = decoder->w, h = decoder->h, bpp;
+  size_t linebytes;
+
+  decoder->started = 1;
+  if(info->color.colortype == LCT_PALETTE && !info->color.palette) {
+    return 106; /* error: PNG file must have PLTE chunk if color type is palette */
+  }
 
-    /*TODO: check if this works according to the statement in the documentation: "The converter can convert
-    from grayscale input color type, to 8-bit grayscale or grayscale with alpha"*/
+  bpp = decoder->bpp = lodepng_get_bpp(&info->color);
+  if(info->interlace_method == 0) {
+    lodepng_memset(decoder->passw, 0, sizeof(decoder->passw));
+    lodepng_memset(decoder->passh, 0, sizeof(decoder->passh));
+    decoder->passw[0] = w;
+    decoder->passh[0] = h;
+    decoder->expected = lodepng_get_raw_size_idat(w, h, bpp);
+  } else {
+    size_t filter_passstart[8], padded_passstart[8], passstart[8];
+    size_t size = lodepng_get_raw_size(w, h, &info->color);
+    Adam7_getpassvalues(decoder->passw, decoder->passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
+    decoder->expected = filter_passstart[7];
+    decoder->image = (unsigned char*)lodepng_malloc(size);
+    if(!decoder->image) return 83; /*alloc fail*/
+    lodepng_memset(decoder->image, 0, size);
+  }
+  /*skip empty passes*/
+  while(decoder->pass < 7 && !decoder->passh[decoder->pass]) ++decoder->pass;
+
+  linebytes = lodepng_get_raw_size_idat(w, 1, bpp) - 1u;
+  decoder->line = (unsigned char*)lodepng_malloc(linebytes);
+  decoder->prevline = (unsigned char*)lodepng_malloc(linebytes);
+  if(!decoder->line || !decoder->prevline) return 83; /*alloc fail*/
+
+  /*the same color conversion as lodepng_decode does for the whole image*/
+  if(!state->decoder.color_convert || lodepng_color_mode_equal(&state->info_raw, &info->color)) {
+    if(!state->decoder.color_convert) {
+      unsigned error = lodepng_color_mode_copy(&state->info_raw, &info->color);
+      if(error) return error;
+    }
+  } else {
     if(!(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
        && !(state->info_raw.bitdepth == 8)) {
       return 56; /*unsupported color mode conversion*/
     }
+    decoder->row = (unsigned char*)lodepng_malloc(lodepng_get_raw_size(w, 1, &state->info_raw));
+    if(!decoder->row) return 83; /*alloc fail*/
+  }
+  return 0;
+}
+
+/*unfilters the complete scanlines in the inflated data, and gives the rows of non-interlaced images to the callback.
+Sets used to the amount of bytes used, the rest is an incomplete scanline.*/
+static unsigned streamScanlines(LodePNGStreamDecoder* decoder, const unsigned char* in, size_t insize, size_t* used) {
+  unsigned bpp = decoder->bpp;
+  size_t bytewidth = (bpp + 7u) / 8u;
+  size_t pos = 0;
+
+  while(decoder->pass < 7) {
+    unsigned i = decoder->pass;
+    size_t linebytes = lodepng_get_raw_size_idat(decoder->passw[i], 1, bpp) - 1u;
+    unsigned char* temp;
+    if(insize - pos < 1u + linebytes) break;
+
+    CERROR_TRY_RETURN(unfilterScanline(decoder->line, &in[pos + 1], decoder->y ? decoder->prevline : 0,
+                                       bytewidth, in[pos], linebytes));
+    pos += 1u + linebytes;
+
+    if(decoder->image) {
+      Adam7_deinterlaceScanline(decoder->image, decoder->line, decoder->w, decoder->passw[i], i, decoder->y, bpp);
+    } else {
+      CERROR_TRY_RETURN(streamRow(decoder, decoder->line, decoder->y));
+    }
+
+    temp = decoder->prevline;
+    decoder->prevline = decoder->line;
+    decoder->line = temp;
+    if(++decoder->y == decoder->passh[i]) {
+      decoder->y = 0;
+      do ++decoder->pass; while(decoder->pass < 7 && !decoder->passh[decoder->pass]);
+    }
+  }
+  *used = pos;
+  return 0;
+}
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*decompresses what it can of the IDAT data so far, and uses the scanlines that became complete*/
+static unsigned streamInflate(LodePNGStreamDecoder* decoder, unsigned partial) {
+  ZlibStream* zlib = &decoder->zlib;
+  /*room for the longest scanline beyond the window*/
+  size_t room = lodepng_get_raw_size_idat(decoder->w, 1, decoder->bpp) + 32768u;
+  for(;;) {
+    size_t used, stop_size = zlib->taken + room;
+    int full;
+    CERROR_TRY_RETURN(ZlibStream_run(zlib, &decoder->state->decoder.zlibsettings, partial, stop_size));
+    CERROR_TRY_RETURN(streamScanlines(decoder, zlib->out.data + zlib->taken, zlib->out.size - zlib->taken, &used));
+    zlib->taken += used;
+    /*data after the last scanline is not used, the size is checked at the end*/
+    if(decoder->pass == 7) zlib->taken = zlib->out.size;
+    full = zlib->out.size >= stop_size;
+    ZlibStream_compact(zlib);
+    if(!full) return 0; /*it stopped for more input, not for room*/
+  }
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+/*decompresses IDAT chunk data as it arrives*/
+static unsigned streamIdat(LodePNGStreamDecoder* decoder, const unsigned char* in, size_t insize) {
+  if(decoder->custom) {
+    if(!ucvector_resize(&decoder->idat, decoder->idat.size + insize)) return 83; /*alloc fail*/
+    lodepng_memcpy(decoder->idat.data + decoder->idat.size - insize, in, insize);
+    return 0;
+  }
+#ifdef LODEPNG_COMPILE_ZLIB
+  CERROR_TRY_RETURN(ZlibStream_push(&decoder->zlib, in, insize));
+  return streamInflate(decoder, 1);
+#else /*LODEPNG_COMPILE_ZLIB*/
+  return 0; /*not reached: without zlib, custom is always set*/
+#endif /*LODEPNG_COMPILE_ZLIB*/
+}
+
+/*at the IEND chunk: decompresses the rest, checks it and gives the rows of interlaced images*/
+static unsigned streamEnd(LodePNGStreamDecoder* decoder) {
+  LodePNGState* state = decoder->state;
+  size_t total = 0;
+  unsigned y;
+
+  decoder->mode = PNG_STREAM_END;
+  if(!decoder->started) CERROR_TRY_RETURN(streamStart(decoder));
+  if(decoder->custom) {
+    unsigned char* scanlines = 0;
+    size_t used;
+    unsigned error = zlib_decompress(&scanlines, &total, decoder->expected, decoder->idat.data, decoder->idat.size,
+                                     &state->decoder.zlibsettings);
+    if(!error && total == decoder->expected) error = streamScanlines(decoder, scanlines, total, &used);
+    lodepng_scratch_free(scanlines);
+    if(error) return error;
+  }
+#ifdef LODEPNG_COMPILE_ZLIB
+  else {
+    CERROR_TRY_RETURN(streamInflate(decoder, 0));
+    CERROR_TRY_RETURN(ZlibStream_finish(&decoder->zlib, &state->decoder.zlibsettings));
+    total = decoder->zlib.total;
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  if(total != decoder->expected) return 91; /*decompressed size doesn't match prediction*/
+
+  if(decoder->image) {
+    unsigned bpp = decoder->bpp;
+    size_t linebits = (size_t)decoder->w * bpp;
+    for(y = 0; y < decoder->h; ++y) {
+      if(linebits & 7u) {
+        /*the rows of the image are not byte aligned, take them out to the start of a byte*/
+        size_t ibp = y * linebits, obp = 0, i;
+        for(i = 0; i < linebits; ++i) {
+          unsigned char bit = readBitFromReversedStream(&ibp, decoder->image);
+          setBitOfReversedStream(&obp, decoder->line, bit);
+        }
+        CERROR_TRY_RETURN(streamRow(decoder, decoder->line, y));
+      } else {
+        CERROR_TRY_RETURN(streamRow(decoder, decoder->image + y * (linebits >> 3u), y));
+      }
+    }
+  }
+  return 0;
+}
+
+/*uses the bytes gathered in the chunk buffer, which reached the size the current state needs*/
+static unsigned streamChunk(LodePNGStreamDecoder* decoder) {
+  LodePNGState* state = decoder->state;
+  const unsigned char* chunk = decoder->chunk.data;
+  unsigned unknown = 0;
+
+  if(decoder->mode == PNG_STREAM_SIGNATURE) {
+    /*reads header and resets other parameters in state->info_png*/
+    CERROR_TRY_RETURN(lodepng_inspect(&decoder->w, &decoder->h, state, chunk, decoder->chunk.size));
+    if(lodepng_pixel_overflow(decoder->w, decoder->h, &state->info_png.color, &state->info_raw)) {
+      return 92; /*overflow possible due to amount of pixels*/
+    }
+    decoder->mode = PNG_STREAM_CHUNK;
+    decoder->need = 8;
+  } else if(decoder->mode == PNG_STREAM_CHUNK) {
+    unsigned chunkLength = lodepng_chunk_length(chunk);
+    /*error: chunk length larger than the max PNG chunk size*/
+    if(chunkLength > 2147483647) {
+      if(state->decoder.ignore_end) return streamEnd(decoder); /*other errors may still happen though*/
+      return 63;
+    }
+    if(lodepng_chunk_type_equals(chunk, "IDAT")) {
+      decoder->critical_pos = 3;
+      if(!decoder->started) CERROR_TRY_RETURN(streamStart(decoder));
+#ifdef LODEPNG_COMPILE_CRC
+      decoder->crc = lodepng_crc32_update(0, &chunk[4], 4);
+#endif /*LODEPNG_COMPILE_CRC*/
+      lodepng_memcpy(decoder->idat_header, chunk, 8);
+      decoder->idat_left = chunkLength;
+      decoder->mode = chunkLength ? PNG_STREAM_IDAT : PNG_STREAM_CRC;
+      decoder->need = 4;
+      decoder->chunk.size = 0;
+      return 0;
+    }
+    decoder->mode = PNG_STREAM_DATA;
+    decoder->need = 12u + (size_t)chunkLength;
+    return 0;
+  } else if(decoder->mode == PNG_STREAM_DATA) {
+    if(!lodepng_chunk_type_equals(chunk, "IEND")) {
+      CERROR_TRY_RETURN(readChunk(state, chunk, &decoder->critical_pos, &unknown));
+    }
+    if(!state->decoder.ignore_crc && !unknown) /*check CRC if wanted, only on known chunk types*/ {
+      if(lodepng_chunk_check_crc(chunk)) return 57; /*invalid CRC*/
+    }
+    if(lodepng_chunk_type_equals(chunk, "IEND")) return streamEnd(decoder);
+    decoder->mode = PNG_STREAM_CHUNK;
+    decoder->need = 8;
+  } else /*if(decoder->mode == PNG_STREAM_CRC)*/ {
+#ifdef LODEPNG_COMPILE_CRC
+    /*the CRC of streamed IDAT data can only be computed in pieces with the built-in CRC function*/
+    if(!state->decoder.ignore_crc && lodepng_read32bitInt(chunk) != decoder->crc) return 57; /*invalid CRC*/
+#endif /*LODEPNG_COMPILE_CRC*/
+    decoder->mode = PNG_STREAM_CHUNK;
+    decoder->need = 8;
+  }
+  decoder->chunk.size = 0;
+  return 0;
+}
 
-    outsize = lodepng_get_raw_size(*w, *h, &state->info_raw);
-    *out = (unsigned char*)lodepng_malloc(outsize);
-    if(!(*out)) {
-      state->error = 83; /*alloc fail*/
+LodePNGStreamDecoder* lodepng_stream_decoder_new(LodePNGState* state, LodePNGRowCallback callback, void* user) {
+  LodePNGStreamDecoder* decoder = (LodePNGStreamDecoder*)lodepng_malloc(sizeof(LodePNGStreamDecoder));
+  const LodePNGDecompressSettings* settings = &state->decoder.zlibsettings;
+  if(!decoder) return 0;
+  lodepng_memset(decoder, 0, sizeof(LodePNGStreamDecoder));
+  decoder->state = state;
+  decoder->callback = callback;
+  decoder->user = user;
+  decoder->mode = PNG_STREAM_SIGNATURE;
+  decoder->need = 33;
+  decoder->chunk = ucvector_init(NULL, 0);
+  decoder->idat = ucvector_init(NULL, 0);
+  decoder->critical_pos = 1;
+#ifdef LODEPNG_COMPILE_ZLIB
+  decoder->custom = settings->custom_zlib || settings->custom_inflate;
+  ZlibStream_init(&decoder->zlib);
+#else /*LODEPNG_COMPILE_ZLIB*/
+  decoder->custom = 1;
+  (void)settings;
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  state->error = 0;
+  return decoder;
+}
+
+unsigned lodepng_stream_decoder_push(LodePNGStreamDecoder* decoder, const unsigned char* in, size_t insize) {
+  LodePNGState* state = decoder->state;
+  while(!state->error && insize && decoder->mode != PNG_STREAM_END) {
+    size_t amount;
+    if(decoder->mode == PNG_STREAM_IDAT) {
+      amount = LODEPNG_MIN(insize, LODEPNG_MIN(decoder->idat_left, PNG_STREAM_SLICE));
+#ifdef LODEPNG_COMPILE_CRC
+      decoder->crc = lodepng_crc32_update(decoder->crc, in, amount);
+#endif /*LODEPNG_COMPILE_CRC*/
+      state->error = streamIdat(decoder, in, amount);
+      decoder->idat_left -= amount;
+      if(!decoder->idat_left) decoder->mode = PNG_STREAM_CRC;
+    } else {
+      amount = LODEPNG_MIN(insize, decoder->need - decoder->chunk.size);
+      if(!ucvector_resize(&decoder->chunk, decoder->chunk.size + amount)) CERROR_BREAK(state->error, 83);
+      lodepng_memcpy(decoder->chunk.data + decoder->chunk.size - amount, in, amount);
+      if(decoder->chunk.size == decoder->need) state->error = streamChunk(decoder);
     }
-    else state->error = lodepng_convert(*out, data, &state->info_raw,
-                                        &state->info_png.color, *w, *h);
-    lodepng_free(data);
+    in += amount;
+    insize -= amount;
   }
   return state->error;
 }
 
+/*how many bytes of the current chunk arrived so far*/
+static size_t streamChunkReceived(const LodePNGStreamDecoder* decoder) {
+  size_t length = decoder->chunk.size;
+  if(decoder->mode == PNG_STREAM_IDAT || decoder->mode == PNG_STREAM_CRC) {
+    length = lodepng_chunk_length(decoder->idat_header) - decoder->idat_left + 8u;
+    if(decoder->mode == PNG_STREAM_CRC) length += decoder->chunk.size;
+  }
+  return length;
+}
+
+unsigned lodepng_stream_decoder_finish(LodePNGStreamDecoder* decoder) {
+  LodePNGState* state = decoder->state;
+  if(state->error || decoder->mode == PNG_STREAM_END) return state->error;
+  if(decoder->mode == PNG_STREAM_SIGNATURE) {
+    unsigned w, h;
+    /*gives the error for a file too small for the header*/
+    state->error = lodepng_inspect(&w, &h, state, decoder->chunk.data, decoder->chunk.size);
+    if(!state->error) state->error = 30;
+  } else if(decoder->mode != PNG_STREAM_CHUNK && streamChunkReceived(decoder) >= 12) {
+    state->error = 64; /*error: size of the in buffer too small to contain next chunk*/
+  } else if(state->decoder.ignore_end) {
+    state->error = streamEnd(decoder); /*other errors may still happen though*/
+  } else {
+    state->error = 30; /*error: the file ended before the IEND chunk*/
+  }
+  return state->error;
+}
+
+void lodepng_stream_decoder_delete(LodePNGStreamDecoder* decoder) {
+  if(!decoder) return;
+  lodepng_scratch_free(decoder->chunk.data);
+  lodepng_scratch_free(decoder->idat.data);
+#ifdef LODEPNG_COMPILE_ZLIB
+  ZlibStream_cleanup(&decoder->zlib);
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  lodepng_scratch_free(decoder->line);
+  lodepng_scratch_free(decoder->prevline);
+  lodepng_scratch_free(decoder->image);
+  lodepng_scratch_free(decoder->row);
+  lodepng_scratch_free(decoder);
+}
+#endif /*LODEPNG_COMPILE_STREAMING*/
+
 unsigned lodepng_decode_memory(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in,
                                size_t insize, LodePNGColorType colortype, unsigned bitdepth) {
   unsigned error;
@@ -5433,15 +7446,15 @@ unsigned lodepng_decode24(unsigned char** out, unsigned* w, unsigned* h, const u
 #ifdef LODEPNG_COMPILE_DISK
 unsigned lodepng_decode_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename,
                              LodePNGColorType colortype, unsigned bitdepth) {
-  unsigned char* buffer = 0;
+  const unsigned char* buffer = 0;
   size_t buffersize;
   unsigned error;
   /* safe output values in case error happens */
   *out = 0;
   *w = *h = 0;
-  error = lodepng_load_file(&buffer, &buffersize, filename);
+  error = lodepng_map_file(&buffer, &buffersize, filename);
   if(!error) error = lodepng_decode_memory(out, w, h, buffer, buffersize, colortype, bitdepth);
-  lodepng_free(buffer);
+  lodepng_unmap_file(buffer, buffersize);
   return error;
 }
 
@@ -5594,7 +7607,7 @@ static unsigned addChunk_tRNS(ucvector* out, const LodePNGColorMode* info) {
 }
 
 static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
-                              LodePNGCompressSettings* zlibsettings) {
+                              const LodePNGCompressSettings* zlibsettings) {
   unsigned error = 0;
   unsigned char* zlib = 0;
   size_t pos = 0;
@@ -5612,7 +7625,7 @@ static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t d
       break;
     }
   }
-  lodepng_free(zlib);
+  lodepng_scratch_free(zlib);
   return error;
 }
 
@@ -5636,7 +7649,7 @@ static unsigned addChunk_tEXt(ucvector* out, const char* keyword, const char* te
 }
 
 static unsigned addChunk_zTXt(ucvector* out, const char* keyword, const char* textstring,
-                              LodePNGCompressSettings* zlibsettings) {
+                              const LodePNGCompressSettings* zlibsettings) {
   unsigned error = 0;
   unsigned char* chunk = 0;
   unsigned char* compressed = 0;
@@ -5659,12 +7672,13 @@ static unsigned addChunk_zTXt(ucvector* out, const char* keyword, const char* te
     lodepng_chunk_generate_crc(chunk);
   }
 
-  lodepng_free(compressed);
+  lodepng_scratch_free(compressed);
   return error;
 }
 
 static unsigned addChunk_iTXt(ucvector* out, unsigned compress, const char* keyword, const char* langtag,
-                              const char* transkey, const char* textstring, LodePNGCompressSettings* zlibsettings) {
+                              const char* transkey, const char* textstring,
+                              const LodePNGCompressSettings* zlibsettings) {
   unsigned error = 0;
   unsigned char* chunk = 0;
   unsigned char* compressed = 0;
@@ -5703,7 +7717,7 @@ static unsigned addChunk_iTXt(ucvector* out, unsigned compress, const char* keyw
     lodepng_chunk_generate_crc(chunk);
   }
 
-  lodepng_free(compressed);
+  lodepng_scratch_free(compressed);
   return error;
 }
 
@@ -5781,7 +7795,8 @@ static unsigned addChunk_sRGB(ucvector* out, const LodePNGInfo* info) {
   return lodepng_chunk_createv(out, 1, "sRGB", &data);
 }
 
-static unsigned addChunk_iCCP(ucvector* out, const LodePNGInfo* info, LodePNGCompressSettings* zlibsettings) {
+static unsigned addChunk_iCCP(ucvector* out, const LodePNGInfo* info,
+                              const LodePNGCompressSettings* zlibsettings) {
   unsigned error = 0;
   unsigned char* chunk = 0;
   unsigned char* compressed = 0;
@@ -5803,7 +7818,7 @@ static unsigned addChunk_iCCP(ucvector* out, const LodePNGInfo* info, LodePNGCom
     lodepng_chunk_generate_crc(chunk);
   }
 
-  lodepng_free(compressed);
+  lodepng_scratch_free(compressed);
   return error;
 }
 
@@ -5910,48 +7925,19 @@ static size_t ilog2i(size_t i) {
   return i * l + ((i - (((size_t)1) << l)) << 1u);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
-  /*
-  For PNG filter method 0
-  out must be a buffer with as size: h + (w * h * bpp + 7u) / 8u, because there are
-  the scanlines with 1 extra byte per scanline
-  */
-
-  unsigned bpp = lodepng_get_bpp(color);
-  /*the width of a scanline in bytes, not including the filter type*/
-  size_t linebytes = lodepng_get_raw_size_idat(w, 1, bpp) - 1u;
-
-  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
-  size_t bytewidth = (bpp + 7u) / 8u;
-  const unsigned char* prevline = 0;
+/*Filters the scanlines y0..y1-1 with the given strategy, see filter. in and out start at scanline y0,
+prevline is the scanline above it or NULL, y0 only matters for LFS_PREDEFINED.*/
+static unsigned filterRows(unsigned char* out, const unsigned char* in, const unsigned char* prevline,
+                           size_t linebytes, size_t bytewidth, unsigned y0, unsigned y1,
+                           LodePNGFilterStrategy strategy, const LodePNGEncoderSettings* settings) {
   unsigned x, y;
   unsigned error = 0;
-  LodePNGFilterStrategy strategy = settings->filter_strategy;
-
-  /*
-  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
-   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
-      use fixed filtering, with the filter None).
-   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
-     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
-     all five filters and select the filter that produces the smallest sum of absolute values per row.
-  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
-
-  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
-  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
-  heuristic is used.
-  */
-  if(settings->filter_palette_zero &&
-     (color->colortype == LCT_PALETTE || color->bitdepth < 8)) strategy = LFS_ZERO;
-
-  if(bpp == 0) return 31; /*error: invalid color type*/
 
   if(strategy >= LFS_ZERO && strategy <= LFS_FOUR) {
     unsigned char type = (unsigned char)strategy;
-    for(y = 0; y != h; ++y) {
-      size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
-      size_t inindex = linebytes * y;
+    for(y = y0; y != y1; ++y) {
+      size_t outindex = (1 + linebytes) * (y - y0); /*the extra filterbyte added to each row*/
+      size_t inindex = linebytes * (y - y0);
       out[outindex] = type; /*filter type byte*/
       filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, type);
       prevline = &in[inindex];
@@ -5963,16 +7949,16 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     unsigned char type, bestType = 0;
 
     for(type = 0; type != 5; ++type) {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
+      attempt[type] = (unsigned char*)lodepng_scratch_malloc(linebytes);
       if(!attempt[type]) error = 83; /*alloc fail*/
     }
 
     if(!error) {
-      for(y = 0; y != h; ++y) {
+      for(y = y0; y != y1; ++y) {
         /*try the 5 filter types*/
         for(type = 0; type != 5; ++type) {
           size_t sum = 0;
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
+          filterScanline(attempt[type], &in[(y - y0) * linebytes], prevline, linebytes, bytewidth, type);
 
           /*calculate the sum of the result*/
           if(type == 0) {
@@ -5994,15 +7980,15 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
           }
         }
 
-        prevline = &in[y * linebytes];
+        prevline = &in[(y - y0) * linebytes];
 
         /*now fill the out values*/
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
+        out[(y - y0) * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
+        for(x = 0; x != linebytes; ++x) out[(y - y0) * (linebytes + 1) + 1 + x] = attempt[bestType][x];
       }
     }
 
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+    for(type = 0; type != 5; ++type) lodepng_scratch_free(attempt[type]);
   } else if(strategy == LFS_ENTROPY) {
     unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
     size_t bestSum = 0;
@@ -6010,16 +7996,16 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     unsigned count[256];
 
     for(type = 0; type != 5; ++type) {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
+      attempt[type] = (unsigned char*)lodepng_scratch_malloc(linebytes);
       if(!attempt[type]) error = 83; /*alloc fail*/
     }
 
     if(!error) {
-      for(y = 0; y != h; ++y) {
+      for(y = y0; y != y1; ++y) {
         /*try the 5 filter types*/
         for(type = 0; type != 5; ++type) {
           size_t sum = 0;
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
+          filterScanline(attempt[type], &in[(y - y0) * linebytes], prevline, linebytes, bytewidth, type);
           lodepng_memset(count, 0, 256 * sizeof(*count));
           for(x = 0; x != linebytes; ++x) ++count[attempt[type][x]];
           ++count[type]; /*the filter type itself is part of the scanline*/
@@ -6033,19 +8019,19 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
           }
         }
 
-        prevline = &in[y * linebytes];
+        prevline = &in[(y - y0) * linebytes];
 
         /*now fill the out values*/
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
+        out[(y - y0) * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
+        for(x = 0; x != linebytes; ++x) out[(y - y0) * (linebytes + 1) + 1 + x] = attempt[bestType][x];
       }
     }
 
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+    for(type = 0; type != 5; ++type) lodepng_scratch_free(attempt[type]);
   } else if(strategy == LFS_PREDEFINED) {
-    for(y = 0; y != h; ++y) {
-      size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
-      size_t inindex = linebytes * y;
+    for(y = y0; y != y1; ++y) {
+      size_t outindex = (1 + linebytes) * (y - y0); /*the extra filterbyte added to each row*/
+      size_t inindex = linebytes * (y - y0);
       unsigned char type = settings->predefined_filters[y];
       out[outindex] = type; /*filter type byte*/
       filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, type);
@@ -6071,39 +8057,126 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     images only, so disable it*/
     zlibsettings.custom_zlib = 0;
     zlibsettings.custom_deflate = 0;
+    /*the rows may already be filtered in parallel, and a single row is too small to split*/
+    zlibsettings.num_threads = 1;
     for(type = 0; type != 5; ++type) {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
+      attempt[type] = (unsigned char*)lodepng_scratch_malloc(linebytes);
       if(!attempt[type]) error = 83; /*alloc fail*/
     }
     if(!error) {
-      for(y = 0; y != h; ++y) /*try the 5 filter types*/ {
+      for(y = y0; y != y1; ++y) /*try the 5 filter types*/ {
         for(type = 0; type != 5; ++type) {
           unsigned testsize = (unsigned)linebytes;
           /*if(testsize > 8) testsize /= 8;*/ /*it already works good enough by testing a part of the row*/
 
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
+          filterScanline(attempt[type], &in[(y - y0) * linebytes], prevline, linebytes, bytewidth, type);
           size[type] = 0;
           dummy = 0;
           zlib_compress(&dummy, &size[type], attempt[type], testsize, &zlibsettings);
-          lodepng_free(dummy);
+          lodepng_scratch_free(dummy);
           /*check if this is smallest size (or if type == 0 it's the first case so always store the values)*/
           if(type == 0 || size[type] < smallest) {
             bestType = type;
             smallest = size[type];
           }
         }
-        prevline = &in[y * linebytes];
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
+        prevline = &in[(y - y0) * linebytes];
+        out[(y - y0) * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
+        for(x = 0; x != linebytes; ++x) out[(y - y0) * (linebytes + 1) + 1 + x] = attempt[bestType][x];
       }
     }
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+    for(type = 0; type != 5; ++type) lodepng_scratch_free(attempt[type]);
   }
   else return 88; /* unknown filter strategy */
 
   return error;
 }
 
+#define FILTER_BAND_HEIGHT 16u /*rows per task when filtering in parallel*/
+
+/*the bands of rows of a parallel filter, each filtered by filterBand on some thread*/
+typedef struct FilterBands {
+  unsigned char* out;
+  const unsigned char* in;
+  unsigned h;
+  size_t linebytes;
+  size_t bytewidth;
+  LodePNGFilterStrategy strategy;
+  const LodePNGEncoderSettings* settings;
+  unsigned* errors;
+} FilterBands;
+
+static void filterBand(void* context, size_t index) {
+  FilterBands* bands = (FilterBands*)context;
+  unsigned y0 = (unsigned)index * FILTER_BAND_HEIGHT;
+  unsigned y1 = LODEPNG_MIN(y0 + FILTER_BAND_HEIGHT, bands->h);
+  size_t linebytes = bands->linebytes;
+  bands->errors[index] = filterRows(&bands->out[y0 * (linebytes + 1)], &bands->in[y0 * linebytes],
+                                    y0 ? &bands->in[(y0 - 1) * linebytes] : 0, linebytes, bands->bytewidth,
+                                    y0, y1, bands->strategy, bands->settings);
+}
+
+/*the filter strategy for an image with the given color type*/
+static LodePNGFilterStrategy filterStrategy(const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
+  /*
+  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
+   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
+      use fixed filtering, with the filter None).
+   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
+     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
+     all five filters and select the filter that produces the smallest sum of absolute values per row.
+  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
+
+  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
+  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
+  heuristic is used.
+  */
+  if(settings->filter_palette_zero &&
+     (color->colortype == LCT_PALETTE || color->bitdepth < 8)) return LFS_ZERO;
+  return settings->filter_strategy;
+}
+
+static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                       const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
+  /*
+  For PNG filter method 0
+  out must be a buffer with as size: h + (w * h * bpp + 7u) / 8u, because there are
+  the scanlines with 1 extra byte per scanline
+  */
+
+  unsigned bpp = lodepng_get_bpp(color);
+  /*the width of a scanline in bytes, not including the filter type*/
+  size_t linebytes = lodepng_get_raw_size_idat(w, 1, bpp) - 1u;
+
+  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
+  size_t bytewidth = (bpp + 7u) / 8u;
+  unsigned num_threads = lodepng_thread_count(settings->zlibsettings.num_threads);
+  LodePNGFilterStrategy strategy = filterStrategy(color, settings);
+
+  if(bpp == 0) return 31; /*error: invalid color type*/
+
+  if(num_threads > 1 && h >= 2 * FILTER_BAND_HEIGHT) {
+    /*each row only depends on itself and the row above it in the input, so bands of rows can be done in parallel*/
+    FilterBands bands;
+    unsigned i, error = 0;
+    size_t numbands = (h + FILTER_BAND_HEIGHT - 1) / FILTER_BAND_HEIGHT;
+    bands.out = out;
+    bands.in = in;
+    bands.h = h;
+    bands.linebytes = linebytes;
+    bands.bytewidth = bytewidth;
+    bands.strategy = strategy;
+    bands.settings = settings;
+    bands.errors = (unsigned*)lodepng_scratch_malloc(numbands * sizeof(unsigned));
+    if(!bands.errors) return 83; /*alloc fail*/
+    lodepng_parallel_for(numbands, num_threads, filterBand, &bands);
+    for(i = 0; i != numbands && !error; ++i) error = bands.errors[i];
+    lodepng_scratch_free(bands.errors);
+    return error;
+  }
+  return filterRows(out, in, 0, linebytes, bytewidth, 0, h, strategy, settings);
+}
+
 static void addPaddingBits(unsigned char* out, const unsigned char* in,
                            size_t olinebits, size_t ilinebits, unsigned h) {
   /*The opposite of the removePaddingBits function
@@ -6188,19 +8261,19 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
   if(info_png->interlace_method == 0) {
     /*image size plus an extra byte per scanline + possible padding bits*/
     *outsize = (size_t)h + ((size_t)h * (((size_t)w * bpp + 7u) / 8u));
-    *out = (unsigned char*)lodepng_malloc(*outsize);
+    *out = (unsigned char*)lodepng_scratch_malloc(*outsize);
     if(!(*out) && (*outsize)) error = 83; /*alloc fail*/
 
     if(!error) {
       /*non multiple of 8 bits per scanline, padding bits needed per scanline*/
       if(bpp < 8 && (size_t)w * bpp != (((size_t)w * bpp + 7u) / 8u) * 8u) {
-        unsigned char* padded = (unsigned char*)lodepng_malloc(h * ((w * bpp + 7u) / 8u));
+        unsigned char* padded = (unsigned char*)lodepng_scratch_malloc(h * ((w * bpp + 7u) / 8u));
         if(!padded) error = 83; /*alloc fail*/
         if(!error) {
           addPaddingBits(padded, in, (((size_t)w * bpp + 7u) / 8u) * 8u, (size_t)w * bpp, h);
           error = filter(*out, padded, w, h, &info_png->color, settings);
         }
-        lodepng_free(padded);
+        lodepng_scratch_free(padded);
       } else {
         /*we can immediately filter into the out buffer, no other steps needed*/
         error = filter(*out, in, w, h, &info_png->color, settings);
@@ -6214,10 +8287,10 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
     Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, (unsigned)bpp);
 
     *outsize = filter_passstart[7]; /*image size plus an extra byte per scanline + possible padding bits*/
-    *out = (unsigned char*)lodepng_malloc(*outsize);
+    *out = (unsigned char*)lodepng_scratch_malloc(*outsize);
     if(!(*out)) error = 83; /*alloc fail*/
 
-    adam7 = (unsigned char*)lodepng_malloc(passstart[7]);
+    adam7 = (unsigned char*)lodepng_scratch_malloc(passstart[7]);
     if(!adam7 && passstart[7]) error = 83; /*alloc fail*/
 
     if(!error) {
@@ -6226,13 +8299,13 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
       Adam7_interlace(adam7, in, w, h, (unsigned)bpp);
       for(i = 0; i != 7; ++i) {
         if(bpp < 8) {
-          unsigned char* padded = (unsigned char*)lodepng_malloc(padded_passstart[i + 1] - padded_passstart[i]);
+          unsigned char* padded = (unsigned char*)lodepng_scratch_malloc(padded_passstart[i + 1] - padded_passstart[i]);
           if(!padded) ERROR_BREAK(83); /*alloc fail*/
           addPaddingBits(padded, &adam7[passstart[i]],
                          (((size_t)passw[i] * bpp + 7u) / 8u) * 8u, (size_t)passw[i] * bpp, passh[i]);
           error = filter(&(*out)[filter_passstart[i]], padded,
                          passw[i], passh[i], &info_png->color, settings);
-          lodepng_free(padded);
+          lodepng_scratch_free(padded);
         } else {
           error = filter(&(*out)[filter_passstart[i]], &adam7[padded_passstart[i]],
                          passw[i], passh[i], &info_png->color, settings);
@@ -6242,7 +8315,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
       }
     }
 
-    lodepng_free(adam7);
+    lodepng_scratch_free(adam7);
   }
 
   return error;
@@ -6252,8 +8325,11 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
 static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t datasize) {
   unsigned char* inchunk = data;
   while((size_t)(inchunk - data) < datasize) {
-    CERROR_TRY_RETURN(lodepng_chunk_append(&out->data, &out->size, inchunk));
-    out->allocsize = out->size; /*fix the allocsize again*/
+    size_t length, size;
+    if(lodepng_addofl(lodepng_chunk_length(inchunk), 12, &length)) return 77;
+    if(lodepng_addofl(out->size, length, &size)) return 77;
+    if(!ucvector_resize(out, size)) return 83; /*alloc fail*/
+    lodepng_memcpy(out->data + size - length, inchunk, length);
     inchunk = lodepng_chunk_next(inchunk, data + datasize);
   }
   return 0;
@@ -6278,14 +8354,190 @@ static unsigned isRGBICCProfile(const unsigned char* profile, unsigned size) {
   if(size < 20) return 0;
   return profile[16] == 'R' &&  profile[17] == 'G' &&  profile[18] == 'B' &&  profile[19] == ' ';
 }
+
+/*checks that the ICC profile fits the color type of the PNG, returns error code*/
+static unsigned checkICCProfile(const LodePNGInfo* info, unsigned auto_convert) {
+  if(info->iccp_defined) {
+    unsigned gray_icc = isGrayICCProfile(info->iccp_profile, info->iccp_profile_size);
+    unsigned rgb_icc = isRGBICCProfile(info->iccp_profile, info->iccp_profile_size);
+    unsigned gray_png = info->color.colortype == LCT_GREY || info->color.colortype == LCT_GREY_ALPHA;
+    if(!gray_icc && !rgb_icc) return 100; /* Disallowed profile color type for PNG */
+    if(gray_icc != gray_png) {
+      /*Not allowed to use RGB/RGBA/palette with GRAY ICC profile or vice versa,
+      or in case of auto_convert, it wasn't possible to find appropriate model*/
+      return auto_convert ? 102 : 101;
+    }
+  }
+  return 0;
+}
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-unsigned lodepng_encode(unsigned char** out, size_t* outsize,
-                        const unsigned char* image, unsigned w, unsigned h,
-                        LodePNGState* state) {
+/*checks the encoder settings and the color types of the state, returns error code*/
+static unsigned checkEncodeState(const LodePNGState* state) {
+  const LodePNGInfo* info_png = &state->info_png;
+  unsigned error;
+  if((info_png->color.colortype == LCT_PALETTE || state->encoder.force_palette)
+      && (info_png->color.palettesize == 0 || info_png->color.palettesize > 256)) {
+    /*this error is returned even if auto_convert is enabled and thus encoder could
+    generate the palette by itself: while allowing this could be possible in theory,
+    it may complicate the code or edge cases, and always requiring to give a palette
+    when setting this color type is a simpler contract*/
+    return 68; /*invalid palette size, it is only allowed to be 1-256*/
+  }
+  if(state->encoder.zlibsettings.btype > 2) return 61; /*error: invalid btype*/
+  if(info_png->interlace_method > 1) return 71; /*error: invalid interlace mode*/
+  error = checkColorValidity(info_png->color.colortype, info_png->color.bitdepth);
+  if(error) return error; /*error: invalid color type given*/
+  return checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
+}
+
+/*writes the signature and the chunks before IDAT of the PNG described by info*/
+static unsigned addChunksBeforeIDAT(ucvector* out, unsigned w, unsigned h,
+                                    const LodePNGInfo* info, const LodePNGEncoderSettings* settings) {
+  unsigned error;
+  /*write signature and chunks*/
+  error = writeSignature(out);
+  if(error) return error;
+  /*IHDR*/
+  error = addChunk_IHDR(out, w, h, info->color.colortype, info->color.bitdepth, info->interlace_method);
+  if(error) return error;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*unknown chunks between IHDR and PLTE*/
+  if(info->unknown_chunks_data[0]) {
+    error = addUnknownChunks(out, info->unknown_chunks_data[0], info->unknown_chunks_size[0]);
+    if(error) return error;
+  }
+  /*color profile chunks must come before PLTE */
+  if(info->iccp_defined) {
+    error = addChunk_iCCP(out, info, &settings->zlibsettings);
+    if(error) return error;
+  }
+  if(info->srgb_defined) {
+    error = addChunk_sRGB(out, info);
+    if(error) return error;
+  }
+  if(info->gama_defined) {
+    error = addChunk_gAMA(out, info);
+    if(error) return error;
+  }
+  if(info->chrm_defined) {
+    error = addChunk_cHRM(out, info);
+    if(error) return error;
+  }
+  if(info->sbit_defined) {
+    error = addChunk_sBIT(out, info);
+    if(error) return error;
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  /*PLTE*/
+  if(info->color.colortype == LCT_PALETTE) {
+    error = addChunk_PLTE(out, &info->color);
+    if(error) return error;
+  }
+  if(settings->force_palette && (info->color.colortype == LCT_RGB || info->color.colortype == LCT_RGBA)) {
+    /*force_palette means: write suggested palette for truecolor in PLTE chunk*/
+    error = addChunk_PLTE(out, &info->color);
+    if(error) return error;
+  }
+  /*tRNS (this will only add if when necessary) */
+  error = addChunk_tRNS(out, &info->color);
+  if(error) return error;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*bKGD (must come between PLTE and the IDAt chunks*/
+  if(info->background_defined) {
+    error = addChunk_bKGD(out, info);
+    if(error) return error;
+  }
+  /*pHYs (must come before the IDAT chunks)*/
+  if(info->phys_defined) {
+    error = addChunk_pHYs(out, info);
+    if(error) return error;
+  }
+
+  /*unknown chunks between PLTE and IDAT*/
+  if(info->unknown_chunks_data[1]) {
+    error = addUnknownChunks(out, info->unknown_chunks_data[1], info->unknown_chunks_size[1]);
+    if(error) return error;
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  return 0;
+}
+
+/*writes the chunks after IDAT, up to and including IEND*/
+static unsigned addChunksAfterIDAT(ucvector* out, const LodePNGInfo* info, const LodePNGEncoderSettings* settings) {
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  size_t i;
+  unsigned error;
+  /*tIME*/
+  if(info->time_defined) {
+    error = addChunk_tIME(out, &info->time);
+    if(error) return error;
+  }
+  /*tEXt and/or zTXt*/
+  for(i = 0; i != info->text_num; ++i) {
+    if(lodepng_strlen(info->text_keys[i]) > 79) {
+      return 66; /*text chunk too large*/
+    }
+    if(lodepng_strlen(info->text_keys[i]) < 1) {
+      return 67; /*text chunk too small*/
+    }
+    if(settings->text_compression) {
+      error = addChunk_zTXt(out, info->text_keys[i], info->text_strings[i], &settings->zlibsettings);
+      if(error) return error;
+    } else {
+      error = addChunk_tEXt(out, info->text_keys[i], info->text_strings[i]);
+      if(error) return error;
+    }
+  }
+  /*LodePNG version id in text chunk*/
+  if(settings->add_id) {
+    unsigned already_added_id_text = 0;
+    for(i = 0; i != info->text_num; ++i) {
+      const char* k = info->text_keys[i];
+      /* Could use strcmp, but we're not calling or reimplementing this C library function for this use only */
+      if(k[0] == 'L' && k[1] == 'o' && k[2] == 'd' && k[3] == 'e' &&
+         k[4] == 'P' && k[5] == 'N' && k[6] == 'G' && k[7] == '\0') {
+        already_added_id_text = 1;
+        break;
+      }
+    }
+    if(already_added_id_text == 0) {
+      error = addChunk_tEXt(out, "LodePNG", LODEPNG_VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
+      if(error) return error;
+    }
+  }
+  /*iTXt*/
+  for(i = 0; i != info->itext_num; ++i) {
+    if(lodepng_strlen(info->itext_keys[i]) > 79) {
+      return 66; /*text chunk too large*/
+    }
+    if(lodepng_strlen(info->itext_keys[i]) < 1) {
+      return 67; /*text chunk too small*/
+    }
+    error = addChunk_iTXt(
+        out, settings->text_compression,
+        info->itext_keys[i], info->itext_langtags[i], info->itext_transkeys[i], info->itext_strings[i],
+        &settings->zlibsettings);
+    if(error) return error;
+  }
+
+  /*unknown chunks between IDAT and IEND*/
+  if(info->unknown_chunks_data[2]) {
+    error = addUnknownChunks(out, info->unknown_chunks_data[2], info->unknown_chunks_size[2]);
+    if(error) return error;
+  }
+#else /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  (void)info;
+  (void)settings;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  return addChunk_IEND(out);
+}
+
+/*appends the PNG file to outv*/
+static unsigned encodeInto(ucvector* outv, const unsigned char* image, unsigned w, unsigned h,
+                           LodePNGState* state) {
   unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
   size_t datasize = 0;
-  ucvector outv = ucvector_init(NULL, 0);
   LodePNGInfo info;
   const LodePNGInfo* info_png = &state->info_png;
   LodePNGColorMode auto_color;
@@ -6293,36 +8545,14 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   lodepng_info_init(&info);
   lodepng_color_mode_init(&auto_color);
 
-  /*provide some proper output values if error will happen*/
-  *out = 0;
-  *outsize = 0;
   state->error = 0;
 
   /*check input values validity*/
-  if((info_png->color.colortype == LCT_PALETTE || state->encoder.force_palette)
-      && (info_png->color.palettesize == 0 || info_png->color.palettesize > 256)) {
-    /*this error is returned even if auto_convert is enabled and thus encoder could
-    generate the palette by itself: while allowing this could be possible in theory,
-    it may complicate the code or edge cases, and always requiring to give a palette
-    when setting this color type is a simpler contract*/
-    state->error = 68; /*invalid palette size, it is only allowed to be 1-256*/
-    goto cleanup;
-  }
-  if(state->encoder.zlibsettings.btype > 2) {
-    state->error = 61; /*error: invalid btype*/
-    goto cleanup;
-  }
-  if(info_png->interlace_method > 1) {
-    state->error = 71; /*error: invalid interlace mode*/
-    goto cleanup;
-  }
-  state->error = checkColorValidity(info_png->color.colortype, info_png->color.bitdepth);
-  if(state->error) goto cleanup; /*error: invalid color type given*/
-  state->error = checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
-  if(state->error) goto cleanup; /*error: invalid color type given*/
+  state->error = checkEncodeState(state);
+  if(state->error) goto cleanup;
 
   /* color convert and compute scanline filter types */
-  lodepng_info_copy(&info, &state->info_png);
+  lodepng_info_copy(&info, info_png);
   if(state->encoder.auto_convert) {
     LodePNGColorStats stats;
     unsigned allow_convert = 1;
@@ -6428,27 +8658,14 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     }
   }
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-  if(info_png->iccp_defined) {
-    unsigned gray_icc = isGrayICCProfile(info_png->iccp_profile, info_png->iccp_profile_size);
-    unsigned rgb_icc = isRGBICCProfile(info_png->iccp_profile, info_png->iccp_profile_size);
-    unsigned gray_png = info.color.colortype == LCT_GREY || info.color.colortype == LCT_GREY_ALPHA;
-    if(!gray_icc && !rgb_icc) {
-      state->error = 100; /* Disallowed profile color type for PNG */
-      goto cleanup;
-    }
-    if(gray_icc != gray_png) {
-      /*Not allowed to use RGB/RGBA/palette with GRAY ICC profile or vice versa,
-      or in case of auto_convert, it wasn't possible to find appropriate model*/
-      state->error = state->encoder.auto_convert ? 102 : 101;
-      goto cleanup;
-    }
-  }
+  state->error = checkICCProfile(&info, state->encoder.auto_convert);
+  if(state->error) goto cleanup;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
   if(!lodepng_color_mode_equal(&state->info_raw, &info.color)) {
     unsigned char* converted;
     size_t size = ((size_t)w * (size_t)h * (size_t)lodepng_get_bpp(&info.color) + 7u) / 8u;
 
-    converted = (unsigned char*)lodepng_malloc(size);
+    converted = (unsigned char*)lodepng_scratch_malloc(size);
     if(!converted && size) state->error = 83; /*alloc fail*/
     if(!state->error) {
       state->error = lodepng_convert(converted, image, &info.color, &state->info_raw, w, h);
@@ -6456,164 +8673,286 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     if(!state->error) {
       state->error = preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder);
     }
-    lodepng_free(converted);
+    lodepng_scratch_free(converted);
     if(state->error) goto cleanup;
   } else {
     state->error = preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder);
     if(state->error) goto cleanup;
   }
 
-  /* output all PNG chunks */ {
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    size_t i;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*write signature and chunks*/
-    state->error = writeSignature(&outv);
-    if(state->error) goto cleanup;
-    /*IHDR*/
-    state->error = addChunk_IHDR(&outv, w, h, info.color.colortype, info.color.bitdepth, info.interlace_method);
-    if(state->error) goto cleanup;
+  /* output all PNG chunks */
+  state->error = addChunksBeforeIDAT(outv, w, h, &info, &state->encoder);
+  if(state->error) goto cleanup;
+  /*IDAT (multiple IDAT chunks must be consecutive)*/
+  state->error = addChunk_IDAT(outv, data, datasize, &state->encoder.zlibsettings);
+  if(state->error) goto cleanup;
+  state->error = addChunksAfterIDAT(outv, &info, &state->encoder);
+
+cleanup:
+  lodepng_info_cleanup(&info);
+  lodepng_scratch_free(data);
+  lodepng_color_mode_cleanup(&auto_color);
+
+  return state->error;
+}
+
+unsigned lodepng_encode(unsigned char** out, size_t* outsize,
+                        const unsigned char* image, unsigned w, unsigned h,
+                        LodePNGState* state) {
+  ucvector outv = ucvector_init(NULL, 0);
+  encodeInto(&outv, image, w, h, state);
+  /*instead of cleaning the vector up, give it to the output*/
+  *out = outv.data;
+  *outsize = outv.size;
+  return state->error;
+}
+
+#ifdef LODEPNG_COMPILE_STREAMING
+struct LodePNGStreamEncoder {
+  LodePNGState* state;
+  LodePNGWriteCallback callback;
+  void* user;
+  unsigned w, h;
+  unsigned y; /*the rows given so far*/
+  LodePNGInfo info; /*the info_png of the state, as it is written*/
+  unsigned buffered; /*Adam7 or custom zlib functions, which can't stream: the image is encoded at the end*/
+  unsigned bpp; /*bits per pixel of the PNG*/
+  size_t linebytes; /*bytes of a scanline of the PNG, without the filter type*/
+  LodePNGFilterStrategy strategy;
+  unsigned char* line; /*the current row in the color type of the PNG*/
+  unsigned char* prevline; /*the previous one, for the filters that look up*/
+  unsigned char* image; /*buffered only: the image in the color type of the PNG*/
+  ucvector out; /*bytes of the file that are not given to the callback yet*/
+#ifdef LODEPNG_COMPILE_ZLIB
+  ucvector filtered; /*the filtered scanlines, after the last 32768 bytes of those deflated before*/
+  size_t start; /*the filtered scanlines from here on are not deflated yet*/
+  size_t partsize; /*filtered bytes per IDAT chunk*/
+  size_t blocksize; /*deflate block size within an IDAT chunk*/
+  unsigned adler; /*adler32 of the filtered scanlines deflated so far*/
+  ucvector zlib; /*the zlib data of the next IDAT chunk*/
+#endif /*LODEPNG_COMPILE_ZLIB*/
+};
+
+/*gives the bytes in out to the callback*/
+static unsigned streamWrite(LodePNGStreamEncoder* encoder) {
+  unsigned error = 0;
+  if(encoder->out.size) error = encoder->callback(encoder->user, encoder->out.data, encoder->out.size);
+  encoder->out.size = 0;
+  return error;
+}
+
+/*checks the state and writes the chunks before IDAT*/
+static unsigned streamEncodeStart(LodePNGStreamEncoder* encoder) {
+  LodePNGState* state = encoder->state;
+  const LodePNGCompressSettings* zlibsettings = &state->encoder.zlibsettings;
+  unsigned error = checkEncodeState(state);
+  if(error) return error;
+  error = lodepng_info_copy(&encoder->info, &state->info_png);
+  if(error) return error;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*unknown chunks between IHDR and PLTE*/
-    if(info.unknown_chunks_data[0]) {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[0], info.unknown_chunks_size[0]);
-      if(state->error) goto cleanup;
-    }
-    /*color profile chunks must come before PLTE */
-    if(info.iccp_defined) {
-      state->error = addChunk_iCCP(&outv, &info, &state->encoder.zlibsettings);
-      if(state->error) goto cleanup;
-    }
-    if(info.srgb_defined) {
-      state->error = addChunk_sRGB(&outv, &info);
-      if(state->error) goto cleanup;
-    }
-    if(info.gama_defined) {
-      state->error = addChunk_gAMA(&outv, &info);
-      if(state->error) goto cleanup;
-    }
-    if(info.chrm_defined) {
-      state->error = addChunk_cHRM(&outv, &info);
-      if(state->error) goto cleanup;
-    }
-    if(info_png->sbit_defined) {
-      state->error = addChunk_sBIT(&outv, &info);
-      if(state->error) goto cleanup;
-    }
+  /*auto_convert needs all pixels to choose the color type, so the stream is always written as info_png says*/
+  error = checkICCProfile(&encoder->info, 0);
+  if(error) return error;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*PLTE*/
-    if(info.color.colortype == LCT_PALETTE) {
-      state->error = addChunk_PLTE(&outv, &info.color);
-      if(state->error) goto cleanup;
-    }
-    if(state->encoder.force_palette && (info.color.colortype == LCT_RGB || info.color.colortype == LCT_RGBA)) {
-      /*force_palette means: write suggested palette for truecolor in PLTE chunk*/
-      state->error = addChunk_PLTE(&outv, &info.color);
-      if(state->error) goto cleanup;
-    }
-    /*tRNS (this will only add if when necessary) */
-    state->error = addChunk_tRNS(&outv, &info.color);
-    if(state->error) goto cleanup;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*bKGD (must come between PLTE and the IDAt chunks*/
-    if(info.background_defined) {
-      state->error = addChunk_bKGD(&outv, &info);
-      if(state->error) goto cleanup;
-    }
-    /*pHYs (must come before the IDAT chunks)*/
-    if(info.phys_defined) {
-      state->error = addChunk_pHYs(&outv, &info);
-      if(state->error) goto cleanup;
-    }
 
-    /*unknown chunks between PLTE and IDAT*/
-    if(info.unknown_chunks_data[1]) {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[1], info.unknown_chunks_size[1]);
-      if(state->error) goto cleanup;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*IDAT (multiple IDAT chunks must be consecutive)*/
-    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
-    if(state->error) goto cleanup;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*tIME*/
-    if(info.time_defined) {
-      state->error = addChunk_tIME(&outv, &info.time);
-      if(state->error) goto cleanup;
-    }
-    /*tEXt and/or zTXt*/
-    for(i = 0; i != info.text_num; ++i) {
-      if(lodepng_strlen(info.text_keys[i]) > 79) {
-        state->error = 66; /*text chunk too large*/
-        goto cleanup;
-      }
-      if(lodepng_strlen(info.text_keys[i]) < 1) {
-        state->error = 67; /*text chunk too small*/
-        goto cleanup;
-      }
-      if(state->encoder.text_compression) {
-        state->error = addChunk_zTXt(&outv, info.text_keys[i], info.text_strings[i], &state->encoder.zlibsettings);
-        if(state->error) goto cleanup;
-      } else {
-        state->error = addChunk_tEXt(&outv, info.text_keys[i], info.text_strings[i]);
-        if(state->error) goto cleanup;
-      }
-    }
-    /*LodePNG version id in text chunk*/
-    if(state->encoder.add_id) {
-      unsigned already_added_id_text = 0;
-      for(i = 0; i != info.text_num; ++i) {
-        const char* k = info.text_keys[i];
-        /* Could use strcmp, but we're not calling or reimplementing this C library function for this use only */
-        if(k[0] == 'L' && k[1] == 'o' && k[2] == 'd' && k[3] == 'e' &&
-           k[4] == 'P' && k[5] == 'N' && k[6] == 'G' && k[7] == '\0') {
-          already_added_id_text = 1;
-          break;
-        }
-      }
-      if(already_added_id_text == 0) {
-        state->error = addChunk_tEXt(&outv, "LodePNG", LODEPNG_VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
-        if(state->error) goto cleanup;
-      }
-    }
-    /*iTXt*/
-    for(i = 0; i != info.itext_num; ++i) {
-      if(lodepng_strlen(info.itext_keys[i]) > 79) {
-        state->error = 66; /*text chunk too large*/
-        goto cleanup;
-      }
-      if(lodepng_strlen(info.itext_keys[i]) < 1) {
-        state->error = 67; /*text chunk too small*/
-        goto cleanup;
+  encoder->bpp = lodepng_get_bpp(&encoder->info.color);
+  encoder->linebytes = lodepng_get_raw_size_idat(encoder->w, 1, encoder->bpp) - 1u;
+  encoder->strategy = filterStrategy(&encoder->info.color, &state->encoder);
+  encoder->line = (unsigned char*)lodepng_malloc(encoder->linebytes);
+  encoder->prevline = (unsigned char*)lodepng_malloc(encoder->linebytes);
+  if(!encoder->line || !encoder->prevline) return 83; /*alloc fail*/
+#ifdef LODEPNG_COMPILE_ZLIB
+  encoder->buffered = encoder->info.interlace_method != 0 || zlibsettings->custom_zlib || zlibsettings->custom_deflate;
+#else /*LODEPNG_COMPILE_ZLIB*/
+  encoder->buffered = 1;
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+  if(encoder->buffered) {
+    size_t size = lodepng_get_raw_size(encoder->w, encoder->h, &encoder->info.color);
+    encoder->image = (unsigned char*)lodepng_malloc(size);
+    if(!encoder->image && size) return 83; /*alloc fail*/
+  }
+#ifdef LODEPNG_COMPILE_ZLIB
+  else {
+    /*with btype 1 or 2, the parts are those of a parallel lodepng_zlib_compress, so the result is the same*/
+    size_t blocksize = deflateBlockSize(lodepng_get_raw_size_idat(encoder->w, encoder->h, encoder->bpp),
+                                        zlibsettings->btype);
+    if(zlibsettings->btype != 0) error = checkWindowSize(zlibsettings);
+    if(error) return error;
+    encoder->partsize = deflatePartSize(blocksize, zlibsettings->btype);
+    encoder->blocksize = LODEPNG_MIN(blocksize, encoder->partsize);
+    /*the zlib header as lodepng_zlib_compress writes it: CM 8, CINFO 7, no FDICT and FLEVEL, FCHECK*/
+    if(!ucvector_resize(&encoder->zlib, 2)) return 83; /*alloc fail*/
+    encoder->zlib.data[0] = 120;
+    encoder->zlib.data[1] = 1;
+  }
+#else /*LODEPNG_COMPILE_ZLIB*/
+  (void)zlibsettings;
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+  error = addChunksBeforeIDAT(&encoder->out, encoder->w, encoder->h, &encoder->info, &state->encoder);
+  if(!error) error = streamWrite(encoder);
+  return error;
+}
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*deflates the next part of the filtered scanlines, or all the rest if final, and writes it as an IDAT chunk.
+Unless final, the deflate stream ends byte aligned so that the next IDAT chunk can continue it.*/
+static unsigned streamDeflate(LodePNGStreamEncoder* encoder, unsigned final) {
+  const LodePNGCompressSettings* settings = &encoder->state->encoder.zlibsettings;
+  ucvector* filtered = &encoder->filtered;
+  size_t end = final ? filtered->size : encoder->start + encoder->partsize;
+  size_t keep;
+  unsigned error;
+
+  encoder->adler = update_adler32(encoder->adler, filtered->data + encoder->start, (unsigned)(end - encoder->start));
+  if(settings->btype == 0) {
+    error = deflateNoCompression(&encoder->zlib, filtered->data + encoder->start, end - encoder->start, final);
+  } else {
+    error = deflatePart(&encoder->zlib, filtered->data, encoder->start, end, encoder->blocksize, settings, final);
+  }
+  if(!error && final) {
+    if(!ucvector_resize(&encoder->zlib, encoder->zlib.size + 4)) return 83; /*alloc fail*/
+    lodepng_set32bitInt(encoder->zlib.data + encoder->zlib.size - 4, encoder->adler);
+  }
+  if(!error) error = lodepng_chunk_createv(&encoder->out, encoder->zlib.size, "IDAT", encoder->zlib.data);
+  if(!error) error = streamWrite(encoder);
+  encoder->zlib.size = 0;
+
+  /*of the deflated bytes, only the window for the backward distances of the next part is kept*/
+  keep = LODEPNG_MIN(end, 32768);
+  lodepng_memmove_down(filtered->data, filtered->data + end - keep, filtered->size - end + keep);
+  filtered->size -= end - keep;
+  encoder->start = keep;
+  return error;
+}
+
+/*filters the current row, and deflates the filtered scanlines in parts of partsize bytes*/
+static unsigned streamFilter(LodePNGStreamEncoder* encoder) {
+  ucvector* filtered = &encoder->filtered;
+  size_t pos = filtered->size;
+  unsigned char* swap;
+  unsigned error;
+
+  if(!ucvector_resize(filtered, pos + 1u + encoder->linebytes)) return 83; /*alloc fail*/
+  error = filterRows(filtered->data + pos, encoder->line, encoder->y ? encoder->prevline : 0, encoder->linebytes,
+                     (encoder->bpp + 7u) / 8u, encoder->y, encoder->y + 1, encoder->strategy,
+                     &encoder->state->encoder);
+  swap = encoder->line;
+  encoder->line = encoder->prevline;
+  encoder->prevline = swap;
+
+  /*the last part, which may be a whole one, is left for lodepng_stream_encoder_finish to end the zlib stream*/
+  while(!error && filtered->size - encoder->start > encoder->partsize) error = streamDeflate(encoder, 0);
+  return error;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+LodePNGStreamEncoder* lodepng_stream_encoder_new(LodePNGState* state, unsigned w, unsigned h,
+                                                 LodePNGWriteCallback callback, void* user) {
+  LodePNGStreamEncoder* encoder = (LodePNGStreamEncoder*)lodepng_malloc(sizeof(LodePNGStreamEncoder));
+  if(!encoder) return 0;
+  lodepng_memset(encoder, 0, sizeof(LodePNGStreamEncoder));
+  encoder->state = state;
+  encoder->callback = callback;
+  encoder->user = user;
+  encoder->w = w;
+  encoder->h = h;
+  lodepng_info_init(&encoder->info);
+  encoder->out = ucvector_init(NULL, 0);
+#ifdef LODEPNG_COMPILE_ZLIB
+  encoder->filtered = ucvector_init(NULL, 0);
+  encoder->zlib = ucvector_init(NULL, 0);
+  encoder->adler = 1u;
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  state->error = streamEncodeStart(encoder);
+  return encoder;
+}
+
+unsigned lodepng_stream_encoder_push(LodePNGStreamEncoder* encoder, const unsigned char* row) {
+  LodePNGState* state = encoder->state;
+  size_t linebits = (size_t)encoder->w * encoder->bpp;
+  if(state->error) return state->error;
+  if(encoder->y == encoder->h) {
+    state->error = 116; /*error: more rows than the height of the image*/
+    return state->error;
+  }
+
+  if(lodepng_color_mode_equal(&state->info_raw, &encoder->info.color)) {
+    lodepng_memcpy(encoder->line, row, encoder->linebytes);
+  } else {
+    state->error = lodepng_convert(encoder->line, row, &encoder->info.color, &state->info_raw, encoder->w, 1);
+    if(state->error) return state->error;
+  }
+  /*zero padding bits after the last pixel, like addPaddingBits*/
+  if(linebits & 7u) encoder->line[encoder->linebytes - 1u] &= (unsigned char)(255u << (8u - (linebits & 7u)));
+
+  if(encoder->buffered) {
+    /*the rows of the image have no padding bits in between*/
+    if(linebits & 7u) {
+      size_t x, ibp = 0, obp = encoder->y * linebits;
+      for(x = 0; x != linebits; ++x) {
+        setBitOfReversedStream(&obp, encoder->image, readBitFromReversedStream(&ibp, encoder->line));
       }
-      state->error = addChunk_iTXt(
-          &outv, state->encoder.text_compression,
-          info.itext_keys[i], info.itext_langtags[i], info.itext_transkeys[i], info.itext_strings[i],
-          &state->encoder.zlibsettings);
-      if(state->error) goto cleanup;
+    } else {
+      lodepng_memcpy(encoder->image + encoder->y * encoder->linebytes, encoder->line, encoder->linebytes);
     }
+  }
+#ifdef LODEPNG_COMPILE_ZLIB
+  else state->error = streamFilter(encoder);
+#endif /*LODEPNG_COMPILE_ZLIB*/
 
-    /*unknown chunks between IDAT and IEND*/
-    if(info.unknown_chunks_data[2]) {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[2], info.unknown_chunks_size[2]);
-      if(state->error) goto cleanup;
+  ++encoder->y;
+  return state->error;
+}
+
+unsigned lodepng_stream_encoder_finish(LodePNGStreamEncoder* encoder) {
+  LodePNGState* state = encoder->state;
+  if(state->error) return state->error;
+  if(encoder->y != encoder->h) {
+    state->error = 116; /*error: fewer rows than the height of the image*/
+    return state->error;
+  }
+
+  if(encoder->buffered) {
+    unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
+    size_t datasize = 0;
+    state->error = preProcessScanlines(&data, &datasize, encoder->image, encoder->w, encoder->h,
+                                       &encoder->info, &state->encoder);
+    if(!state->error) {
+      state->error = addChunk_IDAT(&encoder->out, data, datasize, &state->encoder.zlibsettings);
     }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    state->error = addChunk_IEND(&outv);
-    if(state->error) goto cleanup;
+    lodepng_scratch_free(data);
   }
+#ifdef LODEPNG_COMPILE_ZLIB
+  else state->error = streamDeflate(encoder, 1);
+#endif /*LODEPNG_COMPILE_ZLIB*/
 
-cleanup:
-  lodepng_info_cleanup(&info);
-  lodepng_free(data);
-  lodepng_color_mode_cleanup(&auto_color);
+  if(!state->error) state->error = addChunksAfterIDAT(&encoder->out, &encoder->info, &state->encoder);
+  if(!state->error) state->error = streamWrite(encoder);
+  return state->error;
+}
 
-  /*instead of cleaning the vector up, give it to the output*/
-  *out = outv.data;
-  *outsize = outv.size;
+void lodepng_stream_encoder_delete(LodePNGStreamEncoder* encoder) {
+  if(!encoder) return;
+  lodepng_info_cleanup(&encoder->info);
+  lodepng_scratch_free(encoder->line);
+  lodepng_scratch_free(encoder->prevline);
+  lodepng_scratch_free(encoder->image);
+  lodepng_scratch_free(encoder->out.data);
+#ifdef LODEPNG_COMPILE_ZLIB
+  lodepng_scratch_free(encoder->filtered.data);
+  lodepng_scratch_free(encoder->zlib.data);
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  lodepng_scratch_free(encoder);
+}
 
-  return state->error;
+#ifdef LODEPNG_COMPILE_DISK
+unsigned lodepng_stream_write_file(void* file, const unsigned char* data, size_t size) {
+  return fwrite(data, 1, size, (FILE*)file) == size ? 0 : 79;
 }
+#endif /*LODEPNG_COMPILE_DISK*/
+#endif /*LODEPNG_COMPILE_STREAMING*/
 
 unsigned lodepng_encode_memory(unsigned char** out, size_t* outsize, const unsigned char* image,
                                unsigned w, unsigned h, LodePNGColorType colortype, unsigned bitdepth) {
@@ -6645,7 +8984,7 @@ unsigned lodepng_encode_file(const char* filename, const unsigned char* image, u
   size_t buffersize;
   unsigned error = lodepng_encode_memory(&buffer, &buffersize, image, w, h, colortype, bitdepth);
   if(!error) error = lodepng_save_file(buffer, buffersize, filename);
-  lodepng_free(buffer);
+  lodepng_scratch_free(buffer);
   return error;
 }
 
@@ -6672,6 +9011,69 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings) {
 }
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
+
+#if defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)
+struct LodePNGContext {
+#ifdef LODEPNG_THREAD_LOCAL
+  LodePNGArena arena; /*scratch memory of the calls*/
+#endif /*LODEPNG_THREAD_LOCAL*/
+  ucvector png; /*the file of the last encode, its memory is reused by the next*/
+};
+
+/*makes the arena of the context the one of this thread, returns the previous one*/
+static LodePNGArena* contextBegin(LodePNGContext* context) {
+#ifdef LODEPNG_THREAD_LOCAL
+  return lodepng_arena_set(&context->arena);
+#else /*LODEPNG_THREAD_LOCAL*/
+  (void)context;
+  return lodepng_arena_set(0);
+#endif /*LODEPNG_THREAD_LOCAL*/
+}
+
+LodePNGContext* lodepng_context_new(void) {
+  LodePNGContext* context = (LodePNGContext*)lodepng_malloc(sizeof(LodePNGContext));
+  if(!context) return 0;
+#ifdef LODEPNG_THREAD_LOCAL
+  arena_init(&context->arena);
+#endif /*LODEPNG_THREAD_LOCAL*/
+  context->png = ucvector_init(NULL, 0);
+  return context;
+}
+
+void lodepng_context_delete(LodePNGContext* context) {
+  if(!context) return;
+#ifdef LODEPNG_THREAD_LOCAL
+  arena_cleanup(&context->arena); /*the output is a block of the arena too*/
+#else /*LODEPNG_THREAD_LOCAL*/
+  lodepng_free(context->png.data);
+#endif /*LODEPNG_THREAD_LOCAL*/
+  lodepng_free(context);
+}
+
+#ifdef LODEPNG_COMPILE_DECODER
+unsigned lodepng_context_decode(LodePNGContext* context, unsigned char* out, size_t outsize,
+                                unsigned* w, unsigned* h, LodePNGState* state,
+                                const unsigned char* in, size_t insize) {
+  LodePNGArena* previous = contextBegin(context);
+  unsigned error = lodepng_decode_into(out, outsize, w, h, state, in, insize);
+  lodepng_arena_set(previous);
+  return error;
+}
+#endif /*LODEPNG_COMPILE_DECODER*/
+
+#ifdef LODEPNG_COMPILE_ENCODER
+unsigned lodepng_context_encode(LodePNGContext* context, const unsigned char** out, size_t* outsize,
+                                const unsigned char* image, unsigned w, unsigned h, LodePNGState* state) {
+  LodePNGArena* previous = contextBegin(context);
+  context->png.size = 0;
+  encodeInto(&context->png, image, w, h, state);
+  lodepng_arena_set(previous);
+  *out = state->error ? 0 : context->png.data;
+  *outsize = state->error ? 0 : context->png.size;
+  return state->error;
+}
+#endif /*LODEPNG_COMPILE_ENCODER*/
+#endif /*defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)*/
 #endif /*LODEPNG_COMPILE_PNG*/
 
 #ifdef LODEPNG_COMPILE_ERROR_TEXT
@@ -6803,6 +9205,8 @@ const char* lodepng_error_text(unsigned code) {
     case 113: return "ICC profile unreasonably large";
     case 114: return "sBIT chunk has wrong size for the color type of the image";
     case 115: return "sBIT value out of range";
+    case 116: return "streaming encoder got more or fewer rows than the height of the image";
+    case 117: return "output buffer given to the decoder is smaller than the decoded image";
   }
   return "unknown error code";
 }
@@ -6896,17 +9300,15 @@ State& State::operator=(const State& other) {
 
 unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h, const unsigned char* in,
                 size_t insize, LodePNGColorType colortype, unsigned bitdepth) {
-  unsigned char* buffer = 0;
-  unsigned error = lodepng_decode_memory(&buffer, &w, &h, in, insize, colortype, bitdepth);
-  if(buffer && !error) {
-    State state;
-    state.info_raw.colortype = colortype;
-    state.info_raw.bitdepth = bitdepth;
-    size_t buffersize = lodepng_get_raw_size(w, h, &state.info_raw);
-    out.insert(out.end(), buffer, &buffer[buffersize]);
-  }
-  lodepng_free(buffer);
-  return error;
+  State state;
+  state.info_raw.colortype = colortype;
+  state.info_raw.bitdepth = bitdepth;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*disable reading things that this function doesn't output*/
+  state.decoder.read_text_chunks = 0;
+  state.decoder.remember_unknown_chunks = 0;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  return decode(out, w, h, state, in, insize);
 }
 
 unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
@@ -6914,16 +9316,21 @@ unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
   return decode(out, w, h, in.empty() ? 0 : &in[0], (unsigned)in.size(), colortype, bitdepth);
 }
 
+/*get_out of decodeInto: the image is decoded straight into the end of the vector*/
+static unsigned decodeAppend(unsigned char** out, size_t size, void* user) {
+  std::vector<unsigned char>& buffer = *(std::vector<unsigned char>*)user;
+  size_t start = buffer.size();
+  buffer.resize(start + size);
+  *out = &buffer[start];
+  return 0;
+}
+
 unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
                 State& state,
                 const unsigned char* in, size_t insize) {
-  unsigned char* buffer = NULL;
-  unsigned error = lodepng_decode(&buffer, &w, &h, &state, in, insize);
-  if(buffer && !error) {
-    size_t buffersize = lodepng_get_raw_size(w, h, &state.info_raw);
-    out.insert(out.end(), buffer, &buffer[buffersize]);
-  }
-  lodepng_free(buffer);
+  size_t start = out.size();
+  unsigned error = decodeInto(&w, &h, &state, in, insize, decodeAppend, &out);
+  if(error) out.resize(start);
   return error;
 }
 
@@ -6936,12 +9343,14 @@ unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
 #ifdef LODEPNG_COMPILE_DISK
 unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h, const std::string& filename,
                 LodePNGColorType colortype, unsigned bitdepth) {
-  std::vector<unsigned char> buffer;
+  const unsigned char* buffer = 0;
+  size_t buffersize;
   /* safe output values in case error happens */
   w = h = 0;
-  unsigned error = load_file(buffer, filename);
-  if(error) return error;
-  return decode(out, w, h, buffer, colortype, bitdepth);
+  unsigned error = lodepng_map_file(&buffer, &buffersize, filename.c_str());
+  if(!error) error = decode(out, w, h, buffer, buffersize, colortype, bitdepth);
+  lodepng_unmap_file(buffer, buffersize);
+  return error;
 }
 #endif /* LODEPNG_COMPILE_DECODER */
 #endif /* LODEPNG_COMPILE_DISK */
@@ -70,8 +70,8 @@ public:
 class Spline {
 	std::vector<vec3> ctrlPoints;
 	std::vector<vec3> crvPoints;
-	unsigned int vaoCurve, vboCurve;
-	unsigned int vaoCtrl, vboCtrl;
+	unsigned int vaoCurve, vaoCtrl;
+	StreamingBuffer<vec3> streamCurve, streamCtrl;
 
 	vec3 hermite(const glm::vec3& p0, const glm::vec3& v0, const glm::vec3& p1, const glm::vec3& v1, float t) {
 		float t2 = t * t;
@@ -99,24 +99,20 @@ public:
 		// Curve VAO and VBO
 		glGenVertexArrays(1, &vaoCurve);
 		glBindVertexArray(vaoCurve);
-		glGenBuffers(1, &vboCurve);
-		glBindBuffer(GL_ARRAY_BUFFER, vboCurve);
+		glBindBuffer(GL_ARRAY_BUFFER, streamCurve.Buffer());
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
 
 		// Control points VAO and VBO
 		glGenVertexArrays(1, &vaoCtrl);
 		glBindVertexArray(vaoCtrl);
-		glGenBuffers(1, &vboCtrl);
-		glBindBuffer(GL_ARRAY_BUFFER, vboCtrl);
+		glBindBuffer(GL_ARRAY_BUFFER, streamCtrl.Buffer());
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
 	}
 
 	~Spline() {
-		glDeleteBuffers(1, &vboCurve);
 		glDeleteVertexArrays(1, &vaoCurve);
-		glDeleteBuffers(1, &vboCtrl);
 		glDeleteVertexArrays(1, &vaoCtrl);
 	}
 
@@ -239,12 +235,13 @@ public:
 		return length(ddt) / len;
 	}
 
+	// Only the changed part of the curve and the new control point are uploaded
 	void updateGPU() {
-		glBindBuffer(GL_ARRAY_BUFFER, vboCurve);
-		glBufferData(GL_ARRAY_BUFFER, crvPoints.size() * sizeof(vec3), crvPoints.data(), GL_DYNAMIC_DRAW);
+		glBindVertexArray(vaoCurve);
+		if (streamCurve.Update(crvPoints)) streamCurve.AttribPointer(0, 3);
 
-		glBindBuffer(GL_ARRAY_BUFFER, vboCtrl);
-		glBufferData(GL_ARRAY_BUFFER, ctrlPoints.size() * sizeof(vec3), ctrlPoints.data(), GL_DYNAMIC_DRAW);
+		glBindVertexArray(vaoCtrl);
+		if (streamCtrl.Update(ctrlPoints)) streamCtrl.AttribPointer(0, 3);
 	}
 
 	void Draw(GPUProgram* prog) {
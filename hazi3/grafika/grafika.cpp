@@ -374,6 +374,7 @@ public:
 
 	// Inicializáció, 
 	void onInitialization() {
+		setLoopPolicy(LOOP_WAIT_EVENTS); // csak bemenetre rajzol újra
 		gpuProgram = new GPUProgram(vertSource, fragSource);
 		
 		glPointSize(pointSize);
@@ -10,8 +10,15 @@
 #include <math.h>
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <cstring>
+#include <chrono>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE2			// x86-64-en mindig van
+#endif
 
 #define FILE_OPERATIONS
 #ifdef FILE_OPERATIONS
@@ -22,7 +29,12 @@ namespace fs = std::filesystem;
 #else
 namespace fs = std::experimental::filesystem;
 #endif
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 #include "lodepng.h"
+#define SHADER_BINARY_CACHE		// a linkelt rnyal programok binrisa a futtathat llomny mell kerl
 #endif
 
 using namespace glm;
@@ -31,11 +43,27 @@ inline mat4 translate(const vec3& v) { return translate(mat4(1.0f), v); }
 inline mat4 scale(const vec3& v) { return scale(mat4(1.0f), v); }
 inline mat4 rotate(float angle, const vec3& v) { return rotate(mat4(1.0f), angle, v); }
 
+// Az aktulis kontextus tmogatja-e a kiterjesztst (a glad csak a core verzikat tlti be)
+inline bool glExtensionSupported(const char* name) {
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (GLint i = 0; i < count; i++) {
+		const char* extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
+		if (extension && strcmp(extension, name) == 0) return true;
+	}
+	return false;
+}
+
+#ifdef FILE_OPERATIONS
+fs::path executableDirectory();	// a futtathat llomny mappja
+#endif
+
 //---------------------------
 class GPUProgram {
 //--------------------------
 	GLuint shaderProgramId = 0;
 	bool waitError = true;
+	std::vector<std::pair<GLenum, std::string>> sources;	// a link()-ig sszegyjttt, mg nem fordtott rnyalk
 
 	bool checkShader(unsigned int shader, std::string message) { // shader fordtsi hibk kezelse
 		GLint infoLogLength = 0, result = 0;
@@ -101,63 +129,112 @@ class GPUProgram {
 		}
 	}
 
-public:
-	GPUProgram( ) { }
-	GPUProgram(const char* const vertexShaderSource, const char * const fragmentShaderSource, const char * const geometryShaderSource = nullptr) {
-		create(vertexShaderSource, fragmentShaderSource, geometryShaderSource);
+#ifdef SHADER_BINARY_CACHE
+	// A binris csak ugyanarra a forrsra s ugyanarra a meghajtra rvnyes, ezek FNV-1a hash-e a fjl neve.
+	// 4.1 ta core, a 3.3-as kontextusokon a GL_ARB_get_program_binary adja (a fggvnyeit a framework tlti be)
+	static bool binaryCacheSupported() {
+		if (!GLAD_GL_VERSION_4_1 && !glExtensionSupported("GL_ARB_get_program_binary")) return false;
+		if (!glGetProgramBinary || !glProgramBinary || !glProgramParameteri) return false;
+		GLint formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		return formats > 0;
 	}
 
-	void create(const char* const vertexShaderSource, const char * const fragmentShaderSource, const char * const geometryShaderSource = nullptr) {
-		// Program ltrehozsa a forrs sztringbl
-		GLuint  vertexShader = glCreateShader(GL_VERTEX_SHADER);
-		if (!vertexShader) {
-			printf("Error in vertex shader creation\n");
-			exit(1);
+	fs::path binaryCachePath() const {
+		unsigned long long hash = 14695981039346656037ull;
+		auto add = [&hash](const char* data, size_t length) {
+			for (size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+			hash = (hash ^ 0xff) * 1099511628211ull;	// elvlaszt, hogy "ab"+"c" s "a"+"bc" klnbzzn
+		};
+		for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+			const char* value = (const char*)glGetString(name);
+			if (value) add(value, strlen(value));
 		}
-		glShaderSource(vertexShader, 1, (const GLchar**)&vertexShaderSource, NULL);
-		glCompileShader(vertexShader);
-		if (!checkShader(vertexShader, "Vertex shader error")) return;
-
-		// Program ltrehozsa a forrs sztringbl, ha van geometria rnyal
-		GLuint geometryShader = 0;
-		if (geometryShaderSource != nullptr) {
-			geometryShader = glCreateShader(GL_GEOMETRY_SHADER);
-			if (!geometryShader) {
-				printf("Error in geometry shader creation\n");
-				exit(1);
-			}
-			glShaderSource(geometryShader, 1, (const GLchar**)&geometryShaderSource, NULL);
-			glCompileShader(geometryShader);
-			if (!checkShader(geometryShader, "Geometry shader error")) return;
+		for (const auto& source : sources) {
+			add((const char*)&source.first, sizeof(source.first));
+			add(source.second.data(), source.second.length());
 		}
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.bin", hash);
+		return executableDirectory() / "shadercache" / name;
+	}
+
+	// Ha a meghajt nem fogadja el (pl. frisslt), a fjl trldik s forrsbl fordtunk
+	bool loadBinary(const fs::path& path) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file) return false;
+		GLenum format = 0;
+		if (!file.read((char*)&format, sizeof(format))) return false;
+		std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		if (binary.empty()) return false;
+		file.close();
+		glProgramBinary(shaderProgramId, format, binary.data(), (GLsizei)binary.size());
+		GLint result = 0;
+		glGetProgramiv(shaderProgramId, GL_LINK_STATUS, &result);
+		if (result) return true;
+		printf("Shader binary %s rejected by the driver, compiling from source\n", path.filename().string().c_str());
+		std::error_code ec;
+		fs::remove(path, ec);
+		return false;
+	}
+
+	void storeBinary(const fs::path& path) {
+		GLint length = 0;
+		glGetProgramiv(shaderProgramId, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0) return;
+		std::vector<char> binary(length);
+		GLenum format = 0;
+		glGetProgramBinary(shaderProgramId, length, &length, &format, binary.data());
+		std::error_code ec;
+		fs::create_directories(path.parent_path(), ec);
+		std::ofstream file(path, std::ios::binary);
+		if (!file) return;	// csak nem lesz gyorsabb a kvetkez induls
+		file.write((const char*)&format, sizeof(format));
+		file.write(binary.data(), length);
+	}
+#endif
 
-		// Program ltrehozsa a forrs sztringbl
-		GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-		if (!fragmentShader) {
-			printf("Error in fragment shader creation\n");
+	bool compileShader(GLenum shaderType, const std::string& shaderCode) {
+		GLuint shaderID = glCreateShader(shaderType);
+		if (!shaderID) {
+			printf("Error in %s shader creation\n", shaderType2string(shaderType).c_str());
 			exit(1);
 		}
+		const char* sourcePointer = shaderCode.data();
+		GLint sourceLength = static_cast<GLint>(shaderCode.length());
+		glShaderSource(shaderID, 1, &sourcePointer, &sourceLength);
+		glCompileShader(shaderID);
+		if (!checkShader(shaderID, shaderType2string(shaderType) + " shader error")) return false;
+		glAttachShader(shaderProgramId, shaderID);
+		glDeleteShader(shaderID);	// a programmal egytt szabadul fel
+		return true;
+	}
 
-		glShaderSource(fragmentShader, 1, (const GLchar**)&fragmentShaderSource, NULL);
-		glCompileShader(fragmentShader);
-		if (!checkShader(fragmentShader, "Fragment shader error")) return;
+public:
+	GPUProgram( ) { }
+	GPUProgram(const char* const vertexShaderSource, const char * const fragmentShaderSource, const char * const geometryShaderSource = nullptr) {
+		create(vertexShaderSource, fragmentShaderSource, geometryShaderSource);
+	}
 
-		shaderProgramId = glCreateProgram();
-		if (!shaderProgramId) {
-			printf("Error in shader program creation\n");
-			exit(-1);
-		}
-		glAttachShader(shaderProgramId, vertexShader);
-		glAttachShader(shaderProgramId, fragmentShader);
-		if (geometryShader > 0) glAttachShader(shaderProgramId, geometryShader);
+	void create(const char* const vertexShaderSource, const char * const fragmentShaderSource, const char * const geometryShaderSource = nullptr) {
+		// Program ltrehozsa a forrs sztringekbl, ha van, geometria rnyalval
+		addShaderSource(GL_VERTEX_SHADER, vertexShaderSource);
+		if (geometryShaderSource != nullptr) addShaderSource(GL_GEOMETRY_SHADER, geometryShaderSource);
+		addShaderSource(GL_FRAGMENT_SHADER, fragmentShaderSource);
 
-		// Szerkeszts
+		// Fordts s szerkeszts, vagy a gyorsttrbl betlts
 		if (!link()) return;
 
 		// Ez fusson
 		glUseProgram(shaderProgramId); 
 	}
 
+	// A forrs csak a link()-nl fordul, gy az egsz program egyben kereshet a binris gyorsttrban
+	bool addShaderSource(GLenum shaderType, const std::string& shaderCode) {
+		sources.push_back({ shaderType, shaderCode });
+		return true;
+	}
+
 #ifdef FILE_OPERATIONS
 	bool addShader(const fs::path& _fileName) {
 		GLenum shaderType = 0;
@@ -174,25 +251,38 @@ public:
 
 	bool addShader(GLenum shaderType, const fs::path& _fileName) {
 		std::string shaderCode = file2string(_fileName);
-		GLuint shaderID = glCreateShader(shaderType);
-		if (!shaderID) {
-			printf("Error in vertex shader creation\n");
-			exit(1);
-		}
-		const char* sourcePointer = shaderCode.data();
-		GLint sourceLength = static_cast<GLint>(shaderCode.length());
-		glShaderSource(shaderID, 1, &sourcePointer, &sourceLength);
-		glCompileShader(shaderID);
-		if (!checkShader(shaderID, shaderType2string(shaderType) + " shader error")) return false;
-		if (shaderProgramId == 0) shaderProgramId = glCreateProgram();
-		glAttachShader(shaderProgramId, shaderID);
-		return true;
+		if (shaderCode.empty()) return false;
+		return addShaderSource(shaderType, shaderCode);
 	}
 #endif
 
 	bool link() {
+		if (shaderProgramId == 0) shaderProgramId = glCreateProgram();
+		if (!shaderProgramId) {
+			printf("Error in shader program creation\n");
+			exit(-1);
+		}
+#ifdef SHADER_BINARY_CACHE
+		bool cache = binaryCacheSupported();
+		fs::path cachePath = cache ? binaryCachePath() : fs::path();
+		if (cache && loadBinary(cachePath)) {
+			sources.clear();
+			return true;
+		}
+#endif
+		for (const auto& source : sources) {
+			if (!compileShader(source.first, source.second)) return false;
+		}
+		sources.clear();
+#ifdef SHADER_BINARY_CACHE
+		if (cache) glProgramParameteri(shaderProgramId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+#endif
 		glLinkProgram(shaderProgramId);
-		return checkLinking(shaderProgramId);
+		if (!checkLinking(shaderProgramId)) return false;
+#ifdef SHADER_BINARY_CACHE
+		if (cache) storeBinary(cachePath);
+#endif
+		return true;
 	}
 
 	void Use() { glUseProgram(shaderProgramId); } 		// make this program run
@@ -230,29 +320,118 @@ public:
 	~GPUProgram() { if (shaderProgramId > 0) glDeleteProgram(shaderProgramId); }
 };
 
+//---------------------------
+template<class T>
+class StreamingBuffer {
+//---------------------------
+	// Dinamikus cscsadatok: egy vbo hrom rgival, minden frissts a kvetkez rgiba r, amit a GPU
+	// a fence szerint mr nem olvas. Csak a vltozott tartomny megy fel glBufferSubData-val.
+	static const int regionCount = 3;
+	unsigned int vbo = 0;
+	size_t capacity = 0;			// elemben, rginknt
+	int current = -1;				// a legutbb feltlttt rgi
+	GLsync fences[regionCount] = {};
+	size_t dirtyBegin[regionCount] = {}, dirtyEnd[regionCount] = {};	// rginknt a mg fel nem tlttt vltozsok
+	std::vector<T> uploaded;		// a legutbb feltlttt tartalom, ehhez hasonltva derl ki, mi vltozott
+
+	void reserve(size_t elements) {
+		for (GLsync& fence : fences) if (fence) { glDeleteSync(fence); fence = 0; }
+		capacity = elements;
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, regionCount * capacity * sizeof(T), NULL, GL_DYNAMIC_DRAW);
+		uploaded.clear();			// az j trban mg semmi sincs
+		current = -1;
+	}
+
+	void markDirty(size_t begin, size_t end) {
+		for (int r = 0; r < regionCount; r++) {
+			if (dirtyBegin[r] == dirtyEnd[r]) { dirtyBegin[r] = begin; dirtyEnd[r] = end; }
+			else { dirtyBegin[r] = std::min(dirtyBegin[r], begin); dirtyEnd[r] = std::max(dirtyEnd[r], end); }
+		}
+	}
+public:
+	size_t bytesUploaded = 0;		// sszesen a GPU-ra msolt bjtok, mrshez
+
+	StreamingBuffer() { glGenBuffers(1, &vbo); }
+	StreamingBuffer(const StreamingBuffer&) = delete;
+	StreamingBuffer& operator=(const StreamingBuffer&) = delete;
+	~StreamingBuffer() {
+		for (GLsync fence : fences) if (fence) glDeleteSync(fence);
+		glDeleteBuffers(1, &vbo);
+	}
+
+	unsigned int Buffer() const { return vbo; }
+	size_t Offset() const { return current < 0 ? 0 : current * capacity * sizeof(T); }	// az aktulis rgi eleje bjtban
+
+	// Visszaadja, hogy vltott-e rgit (ilyenkor a vertex attribtumokat t kell lltani az j Offset()-re)
+	bool Update(const std::vector<T>& data) {
+		if (data.size() > capacity) reserve(std::max(data.size(), capacity * 2));
+
+		// a vltozott tartomny az elz feltltshez kpest
+		size_t common = std::min(data.size(), uploaded.size());
+		size_t begin = 0, end = data.size();
+		while (begin < common && memcmp(&data[begin], &uploaded[begin], sizeof(T)) == 0) begin++;
+		if (data.size() == uploaded.size()) {
+			while (end > begin && memcmp(&data[end - 1], &uploaded[end - 1], sizeof(T)) == 0) end--;
+		}
+		if (begin == end && data.size() == uploaded.size() && current >= 0) return false;	// nincs vltozs
+		if (begin < end) markDirty(begin, end);
+		uploaded = data;
+
+		// a most elhagyott rgit a GPU a fence-ig olvassa, a kvetkezt csak akkor rjuk, ha mr vgzett vele
+		if (current >= 0) {
+			if (fences[current]) glDeleteSync(fences[current]);
+			fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+		current = (current + 1) % regionCount;
+		if (fences[current]) {
+			glClientWaitSync(fences[current], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+			glDeleteSync(fences[current]);
+			fences[current] = 0;
+		}
+
+		size_t first = dirtyBegin[current], last = std::min(dirtyEnd[current], data.size());
+		if (first < last) {
+			glBindBuffer(GL_ARRAY_BUFFER, vbo);
+			glBufferSubData(GL_ARRAY_BUFFER, (current * capacity + first) * sizeof(T), (last - first) * sizeof(T), &data[first]);
+			bytesUploaded += (last - first) * sizeof(T);
+		}
+		dirtyBegin[current] = dirtyEnd[current] = 0;
+		return true;
+	}
+
+	// A kttt vao attribtumt az aktulis rgira lltja
+	void AttribPointer(int location, int components) {
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glVertexAttribPointer(location, components, GL_FLOAT, GL_FALSE, 0, (void*)Offset());
+	}
+};
+
 //---------------------------
 template<class T>
 class Geometry {
 //---------------------------
-	unsigned int vao, vbo;	// GPU
+	unsigned int vao;	// GPU
+	StreamingBuffer<T> stream;
+	int nf;
 protected:
 	std::vector<T> vtx;	// CPU
 public:
 	Geometry() {
 		glGenVertexArrays(1, &vao);
 		glBindVertexArray(vao);
-		glGenBuffers(1, &vbo);
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, stream.Buffer());
 		glEnableVertexAttribArray(0);
-		int nf = min((int)(sizeof(T) / sizeof(float)), 4);
+		nf = min((int)(sizeof(T) / sizeof(float)), 4);
 		glVertexAttribPointer(0, nf, GL_FLOAT, GL_FALSE, 0, NULL);
 	}
 	std::vector<T>& Vtx() { return vtx; }
-	void updateGPU() {	// CPU -> GPU
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		glBufferData(GL_ARRAY_BUFFER, vtx.size() * sizeof(T), &vtx[0], GL_DYNAMIC_DRAW);
+	void updateGPU() {	// CPU -> GPU, csak a vltozott rsz
+		glBindVertexArray(vao);
+		if (stream.Update(vtx)) stream.AttribPointer(0, nf);
 	}
-	void Bind() { glBindVertexArray(vao); glBindBuffer(GL_ARRAY_BUFFER, vbo); } // aktivls
+	size_t bytesUploaded() const { return stream.bytesUploaded; }
+	void Bind() { glBindVertexArray(vao); glBindBuffer(GL_ARRAY_BUFFER, stream.Buffer()); } // aktivls
 	void Draw(GPUProgram* prog, int type, vec3 color) {
 		if (vtx.size() > 0) {
 			prog->setUniform(color, "color");
@@ -261,43 +440,107 @@ public:
 		}
 	}
 	virtual ~Geometry() {
-		glDeleteBuffers(1, &vbo);
 		glDeleteVertexArrays(1, &vao);
 	}
 };
 
+// Textra mintavtelezsi belltsai
+struct TextureSampling {
+	int minFilter = GL_LINEAR, magFilter = GL_LINEAR;
+	int wrap = GL_REPEAT;
+	float anisotropy = 1.0f; // 1: nincs anizotrp szrs, a hardver maximumra vgdik
+	bool mipmaps = false;    // minFilter-nek ilyenkor *_MIPMAP_* szrnek kell lennie
+
+	TextureSampling(int filter = GL_LINEAR) : minFilter(filter), magFilter(filter) {}
+	TextureSampling(int _minFilter, int _magFilter, float _anisotropy = 1.0f, int _wrap = GL_REPEAT)
+		: minFilter(_minFilter), magFilter(_magFilter), wrap(_wrap), anisotropy(_anisotropy),
+		  mipmaps(_minFilter != GL_NEAREST && _minFilter != GL_LINEAR) {}
+};
+
 //---------------------------
 class Texture {
 //---------------------------
 	unsigned int textureId = 0;
+#ifdef FILE_OPERATIONS
+	friend class TextureLoader;
+	Texture() {} // a TextureLoader tlti fel ksbb
+#endif
 public:
 #ifdef FILE_OPERATIONS
-	Texture(const fs::path pathname, bool transparent = false, int sampling = GL_LINEAR) {
-		if (textureId == 0) glGenTextures(1, &textureId);  				// azonost generls
-		glBindTexture(GL_TEXTURE_2D, textureId);    // kts
-		unsigned int width, height;
-		unsigned char* pixels;
-		if (transparent) {
-			lodepng_decode32_file(&pixels, &width, &height, pathname.string().c_str());
-			for (int y = 0; y < height; ++y) {
-				for (int x = 0; x < width; ++x) {
-					float sum = 0;
-					for (int c = 0; c < 3; ++c) {
-						sum += pixels[4 * (x + y * width) + c];
-					}
-					pixels[4 * (x + y * width) + 3] = sum / 6;
-				}
-			}
+	// PNG fjl dekdolt kpe, feltltsre kszen
+	struct Image {
+		fs::path pathname;
+		bool transparent = false;		// RGBA a sznbl szmolt alfval, klnben RGB
+		unsigned int error = 0;			// lodepng hibakd
+		unsigned int width = 0, height = 0;
+		std::vector<unsigned char> pixels;
+	};
+
+	Texture(const fs::path pathname, bool transparent = false, const TextureSampling& sampling = TextureSampling()) {
+		Upload(Decode(pathname, transparent), sampling);
+	}
+
+	// Dekdols GL hvsok nlkl, gy brmelyik szlon futhat. A context a dekdols munkamemrijt
+	// tartja meg kprl kpre (nullptr: minden kp jra foglal)
+	static Image Decode(const fs::path& pathname, bool transparent, LodePNGContext* context = nullptr) {
+		Image image;
+		image.pathname = pathname;
+		image.transparent = transparent;
+		const unsigned char* file = nullptr;
+		size_t fileSize = 0;
+		image.error = lodepng_map_file(&file, &fileSize, pathname.string().c_str()); // a lekpezett (mmap) fjlbl, nincs msolat
+		if (image.error) return image;
+		lodepng::State state;
+		state.info_raw.colortype = transparent ? LCT_RGBA : LCT_RGB;
+		state.decoder.read_text_chunks = 0;
+		state.decoder.remember_unknown_chunks = 0;
+		image.error = lodepng_inspect(&image.width, &image.height, &state, file, fileSize);
+		if (!image.error) {
+			image.pixels.resize(lodepng_get_raw_size(image.width, image.height, &state.info_raw));
+			image.error = context
+				? lodepng_context_decode(context, image.pixels.data(), image.pixels.size(), &image.width, &image.height, &state, file, fileSize)
+				: lodepng_decode_into(image.pixels.data(), image.pixels.size(), &image.width, &image.height, &state, file, fileSize);
+		}
+		lodepng_unmap_file(file, fileSize);
+		if (!image.error && transparent) DeriveAlpha(image.pixels.data(), (size_t)image.width * image.height);
+		return image;
+	}
 
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels); // GPU-ra
+	// tltszsg a sznbl: alfa = (r + g + b) / 6, SSE2-vel ngy texelenknt
+	static void DeriveAlpha(unsigned char* rgba, size_t count) {
+		size_t i = 0;
+#ifdef SIMD_SSE2
+		const __m128i rgbMask = _mm_set1_epi32(0x00FFFFFF), zero = _mm_setzero_si128();
+		const __m128i sixth = _mm_set1_epi16(10923); // (s * 10923) >> 16 == s / 6, ha s <= 765
+		for (; i + 4 <= count; i += 4) {
+			__m128i texels = _mm_and_si128(_mm_loadu_si128((const __m128i*)(rgba + 4 * i)), rgbMask);
+			__m128i lo = _mm_unpacklo_epi8(texels, zero), hi = _mm_unpackhi_epi8(texels, zero); // 16 bites svok
+			// texelenknt r + g + b az els svba, az alfa sv mr 0
+			lo = _mm_add_epi16(lo, _mm_add_epi16(_mm_srli_epi64(lo, 16), _mm_srli_epi64(lo, 32)));
+			hi = _mm_add_epi16(hi, _mm_add_epi16(_mm_srli_epi64(hi, 16), _mm_srli_epi64(hi, 32)));
+			// a hnyados az alfa svjba, a tbbi sv kinullzdik
+			lo = _mm_slli_epi64(_mm_mulhi_epu16(lo, sixth), 48);
+			hi = _mm_slli_epi64(_mm_mulhi_epu16(hi, sixth), 48);
+			_mm_storeu_si128((__m128i*)(rgba + 4 * i), _mm_or_si128(texels, _mm_packus_epi16(lo, hi)));
+		}
+#endif
+		for (; i < count; i++) {
+			unsigned char* texel = rgba + 4 * i;
+			texel[3] = (unsigned char)((texel[0] + texel[1] + texel[2]) / 6);
 		}
-		else {
-			lodepng_decode24_file(&pixels, &width, &height, pathname.string().c_str());
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels); // GPU-ra
+	}
+
+	// A dekdolt kp GPU-ra tltse, csak a GL szlon
+	void Upload(const Image& image, const TextureSampling& sampling = TextureSampling()) {
+		if (textureId == 0) glGenTextures(1, &textureId);  				// azonost generls
+		glBindTexture(GL_TEXTURE_2D, textureId);    // kts
+		if (image.error) {
+			printf("Error while reading %s: %s\n", image.pathname.string().c_str(), lodepng_error_text(image.error));
+			return;
 		}
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, sampling); // szrs
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, sampling);
-		printf("%s, w: %d, h: %d\n", pathname.string().c_str(), width, height);
+		if (image.transparent) UploadLevels(image.width, image.height, GL_RGBA8, GL_RGBA, 4, image.pixels, sampling); // GPU-ra
+		else UploadLevels(image.width, image.height, GL_RGB8, GL_RGB, 3, image.pixels, sampling);
+		printf("%s, w: %d, h: %d\n", image.pathname.string().c_str(), image.width, image.height);
 	}
 #endif
 	Texture(int width, int height) {
@@ -322,6 +565,66 @@ public:
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	}
 
+	// 8 bites RGBA texelek (soronknt width * 4 bjt), negyedannyi GPU memria mint a float RGB
+	Texture(int width, int height, const std::vector<unsigned char>& rgba, const TextureSampling& sampling = TextureSampling()) {
+		glGenTextures(1, &textureId); // azonost generlsa
+		UploadLevels(width, height, GL_RGBA8, GL_RGBA, 4, rgba, sampling); // To GPU
+	}
+
+	// Az alapszint, s ha a mintavtelezs kri, a teljes, egyszer a CPU-n szrt mip lnc feltltse
+	void UploadLevels(int width, int height, GLenum internalFormat, GLenum format, int channels,
+					  const std::vector<unsigned char>& pixels, const TextureSampling& sampling) {
+		glBindTexture(GL_TEXTURE_2D, textureId);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // RGB soroknl s a kis mip szinteknl a sorok nincsenek 4 bjtra igaztva
+		glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, GL_UNSIGNED_BYTE, &pixels[0]);
+		int levels = 1;
+		if (sampling.mipmaps) {
+			std::vector<unsigned char> level;
+			const std::vector<unsigned char>* source = &pixels;
+			while (width > 1 || height > 1) {
+				level = Downsample(width, height, *source, channels);
+				source = &level;
+				width = std::max(width / 2, 1); height = std::max(height / 2, 1);
+				glTexImage2D(GL_TEXTURE_2D, levels++, internalFormat, width, height, 0, format, GL_UNSIGNED_BYTE, &level[0]);
+			}
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+		SetSampling(sampling);
+	}
+
+	// 2x2-es doboz szr, a kvetkez mip szint (pratlan mretnl az utols sor/oszlop ismtldik)
+	static std::vector<unsigned char> Downsample(int width, int height, const std::vector<unsigned char>& pixels, int channels = 4) {
+		int w = std::max(width / 2, 1), h = std::max(height / 2, 1);
+		std::vector<unsigned char> result((size_t)w * h * channels);
+		for (int y = 0; y < h; y++) for (int x = 0; x < w; x++) {
+			int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+			int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+			for (int c = 0; c < channels; c++) {
+				int sum = pixels[((size_t)y0 * width + x0) * channels + c] + pixels[((size_t)y0 * width + x1) * channels + c]
+						+ pixels[((size_t)y1 * width + x0) * channels + c] + pixels[((size_t)y1 * width + x1) * channels + c];
+				result[((size_t)y * w + x) * channels + c] = (unsigned char)((sum + 2) / 4);
+			}
+		}
+		return result;
+	}
+
+	// szrs, ismtls s anizotrpia, brmikor tllthat
+	void SetSampling(const TextureSampling& sampling) {
+		glBindTexture(GL_TEXTURE_2D, textureId);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, sampling.minFilter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, sampling.magFilter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, sampling.wrap);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, sampling.wrap);
+		// az anizotrp szrs csak 4.6 ta core, eltte kiterjeszts, nlkle GL_INVALID_ENUM lenne
+		if (sampling.anisotropy > 1.0f && (GLAD_GL_VERSION_4_6 || glExtensionSupported("GL_ARB_texture_filter_anisotropic")
+										   || glExtensionSupported("GL_EXT_texture_filter_anisotropic"))) {
+			float maxAnisotropy = 1.0f;
+			glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY, &maxAnisotropy);
+			glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY, std::min(sampling.anisotropy, maxAnisotropy));
+		}
+	}
+
 	void Bind(int textureUnit) {
 		glActiveTexture(GL_TEXTURE0 + textureUnit); // aktivls
 		glBindTexture(GL_TEXTURE_2D, textureId); // piros nyl
@@ -331,9 +634,272 @@ public:
 	}
 };
 
+#ifdef FILE_OPERATIONS
+//---------------------------
+class TextureLoader {
+//---------------------------
+// Prhuzamos textra betlts: a PNG-ket munkaszlak dekdoljk, a GL szl csak feltlt,
+// gy az induls a leglassabb textrig tart, nem az sszesig
+	struct Job {
+		Texture* texture;
+		TextureSampling sampling;
+		Texture::Image image; // bemenet a fjl neve s a transparent, a munkaszl tlti ki
+	};
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable jobAdded, jobDone;
+	std::deque<Job> queue, done;	// dekdolsra, illetve feltltsre vr munkk
+	int pending = 0;				// mg fel nem tlttt textrk
+	bool stopping = false;
+
+	void Work() {
+		LodePNGContext* context = lodepng_context_new(); // szlanknt, a munkamemria kprl kpre megmarad
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			jobAdded.wait(lock, [this] { return stopping || !queue.empty(); });
+			if (queue.empty()) break;
+			Job job = std::move(queue.front());
+			queue.pop_front();
+			lock.unlock();
+			job.image = Texture::Decode(job.image.pathname, job.image.transparent, context);
+			lock.lock();
+			done.push_back(std::move(job));
+			jobDone.notify_one();
+		}
+		lodepng_context_delete(context);
+	}
+public:
+	TextureLoader(unsigned int threadCount = std::thread::hardware_concurrency()) {
+		threadCount = std::max(threadCount, 1u);
+		for (unsigned int i = 0; i < threadCount; i++) workers.emplace_back(&TextureLoader::Work, this);
+	}
+
+	// A textra azonnal hasznlhat objektum, de a kpe csak a Finish utn van a GPU-n
+	Texture* Load(const fs::path& pathname, bool transparent = false, const TextureSampling& sampling = TextureSampling()) {
+		Job job;
+		job.texture = new Texture();
+		job.sampling = sampling;
+		job.image.pathname = pathname;
+		job.image.transparent = transparent;
+		Texture* texture = job.texture;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.push_back(std::move(job));
+			pending++;
+		}
+		jobAdded.notify_one();
+		return texture;
+	}
+
+	// Megvrja a dekdolsokat, s a ksz kpeket elkszlsk sorrendjben feltlti (a GL szlon kell hvni)
+	void Finish() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (pending > 0) {
+			jobDone.wait(lock, [this] { return !done.empty(); });
+			Job job = std::move(done.front());
+			done.pop_front();
+			pending--;
+			lock.unlock();
+			job.texture->Upload(job.image, job.sampling); // kzben a munkaszlak a tbbit dekdoljk
+			lock.lock();
+		}
+	}
+
+	~TextureLoader() {
+		Finish();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		jobAdded.notify_all();
+		for (std::thread& worker : workers) worker.join();
+	}
+};
+#endif
+
+//---------------------------
+class Profiler {
+//---------------------------
+public:
+	struct Event {
+		const char* name;			// statikus lettartam szveg (literl), csak a mutatt troljuk
+		double begin, end;			// msodpercben a profiler ltrehozsa ta
+		int depth;					// egymsba gyazott znk mlysge
+		unsigned int frame;
+	};
+	struct Stats {
+		const char* name;
+		int calls;
+		double average, p50, p95, p99, max;	// ezredmsodpercben
+	};
+
+private:
+	// Znk idblyegei egy gyrbufferben, az onDisplay krl GL_TIME_ELAPSED lekrdezsek, amiket csak
+	// nhny kpkockval ksbb olvasunk ki, gy a mrs nem vrakoztatja a CPU-t
+	static const size_t eventCapacity = 16384;
+	static const int queryCount = 4;
+	std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+	std::vector<Event> events;
+	size_t nextEvent = 0;			// a kvetkez berand esemny helye a gyrben
+	unsigned int queries[queryCount] = {};
+	double queryStart[queryCount] = {};	// a lekrdezs indtsnak CPU ideje, ehhez igaztjuk a GPU esemnyt
+	bool queryPending[queryCount] = {};
+	int currentQuery = -1;			// a fut lekrdezs, -1 ha nincs
+	int nextQuery = 0;
+	double lastFrame = -1, lastReport = 0;
+	bool csvHeader = false;
+
+	void collectQueries() {
+		for (int q = 0; q < queryCount; q++) {
+			if (!queryPending[q] || q == currentQuery) continue;
+			GLint available = 0;
+			glGetQueryObjectiv(queries[q], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) continue;
+			GLuint64 nanoseconds = 0;
+			glGetQueryObjectui64v(queries[q], GL_QUERY_RESULT, &nanoseconds);
+			Record("gpu", queryStart[q], queryStart[q] + nanoseconds * 1e-9);
+			queryPending[q] = false;
+		}
+	}
+
+	static double percentile(const std::vector<double>& sorted, double p) {
+		size_t rank = (size_t)ceil(p * sorted.size());
+		return sorted[std::min(std::max(rank, (size_t)1), sorted.size()) - 1];
+	}
+public:
+	bool enabled = false;			// a --profile / --profile-csv kapcsolja be, addig a znk s a lekrdezsek sem mrnek
+	double reportInterval = 0;		// ennyi msodpercenknt sszests a konzolra, 0: soha
+	FILE* csv = nullptr;			// ha meg van adva, az sszestsek ide is mennek CSV sorokknt
+	unsigned int frame = 0;
+	int depth = 0;
+
+	double Now() const { return std::chrono::duration<double>(std::chrono::steady_clock::now() - origin).count(); }
+
+	void Record(const char* name, double begin, double end, int eventDepth = 0) {
+		if (!enabled) return;
+		if (events.size() < eventCapacity) events.push_back({ name, begin, end, eventDepth, frame });
+		else events[nextEvent] = { name, begin, end, eventDepth, frame };
+		nextEvent = (nextEvent + 1) % eventCapacity;
+	}
+
+	// A gyrben lv esemnyek idrendben
+	std::vector<Event> Events() const {
+		if (events.size() < eventCapacity) return events;
+		std::vector<Event> ordered(events.begin() + nextEvent, events.end());
+		ordered.insert(ordered.end(), events.begin(), events.begin() + nextEvent);
+		return ordered;
+	}
+
+	// Znnknti statisztika a since ta vget rt esemnyekbl; a "frame" zna a kpkockaid, a "gpu" az onDisplay GPU ideje
+	std::vector<Stats> Collect(double since = 0) const {
+		std::vector<const char*> names;
+		std::vector<std::vector<double>> durations;
+		for (const Event& e : events) {
+			if (e.end < since) continue;
+			size_t i = 0;
+			while (i < names.size() && strcmp(names[i], e.name) != 0) i++;
+			if (i == names.size()) { names.push_back(e.name); durations.emplace_back(); }
+			durations[i].push_back((e.end - e.begin) * 1000.0);
+		}
+		std::vector<Stats> stats;
+		for (size_t i = 0; i < names.size(); i++) {
+			std::vector<double>& d = durations[i];
+			std::sort(d.begin(), d.end());
+			double sum = 0;
+			for (double v : d) sum += v;
+			stats.push_back({ names[i], (int)d.size(), sum / d.size(), percentile(d, 0.5), percentile(d, 0.95), percentile(d, 0.99), d.back() });
+		}
+		return stats;
+	}
+
+	Stats Find(const char* name, double since = 0) const {
+		for (const Stats& s : Collect(since)) if (strcmp(s.name, name) == 0) return s;
+		return { name, 0, 0, 0, 0, 0, 0 };
+	}
+
+	// A GPU id mrse, az onDisplay kr
+	void BeginGpu() {
+		if (!enabled) return;
+		if (queries[0] == 0) glGenQueries(queryCount, queries);
+		collectQueries();
+		if (queryPending[nextQuery]) return;	// a GPU mg nem vgzett vele, ezt a kpkockt kihagyjuk
+		currentQuery = nextQuery;
+		nextQuery = (nextQuery + 1) % queryCount;
+		queryStart[currentQuery] = Now();
+		glBeginQuery(GL_TIME_ELAPSED, queries[currentQuery]);
+	}
+
+	void EndGpu() {
+		if (currentQuery < 0) return;
+		glEndQuery(GL_TIME_ELAPSED);
+		queryPending[currentQuery] = true;
+		currentQuery = -1;
+	}
+
+	// Kirajzolt kpkocka vge: a kpkockaid kt buffercsere kztt telik el
+	void EndFrame() {
+		double now = Now();
+		if (lastFrame >= 0) Record("frame", lastFrame, now);
+		lastFrame = now;
+		frame++;
+		if (reportInterval > 0 && now - lastReport >= reportInterval) {
+			collectQueries();
+			Report(lastReport);
+			lastReport = now;
+		}
+	}
+
+	void Report(double since = 0) {
+		std::vector<Stats> stats = Collect(since);
+		printf("Profile %.1f - %.1f s\n%-24s %6s %8s %8s %8s %8s %8s\n", since, Now(), "zone", "calls", "avg ms", "p50", "p95", "p99", "max");
+		for (const Stats& s : stats) {
+			printf("%-24s %6d %8.3f %8.3f %8.3f %8.3f %8.3f\n", s.name, s.calls, s.average, s.p50, s.p95, s.p99, s.max);
+		}
+		if (!csv) return;
+		if (!csvHeader) { fprintf(csv, "time,zone,calls,avg_ms,p50_ms,p95_ms,p99_ms,max_ms\n"); csvHeader = true; }
+		for (const Stats& s : stats) {
+			fprintf(csv, "%.3f,%s,%d,%.4f,%.4f,%.4f,%.4f,%.4f\n", Now(), s.name, s.calls, s.average, s.p50, s.p95, s.p99, s.max);
+		}
+		fflush(csv);
+	}
+
+	~Profiler() { if (csv) fclose(csv); }	// a lekrdezsek a GL kontextussal egytt sznnek meg
+};
+
+Profiler& profiler();
+
+// Zna mrse a blokk vgig: PROFILE_SCOPE("Scene::Render");
+class ProfileScope {
+	const char* name = nullptr;		// nullptr: a profiler ki volt kapcsolva, semmit sem mr
+	double begin = 0;
+	int depth = 0;
+public:
+	ProfileScope(const char* _name) {
+		if (!profiler().enabled) return;	// kikapcsolva raolvass sincs, a szimulcis lpsekben is olcs
+		name = _name;
+		begin = profiler().Now();
+		depth = profiler().depth++;
+	}
+	~ProfileScope() {
+		if (!name) return;
+		profiler().depth--;
+		profiler().Record(name, begin, profiler().Now(), depth);
+	}
+};
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+
 enum MouseButton { MOUSE_LEFT, MOUSE_MIDDLE, MOUSE_RIGHT};
 enum SpecialKeys { KEY_RIGHT = 262, KEY_LEFT = 263, KEY_DOWN = 264, KEY_UP = 265 };
+// zenetkezel hurok stratgija
+enum LoopPolicy {
+	LOOP_WAIT_EVENTS,	// statikus alkalmazs: alszik, amg esemny nem jn (vagy le nem jr az interval)
+	LOOP_FIXED_RATE,	// animci: interval msodpercenknt egy lps, kzte alszik
+	LOOP_UNLIMITED		// mrs: folyamatos lekrdezs, vsync nlkl
+};
 bool pollKey(int key);
+double inputTime();	// a most kzbestett bemeneti esemny idblyege msodpercben
 
 //---------------------------
 class glApp {
@@ -344,6 +910,8 @@ public:
 		  unsigned int winWidth, unsigned int winHeight, // Alkalmazi ablak felbontsa
 		  const char * caption);       // Megfogcsk szvege
 	void refreshScreen(); // Ablak rvnytelentse
+	// Hurok stratgia, interval < 0 esetn az alaprtk (vrakozsnl 0.5 s, fix temnl 1/60 s)
+	void setLoopPolicy(LoopPolicy policy, float interval = -1);
 	// Esemnykezelk
 	virtual void onInitialization() {}    // Inicializci
 	virtual void onDisplay() {}           // Ablak rvnytelen
@@ -667,6 +667,7 @@ public:
 	Kepszintezis() : glApp(3, 3, windowWidth, windowHeight, "Kepszintezis") {}
 
 	void onInitialization() {
+		setLoopPolicy(LOOP_WAIT_EVENTS); // redraws on input only
 		glViewport(0, 0, windowWidth, windowHeight);
 		glEnable(GL_DEPTH_TEST);
 		glDisable(GL_CULL_FACE);
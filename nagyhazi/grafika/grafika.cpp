@@ -1,8 +1,23 @@
-#include <random>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <unordered_map>
+#include <map>
+#include <thread>
 #include "framework.h"
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtc/packing.hpp>
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define USE_SSE
+#include <xmmintrin.h>
+#endif
 
 #define DEBUG true
 #define ROAD_DEBUG false
+#define HEADLESS_SIM false
+#define OPTIMIZE_VERTEX_CACHE true
+#define PACKED_VERTICES true
 
 const int windowWidth = 1200, windowHeight = 600;
 
@@ -63,134 +78,220 @@ public:
 	}
 };
 
-class CheckerTexture : public Texture {
-public:
-	CheckerTexture(const int _width, const int _height,
-		const vec3 _color1 = vec3(0.0f, 0.1f, 0.3f), const vec3 _color2 = vec3(0.3f, 0.3f, 0.3f))
-		: Texture(_width, _height)
-	{
-		std::vector<vec3> img;
-		img.reserve(_width * _height);
-
-		for (int y = 0; y < _height; ++y) {
-			for (int x = 0; x < _width; ++x) {
-				bool isEven = (x + y) % 2 == 0;
-				img.push_back(isEven ? _color1 : _color2);
-			}
-		}
+// Texture synthesis: every texel is a pure function of the generator parameters and its
+// coordinates, so rows can be generated on any number of threads and the result is the same
+// on every run. Generated textures are cached as PNG, a cache hit only costs a decode.
+const char* textureCacheDirectory = "texcache";
+const int textureSynthVersion = 1; // increase when a generator changes, old cache files are then ignored
+const int minTexelsPerThread = 64 * 1024;
+
+enum TextureGenerator { TEX_CHECKER, TEX_ASPHALT, TEX_LOWASPHALT, TEX_LOWASPHALTLINE, TEX_DRYGRASS };
+const char* textureGeneratorNames[] = { "checker", "asphalt", "lowasphalt", "lowasphaltline", "drygrass" };
+
+// Counter-based RNG: the random value of a texel is a hash of (seed, x, y), there is no state to advance
+inline unsigned int HashTexel(unsigned int seed, unsigned int x, unsigned int y) {
+	unsigned long long h = ((unsigned long long)y << 32 | x) + seed * 0x9E3779B97F4A7C15ull;
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull; // splitmix64 finalizer
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+	return (unsigned int)((h ^ (h >> 31)) >> 32);
+}
 
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, _width, _height, 0, GL_RGB, GL_FLOAT, &img[0]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	}
-};
+// Uniform in [0, 1)
+inline float RandomTexel(unsigned int seed, int x, int y) {
+	return (HashTexel(seed, x, y) >> 8) * (1.0f / 16777216.0f);
+}
 
-class AsphaltTexture : public Texture {
-public:
-	AsphaltTexture(const int _width, const int _height) : Texture(_width, _height)
-	{
-		std::vector<vec3> img(_width * _height);
+struct TextureParams {
+	TextureGenerator generator;
+	int width, height;
+	unsigned int seed;
+	vec3 color1, color2; // only used by the checker
+
+	TextureParams(TextureGenerator _generator, int _width, int _height, unsigned int _seed = 1,
+		vec3 _color1 = vec3(0.0f), vec3 _color2 = vec3(0.0f))
+		: generator(_generator), width(_width), height(_height), seed(_seed), color1(_color1), color2(_color2) {}
+
+	// Every parameter that influences the texels, this is what the cache is keyed by
+	std::string Key() const {
+		char key[256];
+		snprintf(key, sizeof(key), "v%d %s %dx%d seed %u %g %g %g %g %g %g", textureSynthVersion,
+			textureGeneratorNames[generator], width, height, seed,
+			color1.x, color1.y, color1.z, color2.x, color2.y, color2.z);
+		return key;
+	}
 
-		vec3 baseColor(0.4f, 0.4f, 0.4f);
+	fs::path CachePath() const {
+		unsigned int hash = 2166136261u; // FNV-1a
+		for (char c : Key()) hash = (hash ^ (unsigned char)c) * 16777619u;
+		char name[128];
+		snprintf(name, sizeof(name), "%s_%dx%d_%08x.png", textureGeneratorNames[generator], width, height, hash);
+		return fs::path(textureCacheDirectory) / name;
+	}
 
-		std::default_random_engine rng(std::random_device{}());
-		std::uniform_real_distribution<float> noiseDist(-0.05f, 0.05f);
+	vec3 Texel(int x, int y) const {
+		switch (generator) {
+		case TEX_CHECKER:
+			return (x + y) % 2 == 0 ? color1 : color2;
+		case TEX_ASPHALT: {
+			float noise = RandomTexel(seed, x, y) * 0.1f - 0.05f;
+			return clamp(vec3(0.4f + noise), vec3(0.0f), vec3(1.0f));
+		}
+		case TEX_LOWASPHALT:
+			return vec3(0.2f, 0.2f, 0.2f);
+		case TEX_LOWASPHALTLINE: {
+			int lineWidth = width / 20;
+			bool isLine = abs(x - width / 2) < lineWidth / 2 && (y / 20) % 2 == 0;
+			return isLine ? vec3(1.0f, 1.0f, 0.0f) : vec3(0.2f, 0.2f, 0.2f);
+		}
+		case TEX_DRYGRASS: {
+			float noise = RandomTexel(seed, x, y);
+			noise = noise * noise;
+			vec3 baseColor(0.5f, 0.5f, 0.2f);
+			vec3 dryPatch(0.6f, 0.4f, 0.1f);
+			return baseColor * (1.0f - noise) + dryPatch * noise;
+		}
+		}
+		return vec3(0.0f);
+	}
+};
 
-		for (int y = 0; y < _height; ++y) {
-			for (int x = 0; x < _width; ++x) {
-				float noise = noiseDist(rng);
-				vec3 noisyColor = baseColor + vec3(noise);
-				noisyColor = clamp(noisyColor, vec3(0.0f), vec3(1.0f));
-				img[y * _width + x] = noisyColor;
+class TextureSynth {
+	static void GenerateRows(const TextureParams& params, std::vector<unsigned char>& rgba, int yBegin, int yEnd) {
+		for (int y = yBegin; y < yEnd; ++y) {
+			unsigned char* row = &rgba[(size_t)y * params.width * 4];
+			for (int x = 0; x < params.width; ++x) {
+				vec3 color = clamp(params.Texel(x, y), vec3(0.0f), vec3(1.0f));
+				row[x * 4 + 0] = (unsigned char)(color.r * 255.0f + 0.5f);
+				row[x * 4 + 1] = (unsigned char)(color.g * 255.0f + 0.5f);
+				row[x * 4 + 2] = (unsigned char)(color.b * 255.0f + 0.5f);
+				row[x * 4 + 3] = 255;
 			}
 		}
-
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, _width, _height, 0, GL_RGB, GL_FLOAT, &img[0]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	}
-};
 
-class LowAsphaltTexture : public Texture {
 public:
-	LowAsphaltTexture(const int _width, const int _height) : Texture(_width, _height)
-	{
-		std::vector<vec3> img(_width * _height);
-		vec3 asphaltColor(0.2f, 0.2f, 0.2f);
-
-		for (int y = 0; y < _height; ++y) {
-			for (int x = 0; x < _width; ++x) {
-				img[y * _width + x] = asphaltColor;
-			}
+	// Splits the rows into contiguous bands, one per hardware thread
+	static std::vector<unsigned char> Generate(const TextureParams& params) {
+		std::vector<unsigned char> rgba((size_t)params.width * params.height * 4);
+		int threadCount = (int)std::min<long long>(std::max(1u, std::thread::hardware_concurrency()),
+			(long long)params.width * params.height / minTexelsPerThread);
+		threadCount = std::min(threadCount, params.height);
+		if (threadCount <= 1) {
+			GenerateRows(params, rgba, 0, params.height);
+			return rgba;
 		}
 
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, _width, _height, 0, GL_RGB, GL_FLOAT, &img[0]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		std::vector<std::thread> threads;
+		for (int i = 0; i < threadCount; ++i) {
+			int yBegin = params.height * i / threadCount;
+			int yEnd = params.height * (i + 1) / threadCount;
+			threads.emplace_back(GenerateRows, std::cref(params), std::ref(rgba), yBegin, yEnd);
+		}
+		for (std::thread& thread : threads) thread.join();
+		return rgba;
 	}
-};
 
-class LowAsphaltWithLineTexture : public Texture {
-public:
-	LowAsphaltWithLineTexture(const int _width, const int _height) : Texture(_width, _height)
-	{
-		std::vector<vec3> img(_width * _height);
-		vec3 asphaltColor(0.2f, 0.2f, 0.2f);
-		vec3 lineColor(1.0f, 1.0f, 0.0f);
-
-		int lineWidth = _width / 20;
-		int centerX = _width / 2;
-
-		for (int y = 0; y < _height; ++y) {
-			for (int x = 0; x < _width; ++x) {
-				bool isLine = abs(x - centerX) < lineWidth / 2 && (y / 20) % 2 == 0;
-				img[y * _width + x] = isLine ? lineColor : asphaltColor;
-			}
+	static bool LoadCached(const TextureParams& params, std::vector<unsigned char>& rgba) {
+		fs::path path = params.CachePath();
+		if (!fs::exists(path)) return false;
+
+		unsigned int width, height;
+		rgba.clear();
+		unsigned int error = lodepng::decode(rgba, width, height, path.string(), LCT_RGBA); // decode straight to RGBA
+		if (error || (int)width != params.width || (int)height != params.height) {
+			printf("Invalid texture cache file %s, regenerating\n", path.string().c_str());
+			rgba.clear();
+			return false;
 		}
+		return true;
+	}
 
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, _width, _height, 0, GL_RGB, GL_FLOAT, &img[0]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	static void StoreCached(const TextureParams& params, const std::vector<unsigned char>& rgba) {
+		fs::path path = params.CachePath();
+		std::error_code ec;
+		fs::create_directories(path.parent_path(), ec);
+		unsigned int error = lodepng_encode32_file(path.string().c_str(), &rgba[0], params.width, params.height);
+		if (error) printf("Error while writing texture cache %s: %s\n", path.string().c_str(), lodepng_error_text(error));
+	}
+
+	// Cached texels if there are any, otherwise generates and caches them
+	static std::vector<unsigned char> Synthesize(const TextureParams& params) {
+		auto start = std::chrono::high_resolution_clock::now();
+		std::vector<unsigned char> rgba;
+		bool cached = LoadCached(params, rgba);
+		if (!cached) {
+			rgba = Generate(params);
+			StoreCached(params, rgba);
+		}
+		if (DEBUG) printf("Texture %s: %s in %.1f ms\n", params.Key().c_str(), cached ? "loaded from cache" : "generated",
+			std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+		return rgba;
 	}
 };
 
-class DryGrassTexture : public Texture {
+class CheckerTexture : public Texture {
 public:
-	DryGrassTexture(const int _width, const int _height) : Texture(_width, _height)
-	{
-		std::vector<vec3> img(_width * _height);
-		for (int y = 0; y < _height; ++y) {
-			for (int x = 0; x < _width; ++x) {
-				float noise = (rand() % 1000) / 1000.0f;
-				noise = powf(noise, 2.0f);
+	CheckerTexture(const int _width, const int _height,
+		const vec3 _color1 = vec3(0.0f, 0.1f, 0.3f), const vec3 _color2 = vec3(0.3f, 0.3f, 0.3f))
+		: Texture(_width, _height, TextureSynth::Synthesize(TextureParams(TEX_CHECKER, _width, _height, 0, _color1, _color2)), GL_NEAREST) {}
+};
 
-				vec3 baseColor(0.5f, 0.5f, 0.2f);
-				vec3 dryPatch(0.6f, 0.4f, 0.1f);
+class AsphaltTexture : public Texture {
+public:
+	AsphaltTexture(const int _width, const int _height, const unsigned int seed = 1)
+		: Texture(_width, _height, TextureSynth::Synthesize(TextureParams(TEX_ASPHALT, _width, _height, seed)), GL_NEAREST) {}
+};
 
-				vec3 finalColor = baseColor * (1.0f - noise) + dryPatch * noise;
+class LowAsphaltTexture : public Texture {
+public:
+	LowAsphaltTexture(const int _width, const int _height)
+		: Texture(_width, _height, TextureSynth::Synthesize(TextureParams(TEX_LOWASPHALT, _width, _height, 0)), GL_NEAREST) {}
+};
 
-				img[y * _width + x] = finalColor;
-			}
-		}
+class LowAsphaltWithLineTexture : public Texture {
+public:
+	LowAsphaltWithLineTexture(const int _width, const int _height)
+		: Texture(_width, _height, TextureSynth::Synthesize(TextureParams(TEX_LOWASPHALTLINE, _width, _height, 0)), GL_NEAREST) {}
+};
 
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, _width, _height, 0, GL_RGB, GL_FLOAT, &img[0]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	}
+class DryGrassTexture : public Texture {
+public:
+	// The grass plane is mostly seen at grazing angles: trilinear + anisotropic minification, blocky magnification
+	DryGrassTexture(const int _width, const int _height, const unsigned int seed = 1,
+		const TextureSampling& sampling = TextureSampling(GL_LINEAR_MIPMAP_LINEAR, GL_NEAREST, 8.0f))
+		: Texture(_width, _height, TextureSynth::Synthesize(TextureParams(TEX_DRYGRASS, _width, _height, seed)), sampling) {}
 };
 
+// Procedural textures that a track file can refer to by name
+Texture* CreateTrackTexture(const std::string& name, const int width, const int height) {
+	if (name == "checker") return new CheckerTexture(width, height, vec3(0.0f, 0.0f, 0.0f), vec3(0.9f, 0.9f, 0.9f));
+	if (name == "asphalt") return new AsphaltTexture(width, height);
+	if (name == "lowasphalt") return new LowAsphaltTexture(width, height);
+	if (name == "lowasphaltline") return new LowAsphaltWithLineTexture(width, height);
+	if (name == "drygrass") return new DryGrassTexture(width, height);
+	printf("Unknown texture %s, the surface will not be textured\n", name.c_str());
+	return nullptr;
+}
+
 struct RenderState {
 	mat4 MVP, M, Minv, V, P;
 	Material* material;
 	std::vector<Light> lights;
 	Texture* texture;
 	vec3 wEye;
+	bool instanced = false;
+	float cullDistance = 0.0f;	// objects farther from the eye are not drawn, 0: no distance culling
 };
 
 class Shader : public GPUProgram {
 public:
 	virtual void Bind(RenderState state) = 0;
 
+	// The same as Bind, split up by how often the state changes, so batched drawing can skip the redundant parts
+	virtual void BindFrame(const RenderState& state) = 0;
+	virtual void BindMaterial(Material* material, Texture* texture) = 0;
+	virtual void BindTransform(const RenderState& state) = 0;
+
 	void setUniformMaterial(const Material& material, const std::string& name) {
 		setUniform(material.kd, name + ".kd");
 		setUniform(material.ks, name + ".ks");
@@ -219,10 +320,13 @@ class PhongShader : public Shader {
 		uniform Light[8] lights;
 		uniform int   nLights;
 		uniform vec3  wEye;
+		uniform bool  instanced;
 
 		layout(location = 0) in vec3  vtxPos;
 		layout(location = 1) in vec3  vtxNorm;
 		layout(location = 2) in vec2  vtxUV;
+		layout(location = 3) in mat4  instM;		// per instance, locations 3-6
+		layout(location = 7) in mat4  instMinv;		// per instance, locations 7-10
 
 		out vec3 wNormal;
 		out vec3 wView;
@@ -231,14 +335,16 @@ class PhongShader : public Shader {
 		out vec3 worldPos;
 
 		void main() {
-			gl_Position = MVP * vec4(vtxPos, 1);
-			vec4 wPos = vec4(vtxPos, 1) * M;
+			vec4 lPos = instanced ? instM * vec4(vtxPos, 1) : vec4(vtxPos, 1);
+			vec3 lNorm = instanced ? (vec4(vtxNorm, 0) * instMinv).xyz : vtxNorm;
+			gl_Position = MVP * lPos;
+			vec4 wPos = lPos * M;
 			worldPos = wPos.xyz;
 			for(int i = 0; i < nLights; i++) {
 				wLight[i] = lights[i].wLightPos.xyz * wPos.w - wPos.xyz * lights[i].wLightPos.w;
 			}
 		    wView  = wEye * wPos.w - wPos.xyz;
-		    wNormal = (Minv * vec4(vtxNorm, 0)).xyz;
+		    wNormal = (Minv * vec4(lNorm, 0)).xyz;
 		    texcoord = vtxUV;
 		}
 	)";
@@ -336,28 +442,37 @@ public:
 	PhongShader() { create(vertexSource, fragmentSource); }
 
 	void Bind(RenderState state) {
+		BindFrame(state);
+		BindMaterial(state.material, state.texture);
+		BindTransform(state);
+	}
+
+	void BindFrame(const RenderState& state) {
 		Use();
-		setUniform(state.MVP, "MVP");
-		setUniform(state.M, "M");
-		setUniform(state.Minv, "Minv");
 		setUniform(state.wEye, "wEye");
-
 		setUniform(0, "diffuseTexture");
-		bool useTexture = state.texture != nullptr;
-		setUniform(useTexture, "useTexture");
-		if (useTexture) {
-			state.texture->Bind(0);
-			// kell ez?
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		}
-		setUniformMaterial(*state.material, "material");
 
 		setUniform((int)state.lights.size(), "nLights");
 		for (unsigned int i = 0; i < state.lights.size(); i++) {
 			setUniformLight(state.lights[i], std::string("lights[") + std::to_string(i) + std::string("]"));
 		}
 	}
+
+	void BindMaterial(Material* material, Texture* texture) {
+		bool useTexture = texture != nullptr;
+		setUniform(useTexture, "useTexture");
+		if (useTexture) {
+			texture->Bind(0);
+		}
+		setUniformMaterial(*material, "material");
+	}
+
+	void BindTransform(const RenderState& state) {
+		setUniform(state.MVP, "MVP");
+		setUniform(state.M, "M");
+		setUniform(state.Minv, "Minv");
+		setUniform(state.instanced, "instanced");
+	}
 };
 
 struct VertexData {
@@ -365,50 +480,451 @@ struct VertexData {
 	vec2 texcoord;
 };
 
+// Quantized vertex for the GPU, 20 bytes instead of 32: the normal is 10 bit signed normalized per
+// component (GL_INT_2_10_10_10_REV), the texture coordinates are half floats
+struct PackedVertexData {
+	vec3 position;
+	GLuint normal;
+	GLuint texcoord;
+};
+
+inline GLuint PackNormal(const vec3& normal) { return packSnorm3x10_1x2(vec4(normal, 0.0f)); }
+inline vec3 UnpackNormal(const GLuint packed) { return vec3(unpackSnorm3x10_1x2(packed)); }
+inline GLuint PackTexcoord(const vec2& texcoord) { return packHalf2x16(texcoord); }
+inline vec2 UnpackTexcoord(const GLuint packed) { return unpackHalf2x16(packed); }
+
+struct VertexAttribute {
+	GLuint location;
+	GLint components;
+	GLenum type;
+	GLboolean normalized;
+	size_t offset;
+};
+
+// How VertexData is stored in the vbo, Object3d picks the layout at runtime
+struct VertexLayout {
+	const char* name;
+	GLsizei stride;
+	std::vector<VertexAttribute> attributes;
+	void (*write)(const VertexData& vertex, unsigned char* out);
+
+	std::vector<unsigned char> Pack(const std::vector<VertexData>& vertices) const {
+		std::vector<unsigned char> bytes(vertices.size() * stride);
+		for (size_t i = 0; i < vertices.size(); i++) write(vertices[i], &bytes[i * stride]);
+		return bytes;
+	}
+
+	// for the bound vao and vbo
+	void Setup() const {
+		for (const VertexAttribute& attribute : attributes) {
+			glEnableVertexAttribArray(attribute.location);
+			glVertexAttribPointer(attribute.location, attribute.components, attribute.type, attribute.normalized, stride, (void*)attribute.offset);
+		}
+	}
+};
+
+const VertexLayout floatVertexLayout = { "float", sizeof(VertexData), {
+		{ 0, 3, GL_FLOAT, GL_FALSE, offsetof(VertexData, position) },
+		{ 1, 3, GL_FLOAT, GL_FALSE, offsetof(VertexData, normal) },
+		{ 2, 2, GL_FLOAT, GL_FALSE, offsetof(VertexData, texcoord) },
+	},
+	[](const VertexData& vertex, unsigned char* out) { memcpy(out, &vertex, sizeof(VertexData)); }
+};
+
+const VertexLayout packedVertexLayout = { "packed", sizeof(PackedVertexData), {
+		{ 0, 3, GL_FLOAT, GL_FALSE, offsetof(PackedVertexData, position) },
+		{ 1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, offsetof(PackedVertexData, normal) },
+		{ 2, 2, GL_HALF_FLOAT, GL_FALSE, offsetof(PackedVertexData, texcoord) },
+	},
+	[](const VertexData& vertex, unsigned char* out) {
+		PackedVertexData packed = { vertex.position, PackNormal(vertex.normal), PackTexcoord(vertex.texcoord) };
+		memcpy(out, &packed, sizeof(PackedVertexData));
+	}
+};
+
+// The layout of the meshes created from now on
+const VertexLayout* vertexLayout = PACKED_VERTICES ? &packedVertexLayout : &floatVertexLayout;
+
+const float lodMaxScreenError = 1.0f;	// in pixels, the coarsest level below this is drawn
+const float minLodDistance = 0.1f;
+
+// Tessellations of a primitive from the finest to the coarsest, and a coarse one for the shadows and the collision
+struct LodSlices {
+	std::vector<int> slices;
+	int shadowSlices;
+};
+const LodSlices defaultLodSlices = { { 24, 12, 6 }, 6 };
+const LodSlices coneLodSlices = { { 24, 12, 6 }, 12 };	// the cone always had 12 slices, its shadow keeps them
+
+// Largest distance between a circle and its polygon with the given number of slices
+inline float SlicingError(const float radius, const int slices) {
+	return radius * (1.0f - cos((float)M_PI / slices));
+}
+
+struct BoundingSphere {
+	vec3 center = vec3(0.0f);
+	float radius = 0.0f;
+
+	static BoundingSphere FromVertices(const std::vector<VertexData>& vertices) {
+		BoundingSphere sphere;
+		if (vertices.empty()) return sphere;
+		vec3 lo = vertices[0].position, hi = lo;
+		for (const VertexData& v : vertices) {
+			lo = min(lo, v.position);
+			hi = max(hi, v.position);
+		}
+		sphere.center = (lo + hi) * 0.5f;
+		for (const VertexData& v : vertices) sphere.radius = std::max(sphere.radius, length(v.position - sphere.center));
+		return sphere;
+	}
+
+	// Bounds of the transformed sphere, the radius grows with the largest scaling of M
+	BoundingSphere Transform(const mat4& M) const {
+		BoundingSphere sphere;
+		sphere.center = vec3(M * vec4(center, 1.0f));
+		float scaling = std::max(std::max(length(vec3(M[0])), length(vec3(M[1]))), length(vec3(M[2])));
+		sphere.radius = radius * scaling;
+		return sphere;
+	}
+};
+
+// The six clipping planes of a view-projection matrix, the normals point inwards
+class ViewFrustum {
+	// structure of arrays, padded to 8 planes with ones that never cull, so the SSE path tests 4 planes at once
+	alignas(16) float nx[8], ny[8], nz[8], d[8];
+	vec3 eye;
+	float maxDistance;
+public:
+	ViewFrustum(const mat4& VP, const vec3& _eye, const float _maxDistance = 0.0f) : eye(_eye), maxDistance(_maxDistance) {
+		vec4 rows[4];
+		for (int i = 0; i < 4; i++) rows[i] = vec4(VP[0][i], VP[1][i], VP[2][i], VP[3][i]);
+		vec4 planes[6] = {
+			rows[3] + rows[0], rows[3] - rows[0],	// left, right
+			rows[3] + rows[1], rows[3] - rows[1],	// bottom, top
+			rows[3] + rows[2], rows[3] - rows[2],	// near, far
+		};
+		for (int i = 0; i < 8; i++) {
+			vec4 plane = i < 6 ? planes[i] / length(vec3(planes[i])) : vec4(0.0f, 0.0f, 0.0f, 1.0f);
+			nx[i] = plane.x; ny[i] = plane.y; nz[i] = plane.z; d[i] = plane.w;
+		}
+	}
+
+	bool IsVisible(const BoundingSphere& sphere) const {
+		if (maxDistance > 0.0f && length(sphere.center - eye) - sphere.radius > maxDistance) return false;
+#ifdef USE_SSE
+		__m128 cx = _mm_set1_ps(sphere.center.x), cy = _mm_set1_ps(sphere.center.y), cz = _mm_set1_ps(sphere.center.z);
+		__m128 negRadius = _mm_set1_ps(-sphere.radius);
+		for (int i = 0; i < 8; i += 4) {
+			__m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(nx + i), cx), _mm_mul_ps(_mm_load_ps(ny + i), cy)),
+				_mm_add_ps(_mm_mul_ps(_mm_load_ps(nz + i), cz), _mm_load_ps(d + i)));
+			if (_mm_movemask_ps(_mm_cmplt_ps(dist, negRadius))) return false;
+		}
+#else
+		for (int i = 0; i < 6; i++) {
+			if (nx[i] * sphere.center.x + ny[i] * sphere.center.y + nz[i] * sphere.center.z + d[i] < -sphere.radius) return false;
+		}
+#endif
+		return true;
+	}
+
+	// Screen size of a modeling space unit of the sphere at its closest point, relative to a unit at unit distance
+	float Detail(const BoundingSphere& local, const BoundingSphere& world) const {
+		float scaling = local.radius > 0.0f ? world.radius / local.radius : 1.0f;
+		return scaling / std::max(length(world.center - eye) - world.radius, minLodDistance);
+	}
+};
+
+// Merges the bitwise equal vertices of a triangle soup, the triangles become indices into the unique vertices
+void WeldVertices(const std::vector<VertexData>& soup, std::vector<VertexData>& unique, std::vector<GLuint>& indices) {
+	struct VertexHash {
+		size_t operator()(const VertexData& v) const {
+			const unsigned int* words = reinterpret_cast<const unsigned int*>(&v);
+			size_t hash = 2166136261u;
+			for (size_t i = 0; i < sizeof(VertexData) / sizeof(unsigned int); i++) hash = (hash ^ words[i]) * 16777619u;
+			return hash;
+		}
+	};
+	struct VertexEqual {
+		bool operator()(const VertexData& a, const VertexData& b) const { return memcmp(&a, &b, sizeof(VertexData)) == 0; }
+	};
+
+	std::unordered_map<VertexData, GLuint, VertexHash, VertexEqual> lookup;
+	lookup.reserve(soup.size());
+	unique.clear();
+	indices.clear();
+	indices.reserve(soup.size());
+	for (const VertexData& v : soup) {
+		auto it = lookup.find(v);
+		if (it == lookup.end()) {
+			it = lookup.emplace(v, (GLuint)unique.size()).first;
+			unique.push_back(v);
+		}
+		indices.push_back(it->second);
+	}
+}
+
+// Average cache miss ratio: transformed vertices per triangle with a FIFO post-transform cache
+float ComputeACMR(const std::vector<GLuint>& indices, const int cacheSize = 16) {
+	if (indices.size() < 3) return 0.0f;
+	std::vector<GLuint> cache;
+	int misses = 0;
+	for (GLuint index : indices) {
+		if (std::find(cache.begin(), cache.end(), index) != cache.end()) continue;
+		misses++;
+		cache.push_back(index);
+		if ((int)cache.size() > cacheSize) cache.erase(cache.begin());
+	}
+	return (float)misses / (indices.size() / 3);
+}
+
+// Forsyth's linear-speed vertex cache optimization: greedily emits the triangle whose vertices score the highest,
+// a vertex scores high when it is recently used (in the simulated LRU cache) or has few remaining triangles
+void OptimizeVertexCache(std::vector<GLuint>& indices, const int vertexCount) {
+	const int cacheSize = 32;
+	const int triangleCount = (int)indices.size() / 3;
+	if (triangleCount == 0) return;
+
+	auto vertexScore = [cacheSize](int cachePosition, int remaining) {
+		if (remaining == 0) return -1.0f;
+		float score = 0.0f;
+		if (cachePosition >= 3) score = powf(1.0f - (float)(cachePosition - 3) / (cacheSize - 3), 1.5f);
+		else if (cachePosition >= 0) score = 0.75f;	// the last triangle, using it again would not help
+		return score + 2.0f / sqrtf((float)remaining);
+	};
+
+	std::vector<int> remaining(vertexCount, 0), triangleStart(vertexCount + 1, 0);
+	for (GLuint index : indices) remaining[index]++;
+	for (int v = 0; v < vertexCount; v++) triangleStart[v + 1] = triangleStart[v] + remaining[v];
+	std::vector<int> vertexTriangles(indices.size()), filled(vertexCount, 0);	// triangles of each vertex, the live ones first
+	for (int t = 0; t < triangleCount; t++) {
+		for (int k = 0; k < 3; k++) {
+			GLuint v = indices[t * 3 + k];
+			vertexTriangles[triangleStart[v] + filled[v]++] = t;
+		}
+	}
+
+	std::vector<float> vertexScores(vertexCount), triangleScores(triangleCount, 0.0f);
+	std::vector<bool> emitted(triangleCount, false);
+	for (int v = 0; v < vertexCount; v++) vertexScores[v] = vertexScore(-1, remaining[v]);
+	for (int t = 0; t < triangleCount; t++) {
+		for (int k = 0; k < 3; k++) triangleScores[t] += vertexScores[indices[t * 3 + k]];
+	}
+
+	std::vector<GLuint> result;
+	result.reserve(indices.size());
+	std::vector<int> cache, newCache;
+	int bestTriangle = -1, scanFrom = 0;
+	while ((int)result.size() < triangleCount * 3) {
+		if (bestTriangle < 0) {	// nothing useful in the cache, take the best remaining triangle
+			float bestScore = -1.0f;
+			for (int t = scanFrom; t < triangleCount; t++) {
+				if (!emitted[t] && triangleScores[t] > bestScore) { bestScore = triangleScores[t]; bestTriangle = t; }
+			}
+			while (scanFrom < triangleCount && emitted[scanFrom]) scanFrom++;
+		}
+
+		emitted[bestTriangle] = true;
+		newCache.clear();
+		for (int k = 0; k < 3; k++) {
+			GLuint v = indices[bestTriangle * 3 + k];
+			result.push_back(v);
+			newCache.push_back(v);
+			// move the emitted triangle behind the live ones of the vertex
+			int* first = &vertexTriangles[triangleStart[v]];
+			int live = remaining[v]--;
+			for (int i = 0; i < live; i++) {
+				if (first[i] == bestTriangle) { std::swap(first[i], first[live - 1]); break; }
+			}
+		}
+		for (int v : cache) {
+			if (std::find(newCache.begin(), newCache.end(), v) == newCache.end()) newCache.push_back(v);
+		}
+
+		// rescore the vertices that moved in or out of the cache, and their live triangles
+		auto rescore = [&](int v, int position) {
+			float delta = vertexScore(position, remaining[v]) - vertexScores[v];
+			vertexScores[v] += delta;
+			for (int j = 0; j < remaining[v]; j++) triangleScores[vertexTriangles[triangleStart[v] + j]] += delta;
+		};
+		for (size_t i = cacheSize; i < newCache.size(); i++) rescore(newCache[i], -1);
+		if ((int)newCache.size() > cacheSize) newCache.resize(cacheSize);
+		for (size_t i = 0; i < newCache.size(); i++) rescore(newCache[i], (int)i);
+		std::swap(cache, newCache);
+
+		bestTriangle = -1;
+		float bestScore = -1.0f;
+		for (int v : cache) {
+			for (int j = 0; j < remaining[v]; j++) {
+				int t = vertexTriangles[triangleStart[v] + j];
+				if (triangleScores[t] > bestScore) { bestScore = triangleScores[t]; bestTriangle = t; }
+			}
+		}
+	}
+	indices.swap(result);
+}
+
 class Object3d {
 protected:
-	GLuint vao = 0, vbo = 0;
+	struct MeshLod {
+		int first, count;	// index range in the ebo
+		float error;		// largest distance from the exact surface, in modeling space
+	};
+
+	GLuint vao = 0, vbo = 0, ebo = 0, instanceVbo = 0;
+	const VertexLayout* layout = vertexLayout;
 	int vertexCount = 0;
-	std::vector<VertexData> vertices;
+	bool instanced = false;
+	std::vector<VertexData> vertices;	// CPU copy for the shadows and the collision, the coarse level of LOD meshes
+	std::vector<GLuint> indices;		// triangles of the CPU copy
+	std::vector<MeshLod> lods;
+	int currentLod = 0;
+	std::vector<mat4> instances;
+	BoundingSphere bounds;				// of one instance, in modeling space
+	std::vector<int> drawnInstances;	// indices of the instances in the instance buffer
+
+	void uploadInstanceBuffer(const std::vector<int>& indices) {
+		drawnInstances = indices;
+		std::vector<mat4> instanceData;	// M and Minv interleaved
+		instanceData.reserve(indices.size() * 2);
+		for (int i : indices) {
+			instanceData.push_back(instances[i]);
+			instanceData.push_back(inverse(instances[i]));
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+		glBufferData(GL_ARRAY_BUFFER, instanceData.size() * sizeof(mat4), instanceData.data(), GL_DYNAMIC_DRAW);
+	}
 public:
 	Object3d() {
 		glGenVertexArrays(1, &vao);
 		glGenBuffers(1, &vbo);
+		glGenBuffers(1, &ebo);
 	}
 
 	const std::vector<VertexData>& getVertices() const { return vertices; }
+	const std::vector<GLuint>& getIndices() const { return indices; }
+	const std::vector<mat4>& getInstances() const { return instances; }
+	bool isInstanced() const { return instanced; }
+	const BoundingSphere& getBounds() const { return bounds; }
+	int getDrawnInstanceCount() const { return (int)drawnInstances.size(); }
+	int getCurrentLod() const { return currentLod; }
 
 	virtual ~Object3d() {
+		if (instanceVbo) glDeleteBuffers(1, &instanceVbo);
+		if (ebo) glDeleteBuffers(1, &ebo);
 		if (vbo) glDeleteBuffers(1, &vbo);
 		if (vao) glDeleteVertexArrays(1, &vao);
 	}
 
-	void uploadVertexData(const std::vector<VertexData>& vertices) {
-		vertexCount = vertices.size();
-		this->vertices = vertices;
+	// Welds the triangle soup into an indexed mesh
+	void uploadVertexData(const std::vector<VertexData>& soup) {
+		WeldVertices(soup, vertices, indices);
+		Optimize(vertices, indices);
+		uploadIndexed(vertices, indices);
+		lods = { { 0, (int)indices.size(), 0.0f } };
+		currentLod = 0;
+	}
+
+	// Several tessellations of the same surface in one vbo, finest first. The shadow level only stays on the CPU
+	void uploadLods(const std::vector<std::vector<VertexData>>& levels, const std::vector<float>& errors, const std::vector<VertexData>& shadowLevel) {
+		std::vector<VertexData> allVertices, levelVertices;
+		std::vector<GLuint> allIndices, levelIndices;
+		lods.clear();
+		for (size_t i = 0; i < levels.size(); i++) {
+			WeldVertices(levels[i], levelVertices, levelIndices);
+			Optimize(levelVertices, levelIndices);
+			lods.push_back({ (int)allIndices.size(), (int)levelIndices.size(), errors[i] });
+			for (GLuint index : levelIndices) allIndices.push_back(index + (GLuint)allVertices.size());
+			allVertices.insert(allVertices.end(), levelVertices.begin(), levelVertices.end());
+		}
+		uploadIndexed(allVertices, allIndices);
+		currentLod = 0;
+		WeldVertices(shadowLevel, vertices, indices);
+	}
+
+	void uploadIndexed(const std::vector<VertexData>& unique, const std::vector<GLuint>& triangles) {
+		vertexCount = unique.size();
+		bounds = BoundingSphere::FromVertices(unique);
+		std::vector<unsigned char> bytes = layout->Pack(unique);
 		glBindVertexArray(vao);
 		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		glBufferData(GL_ARRAY_BUFFER, vertexCount * sizeof(VertexData), vertices.data(), GL_STATIC_DRAW);
+		glBufferData(GL_ARRAY_BUFFER, bytes.size(), bytes.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);	// part of the vao state
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, triangles.size() * sizeof(GLuint), triangles.data(), GL_STATIC_DRAW);
+		layout->Setup();	// position, normal, texcoord
+	}
+
+	// Reorders the triangles for the post-transform vertex cache
+	static void Optimize(const std::vector<VertexData>& unique, std::vector<GLuint>& triangles) {
+		if (!OPTIMIZE_VERTEX_CACHE) return;
+		float before = ComputeACMR(triangles);
+		OptimizeVertexCache(triangles, (int)unique.size());
+		if (DEBUG) printf("Mesh: %d triangles, %d vertices, ACMR %.3f -> %.3f\n",
+			(int)triangles.size() / 3, (int)unique.size(), before, ComputeACMR(triangles));
+	}
 
-		glEnableVertexAttribArray(0); // position
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, position));
+	// Picks the coarsest level whose error is below lodMaxScreenError, pixelsPerUnit is the screen size of a modeling space unit
+	void selectLod(const float pixelsPerUnit) {
+		currentLod = 0;
+		for (size_t i = 1; i < lods.size(); i++) {
+			if (lods[i].error * pixelsPerUnit <= lodMaxScreenError) currentLod = (int)i;
+		}
+	}
 
-		glEnableVertexAttribArray(1); // normal
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, normal));
+	// Turns the mesh into an instanced one: it is drawn once for every modeling transform with a single draw call
+	void uploadInstanceData(const std::vector<mat4>& transforms) {
+		instanced = true;
+		instances = transforms;
 
-		glEnableVertexAttribArray(2); // texcoord
-		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, texcoord));
+		if (!instanceVbo) glGenBuffers(1, &instanceVbo);
+		glBindVertexArray(vao);
+		std::vector<int> all(transforms.size());
+		for (size_t i = 0; i < all.size(); i++) all[i] = (int)i;
+		uploadInstanceBuffer(all);
+
+		for (int i = 0; i < 8; i++) { // instM and instMinv, one vec4 column per location
+			glEnableVertexAttribArray(3 + i);
+			glVertexAttribPointer(3 + i, 4, GL_FLOAT, GL_FALSE, 2 * sizeof(mat4), (void*)(i * sizeof(vec4)));
+			glVertexAttribDivisor(3 + i, 1);
+		}
+	}
+
+	// Keeps only the instances inside the frustum in the instance buffer, it is rewritten only when this set changes.
+	// M is the modeling transform of the object, returns the number of visible instances and the detail of the closest one
+	int cullInstances(const ViewFrustum& frustum, const mat4& M, float& detail) {
+		std::vector<int> visible;
+		visible.reserve(instances.size());
+		detail = 0.0f;
+		for (size_t i = 0; i < instances.size(); i++) {
+			BoundingSphere world = bounds.Transform(M * instances[i]);
+			if (frustum.IsVisible(world)) {
+				visible.push_back((int)i);
+				detail = std::max(detail, frustum.Detail(bounds, world));
+			}
+		}
+		if (visible != drawnInstances) uploadInstanceBuffer(visible);
+		return (int)visible.size();
 	}
 
 	virtual void Draw() {
 		glBindVertexArray(vao);
-		glDrawArrays(GL_TRIANGLES, 0, vertexCount);
+		if (instanced) {
+			if (!drawnInstances.empty()) glDrawElementsInstanced(GL_TRIANGLES, lods[currentLod].count, GL_UNSIGNED_INT,
+				(void*)(lods[currentLod].first * sizeof(GLuint)), (GLsizei)drawnInstances.size());
+		}
+		else {
+			glDrawElements(GL_TRIANGLES, lods[currentLod].count, GL_UNSIGNED_INT, (void*)(lods[currentLod].first * sizeof(GLuint)));
+		}
 	}
 };
 
 class Plane : public Object3d {
 public:
 	Plane(const vec3 _center, const vec2 _size, const vec3 _normal, const float _angle = 0.0f) {
+		uploadVertexData(Generate(_center, _size, _normal, _angle));
+	}
+
+	// CPU only, so the simulation can build the road without a GL context
+	static std::vector<VertexData> Generate(const vec3 _center, const vec2 _size, const vec3 _normal, const float _angle = 0.0f) {
 		std::vector<VertexData> verticles;
 
 		vec3 tangent = normalize(cross(_normal, vec3(0.0f, 0.0f, 1.0f)));
@@ -439,13 +955,24 @@ public:
 		verticles.push_back({ P3, _normal, vec2(1.0f, 1.0f) });
 		verticles.push_back({ P4, _normal, vec2(0.0f, 1.0f) });
 
-		uploadVertexData(verticles);
+		return verticles;
 	}
 };
 
 class Cylinder : public Object3d {
 public:
-	Cylinder(const vec3 _base, const vec3 _axis, const float _radius, const float _height) {
+	Cylinder(const vec3 _base, const vec3 _axis, const float _radius, const float _height, const LodSlices& lod = defaultLodSlices) {
+		std::vector<std::vector<VertexData>> levels;
+		std::vector<float> errors;
+		for (int slices : lod.slices) {
+			levels.push_back(Generate(_base, _axis, _radius, _height, slices));
+			errors.push_back(SlicingError(_radius, slices));
+		}
+		uploadLods(levels, errors, Generate(_base, _axis, _radius, _height, lod.shadowSlices));
+	}
+
+	static std::vector<VertexData> Generate(const vec3 _base, const vec3 _axis, const float _radius, const float _height, const int slices) {
+		std::vector<VertexData> vertices;
 		vec3 axis = normalize(_axis);
 		vec3 top = _base + axis * _height;
 
@@ -455,7 +982,6 @@ public:
 		vec3 tangent = normalize(cross(up, axis));
 		vec3 bitangent = normalize(cross(axis, tangent));
 
-		const int slices = 6;
 		const float angleStep = 2.0f * M_PI / slices;
 
 		for (int i = 0; i < slices; i++) {
@@ -505,13 +1031,23 @@ public:
 			vertices.push_back({ P2, normal, vec2(0.5f + 0.5f * cos(a1), 0.5f + 0.5f * sin(a1)) });
 		}
 
-		uploadVertexData(vertices);
+		return vertices;
 	}
 };
 
 class Cone : public Object3d {
 public:
-	Cone(const vec3 _apex, const vec3 _axisDir, const float _height, const float _angle) {
+	Cone(const vec3 _apex, const vec3 _axisDir, const float _height, const float _angle, const LodSlices& lod = coneLodSlices) {
+		std::vector<std::vector<VertexData>> levels;
+		std::vector<float> errors;
+		for (int slices : lod.slices) {
+			levels.push_back(Generate(_apex, _axisDir, _height, _angle, slices));
+			errors.push_back(SlicingError(tan(_angle) * _height, slices));
+		}
+		uploadLods(levels, errors, Generate(_apex, _axisDir, _height, _angle, lod.shadowSlices));
+	}
+
+	static std::vector<VertexData> Generate(const vec3 _apex, const vec3 _axisDir, const float _height, const float _angle, const int slices) {
 		std::vector<VertexData> verticles;
 
 		vec3 axisDir = normalize(_axisDir);
@@ -522,7 +1058,6 @@ public:
 		if (length(U) < 1e-6f) U = normalize(cross(axisDir, vec3(0.0f, 1.0f, 0.0f)));
 		vec3 V = normalize(cross(axisDir, U));
 
-		const int slices = 12;
 		for (int i = 0; i < slices; ++i) {
 			float theta1 = (float)(i + 0.5f) / slices * 2 * M_PI;
 			float theta2 = (float)(i + 1.5f) / slices * 2 * M_PI;
@@ -543,13 +1078,26 @@ public:
 			verticles.push_back({ p1, baseNormal, vec2(0.5f + 0.5f * cos(theta1), 0.5f + 0.5f * sin(theta1)) });
 		}
 
-		uploadVertexData(verticles);
+		return verticles;
 	}
 };
 
 class Frustum : public Object3d {
 public:
-	Frustum(const vec3 _base, const vec3 _axisDir, const float _height, const float _radiusBottom, const float _radiusTop) {
+	Frustum(const vec3 _base, const vec3 _axisDir, const float _height, const float _radiusBottom, const float _radiusTop,
+		const LodSlices& lod = defaultLodSlices) {
+		std::vector<std::vector<VertexData>> levels;
+		std::vector<float> errors;
+		for (int slices : lod.slices) {
+			levels.push_back(Generate(_base, _axisDir, _height, _radiusBottom, _radiusTop, slices));
+			errors.push_back(SlicingError(std::max(_radiusBottom, _radiusTop), slices));
+		}
+		uploadLods(levels, errors, Generate(_base, _axisDir, _height, _radiusBottom, _radiusTop, lod.shadowSlices));
+	}
+
+	static std::vector<VertexData> Generate(const vec3 _base, const vec3 _axisDir, const float _height, const float _radiusBottom, const float _radiusTop,
+		const int slices) {
+		std::vector<VertexData> vertices;
 		vec3 axis = normalize(_axisDir);
 		vec3 top = _base + axis * _height;
 
@@ -559,8 +1107,6 @@ public:
 		vec3 tangent = normalize(cross(up, axis));
 		vec3 bitangent = normalize(cross(axis, tangent));
 
-		const int slices = 6;
-
 		const float angleStep = 2.0f * M_PI / slices;
 
 		for (int i = 0; i < slices; ++i) {
@@ -613,15 +1159,33 @@ public:
 			vertices.push_back({ p1, normal, vec2(0.5f + 0.5f * cos(a1), 0.5f + 0.5f * sin(a1)) });
 		}
 
-		uploadVertexData(vertices);
+		return vertices;
 	}
 };
 
 class Sphere : public Object3d {
 public:
-	Sphere(const vec3 _center, const float _radius, const int latitudeSegments = 6, const int longitudeSegments = 6) {
+	// the same number of latitude and longitude segments on every level
+	Sphere(const vec3 _center, const float _radius, const LodSlices& lod = defaultLodSlices) {
+		std::vector<std::vector<VertexData>> levels;
+		std::vector<float> errors;
+		for (int slices : lod.slices) {
+			levels.push_back(Generate(_center, _radius, slices, slices));
+			errors.push_back(SlicingError(_radius, slices));
+		}
+		uploadLods(levels, errors, Generate(_center, _radius, lod.shadowSlices, lod.shadowSlices));
+	}
+
+	// a single level with the given tessellation, it is also used for the shadows
+	Sphere(const vec3 _center, const float _radius, const int latitudeSegments, const int longitudeSegments = 6) {
+		std::vector<VertexData> vertices = Generate(_center, _radius, latitudeSegments, longitudeSegments);
+		uploadLods({ vertices }, { SlicingError(_radius, std::min(latitudeSegments, longitudeSegments)) }, vertices);
+	}
+
+	static std::vector<VertexData> Generate(const vec3 _center, const float _radius, const int latitudeSegments, const int longitudeSegments) {
+		std::vector<VertexData> vertices;
 		std::vector<std::vector<VertexData>> vertexGrid;
-for (int lat = 0; lat <= latitudeSegments; ++lat) {
+		for (int lat = 0; lat <= latitudeSegments; ++lat) {
 			float theta = (float)lat / latitudeSegments * M_PI;
 			float sinTheta = sin(theta);
 			float cosTheta = cos(theta);
@@ -658,7 +1222,7 @@ for (int lat = 0; lat <= latitudeSegments; ++lat) {
 			}
 		}
 
-		uploadVertexData(vertices);
+		return vertices;
 	}
 };
 
@@ -700,10 +1264,105 @@ public:
 			state.MVP = state.P * state.V * state.M;
 			state.material = material;
 			state.texture = texture;
+			state.instanced = geoObj->isInstanced();
 			shader->Bind(state);
 			geoObj->Draw();
 		}
 	}
+
+	// Frustum and distance test of the bounds, instanced meshes are culled instance by instance.
+	// Visible meshes also select their level of detail, pixelsPerUnit is the screen size of a unit at unit distance
+	bool IsVisible(const ViewFrustum& frustum, const float pixelsPerUnit) {
+		mat4 M, Minv;
+		SetModelingTransform(M, Minv);
+		float detail;
+		if (geoObj->isInstanced()) {
+			if (geoObj->cullInstances(frustum, M, detail) == 0) return false;
+		}
+		else {
+			BoundingSphere world = geoObj->getBounds().Transform(M);
+			if (!frustum.IsVisible(world)) return false;
+			detail = frustum.Detail(geoObj->getBounds(), world);
+		}
+		geoObj->selectLod(detail * pixelsPerUnit);
+		return true;
+	}
+
+	// Draw when the shader, the material and the texture are already bound by the batch
+	void DrawBatched(RenderState& state) {
+		mat4 M, Minv;
+		SetModelingTransform(M, Minv);
+		state.M = M;
+		state.Minv = Minv;
+		state.MVP = state.P * state.V * state.M;
+		state.instanced = geoObj->isInstanced();
+		shader->BindTransform(state);
+		geoObj->Draw();
+	}
+};
+
+// Groups the objects by shader, material and texture, so these are bound once per group instead of once per object
+class RenderBatcher {
+	struct Batch {
+		Shader* shader;
+		Material* material;
+		Texture* texture;
+		std::vector<Object*> objects;
+	};
+	std::vector<Batch> batches;
+	std::vector<std::vector<Object*>> visibleObjects;	// of each batch, refilled by every Draw
+public:
+	int drawCalls = 0, stateChanges = 0, culled = 0;	// of the last Draw
+
+	void Build(const std::vector<Object*>& objects) {
+		batches.clear();
+		for (Object* obj : objects) {
+			if (!obj->geoObj || !obj->shader) continue;
+			auto it = std::find_if(batches.begin(), batches.end(), [obj](const Batch& batch) {
+				return batch.shader == obj->shader && batch.material == obj->material && batch.texture == obj->texture;
+			});
+			if (it == batches.end()) batches.push_back({ obj->shader, obj->material, obj->texture, { obj } });
+			else it->objects.push_back(obj);
+		}
+		std::stable_sort(batches.begin(), batches.end(), [](const Batch& a, const Batch& b) {
+			if (a.shader != b.shader) return a.shader < b.shader;
+			return a.texture < b.texture;
+		});
+	}
+
+	void Draw(RenderState state) {
+		PROFILE_SCOPE("RenderBatcher::Draw");
+		drawCalls = stateChanges = culled = 0;
+
+		// culling first, so batches without visible objects do not bind anything
+		ViewFrustum frustum(state.P * state.V, state.wEye, state.cullDistance);
+		float pixelsPerUnit = state.P[1][1] * windowHeight * 0.5f;
+		visibleObjects.resize(batches.size());
+		for (size_t i = 0; i < batches.size(); i++) {
+			visibleObjects[i].clear();
+			for (Object* obj : batches[i].objects) {
+				if (obj->IsVisible(frustum, pixelsPerUnit)) visibleObjects[i].push_back(obj);
+				else culled++;
+			}
+		}
+
+		Shader* boundShader = nullptr;
+		for (size_t i = 0; i < batches.size(); i++) {
+			Batch& batch = batches[i];
+			if (visibleObjects[i].empty()) continue;
+			if (batch.shader != boundShader) {
+				batch.shader->BindFrame(state);
+				boundShader = batch.shader;
+				stateChanges++;
+			}
+			batch.shader->BindMaterial(batch.material, batch.texture);
+			stateChanges++;
+			for (Object* obj : visibleObjects[i]) {
+				obj->DrawBatched(state);
+				drawCalls++;
+			}
+		}
+	}
 };
 
 float sign(const vec3 p1, const vec3 p2, const vec3 p3) {
@@ -730,26 +1389,376 @@ bool isPointInTriangle(const vec3& p, const vec3& t1, const vec3& t2, const vec3
 	return distToEdge <= 1.0f;
 }
 
+struct RoadSegment {
+	vec3 center;
+	vec2 size;
+	float angle;
+	int surface = 0;	// index into TrackDefinition::surfaces
+};
+
+// How a group of segments looks, the material and the texture are looked up by name when the scene is built
+struct TrackSurface {
+	std::string name, material, texture;
+	int textureWidth = 1, textureHeight = 1;
+};
+
+const char* const defaultTrackFile = "maputo.track";
+
+// The road, loaded from a text file at startup:
+//	surface <name> <material> <texture> <texture width> <texture height>
+//	segment <surface> <center x> <center y> <center z> <width> <length> <angle in degrees>
+// Empty lines and lines starting with # are skipped.
+class TrackDefinition {
+public:
+	std::vector<TrackSurface> surfaces;
+	std::vector<RoadSegment> segments;
+
+	int findSurface(const std::string& name) const {
+		for (size_t i = 0; i < surfaces.size(); i++) {
+			if (surfaces[i].name == name) return (int)i;
+		}
+		return -1;
+	}
+
+	bool Load(const fs::path& path) {
+		std::ifstream file(path);
+		if (!file.is_open()) {
+			printf("Error while opening track file %s!\n", path.string().c_str());
+			return false;
+		}
+		surfaces.clear();
+		segments.clear();
+
+		std::string line;
+		int lineNumber = 0;
+		while (std::getline(file, line)) {
+			lineNumber++;
+			std::istringstream words(line);
+			std::string keyword;
+			if (!(words >> keyword) || keyword[0] == '#') continue;
+
+			if (keyword == "surface") {
+				TrackSurface surface;
+				if (words >> surface.name >> surface.material >> surface.texture >> surface.textureWidth >> surface.textureHeight) {
+					surfaces.push_back(surface);
+					continue;
+				}
+			}
+			else if (keyword == "segment") {
+				std::string surfaceName;
+				RoadSegment segment;
+				float angleDeg;
+				if (words >> surfaceName >> segment.center.x >> segment.center.y >> segment.center.z >> segment.size.x >> segment.size.y >> angleDeg) {
+					segment.surface = findSurface(surfaceName);
+					segment.angle = radians(angleDeg);
+					if (segment.surface >= 0) {
+						segments.push_back(segment);
+						continue;
+					}
+				}
+			}
+			printf("%s:%d: invalid line: %s\n", path.string().c_str(), lineNumber, line.c_str());
+			return false;
+		}
+		if (DEBUG) printf("Track %s: %d surfaces, %d segments\n", path.string().c_str(), (int)surfaces.size(), (int)segments.size());
+		return !segments.empty();
+	}
+
+	// The original circuit, used when the track file is missing
+	static TrackDefinition BuiltIn() {
+		TrackDefinition track;
+		track.surfaces = {
+			{ "start", "board", "checker", 3, 3 },
+			{ "asphalt", "road", "asphalt", 200, 200 },
+		};
+		track.segments = {
+			{ vec3(0.0f, -0.99f, 0.0f),		vec2(7.0f, 7.0f),	0.0f,	0 },
+			{ vec3(50.0f, -1.0f, 0.0f),		vec2(7.0f, 100.0f),	M_PI_2,	1 },
+			{ vec3(100.0f, -1.0f, 5.0f),	vec2(7.0f, 20.0f),	M_PI_2,	1 },
+			{ vec3(110.0f, -1.0f, 21.5f),	vec2(7.0f, 40.0f),	0.0f,	1 },
+			{ vec3(105.0f, -1.0f, 50.5f),	vec2(7.0f, 40.0f),	0.0f,	1 },
+			{ vec3(88.5f, -1.0f, 70.0f),	vec2(7.0f, 40.0f),	M_PI_2,	1 },
+			{ vec3(65.0f, -1.0f, 65.0f),	vec2(10.0f, 20.0f),	M_PI_2,	1 },
+			{ vec3(55.0f, -1.0f, 60.0f),	vec2(10.0f, 20.0f),	M_PI_2,	1 },
+			{ vec3(35.0f, -1.0f, 58.5f),	vec2(7.0f, 40.0f),	M_PI_2,	1 },
+			{ vec3(5.0f, -1.0f, 65.5f),		vec2(7.0f, 40.0f),	M_PI_2,	1 },
+			{ vec3(-20.0f, -1.0f, 72.5f),	vec2(7.0f, 30.0f),	M_PI_2,	1 },
+			{ vec3(-20.0f, -1.0f, 72.5f),	vec2(7.0f, 30.0f),	M_PI_2,	1 },
+			{ vec3(-33.0f, -1.0f, 64.0f),	vec2(7.0f, 25.0f),	0.0f,	1 },
+			{ vec3(-60.0f, -1.0f, 55.0f),	vec2(7.0f, 60.0f),	M_PI_2,	1 },
+			{ vec3(-97.0f, -1.0f, 50.0f),	vec2(7.0f, 30.0f),	M_PI_2,	1 },
+			{ vec3(-110.0f, -1.0f, 55.0f),	vec2(7.0f, 20.0f),	M_PI_2,	1 },
+			{ vec3(-120.0f, -1.0f, 60.0f),	vec2(7.0f, 20.0f),	M_PI_2,	1 },
+			{ vec3(-130.0f, -1.0f, 41.0f),	vec2(7.0f, 44.5f),	0.0f,	1 },
+			{ vec3(-135.0f, -1.0f, 9.5f),	vec2(7.0f, 40.0f),	0.0f,	1 },
+			{ vec3(-125.0f, -1.0f, -7.0f),	vec2(7.0f, 20.0f),	M_PI_2,	1 },
+			{ vec3(-62.0f, -1.0f, 0.0f),	vec2(7.0f, 125.0f),	M_PI_2,	1 },
+		};
+		return track;
+	}
+
+	static TrackDefinition LoadOrBuiltIn(const fs::path& path = defaultTrackFile) {
+		TrackDefinition track;
+		if (!track.Load(path)) {
+			printf("Using the built-in track\n");
+			track = BuiltIn();
+		}
+		return track;
+	}
+};
+
+// Segments farther than this from the car are neither drawn nor tested for collision.
+// It is larger than the far plane of the camera, so nothing pops up in view.
+const float streamingRadius = 60.0f;
+const float streamingCellSize = 20.0f;
+
+// Keeps the set of segments near a point up to date. The segments are put into a uniform grid,
+// the active set is only recomputed when the point moves to another cell and only nearby cells are visited,
+// so the cost does not depend on the length of the track.
+class TrackStreamer {
+	const TrackDefinition* track = nullptr;
+	std::unordered_map<long long, std::vector<int>> cells;
+	std::vector<int> active, visited;
+	long long currentCell = 0;
+	bool valid = false;
+	int version = 0, stamp = 0;
+
+	static long long cellKey(const int x, const int z) { return ((long long)x << 32) ^ (unsigned int)z; }
+	static int cellCoord(const float v) { return (int)floor(v / streamingCellSize); }
+	static float segmentRadius(const RoadSegment& segment) { return 0.5f * length(segment.size); }
+public:
+	void Build(const TrackDefinition* _track) {
+		track = _track;
+		cells.clear();
+		active.clear();
+		valid = false;
+		visited.assign(track->segments.size(), -1);
+		stamp = 0;
+		for (size_t i = 0; i < track->segments.size(); i++) {
+			const RoadSegment& segment = track->segments[i];
+			float r = segmentRadius(segment);
+			for (int x = cellCoord(segment.center.x - r); x <= cellCoord(segment.center.x + r); x++) {
+				for (int z = cellCoord(segment.center.z - r); z <= cellCoord(segment.center.z + r); z++) {
+					cells[cellKey(x, z)].push_back((int)i);
+				}
+			}
+		}
+		version++;
+	}
+
+	// Returns true if the active set has changed
+	bool Update(const vec3& center) {
+		int cx = cellCoord(center.x), cz = cellCoord(center.z);
+		long long key = cellKey(cx, cz);
+		if (valid && key == currentCell) return false;
+		currentCell = key;
+		valid = true;
+
+		// anything within the radius of any point of the cell
+		vec2 cellCenter = (vec2(cx, cz) + 0.5f) * streamingCellSize;
+		float reach = streamingRadius + streamingCellSize * (float)M_SQRT1_2;
+		int range = (int)ceil(reach / streamingCellSize);
+
+		std::vector<int> found;
+		for (int x = cx - range; x <= cx + range; x++) {
+			for (int z = cz - range; z <= cz + range; z++) {
+				auto cell = cells.find(cellKey(x, z));
+				if (cell == cells.end()) continue;
+				for (int i : cell->second) {
+					if (visited[i] == stamp) continue;
+					visited[i] = stamp;
+					const RoadSegment& segment = track->segments[i];
+					if (length(vec2(segment.center.x, segment.center.z) - cellCenter) <= reach + segmentRadius(segment)) {
+						found.push_back(i);
+					}
+				}
+			}
+		}
+		stamp++;
+		std::sort(found.begin(), found.end());
+		if (found == active) return false;
+		active = found;
+		version++;
+		if (DEBUG) printf("Streaming: %d of %d segments active\n", (int)active.size(), (int)track->segments.size());
+		return true;
+	}
+
+	const std::vector<int>& Active() const { return active; }
+	int Version() const { return version; }
+};
+
+// Length of one physics step in seconds, the speed of the car is measured in units per step
+const float simTimeStep = 1.0f / 60.0f;
+// Upper limit of steps in one frame, so a long hiccup does not freeze the game
+const int maxStepsPerFrame = 8;
+
+class FixedTimestep {
+	float step, accumulator = 0.0f;
+	int maxSteps;
+public:
+	FixedTimestep(const float _step = simTimeStep, const int _maxSteps = maxStepsPerFrame) : step(_step), maxSteps(_maxSteps) {}
+
+	// Returns how many simulation steps have to be taken for the elapsed real time
+	int Advance(const float elapsed) {
+		accumulator += elapsed;
+		int steps = (int)(accumulator / step);
+		if (steps > maxSteps) {
+			steps = maxSteps;
+			accumulator = 0.0f;
+		}
+		else {
+			accumulator -= steps * step;
+		}
+		return steps;
+	}
+
+	// How far we are between the last two simulation steps, used for the interpolation
+	float Alpha() const { return accumulator / step; }
+	void Reset() { accumulator = 0.0f; }
+};
+
+// The car physics without any GL dependency, so it can run headless too
+class CarSimulation {
+	std::vector<vec3> roadP1, roadP2, roadP3;	// of the active segments
+	const TrackDefinition* track = nullptr;
+public:
+	TrackStreamer streamer;
+	vec3 carBase = vec3(0.0f, -0.25f, 0.0f);
+	vec3 carTarget = carBase;
+	vec3 carAxis = vec3(0.0f, 0.0f, -1.0f);
+	float speed = 0.0f;
+	long long steps = 0;
+	bool Start = false;
+	bool Out = false;
+
+	void AddRoad(const RoadSegment& segment) {
+		std::vector<VertexData> verts = Plane::Generate(segment.center, segment.size, vec3(0.0f, 1.0f, 0.0f), segment.angle);
+		for (size_t i = 0; i + 2 < verts.size(); i += 3) {
+			roadP1.push_back(verts[i].position);
+			roadP2.push_back(verts[i + 1].position);
+			roadP3.push_back(verts[i + 2].position);
+		}
+	}
+
+	void BuildTrack(const TrackDefinition& _track) {
+		track = &_track;
+		streamer.Build(track);
+		StreamRoad(true);
+	}
+
+	// Keeps only the segments near the car in the collision set
+	void StreamRoad(const bool force = false) {
+		if (!streamer.Update(carBase) && !force) return;
+		roadP1.clear();
+		roadP2.clear();
+		roadP3.clear();
+		for (int i : streamer.Active()) AddRoad(track->segments[i]);
+	}
+
+	bool isCarOnRoad() const {
+		PROFILE_SCOPE("isCarOnRoad");
+		for (size_t i = 0; i < roadP1.size(); i++) {
+			if (isPointInTriangle(carBase, roadP1[i], roadP2[i], roadP3[i])) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// One fixed step, returns true if the car has moved
+	bool Step() {
+		steps++;
+		if (Out) return false;
+
+		vec3 dir = carTarget - carBase;
+		if (length(dir) <= 1e-4) return false;
+
+		if (length(dir) > speed)
+			dir = normalize(dir) * speed;
+		carTarget += dir;
+
+		if (!Start || speed == 0.0f) return false;
+
+		StreamRoad();
+		if (!isCarOnRoad()) {
+			Out = true;
+			if (DEBUG) printf("Car is out of the road:\t%f, %f, %f\n", carBase.x, carBase.y, carBase.z);
+			return false;
+		}
+
+		if (length(dir) > 1e-4) {
+			vec3 newDir = normalize(dir);
+			carAxis = normalize(mix(carAxis, newDir, 0.2f));
+		}
+
+		carBase = carBase + dir;
+		carBase *= vec3(1.0f, 0.0f, 1.0f);
+		return true;
+	}
+
+	void Reset() {
+		carBase = vec3(0.0f, 0.0f, 0.0f);
+		carTarget = carBase;
+		carAxis = vec3(0.0f, 0.0f, -1.0f);
+		speed = 0.0f;
+		Out = false;
+		if (track) StreamRoad();
+	}
+};
+
+// Runs the simulation without rendering, as fast as the CPU can, e.g. for replays or for evaluating AI drivers.
+// The driver is called before every step and can steer the car through the target and the speed.
+// Returns the number of steps taken before the car left the road or the step limit was reached.
+template<class Driver>
+long long RunHeadless(CarSimulation& sim, const long long maxSteps, Driver driver) {
+	long long step = 0;
+	for (; step < maxSteps && !sim.Out; step++) {
+		driver(sim, step);
+		sim.Step();
+	}
+	return step;
+}
+
 const vec3 defCamBase = vec3(-10.0f, 10.0f, 0.0f);
 
+// What the renderer needs from a simulation step, it is interpolated between the last two steps
+struct CarPose {
+	vec3 translation;
+	quat rotation;
+	vec3 camEye, camLookat;
+
+	bool operator==(const CarPose& other) const {
+		return translation == other.translation && rotation == other.rotation &&
+			camEye == other.camEye && camLookat == other.camLookat;
+	}
+
+	static CarPose Interpolate(const CarPose& from, const CarPose& to, const float alpha) {
+		CarPose pose;
+		pose.translation = mix(from.translation, to.translation, alpha);
+		pose.rotation = slerp(from.rotation, to.rotation, alpha);
+		pose.camEye = mix(from.camEye, to.camEye, alpha);
+		pose.camLookat = mix(from.camLookat, to.camLookat, alpha);
+		return pose;
+	}
+};
+
 class Scene {
 	std::vector<Object*> objects;
 	std::vector<vec3> trisP1, trisP2, trisP3;
 	std::vector<Light> lights;
 	Camera camera;
+	RenderBatcher batcher;
 
-	vec3 carBase = vec3(0.0f, -0.25f, 0.0f);
+	TrackDefinition track;
+	std::vector<Object3d*> surfaceMeshes;	// instanced, one for each surface of the track
+	int streamedVersion = -1;
+
+	CarSimulation sim;
+	CarPose prevPose, currPose, drawnPose;
+	bool sceneDirty = true;	// the car objects and the shadow triangles have to be updated
 	vec3 camBase = defCamBase;
-	vec3 carTarget = carBase;
-	vec3 carAxis = vec3(0.0f, 0.0f, -1.0f);
-	Object* carObj;
-	std::vector<Object*> roadObjects;
 	std::vector<Object*> carObjects;
-	float speed = 0.0f;
 public:
-	bool Start = false;
-	bool Out = false;
-
 	void Build() {
 		if (DEBUG) printf("Creating scene...\n");
 		// Shaders
@@ -765,118 +1774,25 @@ public:
 		Material* grassMat = new Material(vec3(0.6f, 1.0f, 0.2f), vec3(0.05f, 0.05f, 0.05f), vec3(0.2f, 0.2f, 0.1f), 2.0f);
 
 		// Textures
-		Texture* boardTexture = new CheckerTexture(3, 3, vec3(0.0f, 0.0f, 0.0f), vec3(0.9f, 0.9f, 0.9f));
-		Texture* asphaltTexture = new AsphaltTexture(200, 200);
 		Texture* dryGrassTexture = new DryGrassTexture(1200, 600);
 
 		// Create objects by setting up their vertex data on the GPU
 		// ----------
 		// Road
 		// ----------
-		Object3d* checkerPlane = new Plane(vec3(0.0f, -0.99f, 0.0f), vec2(7.0f, 7.0f), vec3(0.0f, 1.0f, 0.0f));
-		Object* board = new Object(phongShader, boardMaterial, checkerPlane, boardTexture);
-		objects.push_back(board);
-		roadObjects.push_back(board);
-
-		Object3d* roadPlane1 = new Plane(vec3(50.0f, -1.0f, 0.0f), vec2(7.0f, 100.0f), vec3(0.0f, 1.0f, 0.0f), M_PI_2);
-		Object* road1 = new Object(phongShader, roadMaterial, roadPlane1, asphaltTexture);
-		objects.push_back(road1);
-		roadObjects.push_back(road1);
-
-		Object3d* roadPlane2 = new Plane(vec3(100.0f, -1.0f, 5.0f), vec2(7.0f, 20.0f), vec3(0.0f, 1.0f, 0.0f), M_PI_2);
-		Object* road2 = new Object(phongShader, roadMaterial, roadPlane2, asphaltTexture);
-		objects.push_back(road2);
-		roadObjects.push_back(road2);
-
-		Object3d* roadPlane3 = new Plane(vec3(110.0f, -1.0f, 21.5f), vec2(7.0f, 40.0f), vec3(0.0f, 1.0f, 0.0f));
-		Object* road3 = new Object(phongShader, roadMaterial, roadPlane3, asphaltTexture);
-		objects.push_back(road3);
-		roadObjects.push_back(road3);
-
-		Object3d* roadPlane4 = new Plane(vec3(105.0f, -1.0f, 50.5f), vec2(7.0f, 40.0f), vec3(0.0f, 1.0f, 0.0f));
-		Object* road4 = new Object(phongShader, roadMaterial, roadPlane4, asphaltTexture);
-		objects.push_back(road4);
-		roadObjects.push_back(road4);
-
-		Object3d* roadPlane5 = new Plane(vec3(88.5f, -1.0f, 70.0f), vec2(7.0f, 40.0f), vec3(0.0f, 1.0f, 0.0f), M_PI_2);
-		Object* road5 = new Object(phongShader, roadMaterial, roadPlane5, asphaltTexture);
-		objects.push_back(road5);
-		roadObjects.push_back(road5);
-
-		Object3d* roadPlane6 = new Plane(vec3(65.0f, -1.0f, 65.0f), vec2(10.0f, 20.0f), vec3(0.0f, 1.0f, 0.0f), M_PI_2);
-		Object* road6 = new Object(phongShader, roadMaterial, roadPlane6, asphaltTexture);
-		objects.push_back(road6);
-		roadObjects.push_back(road6);
-
-		Object3d* roadPlane7 = new Plane(vec3(55.0f, -1.0f, 60.0f), vec2(10.0f, 20.0f), vec3(0.0f, 1.0f, 0.0f), M_PI_2);
-		Object* road7 = new Object(phongShader, roadMaterial, roadPlane7, asphaltTexture);
-		objects.push_back(road7);
-		roadObjects.push_back(road7);
-
-		Object3d* roadPlane8 = new Plane(vec3(35.0f, -1.0f, 58.5f), vec2(7.0f, 40.0f), vec3(0.0f, 1.0f, 0.0f), M_PI_2);
-		Object* road8 = new Object(phongShader, roadMaterial, roadPlane8, asphaltTexture);
-		objects.push_back(road8);
-		roadObjects.push_back(road8);
-
-		Object3d* roadPlane9 = new Plane(vec3(5.0f, -1.0f, 65.5f), vec2(7.0f, 40.0f), vec3(0.0f, 1.0f, 0.0f), M_PI_2);
-		Object* road9 = new Object(phongShader, roadMaterial, roadPlane9, asphaltTexture);
-		objects.push_back(road9);
-		roadObjects.push_back(road9);
-
-		Object3d* roadPlane10 = new Plane(vec3(-20.0f, -1.0f, 72.5f), vec2(7.0f, 30.0f), vec3(0.0f, 1.0f, 0.0f), M_PI_2);
-		Object* road10 = new Object(phongShader, roadMaterial, roadPlane10, asphaltTexture);
-		objects.push_back(road10);
-		roadObjects.push_back(road10);
-
-		Object3d* roadPlane11 = new Plane(vec3(-20.0f, -1.0f, 72.5f), vec2(7.0f, 30.0f), vec3(0.0f, 1.0f, 0.0f), M_PI_2);
-		Object* road11 = new Object(phongShader, roadMaterial, roadPlane11, asphaltTexture);
-		objects.push_back(road11);
-		roadObjects.push_back(road11);
-
-		Object3d* roadPlane12 = new Plane(vec3(-33.0f, -1.0f, 64.0f), vec2(7.0f, 25.0f), vec3(0.0f, 1.0f, 0.0f));
-		Object* road12 = new Object(phongShader, roadMaterial, roadPlane12, asphaltTexture);
-		objects.push_back(road12);
-		roadObjects.push_back(road12);
-
-		Object3d* roadPlane13 = new Plane(vec3(-60.0f, -1.0f, 55.0f), vec2(7.0f, 60.0f), vec3(0.0f, 1.0f, 0.0f), M_PI_2);
-		Object* road13 = new Object(phongShader, roadMaterial, roadPlane13, asphaltTexture);
-		objects.push_back(road13);
-		roadObjects.push_back(road13);
-
-		Object3d* roadPlane14 = new Plane(vec3(-97.0f, -1.0f, 50.0f), vec2(7.0f, 30.0f), vec3(0.0f, 1.0f, 0.0f), M_PI_2);
-		Object* road14 = new Object(phongShader, roadMaterial, roadPlane14, asphaltTexture);
-		objects.push_back(road14);
-		roadObjects.push_back(road14);
-
-		Object3d* roadPlane15 = new Plane(vec3(-110.0f, -1.0f, 55.0f), vec2(7.0f, 20.0f), vec3(0.0f, 1.0f, 0.0f), M_PI_2);
-		Object* road15 = new Object(phongShader, roadMaterial, roadPlane15, asphaltTexture);
-		objects.push_back(road15);
-		roadObjects.push_back(road15);
-
-		Object3d* roadPlane16 = new Plane(vec3(-120.0f, -1.0f, 60.0f), vec2(7.0f, 20.0f), vec3(0.0f, 1.0f, 0.0f), M_PI_2);
-		Object* road16 = new Object(phongShader, roadMaterial, roadPlane16, asphaltTexture);
-		objects.push_back(road16);
-		roadObjects.push_back(road16);
-
-		Object3d* roadPlane17 = new Plane(vec3(-130.0f, -1.0f, 41.0f), vec2(7.0f, 44.5f), vec3(0.0f, 1.0f, 0.0f));
-		Object* road17 = new Object(phongShader, roadMaterial, roadPlane17, asphaltTexture);
-		objects.push_back(road17);
-		roadObjects.push_back(road17);
-
-		Object3d* roadPlane18 = new Plane(vec3(-135.0f, -1.0f, 9.5f), vec2(7.0f, 40.0f), vec3(0.0f, 1.0f, 0.0f));
-		Object* road18 = new Object(phongShader, roadMaterial, roadPlane18, asphaltTexture);
-		objects.push_back(road18);
-		roadObjects.push_back(road18);
-
-		Object3d* roadPlane19 = new Plane(vec3(-125.0f, -1.0f, -7.0f), vec2(7.0f, 20.0f), vec3(0.0f, 1.0f, 0.0f), M_PI_2);
-		Object* road19 = new Object(phongShader, roadMaterial, roadPlane19, asphaltTexture);
-		objects.push_back(road19);
-		roadObjects.push_back(road19);
-
-		Object3d* roadPlane20 = new Plane(vec3(-62.0f, -1.0f, 0.0f), vec2(7.0f, 125.0f), vec3(0.0f, 1.0f, 0.0f), M_PI_2);
-		Object* road20 = new Object(phongShader, roadMaterial, roadPlane20, asphaltTexture);
-		objects.push_back(road20);
-		roadObjects.push_back(road20);
+		// every segment is an instance of the same unit plane, one instanced mesh for each surface of the track,
+		// the instances are filled by the streaming
+		std::map<std::string, Material*> materials = { { "board", boardMaterial }, { "road", roadMaterial }, { "grass", grassMat } };
+		track = TrackDefinition::LoadOrBuiltIn();
+		for (const TrackSurface& surface : track.surfaces) {
+			Material* material = materials.count(surface.material) ? materials[surface.material] : roadMaterial;
+			Texture* texture = CreateTrackTexture(surface.texture, surface.textureWidth, surface.textureHeight);
+			Object3d* roadPlane = new Plane(vec3(0.0f, 0.0f, 0.0f), vec2(1.0f, 1.0f), vec3(0.0f, 1.0f, 0.0f));
+			roadPlane->uploadInstanceData({});
+			surfaceMeshes.push_back(roadPlane);
+			objects.push_back(new Object(phongShader, material, roadPlane, texture));
+		}
+		sim.BuildTrack(track);
 
 		// ----------
 		// Grass
@@ -888,8 +1804,9 @@ public:
 		// ----------
 		// Car
 		// ----------
+		vec3 carBase = sim.carBase, carAxis = sim.carAxis;
 		Object3d* carBodyObj = new Cylinder(carBase, carAxis, 0.5f, 2.0f);
-		carObj = new Object(phongShader, carBodyMat, carBodyObj);
+		Object* carObj = new Object(phongShader, carBodyMat, carBodyObj);
 		objects.push_back(carObj);
 		carObjects.push_back(carObj);
 
@@ -903,36 +1820,24 @@ public:
 		objects.push_back(carBody3);
 		carObjects.push_back(carBody3);
 
-		Object3d* wheel1Obj = new Cylinder(carBase + vec3(0.65f, -0.4f, -1.5f), carAxis + vec3(-1.0f, 0.0f, 1.0f), 0.4f, 0.3f);
-		Object* wheel1 = new Object(phongShader, blackRubber, wheel1Obj);
-		objects.push_back(wheel1);
-		carObjects.push_back(wheel1);
-
-		Object3d* wheel2Obj = new Cylinder(carBase + vec3(0.65f, -0.4f, -0.5f), carAxis + vec3(-1.0f, 0.0f, 1.0f), 0.4f, 0.3f);
-		Object* wheel2 = new Object(phongShader, blackRubber, wheel2Obj);
-		objects.push_back(wheel2);
-		carObjects.push_back(wheel2);
-
-		Object3d* wheel3Obj = new Cylinder(carBase + vec3(-0.35f, -0.4f, -1.5f), carAxis + vec3(-1.0f, 0.0f, 1.0f), 0.4f, 0.3f);
-		Object* wheel3 = new Object(phongShader, blackRubber, wheel3Obj);
-		objects.push_back(wheel3);
-		carObjects.push_back(wheel3);
-
-		Object3d* wheel4Obj = new Cylinder(carBase + vec3(-0.35f, -0.4f, -0.5f), carAxis + vec3(-1.0f, 0.0f, 1.0f), 0.4f, 0.3f);
-		Object* wheel4 = new Object(phongShader, blackRubber, wheel4Obj);
-		objects.push_back(wheel4);
-		carObjects.push_back(wheel4);
+		// the four wheels share one mesh, only their offsets differ
+		std::vector<mat4> wheelTransforms = {
+			translate(carBase + vec3(0.65f, -0.4f, -1.5f)),
+			translate(carBase + vec3(0.65f, -0.4f, -0.5f)),
+			translate(carBase + vec3(-0.35f, -0.4f, -1.5f)),
+			translate(carBase + vec3(-0.35f, -0.4f, -0.5f)),
+		};
+		Object3d* wheelObj = new Cylinder(vec3(0.0f, 0.0f, 0.0f), carAxis + vec3(-1.0f, 0.0f, 1.0f), 0.4f, 0.3f);
+		wheelObj->uploadInstanceData(wheelTransforms);
+		Object* wheels = new Object(phongShader, blackRubber, wheelObj);
+		objects.push_back(wheels);
+		carObjects.push_back(wheels);
 
-		for (Object* obj : carObjects) {
-			obj->translation = carBase;
-			obj->rotationAxis = vec3(0.0f, 1.0f, 0.0f);
-			obj->rotationAngle = M_PI_2;
-		}
+		batcher.Build(objects);
 
 		// Camera
-		camera.wEye = camBase;
-		camera.wLookat = carBase;
 		camera.wVup = vec3(0.0f, 1.0f, 0.0f);
+		ResetPose();
 
 		// Lights
 		lights.resize(2);
@@ -944,34 +1849,92 @@ public:
 		lights[1].Le = vec3(1.0f, 1.0f, 1.0f);
 
 		if (DEBUG) printf("All set up!\n");
-
-		// Upload the objects (and triangles) to the GPU
-		UploadToGPU();
 	}
 
-	void Render() {
+	// Draws the scene between the last two simulation steps, alpha is in [0, 1]
+	void Render(const float alpha) {
+		PROFILE_SCOPE("Scene::Render");
+		CarPose pose = CarPose::Interpolate(prevPose, currPose, alpha);
+		camera.wEye = pose.camEye;
+		camera.wLookat = pose.camLookat;
+		StreamSegments();
+		if (sceneDirty || !(pose == drawnPose)) {
+			float angle = glm::angle(pose.rotation);
+			vec3 axis = angle > 1e-6f ? glm::axis(pose.rotation) : vec3(0.0f, 1.0f, 0.0f);
+			for (Object* obj : carObjects) {
+				obj->translation = pose.translation;
+				obj->rotationAxis = axis;
+				obj->rotationAngle = angle;
+			}
+			// Upload the objects (and triangles) to the GPU
+			UploadToGPU();
+			drawnPose = pose;
+			sceneDirty = false;
+		}
+
 		RenderState state;
 		state.wEye = camera.wEye;
 		state.V = camera.V();
 		state.P = camera.P();
 		state.lights = lights;
-		for (Object* obj : objects) obj->Draw(state);
-
-		if (Out) return;
+		state.cullDistance = camera.bp;
+		batcher.Draw(state);
+	}
 
-		vec3 carPos = getCarPosition();
-		vec3 dir = carTarget - carPos;
+	// Uploads the transforms of the active segments as instances, when the active set has changed
+	void StreamSegments() {
+		if (streamedVersion == sim.streamer.Version()) return;
+		streamedVersion = sim.streamer.Version();
 
-		if (length(dir) > 1e-4) {
-			if (length(dir) > speed)
-				dir = normalize(dir) * speed;
-			carTarget += dir;
-			MoveCar(dir);
+		std::vector<std::vector<mat4>> transforms(track.surfaces.size());
+		for (int i : sim.streamer.Active()) {
+			const RoadSegment& segment = track.segments[i];
+			transforms[segment.surface].push_back(translate(segment.center) * rotate(segment.angle, vec3(0.0f, 1.0f, 0.0f)) * scale(vec3(segment.size.x, 1.0f, segment.size.y)));
 		}
+		for (size_t i = 0; i < surfaceMeshes.size(); i++) surfaceMeshes[i]->uploadInstanceData(transforms[i]);
+		sceneDirty = true;
+	}
+
+	// One fixed physics step, the car follows the target and the camera follows the car
+	void Step() {
+		prevPose = currPose;
+		if (!sim.Step()) return;
 
+		vec3 carAxis = sim.carAxis, carBase = sim.carBase;
+		vec3 forward = vec3(0.0f, 0.0f, 1.0f);
+		float angle = acos(clamp(dot(forward, carAxis), -1.0f, 1.0f));
+		vec3 axis = cross(forward, carAxis);
+		if (length(axis) < 1e-4) axis = vec3(0.0f, 1.0f, 0.0f);
+
+		currPose.translation = carBase;
+		currPose.rotation = angleAxis(angle, normalize(axis));
+
+		float camAngle = atan2(carAxis.x, carAxis.z);
+		vec3 rotatedCamBase = vec3(
+			camBase.x * sin(camAngle) + camBase.z * cos(camAngle),
+			camBase.y,
+			camBase.x * cos(camAngle) - camBase.z * sin(camAngle)
+		);
+
+		vec3 desiredCamEye = carBase + rotatedCamBase;
+		currPose.camEye = mix(currPose.camEye, desiredCamEye, 0.1f);
+		currPose.camLookat = mix(currPose.camLookat, carBase, 0.1f);
+
+		lights[1].wLightPos = vec4(camBase.x, camBase.y, camBase.z, 1.0f);
+	}
+
+	// Puts the car and the camera to the start position without interpolating there
+	void ResetPose() {
+		currPose.translation = sim.carBase;
+		currPose.rotation = angleAxis((float)M_PI_2, vec3(0.0f, 1.0f, 0.0f));
+		currPose.camEye = camBase;
+		currPose.camLookat = sim.carBase;
+		prevPose = currPose;
+		sceneDirty = true;
 	}
 
 	void UploadToGPU() {
+		PROFILE_SCOPE("Scene::UploadToGPU");
 		// Upload the objects (and triangles) to the GPU
 		trisP1.clear();
 		trisP2.clear();
@@ -982,10 +1945,16 @@ public:
 			if (!mesh)
 				continue;
 			const std::vector<VertexData>& verts = mesh->getVertices();
-			for (size_t i = 0; i + 2 < verts.size(); i += 3) {
-				trisP1.push_back(obj->transformPoint(verts[i + 0].position));
-				trisP2.push_back(obj->transformPoint(verts[i + 1].position));
-				trisP3.push_back(obj->transformPoint(verts[i + 2].position));
+			const std::vector<GLuint>& tris = mesh->getIndices();
+			const std::vector<mat4>& instances = mesh->getInstances();
+			size_t instanceCount = mesh->isInstanced() ? instances.size() : 1;
+			for (size_t k = 0; k < instanceCount; k++) {
+				mat4 I = mesh->isInstanced() ? instances[k] : mat4(1.0f);
+				for (size_t i = 0; i + 2 < tris.size(); i += 3) {
+					trisP1.push_back(obj->transformPoint(vec3(I * vec4(verts[tris[i + 0]].position, 1.0f))));
+					trisP2.push_back(obj->transformPoint(vec3(I * vec4(verts[tris[i + 1]].position, 1.0f))));
+					trisP3.push_back(obj->transformPoint(vec3(I * vec4(verts[tris[i + 2]].position, 1.0f))));
+				}
 			}
 		}
 
@@ -1023,128 +1992,62 @@ public:
 		camera.Spin(angle);
 	}
 
-	void MoveCar(const vec3& dir) {
-		if (!carObj) return;
-
-		if (!Start || speed == 0.0f) return;
-
-		if (!isCarOnRoad()) {
-			Out = true;
-			if (DEBUG) printf("Car is out of the road:\t%f, %f, %f\n", carBase.x, carBase.y, carBase.z);
-			return;
-		}
-
-		if (length(dir) > 1e-4) {
-			vec3 newDir = normalize(dir);
-			carAxis = normalize(mix(carAxis, newDir, 0.2f));
-		}
-
-		vec3 forward = vec3(0.0f, 0.0f, 1.0f);
-		float angle = acos(clamp(dot(forward, carAxis), -1.0f, 1.0f));
-		vec3 axis = cross(forward, carAxis);
-		if (length(axis) < 1e-4) axis = vec3(0.0f, 1.0f, 0.0f);
-
-		carBase = carBase + dir;
-		carBase *= vec3(1.0f, 0.0f, 1.0f);
-
-		for (Object* obj : carObjects) {
-			obj->translation = carBase;
-			obj->rotationAxis = axis;
-			obj->rotationAngle = angle;
-		}
-
-		float camAngle = atan2(carAxis.x, carAxis.z);
-		vec3 rotatedCamBase = vec3(
-			camBase.x * sin(camAngle) + camBase.z * cos(camAngle),
-			camBase.y,
-			camBase.x * cos(camAngle) - camBase.z * sin(camAngle)
-		);
-
-		vec3 desiredCamEye = carBase + rotatedCamBase;
-		camera.wEye = mix(camera.wEye, desiredCamEye, 0.1f);
-		camera.wLookat = mix(camera.wLookat, carBase, 0.1f);
-
-		lights[1].wLightPos = vec4(camBase.x, camBase.y, camBase.z, 1.0f);
-
-		UploadToGPU();
-	}
-
 	mat4 getCameraViewMatrix() { return camera.V(); }
 	mat4 getCameraProjMatrix() { return camera.P(); }
-	vec3 getCarPosition() { return carBase; }
+	vec3 getCarPosition() { return sim.carBase; }
 
 	void setTarget(const vec3& _target) {
-		carTarget = _target;
+		sim.carTarget = _target;
 	}
 
-	vec3 getCarAxis() { return carAxis; }
-	vec3 getCarBase() { return carBase; }
+	vec3 getCarAxis() { return sim.carAxis; }
+	vec3 getCarBase() { return sim.carBase; }
 
-	bool isCarOnRoad() {
-		for (Object* roadObj : roadObjects) {
-			const std::vector<VertexData>& verts = roadObj->geoObj->getVertices();
-			for (int i = 0; i + 2 < verts.size(); i += 3) {
-				vec3 t1 = roadObj->transformPoint(verts[i].position);
-				vec3 t2 = roadObj->transformPoint(verts[i + 1].position);
-				vec3 t3 = roadObj->transformPoint(verts[i + 2].position);
-				if (isPointInTriangle(carBase, t1, t2, t3)) {
-					return true;
-				}
-			}
-		}
-		return false;
+	void toggleStart() {
+		sim.Start = !sim.Start;
 	}
 
 	void ResetCar() {
-
-		carBase = vec3(0.0f, 0.0f, 0.0f);
-		carTarget = carBase;
-		carAxis = vec3(0.0f, 0.0f, -1.0f);
-
-		for (Object* obj : carObjects) {
-			obj->translation = carBase;
-			obj->rotationAxis = vec3(0.0f, 1.0f, 0.0f);
-			obj->rotationAngle = M_PI_2;
-		}
-		speed = 0.0f;
-
+		sim.Reset();
 		camBase = defCamBase;
-		camera.wEye = camBase;
-		camera.wLookat = carBase;
+		ResetPose();
 		lights[1].wLightPos = vec4(camBase.x, camBase.y, camBase.z, 1.0f);
 
-		Out = false;
-
 		if (DEBUG) printf("Car is resetted!\n");
 	}
 
 	void speedUp() {
-		if (speed < 0.5f) speed += 0.01f;
-		if (DEBUG) printf("Speed up! Actual speed: %f\n", speed);
+		if (sim.speed < 0.5f) sim.speed += 0.01f;
+		if (DEBUG) printf("Speed up! Actual speed: %f\n", sim.speed);
 	}
 
 	void slowDown() {
-		if (speed > 0.0f) speed -= 0.01f;
-		if (DEBUG) printf("Slow donw! Actual speed: %f\n", speed);
+		if (sim.speed > 0.0f) sim.speed -= 0.01f;
+		if (DEBUG) printf("Slow donw! Actual speed: %f\n", sim.speed);
 	}
 
 	void camUp() {
 		camBase.y += 1.0f;
-		camera.wEye = camBase;
-		camera.wLookat = carBase;
+		currPose.camEye = camBase;
+		currPose.camLookat = sim.carBase;
+		prevPose.camEye = currPose.camEye;
+		prevPose.camLookat = currPose.camLookat;
 		lights[1].wLightPos = vec4(camBase.x, camBase.y, camBase.z, 1.0f);
 	}
 
 	void camDown() {
 		camBase.y -= 1.0f;
-		camera.wEye = camBase;
-		camera.wLookat = carBase;
+		currPose.camEye = camBase;
+		currPose.camLookat = sim.carBase;
+		prevPose.camEye = currPose.camEye;
+		prevPose.camLookat = currPose.camLookat;
 		lights[1].wLightPos = vec4(camBase.x, camBase.y, camBase.z, 1.0f);
 	}
 };
 
 class AutodromoDeMaputo : public glApp {
 	Scene scene;
+	FixedTimestep timestep;
 public:
 	AutodromoDeMaputo() : glApp(3, 3, windowWidth, windowHeight, "Mazambique, Autodromo Internacional de Maputo") {}
 
@@ -1152,19 +2055,36 @@ public:
 		glViewport(0, 0, windowWidth, windowHeight);
 		glEnable(GL_DEPTH_TEST);
 		glDisable(GL_CULL_FACE);
+		if (HEADLESS_SIM) RunHeadlessBenchmark();
 		scene.Build();
 	}
 
+	// Drives straight down the main straight without rendering and measures how fast the simulation runs
+	void RunHeadlessBenchmark() {
+		TrackDefinition track = TrackDefinition::LoadOrBuiltIn();
+		CarSimulation sim;
+		sim.BuildTrack(track);
+		sim.Start = true;
+		sim.speed = 0.3f;
+		auto start = std::chrono::steady_clock::now();
+		long long steps = RunHeadless(sim, 1000000, [](CarSimulation& s, long long) {
+			s.carTarget = s.carBase + vec3(10.0f, 0.0f, 0.0f);
+		});
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		printf("Headless: %lld steps (%.1f s game time) in %.3f s, car is %s at %f, %f\n",
+			steps, steps * simTimeStep, seconds, sim.Out ? "out" : "on the road", sim.carBase.x, sim.carBase.z);
+	}
+
 	void onDisplay() {
 		glClearColor(0.0f, 0.65f, 0.098f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		scene.Render();
+		scene.Render(timestep.Alpha());
 	}
 
 	void onKeyboard(int key) override {
 		if (DEBUG) printf("Key pressed: %c\n", key);
 		if (key == 'p') {
-			scene.Start = !scene.Start;
+			scene.toggleStart();
 			refreshScreen();
 		}
 		else if (key == 'r') {
@@ -1216,10 +2136,13 @@ public:
 	}
 
 	void onTimeElapsed(float startTime, float endTime) override {
-		scene.Render();
+		int steps = timestep.Advance(endTime - startTime);
+		for (int i = 0; i < steps; i++) scene.Step();
 		refreshScreen();
 	}
 
 };
 
-AutodromoDeMaputo app;
\ No newline at end of file
+#ifndef GRAFIKA_NO_APP	// the command line tests include this file for its CPU-only classes
+AutodromoDeMaputo app;
+#endif
\ No newline at end of file
@@ -4,6 +4,12 @@
 #include "framework.h"
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
+#include <chrono>
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>	// GetModuleFileNameA
+#endif
 
 // Keretrendszer llapota
 static int minorNumber = 3, majorNumber = 3;
@@ -13,6 +19,120 @@ static GLFWwindow* window;
 static bool screenRefresh = true;
 static glApp * pApp = nullptr;
 
+// Fejnlkli (headless) futs: lthatatlan ablak vagy GLFW null platform + OSMesa, vsync nlkl, determinisztikus rval.
+// Parancssorbl (--headless, --frames N, --seconds S, --fps F, --dump mappa, --dump-every N) vagy
+// krnyezeti vltozkbl (GRAFIKA_HEADLESS, GRAFIKA_FRAMES, GRAFIKA_SECONDS, GRAFIKA_FPS, GRAFIKA_DUMP, GRAFIKA_DUMP_EVERY)
+struct HeadlessSettings {
+	bool enabled = false;
+	int frames = 600;
+	float fps = 60.0f;				// a szimullt ra ennyi kpkockt lp msodpercenknt
+	const char* dumpDirectory = nullptr;	// ha meg van adva, ide kerlnek a kpkockk PNG-knt
+	int dumpEvery = 1;
+};
+static HeadlessSettings headless;
+
+// Hurok stratgia: alapbl fix 60 Hz, az alkalmazs fellrhatja, a --loop wait|fixed|unlimited (GRAFIKA_LOOP) pedig az alkalmazst
+static LoopPolicy loopPolicy = LOOP_FIXED_RATE;
+static double loopInterval = 1.0 / 60.0;
+static const char* loopOverride = nullptr;
+
+// Beptett profiler: --profile [msodperc] (GRAFIKA_PROFILE) idkznknt sszest a konzolra s az ablak cmsorba,
+// --profile-csv fjl (GRAFIKA_PROFILE_CSV) mellett CSV-be is. Egyik nlkl sem mr, a znk ra egy elgazs.
+static Profiler frameworkProfiler;
+static double titleUpdate = 0;
+
+Profiler& profiler() { return frameworkProfiler; }
+
+// Bemeneti esemnyek sora: a GLFW visszahvsok csak sorba teszik az esemnyeket, az alkalmazs kpkocknknt egyszer,
+// az onTimeElapsed eltt kapja meg ket. Az egymst kvet egrmozgsok sszevondnak, a gombesemnyek sorrendje megmarad.
+// --record fjl (GRAFIKA_RECORD) kirja a kzbestett esemnyeket, --replay fjl (GRAFIKA_REPLAY) az l bemenet helyett
+// ugyanazokban a kpkockkban adja vissza ket; fejnlkli futssal egytt determinisztikus mrst ad.
+struct InputEvent {
+	enum Type { KEY_DOWN, KEY_UP, MOUSE_DOWN, MOUSE_UP, MOUSE_MOVE };
+	int type;
+	unsigned int frame;		// a kzbests kpkockja
+	double time;			// az esemny berkezse glfwGetTime szerint
+	int code;				// billenty vagy egrgomb
+	int x, y;
+};
+static std::vector<InputEvent> inputQueue, replayEvents;
+static size_t replayNext = 0;
+static bool replaying = false;
+static FILE* inputRecord = nullptr;
+static unsigned int inputFrame = 0;
+static double currentInputTime = 0;
+
+static void queueInput(int type, int code, int x, int y) {
+	if (replaying) return;
+	if (type == InputEvent::MOUSE_MOVE && !inputQueue.empty() && inputQueue.back().type == InputEvent::MOUSE_MOVE) {
+		InputEvent& last = inputQueue.back();	// csak a legutols pozci szmt
+		last.time = glfwGetTime();
+		last.x = x;
+		last.y = y;
+		return;
+	}
+	inputQueue.push_back({ type, 0, glfwGetTime(), code, x, y });
+}
+
+static void dispatchInput(const InputEvent& e) {
+	currentInputTime = e.time;
+	switch (e.type) {
+	case InputEvent::KEY_DOWN:   pApp->onKeyboard(e.code); break;
+	case InputEvent::KEY_UP:     pApp->onKeyboardUp(e.code); break;
+	case InputEvent::MOUSE_DOWN: pApp->onMousePressed((MouseButton)e.code, e.x, e.y); break;
+	case InputEvent::MOUSE_UP:   pApp->onMouseReleased((MouseButton)e.code, e.x, e.y); break;
+	case InputEvent::MOUSE_MOVE: pApp->onMouseMotion(e.x, e.y); break;
+	}
+}
+
+// A kpkocka bemenetnek kzbestse, az esemnyek feldolgozsa utn s az onTimeElapsed eltt
+static void deliverInput() {
+	PROFILE_SCOPE("deliverInput");
+	if (replaying) {
+		while (replayNext < replayEvents.size() && replayEvents[replayNext].frame <= inputFrame) dispatchInput(replayEvents[replayNext++]);
+	}
+	else {
+		std::vector<InputEvent> events;
+		events.swap(inputQueue);	// a kezelk kzben jabb esemnyt is kivlthatnak, az a kvetkez kpkockra marad
+		for (InputEvent& e : events) {
+			e.frame = inputFrame;
+			if (inputRecord) fprintf(inputRecord, "%u %.6f %d %d %d %d\n", e.frame, e.time, e.type, e.code, e.x, e.y);
+			dispatchInput(e);
+		}
+	}
+	inputFrame++;
+}
+
+static void loadReplay(const char* path) {
+	FILE* file = fopen(path, "r");
+	if (!file) {
+		printf("Error: cannot open %s\n", path);
+		return;
+	}
+	InputEvent e;
+	while (fscanf(file, "%u %lf %d %d %d %d", &e.frame, &e.time, &e.type, &e.code, &e.x, &e.y) == 6) replayEvents.push_back(e);
+	fclose(file);
+	replaying = true;
+	printf("Replaying %d input events from %s\n", (int)replayEvents.size(), path);
+}
+
+double inputTime() { return currentInputTime; }
+
+#ifdef FILE_OPERATIONS
+fs::path executableDirectory() {
+#ifdef _WIN32
+	char path[MAX_PATH];
+	DWORD length = GetModuleFileNameA(NULL, path, MAX_PATH);
+	if (length > 0 && length < MAX_PATH) return fs::path(path).parent_path();
+#else
+	std::error_code ec;
+	fs::path path = fs::read_symlink("/proc/self/exe", ec);
+	if (!ec) return path.parent_path();
+#endif
+	return fs::current_path();
+}
+#endif
+
 // Esemnykezelk
 static void error_callback(int error, const char* description) {
 	fprintf(stderr, "Error: %s\n", description);
@@ -28,23 +148,23 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
 		return;
 	}
 	if ((mods & GLFW_MOD_SHIFT) == 0) key += 'a' - 'A';
-	if (action == GLFW_PRESS || action == GLFW_REPEAT) pApp->onKeyboard(key);
-	if (action == GLFW_RELEASE) pApp->onKeyboardUp(key);
+	if (action == GLFW_PRESS || action == GLFW_REPEAT) queueInput(InputEvent::KEY_DOWN, key, 0, 0);
+	if (action == GLFW_RELEASE) queueInput(InputEvent::KEY_UP, key, 0, 0);
 }
 
 void character_callback(GLFWwindow* window, unsigned int codepoint) {
-	pApp->onKeyboard(codepoint);
+	queueInput(InputEvent::KEY_DOWN, codepoint, 0, 0);
 }
 
 void mouse_button_callback(GLFWwindow* window, int button, int action, int mods) {
 	double pX, pY;
 	glfwGetCursorPos(window, &pX, &pY);
-	if (action == GLFW_PRESS) pApp->onMousePressed((button == GLFW_MOUSE_BUTTON_LEFT) ? MOUSE_LEFT : MOUSE_RIGHT, (int)pX, (int)pY);
-	else				      pApp->onMouseReleased((button == GLFW_MOUSE_BUTTON_LEFT) ? MOUSE_LEFT : MOUSE_RIGHT, (int)pX, (int)pY);
+	MouseButton but = (button == GLFW_MOUSE_BUTTON_LEFT) ? MOUSE_LEFT : MOUSE_RIGHT;
+	queueInput((action == GLFW_PRESS) ? InputEvent::MOUSE_DOWN : InputEvent::MOUSE_UP, but, (int)pX, (int)pY);
 }
 
 static void cursor_position_callback(GLFWwindow* window, double xpos, double ypos) {
-	pApp->onMouseMotion((int)xpos, (int)ypos);
+	queueInput(InputEvent::MOUSE_MOVE, 0, (int)xpos, (int)ypos);
 }
 
 // Applikci konstruktora
@@ -72,21 +192,201 @@ void glApp::refreshScreen() {
 	screenRefresh = true;
 }
 
+void glApp::setLoopPolicy(LoopPolicy policy, float interval) {
+	loopPolicy = policy;
+	if (interval >= 0) loopInterval = interval;
+	else loopInterval = (policy == LOOP_WAIT_EVENTS) ? 0.5 : 1.0 / 60.0;
+}
+
 // Lekrdezses klaviatra kezels
 bool pollKey(int key) {
 	return (glfwGetKey(window, key) == GLFW_PRESS);
 }
 
-int main(void) {
-	// Alkalmazi ablak ltrehozsa
-	glfwSetErrorCallback(error_callback);
-	if (!glfwInit()) exit(EXIT_FAILURE);
+// Parancssori kapcsol rtke, vagy ha nincs, a krnyezeti vltoz
+static const char* option(int argc, char* argv[], const char* name, const char* env) {
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], name) == 0) return (i + 1 < argc && argv[i + 1][0] != '-') ? argv[i + 1] : "1";
+	}
+	return getenv(env);
+}
+
+static void parseHeadless(int argc, char* argv[]) {
+	const char* value;
+	if ((value = option(argc, argv, "--headless", "GRAFIKA_HEADLESS"))) headless.enabled = strcmp(value, "0") != 0;
+	if ((value = option(argc, argv, "--fps", "GRAFIKA_FPS"))) headless.fps = (float)atof(value);
+	if ((value = option(argc, argv, "--frames", "GRAFIKA_FRAMES"))) headless.frames = atoi(value);
+	if ((value = option(argc, argv, "--seconds", "GRAFIKA_SECONDS"))) headless.frames = (int)(atof(value) * headless.fps + 0.5);
+	if ((value = option(argc, argv, "--dump", "GRAFIKA_DUMP"))) headless.dumpDirectory = value;
+	if ((value = option(argc, argv, "--dump-every", "GRAFIKA_DUMP_EVERY"))) headless.dumpEvery = std::max(atoi(value), 1);
+}
+
+static void parseLoop(int argc, char* argv[]) {
+	loopOverride = option(argc, argv, "--loop", "GRAFIKA_LOOP");
+}
 
+static void parseInput(int argc, char* argv[]) {
+	const char* value;
+	if ((value = option(argc, argv, "--replay", "GRAFIKA_REPLAY"))) loadReplay(value);
+	else if ((value = option(argc, argv, "--record", "GRAFIKA_RECORD"))) {
+		inputRecord = fopen(value, "w");
+		if (!inputRecord) printf("Error: cannot open %s\n", value);
+	}
+}
+
+// A parancssori hurok stratgia az alkalmazs inicializlsa utn, az  belltst fellrva
+static void applyLoopOverride() {
+	if (!loopOverride) return;
+	if (strcmp(loopOverride, "wait") == 0) pApp->setLoopPolicy(LOOP_WAIT_EVENTS);
+	else if (strcmp(loopOverride, "fixed") == 0) pApp->setLoopPolicy(LOOP_FIXED_RATE);
+	else if (strcmp(loopOverride, "unlimited") == 0) pApp->setLoopPolicy(LOOP_UNLIMITED);
+	else printf("Error: unknown loop policy %s (wait, fixed or unlimited)\n", loopOverride);
+}
+
+// Esemnyek feldolgozsa a hurok stratgia szerint, igazat ad, ha jhet a kvetkez lps
+static bool processEvents(double& nextTick) {
+	if (loopPolicy == LOOP_UNLIMITED) {
+		glfwPollEvents();
+		return true;
+	}
+	if (loopPolicy == LOOP_WAIT_EVENTS) {
+		if (screenRefresh || replayNext < replayEvents.size()) glfwPollEvents();	// fgg rajzols vagy visszajtszs mellett nem alszunk el
+		else if (loopInterval > 0) glfwWaitEventsTimeout(loopInterval);
+		else glfwWaitEvents();
+		return true;
+	}
+	double now = glfwGetTime();
+	if (now < nextTick) glfwWaitEventsTimeout(nextTick - now);
+	else glfwPollEvents();
+	now = glfwGetTime();
+	if (now < nextTick) return false;	// esemny bresztett, a lps mg nem esedkes
+	nextTick += loopInterval;
+	if (nextTick < now) nextTick = now;	// lemarads utn nem prbljuk behozni
+	return true;
+}
+
+static void parseProfile(int argc, char* argv[]) {
+	const char* value;
+	if ((value = option(argc, argv, "--profile", "GRAFIKA_PROFILE"))) {
+		frameworkProfiler.enabled = true;
+		double interval = atof(value);
+		frameworkProfiler.reportInterval = interval > 0 ? interval : (strcmp(value, "0") != 0 ? 5.0 : 0.0);
+	}
+	if ((value = option(argc, argv, "--profile-csv", "GRAFIKA_PROFILE_CSV"))) {
+		frameworkProfiler.csv = fopen(value, "w");
+		if (!frameworkProfiler.csv) printf("Error: cannot open %s\n", value);
+		else {
+			frameworkProfiler.enabled = true;
+			if (frameworkProfiler.reportInterval <= 0) frameworkProfiler.reportInterval = 5.0;
+		}
+	}
+}
+
+// Kpkockaid percentilisek s GPU id a cmsorban, msodpercenknt
+static void showProfile() {
+	double now = frameworkProfiler.Now();
+	if (frameworkProfiler.reportInterval <= 0 || now - titleUpdate < 1.0) return;
+	Profiler::Stats frame = frameworkProfiler.Find("frame", titleUpdate), gpu = frameworkProfiler.Find("gpu", titleUpdate);
+	char title[256];
+	snprintf(title, sizeof(title), "%s | %.2f ms (p95 %.2f, p99 %.2f) | GPU %.2f ms", windowCaption, frame.p50, frame.p95, frame.p99, gpu.average);
+	glfwSetWindowTitle(window, title);
+	titleUpdate = now;
+}
+
+static GLFWwindow* createWindow() {
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, majorNumber);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, minorNumber);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	if (headless.enabled) glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	return glfwCreateWindow(windowWidth, windowHeight, windowCaption, NULL, NULL);
+}
+
+// Kijelz nlkl (pl. CI gpen) a null platformon, OSMesa szoftveres kontextussal prblkozunk
+static GLFWwindow* createOffscreenWindow() {
+	glfwTerminate();
+	glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+	if (!glfwInit()) return nullptr;
+	glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+	return createWindow();
+}
+
+#ifdef FILE_OPERATIONS
+// A hts buffer tartalma PNG-be, fellrl lefel
+static void dumpFrame(int frame) {
+	std::vector<unsigned char> pixels(windowWidth * windowHeight * 3), flipped(pixels.size());
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, windowWidth, windowHeight, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+	for (int y = 0; y < windowHeight; y++) {
+		memcpy(&flipped[y * windowWidth * 3], &pixels[(windowHeight - 1 - y) * windowWidth * 3], windowWidth * 3);
+	}
+	char name[32];
+	snprintf(name, sizeof(name), "frame_%05d.png", frame);
+	fs::path path = fs::path(headless.dumpDirectory) / name;
+	lodepng::State state;
+	state.info_raw.colortype = state.info_png.color.colortype = LCT_RGB;
+	state.encoder.zlibsettings.num_threads = 0; // a szrs s a tmrts minden hardverszlon fut
+	std::vector<unsigned char> png;
+	unsigned int error = lodepng::encode(png, flipped, windowWidth, windowHeight, state);
+	if (!error) error = lodepng::save_file(png, path.string());
+	if (error) printf("Error while writing %s: %s\n", path.string().c_str(), lodepng_error_text(error));
+}
+#endif
 
-	window = glfwCreateWindow(windowWidth, windowHeight, windowCaption, NULL, NULL);
+// Egy kpkocka mrve (dumpIndex >= 0 esetn PNG-be is mentve): onTimeElapsed s onDisplay CPU znaknt, az onDisplay GPU ideje idlekrdezssel
+static void displayFrame(int dumpIndex = -1) {
+	frameworkProfiler.BeginGpu();
+	{
+		PROFILE_SCOPE("onDisplay");
+		pApp->onDisplay();       // rajzols
+	}
+	frameworkProfiler.EndGpu();
+#ifdef FILE_OPERATIONS
+	if (dumpIndex >= 0) dumpFrame(dumpIndex);
+#endif
+	{
+		PROFILE_SCOPE("glfwSwapBuffers");
+		glfwSwapBuffers(window); // buffercsere
+	}
+	frameworkProfiler.EndFrame();
+}
+
+// Rgztett szm kpkocka, a szimullt id frame / fps, minden kpkocka kirajzoldik
+static void runHeadless() {
+#ifdef FILE_OPERATIONS
+	if (headless.dumpDirectory) {
+		std::error_code ec;
+		fs::create_directories(headless.dumpDirectory, ec);
+	}
+#endif
+	auto start = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < headless.frames; frame++) {
+		glfwPollEvents();
+		deliverInput();
+		{
+			PROFILE_SCOPE("onTimeElapsed");
+			pApp->onTimeElapsed(frame / headless.fps, (frame + 1) / headless.fps);
+		}
+		displayFrame(headless.dumpDirectory && frame % headless.dumpEvery == 0 ? frame : -1);
+	}
+	glFinish();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("Headless: %d frames (%.2f s simulated) in %.3f s, %.3f ms/frame\n", headless.frames, headless.frames / headless.fps,
+		seconds, headless.frames > 0 ? seconds * 1000.0 / headless.frames : 0.0);
+}
+
+int main(int argc, char* argv[]) {
+	parseHeadless(argc, argv);
+	parseProfile(argc, argv);
+	parseLoop(argc, argv);
+	parseInput(argc, argv);
+
+	// Alkalmazi ablak ltrehozsa
+	glfwSetErrorCallback(error_callback);
+	bool initialized = glfwInit();
+	if (!initialized && !headless.enabled) exit(EXIT_FAILURE);
+
+	window = initialized ? createWindow() : nullptr;
+	if (!window && headless.enabled) window = createOffscreenWindow();
 	if (!window) {
 		glfwTerminate();
 		exit(EXIT_FAILURE);
@@ -101,25 +401,43 @@ int main(void) {
 
 
 	glfwMakeContextCurrent(window);
-	gladLoadGL();
-	glfwSwapInterval(1);
+	gladLoadGLLoader((GLADloadproc)glfwGetProcAddress); // OSMesa kontextussal is mkdik
+	if (!GLAD_GL_VERSION_4_1 && glExtensionSupported("GL_ARB_get_program_binary")) {	// a glad csak a core verzik fggvnyeit tlti be
+		glad_glGetProgramBinary = (PFNGLGETPROGRAMBINARYPROC)glfwGetProcAddress("glGetProgramBinary");
+		glad_glProgramBinary = (PFNGLPROGRAMBINARYPROC)glfwGetProcAddress("glProgramBinary");
+		glad_glProgramParameteri = (PFNGLPROGRAMPARAMETERIPROC)glfwGetProcAddress("glProgramParameteri");
+	}
 
 	// Applikci inicializlsa
 	pApp->onInitialization();
+	applyLoopOverride();
+	glfwSwapInterval((headless.enabled || loopPolicy == LOOP_UNLIMITED) ? 0 : 1);
 	float startTime = 0;
 
+	if (headless.enabled) {
+		runHeadless();
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		exit(EXIT_SUCCESS);
+	}
+
 	// zenetkezel hurok
+	double nextTick = glfwGetTime();
 	while (!glfwWindowShouldClose(window)) {
-		glfwPollEvents(); // esemnyek lekrdezse s reakci
+		if (!processEvents(nextTick)) continue; // esemnyek lekrdezse, kzben a stratgia szerint alszik
+		deliverInput();                         // s a kpkocka bemenetnek kzbestse
 
 		float endTime = (float)glfwGetTime();    // id lekrdezse
-		pApp->onTimeElapsed(startTime, endTime); // animci
+		{
+			PROFILE_SCOPE("onTimeElapsed");
+			pApp->onTimeElapsed(startTime, endTime); // animci
+		}
 		startTime = endTime;
 
 		if (screenRefresh) {
-			pApp->onDisplay();       // rajzols
-			glfwSwapBuffers(window); // buffercsere
+			displayFrame();
 			screenRefresh = false;
+			showProfile();
 		}
 	}
 	glfwDestroyWindow(window);
@@ -102,6 +102,39 @@ or comment out LODEPNG_COMPILE_CRC below*/
 #define LODEPNG_COMPILE_CRC
 #endif
 
+/*SIMD kernels (SSE2 with SSSE3/AVX2/PCLMUL chosen at runtime on x86, NEON on ARM) for unfiltering, LZ77 match
+lengths and the Adler-32 and CRC32 checksums. The scalar code stays as the fallback for other CPUs and for the cases the kernels don't cover.*/
+#ifndef LODEPNG_NO_COMPILE_SIMD
+/*pass -DLODEPNG_NO_COMPILE_SIMD to the compiler to use only the portable scalar code,
+or comment out LODEPNG_COMPILE_SIMD below*/
+#define LODEPNG_COMPILE_SIMD
+#endif
+
+/*table-driven fast path for the bulk of inflate: a 64-bit bit buffer and lookup tables that decode a length with
+its extra bits, or two literals, at once. Needs a 64-bit integer type, so it is off for strict C90 compilers.*/
+#ifndef LODEPNG_NO_COMPILE_FAST_INFLATE
+/*pass -DLODEPNG_NO_COMPILE_FAST_INFLATE to the compiler to use only the bit-by-bit decoding loop,
+or comment out LODEPNG_COMPILE_FAST_INFLATE below*/
+#define LODEPNG_COMPILE_FAST_INFLATE
+#endif
+
+/*multithreaded encoding, see num_threads in LodePNGCompressSettings. Uses std::thread, so it needs the file to be
+compiled as C++11 or newer, otherwise everything runs on the calling thread.*/
+#ifndef LODEPNG_NO_COMPILE_THREADS
+/*pass -DLODEPNG_NO_COMPILE_THREADS to the compiler to never start threads,
+or comment out LODEPNG_COMPILE_THREADS below*/
+#define LODEPNG_COMPILE_THREADS
+#endif
+
+/*incremental decoding and encoding, see lodepng_stream_decoder_new and lodepng_stream_encoder_new: the PNG file and
+the image go in and out in pieces and row by row, so only a few rows and the 32KB zlib window are in memory rather than
+the whole compressed and decoded image*/
+#ifndef LODEPNG_NO_COMPILE_STREAMING
+/*pass -DLODEPNG_NO_COMPILE_STREAMING to the compiler to disable this,
+or comment out LODEPNG_COMPILE_STREAMING below*/
+#define LODEPNG_COMPILE_STREAMING
+#endif
+
 /*compile the C++ version (you can disable the C++ wrapper here even when compiling for C++)*/
 #ifdef __cplusplus
 #ifndef LODEPNG_NO_COMPILE_CPP
@@ -356,6 +389,15 @@ struct LodePNGCompressSettings /*deflate = compress*/ {
   unsigned minmatch; /*minimum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*most positions of the hash chain to try per byte, 0 picks it from windowsize: all of a window of 8192 or more,
+  an eighth of smaller ones. If set, matches of nicematch or longer are also taken without lazy matching. Default: 0*/
+  unsigned maxchain;
+
+  /*Threads to compress with: the input is split into parts of one deflate block, each part is compressed on its
+  own thread with the end of the previous part as its LZ77 dictionary, and they are joined into one zlib stream.
+  The PNG encoder also chooses the filters of the scanlines in parallel with this many threads.
+  0 uses all hardware threads, 1 only the calling thread. Needs LODEPNG_COMPILE_THREADS. Default: 1*/
+  unsigned num_threads;
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -373,6 +415,9 @@ struct LodePNGCompressSettings /*deflate = compress*/ {
 
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
 void lodepng_compress_settings_init(LodePNGCompressSettings* settings);
+/*Sets the LZ77 settings to effort level 1 to 9, from the fastest (greedy, trying one earlier position per byte)
+to the smallest (lazy matching over the whole 32768 byte window), all with btype 2.*/
+void lodepng_compress_settings_effort(LodePNGCompressSettings* settings, unsigned effort);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_PNG
@@ -885,6 +930,16 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
                         LodePNGState* state,
                         const unsigned char* in, size_t insize);
 
+/*
+Same as lodepng_decode, but decodes into the buffer out of outsize bytes of the caller,
+instead of allocating the image. It must have lodepng_get_raw_size(w, h, &state->info_raw)
+bytes (with the color type of the PNG if color_convert is off), w and h can be read first
+with lodepng_inspect. Returns error 117 if the buffer is too small.
+*/
+unsigned lodepng_decode_into(unsigned char* out, size_t outsize, unsigned* w, unsigned* h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize);
+
 /*
 Read the PNG header, but not the actual data. This returns only the information
 that is in the IHDR chunk of the PNG, such as width, height and color type. The
@@ -893,6 +948,39 @@ information is placed in the info_png field of the LodePNGState.
 unsigned lodepng_inspect(unsigned* w, unsigned* h,
                          LodePNGState* state,
                          const unsigned char* in, size_t insize);
+
+#ifdef LODEPNG_COMPILE_STREAMING
+/*
+Incremental decoder: instead of the whole file at once, the PNG is given in pieces of
+any size with lodepng_stream_decoder_push, and every row of the image goes to the
+callback as soon as it is decoded. Only two scanlines and the zlib window are kept,
+so the memory use does not grow with the image size. Adam7 interlaced images are the
+exception: their rows are only complete after the last pass, so for them the decoder
+keeps the image (in the color type of the PNG) and gives the rows at the end.
+The state works as for lodepng_decode: decoder settings and info_raw are inputs,
+info_png is filled in while decoding, and must stay valid until the decoder is deleted.
+Custom zlib or inflate functions in the settings can't stream, with those the
+compressed data is collected and decompressed at the IEND chunk.
+Rows given to the callback before an error was found may be part of a corrupt image.
+*/
+typedef struct LodePNGStreamDecoder LodePNGStreamDecoder;
+
+/*
+Receives row y of the w * h image in the color type of state->info_raw (or of the PNG
+if color_convert is off), lodepng_get_raw_size(w, 1, &state->info_raw) bytes. Rows
+come in order from 0 to h - 1. Return 0 to continue, or an error code to stop the
+decoding, which is then returned by lodepng_stream_decoder_push or finish.
+*/
+typedef unsigned (*LodePNGRowCallback)(void* user, const unsigned char* row, unsigned y, unsigned w, unsigned h);
+
+/*Returns the new decoder, or NULL if out of memory. user is given to each callback.*/
+LodePNGStreamDecoder* lodepng_stream_decoder_new(LodePNGState* state, LodePNGRowCallback callback, void* user);
+/*Decodes the next insize bytes of the PNG file. Returns error code, also stored in state->error.*/
+unsigned lodepng_stream_decoder_push(LodePNGStreamDecoder* decoder, const unsigned char* in, size_t insize);
+/*Call after the last bytes of the file were pushed. Returns error code, e.g. when the file ended too early.*/
+unsigned lodepng_stream_decoder_finish(LodePNGStreamDecoder* decoder);
+void lodepng_stream_decoder_delete(LodePNGStreamDecoder* decoder);
+#endif /*LODEPNG_COMPILE_STREAMING*/
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 /*
@@ -915,8 +1003,80 @@ unsigned lodepng_inspect_chunk(LodePNGState* state, size_t pos,
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+#ifdef LODEPNG_COMPILE_STREAMING
+/*
+Incremental encoder: instead of the whole image at once, the rows are given one by one
+with lodepng_stream_encoder_push, and the PNG file goes to a callback in pieces: the
+chunks before IDAT at the start, then an IDAT chunk each time enough rows were
+filtered and compressed, and the rest at lodepng_stream_encoder_finish. Only two
+rows, the zlib window and one IDAT chunk are kept, so the memory use does not grow
+with the image size. The state works as for lodepng_encode, and must stay valid until
+the encoder is deleted, except that auto_convert is ignored since it needs all pixels:
+the PNG gets the color type of info_png. Adam7 interlacing and custom zlib or deflate
+functions can't stream, with those the image is kept and encoded at the end.
+*/
+typedef struct LodePNGStreamEncoder LodePNGStreamEncoder;
+
+/*
+Receives the next size bytes of the PNG file. Return 0 to continue, or an error code to
+stop the encoding, which is then returned by lodepng_stream_encoder_push or finish.
+*/
+typedef unsigned (*LodePNGWriteCallback)(void* user, const unsigned char* data, size_t size);
+
+/*Returns the new encoder of a w * h image, or NULL if out of memory. user is given to each callback.
+Errors in the state, such as an invalid color type, are returned by the first push.*/
+LodePNGStreamEncoder* lodepng_stream_encoder_new(LodePNGState* state, unsigned w, unsigned h,
+                                                 LodePNGWriteCallback callback, void* user);
+/*Encodes the next row, of lodepng_get_raw_size(w, 1, &state->info_raw) bytes. Returns error code,
+also stored in state->error.*/
+unsigned lodepng_stream_encoder_push(LodePNGStreamEncoder* encoder, const unsigned char* row);
+/*Call after all h rows were pushed, writes the rest of the file. Returns error code.*/
+unsigned lodepng_stream_encoder_finish(LodePNGStreamEncoder* encoder);
+void lodepng_stream_encoder_delete(LodePNGStreamEncoder* encoder);
+
+#ifdef LODEPNG_COMPILE_DISK
+/*A LodePNGWriteCallback that writes to the FILE* given as user, e.g. opened with fopen(filename, "wb").*/
+unsigned lodepng_stream_write_file(void* file, const unsigned char* data, size_t size);
+#endif /*LODEPNG_COMPILE_DISK*/
+#endif /*LODEPNG_COMPILE_STREAMING*/
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
+#if defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)
+/*
+Context for decoding or encoding many images, such as the textures of a program at
+startup or the frames of a video. Its calls keep their working memory (zlib window,
+Huffman tables, LZ77 hash chains, filter attempts, scanlines) in an arena of the
+context instead of allocating and freeing it every time, so after the first images
+of a size there are no more allocations. The arena holds on to what the largest
+images needed until the context is deleted. What goes into the state, such as the
+palette, texts or ICC profile, is still allocated normally and cleaned up with the
+state as usual. Use a context from one thread at a time, one per thread to work in
+parallel. The worker threads of an encoder with num_threads other than 1, and custom
+zlib, inflate or deflate functions allocate normally. The arena needs thread local
+storage (C11, C++11, MSVC or GCC), without it only the encoder output is reused.
+*/
+typedef struct LodePNGContext LodePNGContext;
+
+/*Returns the new context, or NULL if out of memory.*/
+LodePNGContext* lodepng_context_new(void);
+void lodepng_context_delete(LodePNGContext* context);
+
+#ifdef LODEPNG_COMPILE_DECODER
+/*Same as lodepng_decode_into, decodes into the buffer of the caller, with the memory of the context.*/
+unsigned lodepng_context_decode(LodePNGContext* context, unsigned char* out, size_t outsize,
+                                unsigned* w, unsigned* h, LodePNGState* state,
+                                const unsigned char* in, size_t insize);
+#endif /*LODEPNG_COMPILE_DECODER*/
+
+#ifdef LODEPNG_COMPILE_ENCODER
+/*Same as lodepng_encode, with the memory of the context. The PNG file stays in the context:
+*out is valid until the next lodepng_context_encode or lodepng_context_delete, don't free it.*/
+unsigned lodepng_context_encode(LodePNGContext* context, const unsigned char** out, size_t* outsize,
+                                const unsigned char* image, unsigned w, unsigned h, LodePNGState* state);
+#endif /*LODEPNG_COMPILE_ENCODER*/
+#endif /*defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)*/
+
 /*
 The lodepng_chunk functions are normally not needed, except to traverse the
 unknown chunks stored in the LodePNGInfo struct, or add new ones to it.
@@ -1078,6 +1238,21 @@ to handle such files and decode in-memory.
 */
 unsigned lodepng_load_file(unsigned char** out, size_t* outsize, const char* filename);
 
+/*
+Map a file into memory read-only instead of reading it: with mmap on POSIX systems and a
+file mapping on Windows, so there's no copy of the file, its pages come straight from the
+disk cache as they are read. Other platforms fall back to lodepng_load_file.
+out: output parameter, pointer to the contents of the file (NULL for an empty file)
+outsize: output parameter, size of the file
+filename: the path to the file to map
+return value: error code (0 means ok)
+Release the buffer with lodepng_unmap_file, not with free.
+*/
+unsigned lodepng_map_file(const unsigned char** out, size_t* outsize, const char* filename);
+
+/*Release a buffer of lodepng_map_file, buffersize is the size it returned*/
+void lodepng_unmap_file(const unsigned char* buffer, size_t buffersize);
+
 /*
 Save a file from buffer to disk. Warning, if it exists, this function overwrites
 the file without warning!
@@ -1401,6 +1576,16 @@ is done, the resulting data will be as it was in the PNG (after decompression)
 and you'll have to puzzle the colors of the pixels together yourself using the
 color type information in the LodePNGInfo.
 
+Streaming decoding
+------------------
+
+lodepng_stream_decoder_new, _push, _finish and _delete decode a PNG that arrives
+in pieces, e.g. read from a file in small blocks, and give the image row by row to
+a callback, for example to write it straight into a mapped GPU buffer. It uses the
+same LodePNGState as lodepng_decode, and gives the same image for the same file. A
+corrupt file can give a different error code, since each chunk is checked as it
+arrives, e.g. broken image data is found before the CRC at the end of its chunk.
+
 
 5. Encoding
 -----------
@@ -1418,6 +1603,11 @@ Like the decoder, the encoder can also give errors. However it gives less errors
 since the encoder input is trusted, the decoder input (a PNG image that could
 be forged by anyone) is not trusted.
 
+To write an image that doesn't fit in memory, or that is made row by row such as
+a render, use lodepng_stream_encoder_new, _push, _finish and _delete. They give the
+same image as lodepng_encode with auto_convert off, with the compressed data split
+over IDAT chunks of at most a few hundred KB.
+
 When using the LodePNGState, it uses the following fields for encoding:
 *) LodePNGInfo info_png: here you specify how you want the PNG (the output) to be.
 *) LodePNGColorMode info_raw: here you say what color type of the raw image (the input) has
@@ -1465,6 +1655,10 @@ can encode the colors of all pixels without information loss.
    true for proper compression.
 *) windowsize: the window size used by the LZ77 encoder (1 - 32768). Has value
    2048 by default, but can be set to 32768 for better, but slow, compression.
+*) lodepng_compress_settings_effort: sets the LZ77 settings (windowsize, nicematch,
+   lazymatching, maxchain) from one level of 1 to 9. Level 1 is about twice as
+   fast as the default settings and still compresses better, level 9 is the
+   same as windowsize 32768 with nicematch 258.
 *) force_palette: if colortype is 2 or 6, you can make the encoder write a PLTE
    chunk if force_palette is true. This can used as suggested palette to convert
    to by viewers that don't support more than 256 colors (if those still exist)
@@ -1887,6 +2081,8 @@ state.encoder.zlibsettings.windowsize: tweak LZ77 windowsize
 state.encoder.zlibsettings.minmatch: tweak min LZ77 length to match
 state.encoder.zlibsettings.nicematch: tweak LZ77 match where to stop searching
 state.encoder.zlibsettings.lazymatching: try one more LZ77 matching
+state.encoder.zlibsettings.maxchain: limit the LZ77 hash chain search per byte
+state.encoder.zlibsettings.num_threads: compress and filter on multiple threads
 state.encoder.zlibsettings.custom_...: use custom deflate function
 state.encoder.auto_convert: choose optimal PNG color type, if 0 uses info_png
 state.encoder.filter_palette_zero: PNG filter strategy for palette
@@ -0,0 +1,143 @@
+// The view frustum culling of nagyhazi on the CPU, along scripted camera paths: reports how many objects
+// are drawn and culled per frame, and checks every decision against a double precision plane test.
+// Usage: culling_paths [-v]   (-v: one line per frame)
+#define GRAFIKA_NO_APP
+#include "../nagyhazi/grafika/grafika.cpp"
+
+Profiler& profiler() { static Profiler p; return p; } // framework.cpp is not linked, profiling stays disabled
+
+struct CameraPose {
+	vec3 eye, lookat;
+};
+
+struct PathStats {
+	int frames = 0, minDrawn = 1 << 30, maxDrawn = 0, minCulled = 1 << 30, maxCulled = 0;
+	long long drawn = 0, culled = 0;
+};
+
+static int mismatches = 0;
+
+// Reference: the sphere is outside when it is fully behind one of the six planes or beyond the distance limit
+static bool referenceVisible(const mat4& VP, const vec3& eye, const float maxDistance, const BoundingSphere& sphere, double& margin) {
+	margin = 1e30;
+	if (maxDistance > 0.0f) {
+		double distance = glm::length(dvec3(sphere.center) - dvec3(eye)) - sphere.radius;
+		margin = maxDistance - distance;
+	}
+	dvec4 rows[4];
+	for (int i = 0; i < 4; i++) rows[i] = dvec4(VP[0][i], VP[1][i], VP[2][i], VP[3][i]);
+	dvec4 planes[6] = { rows[3] + rows[0], rows[3] - rows[0], rows[3] + rows[1], rows[3] - rows[1], rows[3] + rows[2], rows[3] - rows[2] };
+	for (const dvec4& plane : planes) {
+		double distance = (dot(dvec3(plane), dvec3(sphere.center)) + plane.w) / glm::length(dvec3(plane));
+		margin = std::min(margin, distance + sphere.radius);
+	}
+	return margin >= 0.0;
+}
+
+static void frame(const char* path, int index, const CameraPose& pose, const std::vector<BoundingSphere>& objects, PathStats& stats, bool verbose) {
+	Camera camera;
+	camera.wEye = pose.eye;
+	camera.wLookat = pose.lookat;
+	camera.wVup = vec3(0.0f, 1.0f, 0.0f);
+	mat4 VP = camera.P() * camera.V();
+	ViewFrustum frustum(VP, camera.wEye, camera.bp);
+	int drawn = 0, culled = 0;
+	for (const BoundingSphere& sphere : objects) {
+		bool visible = frustum.IsVisible(sphere);
+		double margin;
+		bool expected = referenceVisible(VP, camera.wEye, camera.bp, sphere, margin);
+		if (visible != expected && fabs(margin) > 1e-3 * std::max(1.0f, sphere.radius)) {
+			if (mismatches++ < 10) printf("MISMATCH %s frame %d: sphere (%g, %g, %g) r %g is %s, reference margin %g\n", path, index,
+				sphere.center.x, sphere.center.y, sphere.center.z, sphere.radius, visible ? "drawn" : "culled", margin);
+		}
+		if (visible) drawn++; else culled++;
+	}
+	if (verbose) printf("%-8s %4d  eye (%7.2f, %6.2f, %7.2f)  drawn %3d  culled %3d\n", path, index, pose.eye.x, pose.eye.y, pose.eye.z, drawn, culled);
+	stats.frames++;
+	stats.drawn += drawn; stats.culled += culled;
+	stats.minDrawn = std::min(stats.minDrawn, drawn); stats.maxDrawn = std::max(stats.maxDrawn, drawn);
+	stats.minCulled = std::min(stats.minCulled, culled); stats.maxCulled = std::max(stats.maxCulled, culled);
+}
+
+static void report(const char* path, const PathStats& stats) {
+	printf("%-8s %4d frames  drawn min %3d avg %6.1f max %3d  culled min %3d avg %6.1f max %3d\n", path, stats.frames,
+		stats.minDrawn, (double)stats.drawn / stats.frames, stats.maxDrawn, stats.minCulled, (double)stats.culled / stats.frames, stats.maxCulled);
+}
+
+int main(int argc, char* argv[]) {
+	bool verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+	TrackDefinition track = TrackDefinition::LoadOrBuiltIn();
+
+	// the objects of the scene as the renderer sees them: every road segment is a scaled instance of the unit plane,
+	// the grass is one large plane, the car is bounded by one sphere
+	BoundingSphere unitPlane;
+	unitPlane.radius = sqrtf(0.5f);
+	std::vector<BoundingSphere> objects;
+	for (const RoadSegment& segment : track.segments) {
+		mat4 M = translate(segment.center) * rotate(segment.angle, vec3(0.0f, 1.0f, 0.0f)) * scale(vec3(segment.size.x, 1.0f, segment.size.y));
+		objects.push_back(unitPlane.Transform(M));
+	}
+	BoundingSphere grass;
+	grass.center = vec3(-5.0f, -1.01f, 35.0f);
+	grass.radius = length(vec2(150.0f, 75.0f));
+	objects.push_back(grass);
+	size_t car = objects.size();
+	objects.push_back(BoundingSphere());
+
+	vec3 centroid(0.0f);
+	for (const RoadSegment& segment : track.segments) centroid += segment.center / (float)track.segments.size();
+
+	// chase: the camera follows the car down the main straight the way Scene::Step does
+	{
+		PathStats stats;
+		CarSimulation sim;
+		sim.BuildTrack(track);
+		sim.Start = true;
+		sim.speed = 0.3f;
+		CameraPose pose = { defCamBase, sim.carBase };
+		for (int step = 0; step < 1200 && !sim.Out; step++) {
+			sim.carTarget = sim.carBase + vec3(10.0f, 0.0f, 0.0f);
+			sim.Step();
+			float camAngle = atan2(sim.carAxis.x, sim.carAxis.z);
+			vec3 camBase = vec3(defCamBase.x * sin(camAngle) + defCamBase.z * cos(camAngle), defCamBase.y,
+								defCamBase.x * cos(camAngle) - defCamBase.z * sin(camAngle));
+			pose.eye = mix(pose.eye, sim.carBase + camBase, 0.1f);
+			pose.lookat = mix(pose.lookat, sim.carBase, 0.1f);
+			if (step % 10) continue;
+			objects[car].center = sim.carBase;
+			objects[car].radius = 1.5f;
+			frame("chase", step / 10, pose, objects, stats, verbose);
+		}
+		report("chase", stats);
+	}
+	objects[car].radius = 0.0f;	// the car stays at the start from now on
+	objects[car].center = CarSimulation().carBase;
+
+	// orbit: around the track from above, always looking at its middle
+	{
+		PathStats stats;
+		for (int i = 0; i < 72; i++) {
+			float angle = i * 2.0f * (float)M_PI / 72;
+			frame("orbit", i, { centroid + vec3(40.0f * cos(angle), 25.0f, 40.0f * sin(angle)), centroid }, objects, stats, verbose);
+		}
+		report("orbit", stats);
+	}
+
+	// spin: standing on the track at eye height and turning around
+	{
+		PathStats stats;
+		vec3 eye = track.segments[0].center + vec3(0.0f, 1.5f, 0.0f);
+		for (int i = 0; i < 72; i++) {
+			float angle = i * 2.0f * (float)M_PI / 72;
+			frame("spin", i, { eye, eye + vec3(cos(angle), -0.1f, sin(angle)) }, objects, stats, verbose);
+		}
+		report("spin", stats);
+		if (stats.maxCulled == 0) { printf("FAIL nothing is culled while turning around\n"); return 1; }
+	}
+
+	if (mismatches) {
+		printf("%d culling decisions differ from the reference\n", mismatches);
+		return 1;
+	}
+	return 0;
+}
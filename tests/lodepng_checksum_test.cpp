@@ -0,0 +1,133 @@
+/*
+The checksums of lodepng against byte by byte references. lodepng.cpp is included, so the detected CPU features
+can be overridden and each dispatch variant the CPU supports is forced in turn: scalar, SSSE3 and AVX2 for
+update_adler32, slicing by eight and PCLMUL for lodepng_crc32 / lodepng_crc32_update.
+- every alignment 0..63 of the data and every length 0..2100, random and all-255 bytes, with random start values
+- lengths around the 5552 byte overflow bound of the adler32 sums and its multiples, from the largest start sums
+*/
+#include "lodepng.cpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static unsigned failures = 0;
+
+static unsigned random_state = 2463534242u;
+static unsigned random_next() {
+  random_state ^= random_state << 13; random_state ^= random_state >> 17; random_state ^= random_state << 5;
+  return random_state;
+}
+
+/*the definitions of RFC 1950 and the PNG specification, one byte at a time*/
+static unsigned reference_adler32(unsigned adler, const unsigned char* data, size_t length) {
+  unsigned s1 = adler & 0xffffu, s2 = adler >> 16;
+  for(size_t i = 0; i != length; ++i) {
+    s1 = (s1 + data[i]) % 65521u;
+    s2 = (s2 + s1) % 65521u;
+  }
+  return (s2 << 16) | s1;
+}
+
+static unsigned reference_crc32(unsigned crc, const unsigned char* data, size_t length) {
+  unsigned r = crc ^ 0xffffffffu;
+  for(size_t i = 0; i != length; ++i) r = lodepng_crc32_table0[(r ^ data[i]) & 0xffu] ^ (r >> 8);
+  return r ^ 0xffffffffu;
+}
+
+struct Variant {
+  const char* name;
+  unsigned features; /*the LODEPNG_CPU_* bits the dispatch may see*/
+};
+
+/*lodepng_cpu_features() returns these from now on, as if detected*/
+static void force(const Variant& variant) {
+#ifdef LODEPNG_SIMD_X86
+  LODEPNG_CPU_STORE(LODEPNG_CPU_DETECTED | variant.features);
+#else
+  (void)variant;
+#endif
+}
+
+static void check(const Variant& variant, const unsigned char* data, size_t length, unsigned adler, unsigned crc,
+                  unsigned expectedadler, unsigned expectedcrc, unsigned expectedcrc0, size_t align) {
+  unsigned gotadler = update_adler32(adler, data, (unsigned)length);
+  unsigned gotcrc = lodepng_crc32_update(crc, data, length);
+  unsigned gotcrc0 = lodepng_crc32(data, length);
+  if(gotadler != expectedadler || gotcrc != expectedcrc || gotcrc0 != expectedcrc0) {
+    if(failures++ < 10) {
+      printf("FAIL %s: alignment %u, length %u: adler32 %08x (%08x) crc %08x (%08x) lodepng_crc32 %08x (%08x)\n",
+             variant.name, (unsigned)align, (unsigned)length, gotadler, expectedadler, gotcrc, expectedcrc,
+             gotcrc0, expectedcrc0);
+    }
+  }
+}
+
+int main() {
+  std::vector<Variant> variants;
+  variants.push_back(Variant{ "scalar", 0u });
+#ifdef LODEPNG_SIMD_X86
+  unsigned features = lodepng_cpu_features();
+  printf("CPU: SSSE3 %s, AVX2 %s, PCLMUL %s\n", features & LODEPNG_CPU_SSSE3 ? "yes" : "no",
+         features & LODEPNG_CPU_AVX2 ? "yes" : "no", features & LODEPNG_CPU_PCLMUL ? "yes" : "no");
+  if(features & LODEPNG_CPU_SSSE3) variants.push_back(Variant{ "SSSE3", LODEPNG_CPU_SSSE3 });
+  else printf("SSSE3 adler32 skipped\n");
+  if(features & LODEPNG_CPU_AVX2) variants.push_back(Variant{ "AVX2", LODEPNG_CPU_SSSE3 | LODEPNG_CPU_AVX2 });
+  else printf("AVX2 adler32 skipped\n");
+  if(features & LODEPNG_CPU_PCLMUL) variants.push_back(Variant{ "PCLMUL", LODEPNG_CPU_PCLMUL });
+  else printf("PCLMUL crc32 skipped\n");
+#else
+  printf("no x86 SIMD checksums in this build, only the scalar ones are compared\n");
+#endif
+
+  const size_t maxlength = (1u << 20) + 64;
+  std::vector<unsigned char> buffer(maxlength + 64);
+  unsigned long long cases = 0;
+  for(int fill = 0; fill < 2; ++fill) {
+    /*random bytes, and all 255 which makes the sums grow the fastest*/
+    for(size_t i = 0; i < buffer.size(); ++i) buffer[i] = (unsigned char)(fill == 0 ? random_next() >> 24 : 255);
+
+    for(size_t align = 0; align < 64; ++align) {
+      for(size_t length = 0; length <= 2100; ++length) {
+        const unsigned char* data = buffer.data() + align;
+        unsigned adler = length % 5 == 0 ? 1u : (random_next() % 65521u) | (random_next() % 65521u) << 16;
+        unsigned crc = random_next();
+        unsigned expectedadler = reference_adler32(adler, data, length);
+        unsigned expectedcrc = reference_crc32(crc, data, length);
+        unsigned expectedcrc0 = reference_crc32(0u, data, length);
+        for(size_t v = 0; v < variants.size(); ++v) {
+          force(variants[v]);
+          check(variants[v], data, length, adler, crc, expectedadler, expectedcrc, expectedcrc0, align);
+        }
+        ++cases;
+      }
+    }
+
+    /*the SIMD adler32 reduces after 173 blocks of 32 bytes (5536), the scalar one after 5552 bytes*/
+    const size_t bounds[] = { 5535, 5536, 5537, 5551, 5552, 5553, 5567, 5568, 5600, 11071, 11072, 11073, 11103,
+                              11104, 11105, 16608, 16656, 16657, 65536, 100003, maxlength - 64, maxlength };
+    for(size_t b = 0; b < sizeof(bounds) / sizeof(bounds[0]); ++b) {
+      for(size_t align = 0; align < 64; align += 7) {
+        const unsigned char* data = buffer.data() + align;
+        size_t length = bounds[b];
+        unsigned adler = (65520u << 16) | 65520u;
+        unsigned crc = random_next();
+        unsigned expectedadler = reference_adler32(adler, data, length);
+        unsigned expectedcrc = reference_crc32(crc, data, length);
+        unsigned expectedcrc0 = reference_crc32(0u, data, length);
+        for(size_t v = 0; v < variants.size(); ++v) {
+          force(variants[v]);
+          check(variants[v], data, length, adler, crc, expectedadler, expectedcrc, expectedcrc0, align);
+        }
+        ++cases;
+      }
+    }
+  }
+  printf("%llu cases, %u variants\n", cases, (unsigned)variants.size());
+
+  if(failures) {
+    printf("%u failures\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,112 @@
+/*
+LodePNGContext keeps its working memory between calls: after the first frames of a size, encoding and decoding
+through it must not allocate anymore. lodepng is built with LODEPNG_NO_COMPILE_ALLOCATORS and the allocators below
+count the calls. Frames of the same size but changing content go through lodepng_context_encode and
+lodepng_context_decode, with a few color types and encoder settings; from the 4th frame on both must make 0
+allocations, and every frame must decode back to the image.
+*/
+#include "lodepng.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static unsigned long allocations = 0;
+
+void* lodepng_malloc(size_t size) {
+  ++allocations;
+  return malloc(size);
+}
+
+void* lodepng_realloc(void* ptr, size_t new_size) {
+  ++allocations;
+  return realloc(ptr, new_size);
+}
+
+void lodepng_free(void* ptr) {
+  free(ptr);
+}
+
+static unsigned failures = 0;
+
+struct Setup {
+  const char* name;
+  LodePNGColorType colortype;
+  unsigned w, h;
+  int effort; /*0: the default compress settings*/
+  unsigned interlace;
+};
+
+/*gradients with some noise, moving from frame to frame*/
+static void synthesize(std::vector<unsigned char>& image, const Setup& setup, unsigned channels, int frame) {
+  unsigned seed = 1u + (unsigned)frame;
+  for(unsigned y = 0; y < setup.h; ++y) for(unsigned x = 0; x < setup.w; ++x) {
+    unsigned char* p = &image[((size_t)y * setup.w + x) * channels];
+    seed = seed * 1103515245u + 12345u;
+    unsigned char values[4] = { (unsigned char)(x + frame * 3), (unsigned char)(y * 2 + frame),
+                                (unsigned char)((x ^ y) + (seed >> 28)), (unsigned char)(255 - ((x * y + frame) & 15)) };
+    for(unsigned c = 0; c < channels; ++c) p[c] = values[c];
+  }
+}
+
+static void run(const Setup& setup) {
+  const int frames = 8;
+  unsigned channels = setup.colortype == LCT_RGBA ? 4 : 3;
+  std::vector<unsigned char> image((size_t)setup.w * setup.h * channels), decoded(image.size());
+  LodePNGContext* context = lodepng_context_new();
+  LodePNGState state;
+  lodepng_state_init(&state);
+  state.info_raw.colortype = setup.colortype;
+  state.info_png.interlace_method = setup.interlace;
+  state.encoder.zlibsettings.num_threads = 1; /*worker threads allocate normally*/
+  if(setup.effort) lodepng_compress_settings_effort(&state.encoder.zlibsettings, (unsigned)setup.effort);
+
+  for(int frame = 0; frame < frames; ++frame) {
+    synthesize(image, setup, channels, frame);
+    unsigned long before = allocations;
+    const unsigned char* png = 0;
+    size_t pngsize = 0;
+    unsigned error = lodepng_context_encode(context, &png, &pngsize, image.data(), setup.w, setup.h, &state);
+    unsigned long encoding = allocations - before;
+
+    LodePNGState decode;
+    lodepng_state_init(&decode);
+    decode.info_raw.colortype = setup.colortype;
+    unsigned w = 0, h = 0;
+    before = allocations;
+    if(!error) error = lodepng_context_decode(context, decoded.data(), decoded.size(), &w, &h, &decode, png, pngsize);
+    unsigned long decoding = allocations - before;
+    lodepng_state_cleanup(&decode);
+
+    if(error || w != setup.w || h != setup.h || decoded != image) {
+      if(failures++ < 10) printf("FAIL %s, frame %d: error %u, %ux%u, %s\n", setup.name, frame + 1, error, w, h,
+                                 decoded == image ? "same pixels" : "different pixels");
+    } else if(frame >= 3 && (encoding || decoding)) {
+      if(failures++ < 10) printf("FAIL %s, frame %d: %lu allocations encoding, %lu decoding\n", setup.name, frame + 1,
+                                 encoding, decoding);
+    }
+    if(frame == 0 || frame == frames - 1) {
+      printf("%-24s frame %d: %6lu bytes, %lu allocations encoding, %lu decoding\n", setup.name, frame + 1,
+             (unsigned long)pngsize, encoding, decoding);
+    }
+  }
+  lodepng_state_cleanup(&state);
+  lodepng_context_delete(context);
+}
+
+int main() {
+  const Setup setups[] = {
+    { "RGBA 640x480", LCT_RGBA, 640, 480, 0, 0 },
+    { "RGB 640x480", LCT_RGB, 640, 480, 0, 0 },
+    { "RGBA 333x257 effort 1", LCT_RGBA, 333, 257, 1, 0 },
+    { "RGBA 333x257 effort 9", LCT_RGBA, 333, 257, 9, 0 },
+    { "RGB 201x99 interlaced", LCT_RGB, 201, 99, 4, 1 },
+  };
+  for(size_t i = 0; i < sizeof(setups) / sizeof(setups[0]); ++i) run(setups[i]);
+
+  if(failures) {
+    printf("%u failures\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,104 @@
+/*
+Decode speed of large 8-bit RGB and RGBA PNGs, to compare the SIMD unfiltering with the scalar one: the CMake
+build makes this twice, lodepng_decode_bench and lodepng_decode_bench_scalar (LODEPNG_NO_COMPILE_SIMD).
+Without arguments it synthesizes 2048x2048 images with every scanline filter, both stored (so unfiltering is
+most of the time) and compressed; with arguments it decodes the given PNG files.
+Usage: lodepng_decode_bench [-r repeats] [file.png ...]
+*/
+#include "lodepng.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static double seconds() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*best of repeats, in MB of decoded pixels per second*/
+static void bench(const std::string& name, const std::vector<unsigned char>& png, int repeats) {
+  unsigned w = 0, h = 0;
+  lodepng::State state;
+  if(lodepng_inspect(&w, &h, &state, png.data(), png.size())) {
+    printf("%-36s not a PNG\n", name.c_str());
+    return;
+  }
+  state.info_raw.colortype = state.info_png.color.colortype == LCT_RGBA ? LCT_RGBA : LCT_RGB;
+  std::vector<unsigned char> pixels(lodepng_get_raw_size(w, h, &state.info_raw));
+  double best = 1e30;
+  for(int r = 0; r < repeats; ++r) {
+    double start = seconds();
+    unsigned error = lodepng_decode_into(pixels.data(), pixels.size(), &w, &h, &state, png.data(), png.size());
+    double elapsed = seconds() - start;
+    if(error) {
+      printf("%-36s error %u: %s\n", name.c_str(), error, lodepng_error_text(error));
+      return;
+    }
+    best = std::min(best, elapsed);
+  }
+  printf("%-36s %5ux%-5u %8.1f MB/s  %7.2f ms\n", name.c_str(), w, h, pixels.size() / best / 1e6, best * 1e3);
+}
+
+/*smooth gradients with some noise, like photos and rendered textures*/
+static std::vector<unsigned char> synthesize(unsigned w, unsigned h, unsigned channels) {
+  std::vector<unsigned char> image((size_t)w * h * channels);
+  unsigned seed = 1;
+  for(unsigned y = 0; y < h; ++y) for(unsigned x = 0; x < w; ++x) for(unsigned c = 0; c < channels; ++c) {
+    seed = seed * 1103515245u + 12345u;
+    unsigned value = (x * (c + 1) / 8 + y * (3 - c % 3) / 8 + (x ^ y) / 64 + (seed >> 28)) & 255;
+    image[((size_t)y * w + x) * channels + c] = (unsigned char)(c == 3 ? 255 - (value >> 2) : value);
+  }
+  return image;
+}
+
+int main(int argc, char* argv[]) {
+  int repeats = 5, first = 1;
+  if(argc > 2 && strcmp(argv[1], "-r") == 0) { repeats = std::max(atoi(argv[2]), 1); first = 3; }
+#ifdef LODEPNG_NO_COMPILE_SIMD
+  printf("scalar unfiltering (LODEPNG_NO_COMPILE_SIMD)\n");
+#else
+  printf("SIMD unfiltering where available\n");
+#endif
+  if(first < argc) {
+    for(int i = first; i < argc; ++i) {
+      std::vector<unsigned char> png;
+      if(lodepng::load_file(png, argv[i])) printf("%-36s cannot be read\n", argv[i]);
+      else bench(argv[i], png, repeats);
+    }
+    return 0;
+  }
+
+  const unsigned w = 2048, h = 2048;
+  const char* filterNames[5] = { "none", "sub", "up", "average", "paeth" };
+  for(unsigned channels = 3; channels <= 4; ++channels) {
+    std::vector<unsigned char> image = synthesize(w, h, channels);
+    for(unsigned btype = 0; btype <= 2; btype += 2) {
+      for(int filter = -1; filter < 5; ++filter) {
+        lodepng::State state;
+        state.info_raw.colortype = channels == 4 ? LCT_RGBA : LCT_RGB;
+        state.info_png.color.colortype = state.info_raw.colortype;
+        state.encoder.auto_convert = 0;
+        state.encoder.zlibsettings.btype = btype;
+        std::vector<unsigned char> filters(h, (unsigned char)std::max(filter, 0));
+        if(filter >= 0) {
+          state.encoder.filter_strategy = LFS_PREDEFINED;
+          state.encoder.predefined_filters = filters.data();
+        }
+        std::vector<unsigned char> png;
+        unsigned error = lodepng::encode(png, image, w, h, state);
+        if(error) {
+          printf("encoding failed: %s\n", lodepng_error_text(error));
+          return 1;
+        }
+        std::string name = std::string(channels == 4 ? "RGBA" : "RGB") + (btype ? " compressed " : " stored ") +
+                           (filter < 0 ? "mixed" : filterNames[filter]);
+        bench(name, png, repeats);
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,122 @@
+/*
+Speed and compression ratio of lodepng_zlib_compress at every lodepng_compress_settings_effort level, next to the
+default settings and the old "best" setup (windowsize 32768, nicematch 258). The input is what the PNG encoder
+actually compresses: the filtered scanlines (the inflated IDAT data) of the given PNG files, or without arguments
+of a few synthesized 1024x1024 images. Each setting is timed over the whole input, best of the repeats.
+Usage: lodepng_effort_bench [-r repeats] [file.png ...]
+*/
+#include "lodepng.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+static double seconds() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*the inflated IDAT data of a PNG, empty if it cannot be decoded*/
+static std::vector<unsigned char> filtered(const std::vector<unsigned char>& png) {
+  std::vector<unsigned char> idat, result;
+  if(png.size() < 8) return result;
+  const unsigned char* chunk = png.data() + 8;
+  const unsigned char* end = png.data() + png.size();
+  while(chunk + 12 <= end) {
+    unsigned length = lodepng_chunk_length(chunk);
+    if(length > (size_t)(end - chunk) - 12) break;
+    if(lodepng_chunk_type_equals(chunk, "IDAT")) idat.insert(idat.end(), chunk + 8, chunk + 8 + length);
+    chunk = lodepng_chunk_next_const(chunk, end);
+  }
+  unsigned char* out = 0;
+  size_t outsize = 0;
+  LodePNGDecompressSettings settings;
+  lodepng_decompress_settings_init(&settings);
+  if(!lodepng_zlib_decompress(&out, &outsize, idat.data(), idat.size(), &settings)) result.assign(out, out + outsize);
+  free(out);
+  return result;
+}
+
+/*smooth gradients with sparse noise (rendered), and flat areas with sharp edges (UI-like)*/
+static std::vector<unsigned char> synthesize(unsigned w, unsigned h, unsigned channels, bool flat) {
+  std::vector<unsigned char> image((size_t)w * h * channels);
+  unsigned seed = 1;
+  for(unsigned y = 0; y < h; ++y) for(unsigned x = 0; x < w; ++x) for(unsigned c = 0; c < channels; ++c) {
+    seed = seed * 1103515245u + 12345u;
+    unsigned noise = (seed >> 24) % 8 ? 0 : seed >> 28;
+    unsigned value = flat ? ((x / 96 + y / 40) % 5) * 50 + ((x / 96) % 3 == c ? 5 : 0)
+                          : (x * (c + 1) / 8 + y * (3 - c % 3) / 8 + (x ^ y) / 64 + noise) & 255;
+    image[((size_t)y * w + x) * channels + c] = (unsigned char)(c == 3 ? 255 - (value >> 2) : value);
+  }
+  return image;
+}
+
+int main(int argc, char* argv[]) {
+  int repeats = 2, first = 1;
+  if(argc > 2 && strcmp(argv[1], "-r") == 0) { repeats = std::max(atoi(argv[2]), 1); first = 3; }
+
+  std::vector<std::vector<unsigned char> > inputs;
+  for(int i = first; i < argc; ++i) {
+    std::vector<unsigned char> png;
+    if(lodepng::load_file(png, argv[i])) { printf("%s cannot be read\n", argv[i]); continue; }
+    inputs.push_back(filtered(png));
+    if(inputs.back().empty()) { printf("%s is not a PNG\n", argv[i]); inputs.pop_back(); }
+  }
+  if(first >= argc) {
+    for(unsigned channels = 3; channels <= 4; ++channels) for(int flat = 0; flat < 2; ++flat) {
+      std::vector<unsigned char> png;
+      lodepng::State state;
+      state.info_raw.colortype = channels == 4 ? LCT_RGBA : LCT_RGB;
+      state.info_png.color.colortype = state.info_raw.colortype;
+      state.encoder.auto_convert = 0;
+      state.encoder.zlibsettings.btype = 0; /*stored, only the filtering matters here*/
+      unsigned error = lodepng::encode(png, synthesize(1024, 1024, channels, flat != 0), 1024, 1024, state);
+      if(error) {
+        printf("encoding failed: %s\n", lodepng_error_text(error));
+        return 1;
+      }
+      inputs.push_back(filtered(png));
+    }
+  }
+  size_t total = 0;
+  for(size_t i = 0; i < inputs.size(); ++i) total += inputs[i].size();
+  if(!total) return 1;
+  printf("%u inputs, %.1f MB filtered\n", (unsigned)inputs.size(), total / 1e6);
+
+  for(int level = -1; level <= 9; ++level) {
+    LodePNGCompressSettings settings;
+    lodepng_compress_settings_init(&settings);
+    char name[32] = "default";
+    if(level == 0) {
+      settings.windowsize = 32768;
+      settings.nicematch = 258;
+      strcpy(name, "w32768 n258");
+    } else if(level > 0) {
+      lodepng_compress_settings_effort(&settings, (unsigned)level);
+      snprintf(name, sizeof(name), "effort %d", level);
+    }
+    size_t compressed = 0;
+    double best = 1e30;
+    for(int r = 0; r < repeats; ++r) {
+      compressed = 0;
+      double start = seconds();
+      for(size_t i = 0; i < inputs.size(); ++i) {
+        unsigned char* out = 0;
+        size_t outsize = 0;
+        unsigned error = lodepng_zlib_compress(&out, &outsize, inputs[i].data(), inputs[i].size(), &settings);
+        free(out);
+        if(error) {
+          printf("%s: error %u: %s\n", name, error, lodepng_error_text(error));
+          return 1;
+        }
+        compressed += outsize;
+      }
+      best = std::min(best, seconds() - start);
+    }
+    printf("%-12s %8.1f MB/s  ratio %.4f  (%lu bytes)\n", name, total / best / 1e6, (double)compressed / total,
+           (unsigned long)compressed);
+  }
+  return 0;
+}
@@ -0,0 +1,27 @@
+# cmake -DFAST=<gyors inflate> -DSLOW=<LODEPNG_NO_COMPILE_FAST_INFLATE> -P lodepng_inflate_diff.cmake
+# mindkettőt lefuttatja, és soronként összeveti a kimenetüket
+cmake_policy(SET CMP0007 NEW)
+foreach(variant FAST SLOW)
+	execute_process(COMMAND ${${variant}} RESULT_VARIABLE result OUTPUT_VARIABLE output_${variant})
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "${${variant}}: ${result}")
+	endif()
+endforeach()
+
+if(NOT output_FAST STREQUAL output_SLOW)
+	string(REPLACE "\n" ";" fast_lines "${output_FAST}")
+	string(REPLACE "\n" ";" slow_lines "${output_SLOW}")
+	list(LENGTH fast_lines fast_count)
+	list(LENGTH slow_lines slow_count)
+	foreach(i RANGE ${fast_count})
+		if(i EQUAL fast_count OR i EQUAL slow_count)
+			break()
+		endif()
+		list(GET fast_lines ${i} fast_line)
+		list(GET slow_lines ${i} slow_line)
+		if(NOT fast_line STREQUAL slow_line)
+			message(FATAL_ERROR "elter:\n  gyors: ${fast_line}\n  lassu: ${slow_line}")
+		endif()
+	endforeach()
+	message(FATAL_ERROR "elter a sorok szama: ${fast_count} / ${slow_count}")
+endif()
@@ -0,0 +1,162 @@
+/*
+Differential test of the fast inflate path: the CMake build makes this twice, lodepng_inflate_diff (with
+LODEPNG_COMPILE_FAST_INFLATE) and lodepng_inflate_diff_slow (LODEPNG_NO_COMPILE_FAST_INFLATE, the bit by
+bit decoder), and lodepng_inflate_diff.cmake compares their output line by line.
+Every case prints its error code, output size and output hash. The cases are deterministic:
+- zlib streams of random, text-like and repetitive data, compressed stored, fixed or dynamic at every effort,
+  then left intact, bit flipped, truncated, overwritten, extended or replaced by random bytes after the header,
+  decoded with and without an output limit
+- PNGs of every color type and bit depth, interlaced or not, with corrupted IDAT data (CRCs ignored, so the
+  corruption reaches the inflater)
+Usage: lodepng_inflate_diff [zlib cases] [png cases]
+*/
+#include "lodepng.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static unsigned failures = 0;
+
+static unsigned long long random_state = 0x9E3779B97F4A7C15ull;
+static unsigned random_next() {
+  random_state ^= random_state << 13; random_state ^= random_state >> 7; random_state ^= random_state << 17;
+  return (unsigned)(random_state >> 32);
+}
+static unsigned random_below(unsigned n) { return n ? random_next() % n : 0; }
+
+static unsigned long long fnv1a(const unsigned char* data, size_t size) {
+  unsigned long long hash = 14695981039346656037ull;
+  for(size_t i = 0; i < size; ++i) hash = (hash ^ data[i]) * 1099511628211ull;
+  return hash;
+}
+
+static std::vector<unsigned char> make_data(size_t size) {
+  std::vector<unsigned char> data(size);
+  unsigned kind = random_below(4);
+  for(size_t i = 0; i < size; ++i) {
+    if(kind == 0) data[i] = (unsigned char)random_next(); /*incompressible*/
+    else if(kind == 1) data[i] = (unsigned char)("etaoin shrdlu\n"[random_below(14)]); /*text-like*/
+    else if(kind == 2) data[i] = i >= 3 && random_below(16) ? data[i - 1 - random_below(3)] : (unsigned char)random_next(); /*runs*/
+    else data[i] = i >= 300 && random_below(8) ? data[i - 1 - random_below(300)] : (unsigned char)random_below(40); /*long matches*/
+  }
+  return data;
+}
+
+/*damages the stream after the first keep bytes*/
+static void corrupt(std::vector<unsigned char>& stream, size_t keep) {
+  if(stream.size() <= keep) return;
+  size_t span = stream.size() - keep;
+  switch(random_below(6)) {
+    case 0: /*one to three flipped bits*/
+      for(unsigned n = 1 + random_below(3); n > 0; --n) stream[keep + random_below((unsigned)span)] ^= (unsigned char)(1u << random_below(8));
+      break;
+    case 1: /*truncated*/
+      stream.resize(keep + random_below((unsigned)span));
+      break;
+    case 2: { /*a random run of bytes overwritten*/
+      size_t begin = keep + random_below((unsigned)span), length = 1 + random_below(16);
+      for(size_t i = begin; i < stream.size() && i < begin + length; ++i) stream[i] = (unsigned char)random_next();
+      break;
+    }
+    case 3: /*garbage after the end*/
+      for(unsigned n = 1 + random_below(64); n > 0; --n) stream.push_back((unsigned char)random_next());
+      break;
+    case 4: /*random bytes after the header, any block type and any Huffman tree*/
+      for(size_t i = keep; i < stream.size(); ++i) stream[i] = (unsigned char)random_next();
+      break;
+    default: /*a byte dropped*/
+      stream.erase(stream.begin() + (keep + random_below((unsigned)span)));
+      break;
+  }
+}
+
+static void zlib_case(unsigned index) {
+  static const unsigned sizes[] = { 0, 1, 2, 17, 255, 1000, 4096, 20000, 70000 };
+  size_t size = sizes[random_below(9)];
+  size = size ? size / 2 + random_below((unsigned)size) : 0;
+  std::vector<unsigned char> data = make_data(size);
+
+  LodePNGCompressSettings compress;
+  lodepng_compress_settings_init(&compress);
+  lodepng_compress_settings_effort(&compress, random_below(10));
+  compress.btype = random_below(3);
+  unsigned char* stream = 0;
+  size_t streamsize = 0;
+  unsigned error = lodepng_zlib_compress(&stream, &streamsize, data.data(), data.size(), &compress);
+  std::vector<unsigned char> input(stream, stream + streamsize);
+  free(stream);
+  if(error) { printf("z%u compress error %u\n", index, error); return; }
+  bool corrupted = random_below(10) >= 4;
+  if(corrupted) corrupt(input, 2);
+
+  LodePNGDecompressSettings decompress;
+  lodepng_decompress_settings_init(&decompress);
+  decompress.ignore_adler32 = random_below(2);
+  bool limited = random_below(8) == 0;
+  if(limited) decompress.max_output_size = random_below((unsigned)size + 1);
+  unsigned char* out = 0;
+  size_t outsize = 0;
+  error = lodepng_zlib_decompress(&out, &outsize, input.data(), input.size(), &decompress);
+  /*an intact stream without a limit has to give back the data in either build; the encoder writes no block at all
+  for empty input with btype 0, which the decoder then rejects (error 52), so that one is not counted*/
+  bool intact = !corrupted && !limited && !(size == 0 && compress.btype == 0);
+  bool wrong = intact && (error || outsize != size || fnv1a(out, outsize) != fnv1a(data.data(), size));
+  printf("z%u %u %lu %016llx%s\n", index, error, (unsigned long)outsize, fnv1a(out, outsize), wrong ? " WRONG" : "");
+  if(wrong) ++failures;
+  free(out);
+}
+
+static void png_case(unsigned index) {
+  static const LodePNGColorType types[] = { LCT_GREY, LCT_RGB, LCT_PALETTE, LCT_GREY_ALPHA, LCT_RGBA };
+  static const unsigned depths[5][5] = { { 1, 2, 4, 8, 16 }, { 8, 16 }, { 1, 2, 4, 8 }, { 8, 16 }, { 8, 16 } };
+  static const unsigned depthcount[5] = { 5, 2, 4, 2, 2 };
+  unsigned type = random_below(5);
+  unsigned w = 1 + random_below(random_below(4) ? 64 : 300), h = 1 + random_below(random_below(4) ? 64 : 300);
+
+  lodepng::State state;
+  state.info_png.color.colortype = types[type];
+  state.info_png.color.bitdepth = depths[type][random_below(depthcount[type])];
+  state.info_png.interlace_method = random_below(2);
+  if(types[type] == LCT_PALETTE) {
+    for(unsigned i = 0; i < (1u << state.info_png.color.bitdepth); ++i) {
+      lodepng_palette_add(&state.info_png.color, (unsigned char)random_next(), (unsigned char)random_next(),
+                          (unsigned char)random_next(), 255);
+    }
+  }
+  lodepng_color_mode_copy(&state.info_raw, &state.info_png.color);
+  state.encoder.auto_convert = 0;
+  lodepng_compress_settings_effort(&state.encoder.zlibsettings, random_below(10));
+  std::vector<unsigned char> image = make_data(lodepng_get_raw_size(w, h, &state.info_raw));
+  if(types[type] == LCT_PALETTE && state.info_png.color.bitdepth == 8) {
+    for(size_t i = 0; i < image.size(); ++i) image[i] = (unsigned char)(image[i] % state.info_png.color.palettesize);
+  }
+  /*the unused bits after the last pixel are not kept by a round trip*/
+  size_t bits = (size_t)w * h * lodepng_get_bpp(&state.info_raw);
+  if(bits % 8) image.back() &= (unsigned char)(0xFF << (8 - bits % 8));
+  std::vector<unsigned char> png;
+  unsigned error = lodepng::encode(png, image, w, h, state);
+  if(error) { printf("p%u encode error %u\n", index, error); return; }
+  bool corrupted = random_below(10) >= 3;
+  if(corrupted) corrupt(png, 33 + 8 + 2); /*after the signature, IHDR, and the IDAT and zlib headers*/
+
+  lodepng::State decode;
+  decode.decoder.ignore_crc = 1;
+  decode.decoder.zlibsettings.ignore_adler32 = random_below(2);
+  lodepng_color_mode_copy(&decode.info_raw, &state.info_raw);
+  std::vector<unsigned char> out;
+  error = lodepng::decode(out, w, h, decode, png);
+  bool wrong = !corrupted && (error || out != image);
+  printf("p%u %u %ux%u %lu %016llx%s\n", index, error, w, h, (unsigned long)out.size(), fnv1a(out.data(), out.size()),
+         wrong ? " WRONG" : "");
+  if(wrong) ++failures;
+}
+
+int main(int argc, char* argv[]) {
+  unsigned zlibcases = argc > 1 ? (unsigned)atoi(argv[1]) : 10000;
+  unsigned pngcases = argc > 2 ? (unsigned)atoi(argv[2]) : 2000;
+  for(unsigned i = 0; i < zlibcases; ++i) zlib_case(i);
+  for(unsigned i = 0; i < pngcases; ++i) png_case(i);
+  if(failures) fprintf(stderr, "%u intact inputs decoded wrong\n", failures);
+  return failures ? 1 : 0;
+}
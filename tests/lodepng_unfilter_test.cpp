@@ -0,0 +1,166 @@
+/*
+The SIMD unfilter kernels of lodepng against the scalar code. lodepng.cpp is included, so the static kernels can
+be called one by one, each variant the CPU supports:
+- Paeth: all 2^24 (a, b, c) combinations through the SSE2 and SSSE3 kernels, for 3 and 4 byte pixels
+- random lines: every filter type, pixel sizes 1 to 8, in place and with or without a previous line, through
+  unfilterScanline and through each x86 kernel, compared with a plain per-byte reference
+*/
+#include "lodepng.cpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static unsigned failures = 0;
+
+static unsigned random_state = 2463534242u;
+static unsigned random_next() {
+  random_state ^= random_state << 13; random_state ^= random_state >> 17; random_state ^= random_state << 5;
+  return random_state;
+}
+
+/*the filter types of the PNG specification, byte by byte*/
+static void reference_unfilter(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                               size_t bytewidth, unsigned char type, size_t length) {
+  for(size_t i = 0; i != length; ++i) {
+    unsigned a = i >= bytewidth ? recon[i - bytewidth] : 0;
+    unsigned b = precon ? precon[i] : 0;
+    unsigned c = precon && i >= bytewidth ? precon[i - bytewidth] : 0;
+    unsigned predicted = 0;
+    if(type == 1) predicted = a;
+    else if(type == 2) predicted = b;
+    else if(type == 3) predicted = (a + b) / 2;
+    else if(type == 4) {
+      int p = (int)a + (int)b - (int)c;
+      int pa = abs(p - (int)a), pb = abs(p - (int)b), pc = abs(p - (int)c);
+      predicted = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+    }
+    recon[i] = (unsigned char)(scanline[i] + predicted);
+  }
+}
+
+#ifdef LODEPNG_SIMD_X86
+typedef void (*PaethKernel)(unsigned char*, const unsigned char*, const unsigned char*, size_t, size_t);
+
+/*two pixels per line: the first one reconstructs to a (its b and c are 0 and c), the second one is
+paeth(a, b, c) plus 0. Each channel is one combination, c steps over the channels. bytewidth is a template
+parameter so the two pixels provably fit in the arrays.*/
+template<size_t bytewidth>
+static void check_paeth(const char* name, PaethKernel kernel) {
+  unsigned long long checked = 0;
+  unsigned char precon[2 * bytewidth], scanline[2 * bytewidth], recon[2 * bytewidth];
+  for(unsigned a = 0; a < 256; ++a) for(unsigned b = 0; b < 256; ++b) for(unsigned c0 = 0; c0 < 256; c0 += (unsigned)bytewidth) {
+    for(size_t k = 0; k < bytewidth; ++k) {
+      unsigned c = (c0 + k) & 255;
+      precon[k] = (unsigned char)c;
+      scanline[k] = (unsigned char)(a - c);
+      precon[bytewidth + k] = (unsigned char)b;
+      scanline[bytewidth + k] = 0;
+    }
+    kernel(recon, scanline, precon, bytewidth, 2 * bytewidth);
+    for(size_t k = 0; k < bytewidth; ++k) {
+      unsigned c = (c0 + k) & 255;
+      if(c0 + k > 255) continue; /*wrapped around, checked with the next a*/
+      unsigned char expected = paethPredictor((unsigned char)a, (unsigned char)b, (unsigned char)c);
+      if(recon[k] != a || recon[bytewidth + k] != expected) {
+        if(failures++ < 10) printf("FAIL %s, %u byte pixels: paeth(%u, %u, %u) = %u instead of %u\n",
+                                   name, (unsigned)bytewidth, a, b, c, recon[bytewidth + k], expected);
+      }
+      ++checked;
+    }
+  }
+  printf("%s, %u byte pixels: %llu Paeth combinations\n", name, (unsigned)bytewidth, checked);
+}
+
+typedef void (*UpKernel)(unsigned char*, const unsigned char*, const unsigned char*, size_t);
+typedef void (*LineKernel)(unsigned char*, const unsigned char*, const unsigned char*, size_t, size_t);
+#endif /*LODEPNG_SIMD_X86*/
+
+static void compare(const char* name, const std::vector<unsigned char>& got, const std::vector<unsigned char>& expected,
+                    size_t bytewidth, unsigned type, size_t length, int line) {
+  if(got == expected) return;
+  size_t i = 0;
+  while(got[i] == expected[i]) ++i;
+  if(failures++ < 10) printf("FAIL %s, line %d: filter %u, %u byte pixels, length %u differs at %u\n",
+                             name, line, type, (unsigned)bytewidth, (unsigned)length, (unsigned)i);
+}
+
+int main() {
+#ifdef LODEPNG_SIMD_X86
+  unsigned features = lodepng_cpu_features();
+  printf("CPU: SSSE3 %s, AVX2 %s\n", features & LODEPNG_CPU_SSSE3 ? "yes" : "no", features & LODEPNG_CPU_AVX2 ? "yes" : "no");
+  check_paeth<3>("unfilterPaeth_sse2", unfilterPaeth_sse2);
+  check_paeth<4>("unfilterPaeth_sse2", unfilterPaeth_sse2);
+  if(features & LODEPNG_CPU_SSSE3) {
+    check_paeth<3>("unfilterPaeth_ssse3", unfilterPaeth_ssse3);
+    check_paeth<4>("unfilterPaeth_ssse3", unfilterPaeth_ssse3);
+  } else {
+    printf("unfilterPaeth_ssse3 skipped, no SSSE3\n");
+  }
+#else
+  printf("no x86 SIMD kernels in this build, only unfilterScanline is compared\n");
+#endif
+
+  unsigned long long lines = 0;
+  for(int line = 0; line < 20000; ++line) {
+    size_t bytewidth = 1 + random_next() % 8;
+    if(line % 2) bytewidth = 3 + line / 2 % 2; /*half of the lines take the RGB and RGBA kernels*/
+    unsigned char type = (unsigned char)(random_next() % 5);
+    size_t length = bytewidth * (1 + random_next() % 1400); /*a line has at least one pixel*/
+    if(line % 7 == 0) length = bytewidth * (1 + random_next() % 40); /*short lines, around the vector widths*/
+    bool haveprecon = random_next() % 8 != 0;
+    std::vector<unsigned char> scanline(length), precon(length), expected(length), got(length);
+    unsigned mode = random_next() % 3; /*uniform bytes, small deltas (smooth images) or extremes*/
+    for(size_t i = 0; i < length; ++i) {
+      unsigned r = random_next();
+      scanline[i] = (unsigned char)(mode == 0 ? r : mode == 1 ? (r % 7) - 3 : (r & 1) * 255);
+      precon[i] = (unsigned char)(mode == 2 ? (r >> 8 & 1) * 255 : r >> 8);
+    }
+    const unsigned char* p = haveprecon ? precon.data() : 0;
+    reference_unfilter(expected.data(), scanline.data(), p, bytewidth, type, length);
+
+    /*through the dispatch, separate and in place*/
+    unfilterScanline(got.data(), scanline.data(), p, bytewidth, type, length);
+    compare("unfilterScanline", got, expected, bytewidth, type, length, line);
+    got = scanline;
+    unfilterScanline(got.data(), got.data(), p, bytewidth, type, length);
+    compare("unfilterScanline in place", got, expected, bytewidth, type, length, line);
+
+#ifdef LODEPNG_SIMD_X86
+    /*each kernel the dispatch could pick*/
+    if(type == 2 && p) {
+      UpKernel kernels[2] = { unfilterUp_sse2, unfilterUp_avx2 };
+      const char* names[2] = { "unfilterUp_sse2", "unfilterUp_avx2" };
+      for(int k = 0; k < 2; ++k) {
+        if(k == 1 && !(features & LODEPNG_CPU_AVX2)) continue;
+        got = scanline;
+        kernels[k](got.data(), got.data(), p, length);
+        compare(names[k], got, expected, bytewidth, type, length, line);
+      }
+    }
+    if((bytewidth == 3 || bytewidth == 4) && type == 1) {
+      got = scanline;
+      unfilterSub_sse2(got.data(), got.data(), bytewidth, length);
+      compare("unfilterSub_sse2", got, expected, bytewidth, type, length, line);
+    }
+    if((bytewidth == 3 || bytewidth == 4) && p && (type == 3 || type == 4)) {
+      LineKernel kernels[3] = { unfilterAverage_sse2, unfilterPaeth_sse2, unfilterPaeth_ssse3 };
+      const char* names[3] = { "unfilterAverage_sse2", "unfilterPaeth_sse2", "unfilterPaeth_ssse3" };
+      for(int k = type == 3 ? 0 : 1; k < (type == 3 ? 1 : 3); ++k) {
+        if(k == 2 && !(features & LODEPNG_CPU_SSSE3)) continue;
+        got = scanline;
+        kernels[k](got.data(), got.data(), p, bytewidth, length);
+        compare(names[k], got, expected, bytewidth, type, length, line);
+      }
+    }
+#endif /*LODEPNG_SIMD_X86*/
+    ++lines;
+  }
+  printf("%llu random lines\n", lines);
+
+  if(failures) {
+    printf("%u failures\n", failures);
+    return 1;
+  }
+  return 0;
+}
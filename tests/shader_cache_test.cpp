@@ -0,0 +1,164 @@
+// A GPUProgram bináris gyorsítótára egy GL csonk "meghajtóval": a glad függvénymutatói a csonkra mutatnak,
+// a meghajtó binárisa a címkéjéből és a program forrásaiból áll, és csak a saját címkéjű binárist fogadja el.
+// Ellenőrzött esetek: hiány (fordítás és mentés), találat (fordítás nélkül), elutasított bináris (törlés,
+// fordítás, új mentés), kikapcsolt gyorsítótár, és a 3.3-as kontextus a GL_ARB_get_program_binary kiterjesztéssel
+#include "framework.h"
+
+static fs::path cacheRoot;
+fs::path executableDirectory() { return cacheRoot; }	// a framework.cpp nincs hozzálinkelve
+
+struct MockProgram {
+	std::string sources;	// a csatolt árnyalók forrása egymás után
+	bool linked = false;
+};
+static std::vector<MockProgram> programs(1);
+static std::vector<std::string> shaders(1);
+static std::string driver = "driver-1";			// a meghajtó címkéje, frissítéskor változik
+static std::vector<std::string> extensions;
+static GLint binaryFormats = 1;
+static int compiles = 0, links = 0, binaryLoads = 0, binaryStores = 0;
+static const GLenum binaryFormat = 0x1234;
+
+static GLuint APIENTRY createProgram() { programs.emplace_back(); return (GLuint)programs.size() - 1; }
+static GLuint APIENTRY createShader(GLenum) { shaders.emplace_back(); return (GLuint)shaders.size() - 1; }
+static void APIENTRY shaderSource(GLuint shader, GLsizei count, const GLchar* const* strings, const GLint* lengths) {
+	for (GLsizei i = 0; i < count; i++) shaders[shader].append(strings[i], lengths ? lengths[i] : strlen(strings[i]));
+}
+static void APIENTRY compileShader(GLuint) { compiles++; }
+static void APIENTRY getShaderiv(GLuint, GLenum name, GLint* value) { *value = name == GL_COMPILE_STATUS ? GL_TRUE : 0; }
+static void APIENTRY attachShader(GLuint program, GLuint shader) { programs[program].sources += shaders[shader] + "|"; }
+static void APIENTRY deleteShader(GLuint) {}
+static void APIENTRY linkProgram(GLuint program) { links++; programs[program].linked = true; }
+static void APIENTRY getProgramiv(GLuint program, GLenum name, GLint* value) {
+	std::string binary = driver + ":" + programs[program].sources;
+	if (name == GL_LINK_STATUS) *value = programs[program].linked;
+	else if (name == GL_PROGRAM_BINARY_LENGTH) *value = programs[program].linked ? (GLint)binary.size() : 0;
+	else *value = 0;
+}
+static void APIENTRY programParameteri(GLuint, GLenum, GLint) {}
+static void APIENTRY getProgramBinary(GLuint program, GLsizei size, GLsizei* length, GLenum* format, void* out) {
+	std::string binary = driver + ":" + programs[program].sources;
+	*length = std::min(size, (GLsizei)binary.size());
+	*format = binaryFormat;
+	memcpy(out, binary.data(), *length);
+	binaryStores++;
+}
+static void APIENTRY programBinary(GLuint program, GLenum format, const void* data, GLsizei length) {
+	binaryLoads++;
+	std::string binary((const char*)data, length);
+	// csak a saját címkéjű binárist fogadja el, ilyenkor a program úgy viselkedik, mint a forrásból szerkesztett
+	programs[program].linked = format == binaryFormat && binary.compare(0, driver.size() + 1, driver + ":") == 0;
+	if (programs[program].linked) programs[program].sources = binary.substr(driver.size() + 1);
+}
+static void APIENTRY getIntegerv(GLenum name, GLint* value) {
+	if (name == GL_NUM_PROGRAM_BINARY_FORMATS) *value = binaryFormats;
+	else if (name == GL_NUM_EXTENSIONS) *value = (GLint)extensions.size();
+	else *value = 0;
+}
+static const GLubyte* APIENTRY getString(GLenum name) {
+	return (const GLubyte*)(name == GL_VENDOR ? "Mock" : name == GL_RENDERER ? "Mock renderer" : "3.3.0 Mock");
+}
+static const GLubyte* APIENTRY getStringi(GLenum, GLuint index) { return (const GLubyte*)extensions[index].c_str(); }
+static void APIENTRY useProgram(GLuint) {}
+static void APIENTRY deleteProgram(GLuint) {}
+
+static int failures = 0;
+#define CHECK(condition, ...) do { if (!(condition)) { failures++; printf("FAIL line %d: ", __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static const char* const vertexSource = "#version 330\nvoid main() { gl_Position = vec4(0); }\n";
+static const char* const fragmentSource = "#version 330\nout vec4 c;\nvoid main() { c = vec4(1); }\n";
+
+static size_t cacheFiles() {
+	std::error_code ec;
+	if (!fs::exists(cacheRoot / "shadercache", ec)) return 0;
+	return (size_t)std::distance(fs::directory_iterator(cacheRoot / "shadercache"), fs::directory_iterator());
+}
+
+struct Counts { int compiles, links, binaryLoads, binaryStores; };
+static Counts build(const char* fragment = fragmentSource) {
+	int c = compiles, l = links, bl = binaryLoads, bs = binaryStores;
+	GPUProgram program(vertexSource, fragment);
+	return { compiles - c, links - l, binaryLoads - bl, binaryStores - bs };
+}
+
+int main() {
+	glad_glCreateProgram = createProgram;
+	glad_glCreateShader = createShader;
+	glad_glShaderSource = shaderSource;
+	glad_glCompileShader = compileShader;
+	glad_glGetShaderiv = getShaderiv;
+	glad_glAttachShader = attachShader;
+	glad_glDeleteShader = deleteShader;
+	glad_glLinkProgram = linkProgram;
+	glad_glGetProgramiv = getProgramiv;
+	glad_glProgramParameteri = programParameteri;
+	glad_glGetProgramBinary = getProgramBinary;
+	glad_glProgramBinary = programBinary;
+	glad_glGetIntegerv = getIntegerv;
+	glad_glGetString = getString;
+	glad_glGetStringi = getStringi;
+	glad_glUseProgram = useProgram;
+	glad_glDeleteProgram = deleteProgram;
+
+	cacheRoot = fs::temp_directory_path() / ("grafika_shader_cache_test_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+	fs::create_directories(cacheRoot);
+	GLAD_GL_VERSION_4_1 = 1;
+
+	// hiány: forrásból fordít, és elmenti a binárist
+	Counts miss = build();
+	CHECK(miss.compiles == 2 && miss.links == 1 && miss.binaryLoads == 0 && miss.binaryStores == 1,
+		  "miss: %d compiles, %d links, %d loads, %d stores", miss.compiles, miss.links, miss.binaryLoads, miss.binaryStores);
+	CHECK(cacheFiles() == 1, "miss: %zu cache files", cacheFiles());
+
+	// találat: ugyanaz a forrás ugyanazon a meghajtón fordítás és szerkesztés nélkül
+	Counts hit = build();
+	CHECK(hit.compiles == 0 && hit.links == 0 && hit.binaryLoads == 1 && hit.binaryStores == 0,
+		  "hit: %d compiles, %d links, %d loads, %d stores", hit.compiles, hit.links, hit.binaryLoads, hit.binaryStores);
+	CHECK(programs.back().linked && programs.back().sources == std::string(vertexSource) + "|" + fragmentSource + "|", "hit: wrong program");
+
+	// más forrás: saját fájl, a régi megmarad
+	Counts other = build("#version 330\nout vec4 c;\nvoid main() { c = vec4(0.5); }\n");
+	CHECK(other.compiles == 2 && other.binaryStores == 1, "other source: %d compiles, %d stores", other.compiles, other.binaryStores);
+	CHECK(cacheFiles() == 2, "other source: %zu cache files", cacheFiles());
+
+	// elutasított bináris (a meghajtó frissült, a verziószöveg nem változott): törlés, fordítás, új bináris
+	driver = "driver-2";
+	Counts rejected = build();
+	CHECK(rejected.binaryLoads == 1 && rejected.compiles == 2 && rejected.links == 1 && rejected.binaryStores == 1,
+		  "rejected: %d loads, %d compiles, %d links, %d stores", rejected.binaryLoads, rejected.compiles, rejected.links, rejected.binaryStores);
+	CHECK(programs.back().linked, "rejected: the program is not linked");
+	Counts rehit = build();
+	CHECK(rehit.compiles == 0 && rehit.binaryLoads == 1, "after the rejection: %d compiles, %d loads", rehit.compiles, rehit.binaryLoads);
+
+	// sérült fájl (csonka fejléc): fordítás forrásból
+	for (const auto& entry : fs::directory_iterator(cacheRoot / "shadercache")) std::ofstream(entry.path(), std::ios::binary).write("ab", 2);
+	Counts truncated = build();
+	CHECK(truncated.compiles == 2 && truncated.links == 1, "truncated file: %d compiles, %d links", truncated.compiles, truncated.links);
+
+	// kikapcsolt gyorsítótár: 3.3 kiterjesztés nélkül, illetve bináris formátumok nélkül nem ír és nem olvas
+	fs::remove_all(cacheRoot / "shadercache");
+	GLAD_GL_VERSION_4_1 = 0;
+	Counts noExtension = build();
+	CHECK(noExtension.compiles == 2 && noExtension.binaryLoads == 0 && noExtension.binaryStores == 0 && cacheFiles() == 0,
+		  "3.3 without the extension: %d compiles, %d loads, %d stores", noExtension.compiles, noExtension.binaryLoads, noExtension.binaryStores);
+	GLAD_GL_VERSION_4_1 = 1;
+	binaryFormats = 0;
+	Counts noFormats = build();
+	CHECK(noFormats.binaryLoads == 0 && noFormats.binaryStores == 0 && cacheFiles() == 0, "no binary formats: the cache was used");
+	binaryFormats = 1;
+
+	// 3.3-as kontextus a GL_ARB_get_program_binary kiterjesztéssel: a gyorsítótár működik
+	GLAD_GL_VERSION_4_1 = 0;
+	extensions = { "GL_ARB_texture_filter_anisotropic", "GL_ARB_get_program_binary" };
+	Counts arbMiss = build(), arbHit = build();
+	CHECK(arbMiss.binaryStores == 1 && arbHit.compiles == 0 && arbHit.binaryLoads == 1,
+		  "3.3 with the extension: %d stores, then %d compiles, %d loads", arbMiss.binaryStores, arbHit.compiles, arbHit.binaryLoads);
+
+	fs::remove_all(cacheRoot);
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("Shader binary cache: miss, hit, rejection and fallback work\n");
+	return 0;
+}
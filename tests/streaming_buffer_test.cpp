@@ -0,0 +1,129 @@
+// StreamingBuffer a GL helyett egy számláló csonkkal: a glad függvénymutatói a memóriában tartott
+// "GPU" bufferre mutatnak, így ellenőrizhető, hogy egy hozzáfűzés csak a hozzáfűzött bájtokat tölti fel,
+// és hogy a három régió mindegyike a saját kimaradt változásait is megkapja
+#include "framework.h"
+
+static std::vector<unsigned char> gpu;		// a vbo tartalma
+static size_t subDataCalls = 0, subDataBytes = 0, lastOffset = 0, lastSize = 0;
+static int bufferDataCalls = 0, liveFences = 0, nextFence = 1, outOfRange = 0;
+
+static void APIENTRY genBuffers(GLsizei n, GLuint* buffers) { for (GLsizei i = 0; i < n; i++) buffers[i] = 1; }
+static void APIENTRY deleteBuffers(GLsizei, const GLuint*) {}
+static void APIENTRY bindBuffer(GLenum, GLuint) {}
+static void APIENTRY bufferData(GLenum, GLsizeiptr size, const void* data, GLenum) {
+	gpu.assign((size_t)size, 0xCD);	// a tartalom definiálatlan
+	if (data) memcpy(gpu.data(), data, (size_t)size);
+	bufferDataCalls++;
+}
+static void APIENTRY bufferSubData(GLenum, GLintptr offset, GLsizeiptr size, const void* data) {
+	if (offset < 0 || (size_t)(offset + size) > gpu.size()) { outOfRange++; return; }
+	memcpy(gpu.data() + offset, data, (size_t)size);
+	subDataCalls++;
+	subDataBytes += (size_t)size;
+	lastOffset = (size_t)offset; lastSize = (size_t)size;
+}
+static GLsync APIENTRY fenceSync(GLenum, GLbitfield) { liveFences++; return (GLsync)(intptr_t)nextFence++; }
+static void APIENTRY deleteSync(GLsync) { liveFences--; }
+static GLenum APIENTRY clientWaitSync(GLsync, GLbitfield, GLuint64) { return GL_ALREADY_SIGNALED; }
+static void APIENTRY vertexAttribPointer(GLuint, GLint, GLenum, GLboolean, GLsizei, const void*) {}
+
+static int failures = 0;
+#define CHECK(condition, ...) do { if (!(condition)) { if (failures++ < 20) { printf("FAIL line %d: ", __LINE__); printf(__VA_ARGS__); printf("\n"); } } } while (0)
+
+// az aktuális régió pontosan a legutóbb átadott tartalmat tartja
+static bool regionMatches(const StreamingBuffer<vec2>& buffer, const std::vector<vec2>& data) {
+	if (data.empty()) return true;
+	size_t offset = buffer.Offset();
+	return offset + data.size() * sizeof(vec2) <= gpu.size() && memcmp(gpu.data() + offset, data.data(), data.size() * sizeof(vec2)) == 0;
+}
+
+int main() {
+	glad_glGenBuffers = genBuffers;
+	glad_glDeleteBuffers = deleteBuffers;
+	glad_glBindBuffer = bindBuffer;
+	glad_glBufferData = bufferData;
+	glad_glBufferSubData = bufferSubData;
+	glad_glFenceSync = fenceSync;
+	glad_glDeleteSync = deleteSync;
+	glad_glClientWaitSync = clientWaitSync;
+	glad_glVertexAttribPointer = vertexAttribPointer;
+	const size_t point = sizeof(vec2);
+
+	{
+		StreamingBuffer<vec2> buffer;
+		std::vector<vec2> points;
+
+		// egyenként hozzáfűzött pontok: a régió a legutóbbi írása óta hozzáfűzött (regionCount = 3) pontot kapja,
+		// a korábbiakat nem; a tár növelése után három frissítésig a régiók a teljes tartalmat pótolják
+		int lastGrowth = -100;
+		for (int i = 0; i < 1000; i++) {
+			points.push_back(vec2((float)i, (float)-i));
+			int growths = bufferDataCalls;
+			size_t before = subDataBytes;
+			CHECK(buffer.Update(points), "append %d did not switch regions", i);
+			if (bufferDataCalls != growths) lastGrowth = i;
+			size_t bytes = subDataBytes - before;
+			CHECK(regionMatches(buffer, points), "append %d: region differs", i);
+			CHECK(lastOffset + lastSize == buffer.Offset() + points.size() * point, "append %d: the upload does not end at the new point", i);
+			if (i - lastGrowth >= 3) CHECK(bytes == 3 * point, "append %d uploaded %zu bytes instead of the 3 missed points", i, bytes);
+		}
+		CHECK(bufferDataCalls <= 11, "%d reallocations for 1000 points", bufferDataCalls);	// 1, 2, 4, ..., 1024
+		CHECK(buffer.bytesUploaded == subDataBytes, "bytesUploaded %zu, uploaded %zu", buffer.bytesUploaded, subDataBytes);
+		printf("1000 appends: %zu bytes uploaded (%zu bytes of points), %d reallocations\n", subDataBytes, points.size() * point, bufferDataCalls);
+
+		// változatlan tartalom: nincs régióváltás, nincs feltöltés
+		size_t calls = subDataCalls;
+		CHECK(!buffer.Update(points), "unchanged data switched regions");
+		CHECK(subDataCalls == calls, "unchanged data was uploaded");
+
+		// ugyanannak a pontnak a módosítása frissítésenként: a feltöltés a pontnál kezdődik (az első háromnál a régió
+		// még pótolja a kimaradt hozzáfűzéseket is), utána már csak az az egy pont megy fel
+		for (int r = 0; r < 6; r++) {
+			points[500] = vec2((float)r, -1.0f);
+			size_t before = subDataBytes;
+			buffer.Update(points);
+			CHECK(regionMatches(buffer, points), "edit %d: region differs", r);
+			CHECK(lastOffset == buffer.Offset() + 500 * point, "edit %d uploaded from element %zu", r, (lastOffset - buffer.Offset()) / point);
+			if (r >= 3) CHECK(subDataBytes - before == point, "edit %d uploaded %zu bytes instead of one point", r, subDataBytes - before);
+		}
+
+		// két távoli módosítás: a piszkos tartomány a kettőt átfogó intervallum, és a tartalom helyes marad
+		points[10] = vec2(3.0f, 3.0f);
+		points[20] = vec2(4.0f, 4.0f);
+		size_t before = subDataBytes;
+		buffer.Update(points);
+		CHECK(regionMatches(buffer, points), "two edits: region differs");
+		CHECK(subDataBytes - before <= 1000 * point, "two edits uploaded the whole buffer");
+
+		// pontok elhagyása: nincs mit feltölteni a rövidebb tartalomhoz, de a régió helyes
+		for (int i = 0; i < 5; i++) points.pop_back();
+		buffer.Update(points);
+		CHECK(regionMatches(buffer, points), "pop: region differs");
+		points.push_back(vec2(9.0f, 9.0f));
+		buffer.Update(points);
+		CHECK(regionMatches(buffer, points), "push after pop: region differs");
+
+		// véletlen hozzáfűzések, módosítások, elhagyások és változatlan frissítések vegyesen
+		unsigned int seed = 1;
+		auto random = [&seed](unsigned int n) { seed = seed * 1103515245u + 12345u; return (seed >> 8) % n; };
+		for (int i = 0; i < 2000; i++) {
+			switch (random(4)) {
+			case 0: for (unsigned int k = random(4) + 1; k > 0; k--) points.push_back(vec2((float)random(1000), (float)i)); break;
+			case 1: if (!points.empty()) points[random((unsigned int)points.size())] = vec2((float)i, 0.5f); break;
+			case 2: for (unsigned int k = random(3); k > 0 && !points.empty(); k--) points.pop_back(); break;
+			default: break;
+			}
+			buffer.Update(points);
+			CHECK(regionMatches(buffer, points), "random operation %d: region differs", i);
+		}
+		CHECK(outOfRange == 0, "%d uploads outside the buffer", outOfRange);
+	}
+	CHECK(liveFences == 0, "%d fences were not deleted", liveFences);
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("StreamingBuffer uploads only the changed ranges\n");
+	return 0;
+}
@@ -0,0 +1,81 @@
+// Texture::Downsample a CPU-n, GL kontextus nélkül: a mip láncot egy független,
+// double pontosságú referencia lánccal és a szintek méretével veti össze
+#include "framework.h"
+
+static int failures = 0;
+
+static void check(bool condition, const char* what, int width, int height, int channels, int level) {
+	if (condition) return;
+	if (failures++ < 20) printf("FAIL %s: %dx%d, %d channels, level %d\n", what, width, height, channels, level);
+}
+
+static unsigned int seed = 12345;
+static unsigned char randomByte() {
+	seed = seed * 1103515245u + 12345u;
+	return (unsigned char)(seed >> 16);
+}
+
+// A referencia: minden célpixel a 2x2-es forrás négyzet átlaga, a kilógó sor/oszlop a szélsőt ismétli,
+// kerekítés a legközelebbi egészre (fél felfelé)
+static std::vector<unsigned char> referenceLevel(int width, int height, const std::vector<unsigned char>& pixels, int channels) {
+	int w = width > 1 ? width / 2 : 1, h = height > 1 ? height / 2 : 1;
+	std::vector<unsigned char> result((size_t)w * h * channels);
+	for (int y = 0; y < h; y++) for (int x = 0; x < w; x++) for (int c = 0; c < channels; c++) {
+		double sum = 0;
+		for (int dy = 0; dy < 2; dy++) for (int dx = 0; dx < 2; dx++) {
+			int sx = 2 * x + dx < width ? 2 * x + dx : width - 1;
+			int sy = 2 * y + dy < height ? 2 * y + dy : height - 1;
+			sum += pixels[((size_t)sy * width + sx) * channels + c];
+		}
+		result[((size_t)y * w + x) * channels + c] = (unsigned char)floor(sum / 4.0 + 0.5);
+	}
+	return result;
+}
+
+static void checkChain(int width, int height, int channels, bool constant) {
+	std::vector<unsigned char> image((size_t)width * height * channels);
+	unsigned char value = randomByte();
+	for (unsigned char& texel : image) texel = constant ? value : randomByte();
+	std::vector<unsigned char> level = image, reference = image;
+	int w = width, h = height, levels = 1;
+	while (w > 1 || h > 1) {
+		level = Texture::Downsample(w, h, level, channels);
+		reference = referenceLevel(w, h, reference, channels);
+		w = std::max(w / 2, 1); h = std::max(h / 2, 1);
+		check(level.size() == (size_t)w * h * channels, "level size", width, height, channels, levels);
+		check(level == reference, "level differs from the reference", width, height, channels, levels);
+		if (constant) check(std::all_of(level.begin(), level.end(), [value](unsigned char t) { return t == value; }),
+							"constant image changed", width, height, channels, levels);
+		levels++;
+	}
+	int expected = 1 + (int)floor(log2((double)std::max(width, height)));
+	check(levels == expected, "mip chain length", width, height, channels, levels);
+}
+
+int main() {
+	const int sizes[][2] = { { 1, 1 }, { 2, 2 }, { 1, 7 }, { 7, 1 }, { 3, 3 }, { 5, 2 }, { 7, 3 }, { 16, 16 }, { 64, 32 },
+							 { 33, 17 }, { 100, 75 }, { 255, 1 }, { 256, 256 }, { 1200, 600 } };
+	for (auto& size : sizes) {
+		for (int channels : { 3, 4 }) {
+			checkChain(size[0], size[1], channels, false);
+			checkChain(size[0], size[1], channels, true);
+		}
+	}
+
+	// az RGB szint az RGBA szint alfa nélkül, a csatornák nem keverednek
+	std::vector<unsigned char> rgba(37 * 21 * 4), rgb(37 * 21 * 3);
+	for (size_t i = 0; i < (size_t)37 * 21; i++) for (int c = 0; c < 4; c++) {
+		rgba[i * 4 + c] = randomByte();
+		if (c < 3) rgb[i * 3 + c] = rgba[i * 4 + c];
+	}
+	std::vector<unsigned char> fromRgba = Texture::Downsample(37, 21, rgba), fromRgb = Texture::Downsample(37, 21, rgb, 3);
+	for (size_t i = 0; i < (size_t)18 * 10; i++) for (int c = 0; c < 3; c++)
+		check(fromRgba[i * 4 + c] == fromRgb[i * 3 + c], "RGB and RGBA channels differ", 37, 21, 3, 1);
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("Downsample matches the reference chain\n");
+	return 0;
+}
@@ -0,0 +1,61 @@
+// Round trip of the packed vertex format of nagyhazi: 10 bit snorm normals and half float texture coordinates.
+// The normals come back within 0.1 degree (after the normalization the shader does), texture coordinates in [0, 1]
+// within half a half float step (2^-12)
+#define GRAFIKA_NO_APP
+#include "../nagyhazi/grafika/grafika.cpp"
+
+const double maxNormalError = 0.1;				// degrees
+const double maxTexcoordError = 1.0 / 4096.0;	// 2.44e-4
+
+static unsigned long long state = 88172645463325252ull;
+static double random01() {
+	state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+	return (state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double normalError(const vec3& normal) {
+	dvec3 original = normalize(dvec3(normal)), unpacked = normalize(dvec3(UnpackNormal(PackNormal(normal))));
+	return atan2(length(cross(original, unpacked)), dot(original, unpacked)) * 180.0 / M_PI;
+}
+
+static double texcoordError(const vec2& texcoord) {
+	vec2 unpacked = UnpackTexcoord(PackTexcoord(texcoord));
+	return std::max(fabs((double)unpacked.x - texcoord.x), fabs((double)unpacked.y - texcoord.y));
+}
+
+int main() {
+	double worstNormal = 0, worstTexcoord = 0;
+	int failures = 0;
+
+	// the axes, the diagonals and exactly representable texture coordinates
+	for (int x = -1; x <= 1; x++) for (int y = -1; y <= 1; y++) for (int z = -1; z <= 1; z++) {
+		if (x || y || z) worstNormal = std::max(worstNormal, normalError(normalize(vec3((float)x, (float)y, (float)z))));
+	}
+	for (float t : { 0.0f, 0.25f, 0.5f, 1.0f }) {
+		if (texcoordError(vec2(t, 1.0f - t)) != 0.0) { printf("FAIL %g is not exact\n", t); failures++; }
+	}
+
+	// uniformly distributed unit normals and texture coordinates
+	for (int i = 0; i < 1000000; i++) {
+		double z = 2.0 * random01() - 1.0, phi = 2.0 * M_PI * random01(), r = sqrt(1.0 - z * z);
+		vec3 normal((float)(r * cos(phi)), (float)(r * sin(phi)), (float)z);
+		worstNormal = std::max(worstNormal, normalError(normal));
+		worstTexcoord = std::max(worstTexcoord, texcoordError(vec2((float)random01(), (float)random01())));
+	}
+
+	// the whole vertex through the layout the vbo is filled with
+	VertexData vertex = { vec3(1.5f, -2.25f, 3.0f), normalize(vec3(0.3f, -0.8f, 0.5f)), vec2(0.3f, 0.7f) };
+	std::vector<unsigned char> bytes = packedVertexLayout.Pack({ vertex });
+	PackedVertexData packed;
+	memcpy(&packed, bytes.data(), sizeof(packed));
+	if (bytes.size() != 20 || packedVertexLayout.stride != 20 || packed.position != vertex.position
+		|| packed.normal != PackNormal(vertex.normal) || packed.texcoord != PackTexcoord(vertex.texcoord)) {
+		printf("FAIL the packed layout does not hold the packed attributes\n");
+		failures++;
+	}
+
+	printf("normal error at most %.4f degrees, texture coordinate error at most %.3g\n", worstNormal, worstTexcoord);
+	if (worstNormal > maxNormalError) { printf("FAIL normal error above %g degrees\n", maxNormalError); failures++; }
+	if (worstTexcoord > maxTexcoordError) { printf("FAIL texture coordinate error above %g\n", maxTexcoordError); failures++; }
+	return failures ? 1 : 0;
+}